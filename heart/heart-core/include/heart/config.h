@@ -27,6 +27,24 @@
 #endif
 #endif
 
+// Per-job timestamps, histograms and Chrome trace export for HeartJobSystem
+#if !defined(HEART_JOB_TRACING)
+#if HEART_STRICT_PERF
+#define HEART_JOB_TRACING 0
+#else
+#define HEART_JOB_TRACING 1
+#endif
+#endif
+
+// Context switch, run state, idle and stack counters and Chrome trace export for HeartFiberSystem
+#if !defined(HEART_FIBER_TRACING)
+#if HEART_STRICT_PERF
+#define HEART_FIBER_TRACING 0
+#else
+#define HEART_FIBER_TRACING 1
+#endif
+#endif
+
 #if !defined(HEART_USE_OS_FIBERS)
 #define HEART_USE_OS_FIBERS 0
 #endif
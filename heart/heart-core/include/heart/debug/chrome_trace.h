@@ -0,0 +1,104 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/allocator.h>
+#include <heart/copy_move_semantics.h>
+#include <heart/memory/vector.h>
+#include <heart/types.h>
+
+#include <initializer_list>
+#include <type_traits>
+
+struct HeartFile;
+
+// Builds a JSON document in the Chrome trace event format, which can be loaded by
+// chrome://tracing, Perfetto, Speedscope and friends.
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+//
+// All timestamps and durations are in microseconds.
+class HeartChromeTraceWriter
+{
+public:
+	// An entry in an event's "args" object. Either a number or a string.
+	struct Arg
+	{
+		const char* name;
+		const char* stringValue;
+		double numberValue;
+
+		Arg(const char* n, const char* s) :
+			name(n),
+			stringValue(s),
+			numberValue(0.0)
+		{
+		}
+
+		template <typename T, std::enable_if_t<std::is_arithmetic_v<T>, void*> = nullptr>
+		Arg(const char* n, T v) :
+			name(n),
+			stringValue(nullptr),
+			numberValue(double(v))
+		{
+		}
+	};
+
+	using Args = std::initializer_list<Arg>;
+
+private:
+	heart_priv::HeartVector<char> m_buffer;
+	bool m_hasEvents = false;
+	bool m_finished = false;
+
+	void Append(const char* text);
+	void AppendFormat(const char* format, ...);
+	void AppendEscaped(const char* text);
+	void AppendArgs(Args args);
+
+	// Writes everything up to the args of an event
+	void BeginEvent(const char* name, const char* category, char phase, uint32_t threadId, double timestamp);
+
+public:
+	HeartChromeTraceWriter(HeartBaseAllocator& allocator = GetHeartDefaultAllocator());
+	~HeartChromeTraceWriter() = default;
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartChromeTraceWriter);
+
+	// A span of time on one thread.
+	void AddCompleteEvent(const char* name, const char* category, uint32_t threadId, double start, double duration, Args args = {});
+
+	// A single point in time on one thread.
+	void AddInstantEvent(const char* name, const char* category, uint32_t threadId, double timestamp, Args args = {});
+
+	// A set of values displayed as a stacked graph. Every arg must be a number.
+	void AddCounterEvent(const char* name, double timestamp, Args args);
+
+	// Name a thread ID in the trace viewer.
+	void AddThreadName(uint32_t threadId, const char* name);
+
+	// Close the document. No more events can be added afterwards.
+	void Finish();
+
+	// The document so far. Only valid JSON once Finish() has been called.
+	const char* GetData() const
+	{
+		return m_buffer.begin();
+	}
+
+	size_t GetSize() const
+	{
+		return m_buffer.Size();
+	}
+
+	// Finish the document and write it to a file opened for writing.
+	bool WriteToFile(HeartFile& file);
+};
@@ -0,0 +1,84 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/config.h>
+#include <heart/types.h>
+
+#if !HEART_USE_OS_FIBERS
+
+// The registers which survive a call under the platform ABI, and are therefore all that a
+// context switch (which looks like an ordinary function call to both sides) has to save.
+// The layout must match heart_swap_fiber_context in fibercontext.asm / fibercontext_sysv.S.
+#if defined(_WIN32)
+#include <xmmintrin.h>
+
+struct HeartFiberAbiContext
+{
+	uintptr_t rip = 0;
+	uintptr_t rsp = 0;
+	uintptr_t rbx = 0;
+	uintptr_t rbp = 0;
+	uintptr_t r12 = 0;
+	uintptr_t r13 = 0;
+	uintptr_t r14 = 0;
+	uintptr_t r15 = 0;
+	uintptr_t rdi = 0;
+	uintptr_t rsi = 0;
+	__m128 xmm6 = {};
+	__m128 xmm7 = {};
+	__m128 xmm8 = {};
+	__m128 xmm9 = {};
+	__m128 xmm10 = {};
+	__m128 xmm11 = {};
+	__m128 xmm12 = {};
+	__m128 xmm13 = {};
+	__m128 xmm14 = {};
+	__m128 xmm15 = {};
+
+	// Extra
+	byte_t* allocated = nullptr;
+	HeartFiberAbiContext* nextPooled = nullptr;
+};
+#elif defined(__x86_64__)
+struct HeartFiberAbiContext
+{
+	uintptr_t rip = 0;
+	uintptr_t rsp = 0;
+	uintptr_t rbx = 0;
+	uintptr_t rbp = 0;
+	uintptr_t r12 = 0;
+	uintptr_t r13 = 0;
+	uintptr_t r14 = 0;
+	uintptr_t r15 = 0;
+
+	// The control bits of MXCSR and the x87 control word are callee-saved too.
+	// A new fiber starts with the defaults (all exceptions masked, round to nearest).
+	uint32_t mxcsr = 0x1F80;
+	uint16_t x87ControlWord = 0x037F;
+
+	// Extra
+	byte_t* allocated = nullptr;
+	HeartFiberAbiContext* nextPooled = nullptr;
+};
+#else
+#error "Heart fibers need HEART_USE_OS_FIBERS on this platform"
+#endif
+
+// Save the calling context into from and resume to. Returns when something switches back to from.
+extern "C" void heart_swap_fiber_context(HeartFiberAbiContext* from, HeartFiberAbiContext* to);
+
+// Prepare ctx so that switching to it calls entry on the given stack. entry must never return;
+// it has to switch away instead. The stack is not touched beyond its top few bytes.
+void HeartInitializeFiberAbiContext(HeartFiberAbiContext& ctx, byte_t* stackStart, size_t stackSize, void (*entry)(void*));
+
+#endif
@@ -15,10 +15,19 @@
 
 #include <heart/fibers/work_unit.h>
 
+#include <chrono>
+
+struct HeartFiberAbiContext;
+
 class HeartFiberContext
 {
 private:
 	friend class HeartFiberSystem;
+	friend class HeartFiberMutex;
+	friend class HeartFiberCounter;
+	friend class HeartFence;
+	friend class HeartEvent;
+	friend class HeartJobSystem;
 
 	// The system that is executing the current thread. If we're on
 	// a fiber, should *never* be null.
@@ -35,17 +44,63 @@ private:
 	// never be null after the first switch to the pump
 	HeartFiberWorkUnit* currentWorkUnit;
 
+	// Which of the system's pump states belongs to this thread.
+	uint32_t pumpIndex;
+
+	// A work unit which yielded on this thread. The pump makes it runnable again once
+	// we've switched off its stack, so that no other thread can pick it up while we're still on it.
+	HeartFiberWorkUnit* yieldedUnit;
+
+	// A work unit which parked on this thread, and what the pump should do with it once
+	// we've switched off its stack. See HeartFiberSystem::ParkUnit.
+	HeartFiberWorkUnit* parkedUnit;
+	void (*parkFunction)(HeartFiberWorkUnit*, void*);
+	void* parkArgument;
+
+	// On a host's thread, the host fiber which made way for a resumed work unit, and carries on
+	// once that unit parks again or finishes. See HeartFiberSystem::SwitchToHostedUnit.
+	HeartFiberWorkUnit* standbyUnit;
+
 	// The destroy queue for this thread. Only work units which have completed
 	// on this thread can be destroyed by this thread. This prevents a race
 	// condition where the pump running on one thread could kill a currently
 	// executing fiber on another thread before it jumps, causing a crash.
 	HeartFiberWorkUnit::Queue destroyQueue;
 
+	// Work units which returned Retry on this thread. The pump resets them and puts them back
+	// in its run queue once we've switched off their stacks, for the same reason as above.
+	HeartFiberWorkUnit::Queue requeueQueue;
+
+	// Native contexts (and their stacks) left behind by work units which completed on this
+	// thread, by stack class, so that the next work unit can reuse them. Only used when we
+	// do our own context switching; see HeartFiberSystem::InitializeWorkUnitNativeHandle.
+	HeartFiberAbiContext* stackPool[uint32_t(HeartFiberStackClass::Count)];
+	uint32_t stackPoolSize[uint32_t(HeartFiberStackClass::Count)];
+
 	static HeartFiberContext& Get();
 
+	// Park the current fiber; see HeartFiberSystem::ParkUnit. Returns false straight
+	// away if we are not currently executing within a fiber.
+	static bool Park(void (*park)(HeartFiberWorkUnit*, void*), void* argument);
+
 public:
+	// The work unit running on the calling thread, or null if we are not executing within a fiber.
+	static HeartFiberWorkUnit* GetCurrentWorkUnit();
+
 	// Attempt to yield the current fiber. This will return immediately
 	// if we are not currently executing within a fiber, and may effectively
 	// return immediately if there is no other queued work.
 	static void Yield();
+
+	// Suspend the current fiber for at least the given time, leaving its thread free to
+	// run other fibers. Wake-ups are only as precise as the fiber threads' timed waits,
+	// which is to the millisecond when the thread has nothing else to do. Outside of a
+	// fiber, these block the thread instead.
+	static void SleepFor(uint32_t microseconds);
+	static void SleepUntil(std::chrono::steady_clock::time_point deadline);
+
+	// Suspend the current fiber until the counter has come down to value or below; the
+	// fiber which brings it there makes this one runnable again. Returns immediately if it
+	// already has. Outside of a fiber, this spins on the thread instead.
+	static void WaitForCounter(HeartFiberCounter& counter, uint32_t value = 0);
 };
@@ -0,0 +1,68 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/fibers/work_unit.h>
+
+#include <heart/copy_move_semantics.h>
+#include <heart/sync/mutex.h>
+#include <heart/types.h>
+
+#include <atomic>
+
+// Counts outstanding fiber work, so that a fiber can wait for it to finish without polling.
+// Work units enqueued with a counter increment it when they're enqueued and decrement it when
+// they complete. HeartFiberContext::WaitForCounter parks the calling fiber until the counter
+// has come down to a given value, and whoever brings it down that far resumes the waiter.
+class HeartFiberCounter
+{
+private:
+	friend class HeartFiberContext;
+
+	std::atomic<uint32_t> m_value;
+
+	// Fibers parked in Wait. Lets Decrement skip the mutex when there aren't any.
+	std::atomic<uint32_t> m_waiterCount = 0;
+
+	HeartMutex m_waitersMutex;
+	HeartFiberWorkUnit::Queue m_waiters;
+
+	// Decrement() calls which may still touch us after m_value changed. A waiter resumed by
+	// one of them may destroy us straight away, so the destructor waits these out.
+	std::atomic<uint32_t> m_decrementsInFlight = 0;
+
+	// Park the calling fiber until the counter is at or below value
+	void Wait(uint32_t value);
+
+	// Runs on the pump once a fiber has parked in Wait
+	static void AddWaiter(HeartFiberWorkUnit* unit, void* counter);
+
+public:
+	HeartFiberCounter(uint32_t initialValue = 0) :
+		m_value(initialValue)
+	{
+	}
+
+	~HeartFiberCounter();
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartFiberCounter);
+
+	void Increment(uint32_t count = 1);
+
+	// Resumes any fiber waiting for the counter to come down this far.
+	void Decrement(uint32_t count = 1);
+
+	uint32_t GetValue() const
+	{
+		return m_value.load(std::memory_order_acquire);
+	}
+};
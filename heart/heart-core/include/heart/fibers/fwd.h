@@ -16,8 +16,12 @@
 class HeartFiberWorkUnit;
 class HeartFiberContext;
 class HeartFiberSystem;
+class HeartFiberStackProvider;
+class HeartFiberCounter;
+class HeartFiberHost;
 enum class HeartFiberResult : uint8_t;
 enum class HeartFiberWorkUnitStatus : uint8;
+enum class HeartFiberStackClass : uint8_t;
 
 template <typename T>
 class HeartIntrusivePtr;
@@ -0,0 +1,39 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/fibers/fwd.h>
+
+// A scheduler which runs fibers on threads of its own instead of a HeartFiberSystem's pumps,
+// eg HeartJobSystem in HeartJobExecutionMode::Fibers. The system still provides the stacks
+// and everything that parks a fiber (HeartFence, HeartFiberMutex, SleepFor...), but the host
+// decides what its fibers run and when a parked one gets to carry on. Must be thread safe.
+class HeartFiberHost
+{
+public:
+	virtual ~HeartFiberHost() = default;
+
+	// The body of every fiber started on one of the host's threads; see
+	// HeartFiberSystem::RunHostedThread. Return once the thread should stop.
+	virtual HeartFiberResult RunHostedFiber() = 0;
+
+	// A parked work unit can run again. Called from any thread, once the unit is off its stack.
+	// The host must eventually pass it to HeartFiberSystem::SwitchToHostedUnit.
+	virtual void ResumeWorkUnit(HeartFiberWorkUnit& unit) = 0;
+
+	// As above, but not before the steady clock reaches deadline, in microseconds.
+	virtual void ResumeWorkUnitAt(HeartFiberWorkUnit& unit, uint64_t deadline) = 0;
+
+	// Take back the last ResumeWorkUnitAt for this unit, if it hasn't come due yet. Returns false
+	// if it is too late, in which case the unit resumes as planned; otherwise it stays parked.
+	virtual bool CancelResumeAt(HeartFiberWorkUnit& unit) = 0;
+};
@@ -11,11 +11,18 @@
 */
 #pragma once
 
+#include <heart/fibers/work_unit.h>
+
+#include <heart/sync/mutex.h>
 #include <heart/types.h>
 #include <heart/util/tag_type.h>
 
 #include <atomic>
 
+// A mutex for fibers. A fiber which can't take the lock parks until the lock is handed
+// to it by Unlock, leaving its thread free to run other fibers in the meantime. Waiters
+// are served in the order they arrived. Taking and releasing an uncontended lock are a
+// single atomic operation each.
 class HeartFiberMutex
 {
 public:
@@ -25,17 +32,32 @@ public:
 
 	HeartFiberMutex() = default;
 
+	// Park the calling fiber until the lock is ours. Spins like NeverYield when not called from a fiber.
 	void LockExclusive(YieldToFiberT);
 
+	// Spin until the lock is free. Fibers waiting in LockExclusive(YieldToFiber) take priority.
 	void LockExclusive(NeverYieldT);
 
 	bool TryLockExclusive();
 
+	// Release the lock, or hand it straight to the longest waiting fiber if there is one.
 	void Unlock();
 
 private:
-	constexpr static int32_t LockedValue = -1;
 	constexpr static int32_t UnlockedValue = 0;
+	constexpr static int32_t LockedValue = 1;
+
+	// Locked, and there may be fibers in m_waiters. The lock is never released while
+	// there are waiters; Unlock hands it over instead.
+	constexpr static int32_t ContendedValue = 2;
 
 	std::atomic_int32_t value = UnlockedValue;
+
+	// Fibers parked in LockExclusive(YieldToFiber). Moving into or out of ContendedValue
+	// only happens with this held.
+	HeartMutex m_waitersMutex;
+	HeartFiberWorkUnit::Queue m_waiters;
+
+	// Runs on the pump once a fiber has parked in LockExclusive(YieldToFiber)
+	static void AddWaiter(HeartFiberWorkUnit* unit, void* mutex);
 };
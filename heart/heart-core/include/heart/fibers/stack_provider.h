@@ -0,0 +1,103 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/fibers/fwd.h>
+#include <heart/fibers/work_unit.h>
+
+#include <heart/copy_move_semantics.h>
+#include <heart/types.h>
+
+#include <atomic>
+
+// Where a HeartFiberSystem gets its fiber stacks from. Without one, stacks come from the
+// system's allocator. Stacks are pooled by the system, so a provider only sees a stack
+// allocated or freed when the pools grow or shrink; OnStackReleased is called every time
+// a fiber finishes with one. Must be thread safe.
+class HeartFiberStackProvider
+{
+public:
+	virtual ~HeartFiberStackProvider() = default;
+
+	// Allocate a stack of size bytes, and return its lowest address. The memory must be zeroed.
+	virtual byte_t* AllocateStack(size_t size) = 0;
+
+	// Free a stack returned by AllocateStack.
+	virtual void FreeStack(byte_t* stack, size_t size) = 0;
+
+	// A fiber of the given class has finished with this stack (or is about to be retried on it).
+	virtual void OnStackReleased(byte_t* stack, size_t size, HeartFiberStackClass stackClass)
+	{
+	}
+};
+
+// Stacks carved straight out of virtual memory, each with an inaccessible guard page below it
+// so that an overflow crashes on the spot rather than trampling whatever is next to it. Pages
+// are only committed when a fiber first touches them, so resident memory follows how deep the
+// fibers actually go rather than how big their stacks are.
+//
+// Every time a fiber finishes, the provider measures how deep it went (to the page) by asking
+// the OS which pages are resident. With resetPagesOnRelease, the stack is then handed back to
+// the OS so that the next fiber starts from nothing; that makes each measurement cover exactly
+// one fiber and keeps pooled stacks from holding on to memory, at the cost of a syscall and
+// fresh page faults. Without it, a measurement covers every fiber that has used that stack.
+class HeartVirtualFiberStackProvider final : public HeartFiberStackProvider
+{
+public:
+	// High-water marks are bucketed by powers of two: bucket 0 counts marks of up to one page,
+	// bucket i those of up to (page size << i), and the last bucket everything deeper.
+	static constexpr uint32_t HistogramBucketCount = 16;
+
+	struct Stats
+	{
+		// How many times a fiber finished with a stack of this class
+		uint64_t releaseCount = 0;
+
+		// The deepest any of those fibers went, in bytes
+		size_t maxHighWaterMark = 0;
+
+		uint64_t histogram[HistogramBucketCount] = {};
+	};
+
+private:
+	struct AtomicStats
+	{
+		std::atomic<uint64_t> releaseCount = 0;
+		std::atomic<size_t> maxHighWaterMark = 0;
+		std::atomic<uint64_t> histogram[HistogramBucketCount] = {};
+	};
+
+	AtomicStats m_stats[uint32_t(HeartFiberStackClass::Count)];
+	size_t m_pageSize;
+	bool m_resetPagesOnRelease;
+
+public:
+	HeartVirtualFiberStackProvider(bool resetPagesOnRelease = true);
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartVirtualFiberStackProvider);
+
+	byte_t* AllocateStack(size_t size) override;
+	void FreeStack(byte_t* stack, size_t size) override;
+	void OnStackReleased(byte_t* stack, size_t size, HeartFiberStackClass stackClass) override;
+
+	// How much of the stack is resident, measured down from the top, in bytes. Only meaningful
+	// for stacks from this provider, and only while no fiber is running on it.
+	size_t MeasureHighWaterMark(const byte_t* stack, size_t size) const;
+
+	// A snapshot of the high-water marks recorded so far for fibers of the given class.
+	Stats GetStats(HeartFiberStackClass stackClass) const;
+
+	size_t GetPageSize() const
+	{
+		return m_pageSize;
+	}
+};
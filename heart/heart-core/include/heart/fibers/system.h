@@ -11,19 +11,25 @@
 */
 #pragma once
 
+#include <heart/fibers/counter.h>
 #include <heart/fibers/fwd.h>
+#include <heart/fibers/tracing.h>
 #include <heart/fibers/work_unit.h>
 
 #include <heart/allocator.h>
 #include <heart/memory/intrusive_list.h>
 #include <heart/memory/intrusive_ptr.h>
+#include <heart/memory/timer_wheel.h>
 #include <heart/memory/vector.h>
+#include <heart/memory/work_stealing_deque.h>
+#include <heart/sync/event_count.h>
 #include <heart/sync/mutex.h>
 #include <heart/thread/thread.h>
 
 #include <heart/sleep.h>
 
 #include <atomic>
+#include <chrono>
 
 class HeartFiberSystem
 {
@@ -31,10 +37,29 @@ public:
 	struct Settings
 	{
 		uint32_t threadCount = 1;
+
+		// Where fiber stacks come from. If null, they're taken from the system's allocator.
+		// Must outlive the system. Not used with HEART_USE_OS_FIBERS, where the OS owns the stacks.
+		HeartFiberStackProvider* stackProvider = nullptr;
+
+		// Hands the system to a scheduler which runs fibers on threads of its own (see HeartFiberHost).
+		// The system then starts no threads; the host's threads call RunHostedThread instead, and
+		// every fiber they start runs HeartFiberHost::RunHostedFiber on a stack of hostStackClass.
+		// Must outlive the system.
+		HeartFiberHost* host = nullptr;
+		HeartFiberStackClass hostStackClass = HeartFiberStackClass::Large;
 	};
 
+public:
+	// Called by the pump once a parked work unit is off its stack. See ParkUnit.
+	typedef void (*ParkFunction)(HeartFiberWorkUnit* unit, void* argument);
+
 private:
 	friend class HeartFiberContext;
+	friend class HeartFiberMutex;
+	friend class HeartFiberCounter;
+	friend class HeartFence;
+	friend class HeartEvent;
 
 	// Allocator for the system. All allocations must be pulled from this and
 	// not from any global allocation source. Any failure to allocate will
@@ -42,15 +67,76 @@ private:
 	// MUST ensure the allocator is always successful.
 	HeartBaseAllocator& m_allocator;
 
+#if HEART_FIBER_TRACING
+	// Counts switches, stacks and time spent in each state, on every thread we run fibers on
+	HeartFiberTracer m_tracer;
+#endif
+
+	// Optional source of fiber stacks; see Settings::stackProvider
+	HeartFiberStackProvider* m_stackProvider = nullptr;
+
+	// The scheduler running our fibers on its threads instead of ours, if any; see Settings::host
+	HeartFiberHost* m_host = nullptr;
+	HeartFiberStackClass m_hostStackClass = HeartFiberStackClass::Large;
+
 	// The list of threads used by this system for fibers
 	heart_priv::HeartVector<HeartThread> m_threads;
 
-	// List of fiber work awaiting execution. Mutex protected because
-	// the main thread can push work into it and the fiber thread(s)
-	// needs to both push and pull.
+	// How many work units each fiber thread can hold in its own run queue
+	// before the rest spill over into the shared one.
+	static constexpr uint32_t RunQueueCapacity = 256;
+
+	// How often (in work units run) a pump looks at the shared queue before its own,
+	// so that a thread busy with its own work units can't starve the shared queue.
+	static constexpr uint32_t SharedQueueInterval = 31;
+
+	typedef HeartWorkStealingDeque<HeartFiberWorkUnit, RunQueueCapacity> RunQueue;
+
+	// Sleep deadlines are measured in microseconds of the steady clock
+	typedef HeartTimerWheel<HeartFiberWorkUnit, &HeartFiberWorkUnit::m_link, &HeartFiberWorkUnit::m_sleepDeadline> SleepTimerWheel;
+
+	// State owned by a single fiber thread
+	struct PumpState
+	{
+		// Only the owning thread pushes; it takes work units from the top (oldest first)
+		// like any thief, so that a yielding work unit goes to the back of the line.
+		RunQueue runQueue;
+
+		// Work units sleeping on this thread. Only the owning thread schedules and advances, but
+		// any thread can cancel a wake-up (see CancelWakeUp), hence the mutex.
+		SleepTimerWheel sleepWheel;
+		HeartMutex sleepWheelMutex;
+
+		// How many work units are in sleepWheel. Lets the owning thread skip the mutex when it is empty.
+		std::atomic<uint32_t> sleeperCount = 0;
+
+		PumpState(uint64_t currentTick) :
+			sleepWheel(currentTick)
+		{
+		}
+	};
+
+	// One per fiber thread, indexed by HeartFiberContext::pumpIndex
+	PumpState* m_pumpStates = nullptr;
+	uint32_t m_pumpStateCount = 0;
+	std::atomic<uint32_t> m_nextPumpIndex = 0;
+
+	// List of fiber work awaiting execution which isn't in any run queue: work
+	// enqueued from outside the fiber threads, and overflow from full run queues.
+	// Mutex protected because any thread can push work into it.
 	HeartFiberWorkUnit::Queue m_pendingQueue;
 	HeartMutex m_pendingQueueMutex;
 
+	// How many work units are in m_pendingQueue. Lets pumps skip the mutex when it is empty.
+	std::atomic<uint32_t> m_pendingQueueSize = 0;
+
+	// Where pumps park when there is nothing to run anywhere.
+	HeartEventCount m_idleEvent;
+
+	// Work units which are parked (see ParkUnit) rather than in a queue. Shutdown waits for
+	// these like any other outstanding work.
+	std::atomic<uint32_t> m_parkedUnitCount = 0;
+
 	// Flag to signal to the pumps that the system is shutting down.
 	std::atomic_bool m_exit = true;
 
@@ -68,6 +154,10 @@ private:
 	// thread from the queue
 	HeartFiberResult PumpRoutine();
 
+	// The pump routine for a host's thread. Runs a host fiber, starts another whenever that one
+	// parks, and hands parked work units to the host. Returns once a host fiber returns for good.
+	HeartFiberResult HostedPumpRoutine();
+
 	// Sets up the entry fiber, if necessary. Called from thread entry and nowhere else.
 	void InitializeEntryFiber();
 
@@ -82,20 +172,74 @@ private:
 	// Release any resources allocated by the native fiber for this work unit.
 	// This must be called after the fiber has finished executing on all threads.
 	// Calling this e.g while the fiber is still in the process of yielding will crash.
+	// The stack may be kept in the calling thread's pool for the next work unit.
 	void ReleaseWorkUnitNativeHandle(HeartFiberWorkUnit& unit);
 
+	// Get a zeroed stack from the provider, or the allocator if there isn't one.
+	byte_t* AllocateStack(size_t size);
+
+	// Give a stack back to wherever AllocateStack got it from.
+	void FreeStack(byte_t* stack, size_t size);
+
+	// Free every stack pooled by the calling thread. Called from thread entry once the pump is done.
+	void ReleaseStackPool();
+
+	// Rewind a work unit's native fiber so that it runs its worker from the start again.
+	// Like ReleaseWorkUnitNativeHandle, only call this once the fiber has finished executing.
+	void ResetWorkUnitNativeHandle(HeartFiberWorkUnit& unit);
+
+	// Make a work unit runnable. Goes into the calling thread's run queue if it belongs
+	// to this system, otherwise into the shared queue. Wakes a parked pump if there is one.
+	void PushWorkUnit(HeartFiberWorkUnit* unit);
+
+	// Find the next work unit for the calling pump: from its own run queue, the shared
+	// queue, or another thread's run queue, in that order unless sharedFirst is set.
+	HeartFiberWorkUnit* FindWorkUnit(PumpState& pump, bool sharedFirst);
+	HeartFiberWorkUnit* PopSharedWorkUnit();
+
+	// Whether there's a work unit in any queue. Approximate.
+	bool HasQueuedWork() const;
+
+	// Make every work unit whose sleep is over runnable. Owning thread only.
+	void WakeSleepingUnits(PumpState& pump);
+
+	// The current time, and a deadline, in sleep ticks
+	static uint64_t GetSleepTick();
+	static uint64_t ToSleepTick(std::chrono::steady_clock::time_point deadline);
+
 	// Finalize a work unit. Adds it to the destroy queue and passes execution
 	// to the pump.
 	void CompleteWorkUnit(HeartFiberWorkUnit& unit);
 
-	// Requeue a work unit. Internally, creates a copy with the same worker
-	// and adds the old work unit to the destroy queue before passing execution
-	// to the pump.
+	// Requeue a work unit. Adds it to the requeue queue and passes execution to the pump,
+	// which starts it over (on the same stack) and puts it back in its run queue.
 	void RequeueWorkUnit(HeartFiberWorkUnit& unit);
 
 	// Yield the currently executing unit. Passes execution to the pump.
 	void YieldUnit(HeartFiberWorkUnit& unit);
 
+	// Suspend the currently executing unit until something resumes it. Passes execution
+	// to the pump, which calls park(unit, argument) once it's off the unit's stack; park
+	// must hand the unit to whatever will eventually pass it to ResumeWorkUnit. The unit
+	// may have been resumed (and be running on another thread) by the time park returns.
+	void ParkUnit(HeartFiberWorkUnit& unit, ParkFunction park, void* argument);
+
+	// Park the currently executing unit until the given sleep tick. The pump which
+	// it parks on keeps it in its sleep wheel, and wakes it once it's due.
+	void SleepUnit(HeartFiberWorkUnit& unit, uint64_t deadline);
+
+	// From within a park function: resume the unit at the given sleep tick (via ResumeWorkUnit)
+	// unless the wake-up is cancelled first. Uses the unit's m_link, like any queue.
+	void ScheduleWakeUp(HeartFiberWorkUnit& unit, uint64_t deadline);
+
+	// Take back a wake-up from ScheduleWakeUp. Returns true if it was cancelled in time, in
+	// which case the caller must resume the unit itself; false if the timer already fired.
+	// Can be called from any thread, but at most once per ScheduleWakeUp.
+	static bool CancelWakeUp(HeartFiberWorkUnit& unit);
+
+	// Make a parked work unit runnable again. Can be called from any thread.
+	static void ResumeWorkUnit(HeartFiberWorkUnit& unit);
+
 	// Invoke the native method to pass execution to the given work unit.
 	// Could return, if the current fiber is switched back to
 	void NativeSwitchToFiber(HeartFiberWorkUnit& target);
@@ -113,25 +257,71 @@ public:
 	void Initialize(Settings s);
 	void Shutdown();
 
+	// For a HeartFiberHost: turn the calling thread into a fiber thread and run host fibers on it
+	// until one returns while no resumed work unit is running on it. Only for hosted systems.
+	void RunHostedThread();
+
+	// For a HeartFiberHost, from a host fiber on a hosted thread: run a resumed work unit in place
+	// of the calling fiber, which waits until the unit parks again or returns. The calling fiber
+	// must not itself be a resumed one; see IsResumedHostedFiber.
+	void SwitchToHostedUnit(HeartFiberWorkUnit& unit);
+
+	// Whether the calling fiber was resumed by SwitchToHostedUnit, and so has another host fiber
+	// standing by on this thread. Such a fiber should return from RunHostedFiber as soon as it
+	// has finished whatever it had parked in.
+	bool IsResumedHostedFiber() const;
+
+#if HEART_FIBER_TRACING
+	HeartFiberTracer& GetTracer()
+	{
+		return m_tracer;
+	}
+#endif
+
+	// How many work units are parked, including those a host has been asked to resume but hasn't yet.
+	uint32_t GetParkedWorkUnitCount() const
+	{
+		return m_parkedUnitCount.load(std::memory_order_acquire);
+	}
+
 	// Add a work unit to the fiber system. Will be executed at some later point.
-	// F must be movable but is not required to be copyable.
+	// F must be movable but is not required to be copyable. Work units which are known
+	// to stay shallow can ask for a Small stack, which is much cheaper to keep around.
+	template <typename F>
+	HeartFiberWorkUnitRef EnqueueWork(F&& f, HeartFiberStackClass stackClass = HeartFiberStackClass::Large)
+	{
+		return EnqueueWorkUnit(hrt::forward<F>(f), stackClass, nullptr);
+	}
+
+	// As above, but the counter is incremented now and decremented once the work unit
+	// completes, so that a fiber can wait for it with HeartFiberContext::WaitForCounter.
 	template <typename F>
-	HeartFiberWorkUnitRef EnqueueWork(F&& f)
+	HeartFiberWorkUnitRef EnqueueWork(F&& f, HeartFiberCounter& counter, HeartFiberStackClass stackClass = HeartFiberStackClass::Large)
+	{
+		counter.Increment();
+		return EnqueueWorkUnit(hrt::forward<F>(f), stackClass, &counter);
+	}
+
+private:
+	template <typename F>
+	HeartFiberWorkUnitRef EnqueueWorkUnit(F&& f, HeartFiberStackClass stackClass, HeartFiberCounter* counter)
 	{
 		HeartFiberWorkUnit* newWorkUnit = m_allocator.AllocateAndConstruct<HeartFiberWorkUnit>(
 			HeartFiberWorkUnit::ConstructorSecret,
 			&m_allocator,
 			hrt::forward<F>(f));
+		newWorkUnit->m_stackClass = stackClass;
+		newWorkUnit->m_counter = counter;
+		newWorkUnit->m_system = this;
 
-		{
-			HeartLockGuard lock(m_pendingQueueMutex);
+		// Take the caller's ref first; the work unit may run and finish the moment it's pushed
+		HeartFiberWorkUnitRef result(newWorkUnit);
 
-			// We manually increment the ref count here. This is the "queue ref"
-			// since the queue itself holds raw pointers, not intrusive pointers
-			newWorkUnit->IncrementRef();
-			m_pendingQueue.PushBack(newWorkUnit);
-		}
+		// We manually increment the ref count here. This is the "queue ref"
+		// since the queues themselves hold raw pointers, not intrusive pointers
+		newWorkUnit->IncrementRef();
+		PushWorkUnit(newWorkUnit);
 
-		return HeartFiberWorkUnitRef(newWorkUnit);
+		return result;
 	}
 };
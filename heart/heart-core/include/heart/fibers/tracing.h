@@ -0,0 +1,210 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/config.h>
+
+#if HEART_FIBER_TRACING
+
+#include <heart/allocator.h>
+#include <heart/copy_move_semantics.h>
+#include <heart/fibers/fwd.h>
+#include <heart/types.h>
+
+#include <atomic>
+
+class HeartChromeTraceWriter;
+
+// What a work unit is doing, as far as the tracer is concerned
+enum class HeartFiberTraceState : uint8_t
+{
+	None,
+
+	// Queued (or handed to a host), waiting for a thread to switch to it
+	Runnable,
+
+	// On a thread
+	Running,
+
+	// Waiting for something to resume it: a HeartFence, HeartFiberMutex, a sleep...
+	Parked,
+
+	// Finished, for good
+	Done,
+};
+
+// How long a work unit has spent in each state, in nanoseconds
+struct HeartFiberUnitTimes
+{
+	uint64_t running = 0;
+	uint64_t runnable = 0;
+	uint64_t parked = 0;
+};
+
+// Counters kept by a HeartFiberTracer, either for one thread or totalled over all of them.
+struct HeartFiberTraceStats
+{
+	static constexpr uint32_t NotAPump = ~0u;
+
+	// The thread's index in Chrome traces, and its HeartFiberSystem pump index (NotAPump on a
+	// host's thread, or one that only enqueued or resumed work units). Both NotAPump in totals.
+	uint32_t threadIndex = NotAPump;
+	uint32_t pumpIndex = NotAPump;
+
+	// Every switch from one fiber to another, including to and from the pump
+	uint64_t switchCount = 0;
+
+	// How long work units spent running, and the pump spent asleep waiting for work, in nanoseconds
+	uint64_t runTime = 0;
+	uint64_t idleTime = 0;
+	uint64_t idleCount = 0;
+
+	// Stacks created, reused (from the thread's pool, or by a work unit starting over), finished
+	// with by a work unit, and given back. Once the system shuts down, freed == allocated.
+	uint64_t stacksAllocated = 0;
+	uint64_t stacksReused = 0;
+	uint64_t stacksReleased = 0;
+	uint64_t stacksFreed = 0;
+
+	// Work units which finished on the thread, and their times added up
+	uint64_t completedUnitCount = 0;
+	HeartFiberUnitTimes completedUnitTimes;
+};
+
+// One span of time on a fiber thread. Timestamps come from HeartFiberTracer::GetTimestamp().
+struct HeartFiberTraceEvent
+{
+	enum class Type : uint8_t
+	{
+		// A work unit running, from being switched to until it switched away
+		Run,
+
+		// The pump asleep, waiting for work
+		Idle,
+	};
+
+	uint64_t startTime;
+	uint64_t endTime;
+
+	// Which work unit ran, numbered from 1 in the order they first became runnable. 0 for Idle.
+	uint64_t unitId;
+
+	Type type;
+};
+
+// Collects HeartFiberTraceStats and (optionally) HeartFiberTraceEvents from every thread a
+// HeartFiberSystem runs fibers on. Like HeartJobTracer, each thread keeps its own counters and
+// fixed-size event buffer, so recording takes no locks; events which don't fit are dropped.
+// Every HeartFiberSystem has one (see HeartFiberSystem::GetTracer), which starts without events.
+class HeartFiberTracer
+{
+public:
+	static constexpr uint32_t DefaultEventsPerThread = 16 * Kilo;
+
+private:
+	friend class HeartFiberSystem;
+
+	// Written only by the thread that owns it, with a plain load and store
+	struct ThreadBuffer
+	{
+		ThreadBuffer* next = nullptr;
+		const void* owner = nullptr;
+		uint32_t threadIndex = 0;
+		uint32_t pumpIndex = HeartFiberTraceStats::NotAPump;
+
+		std::atomic<uint64_t> switchCount = 0;
+		std::atomic<uint64_t> runTime = 0;
+		std::atomic<uint64_t> idleTime = 0;
+		std::atomic<uint64_t> idleCount = 0;
+		std::atomic<uint64_t> stacksAllocated = 0;
+		std::atomic<uint64_t> stacksReused = 0;
+		std::atomic<uint64_t> stacksReleased = 0;
+		std::atomic<uint64_t> stacksFreed = 0;
+		std::atomic<uint64_t> completedUnitCount = 0;
+		std::atomic<uint64_t> completedRunning = 0;
+		std::atomic<uint64_t> completedRunnable = 0;
+		std::atomic<uint64_t> completedParked = 0;
+
+		// Allocated by the owner the first time it records an event
+		std::atomic<HeartFiberTraceEvent*> events = nullptr;
+		std::atomic<uint32_t> eventCount = 0;
+		std::atomic<uint64_t> droppedCount = 0;
+	};
+
+	HeartBaseAllocator& m_allocator;
+	uint32_t m_eventsPerThread;
+	uint64_t m_startTime;
+
+	// Unique to this tracer, so that threads can't confuse it with an earlier one at the same address
+	uint64_t m_id;
+
+	std::atomic<bool> m_eventsEnabled = false;
+	std::atomic<uint64_t> m_nextUnitId = 1;
+
+	// Every buffer ever created. Only ever pushed to until we are destroyed.
+	std::atomic<ThreadBuffer*> m_buffers = nullptr;
+	std::atomic<uint32_t> m_threadCount = 0;
+
+	ThreadBuffer* GetThreadBuffer();
+
+	void RecordEvent(ThreadBuffer& buffer, HeartFiberTraceEvent::Type type, uint64_t start, uint64_t end, uint64_t unitId);
+
+	static HeartFiberTraceStats GetStats(const ThreadBuffer& buffer);
+
+	// Hooks for HeartFiberSystem, all on the calling thread
+	void AttachThread(uint32_t pumpIndex);
+	void OnSwitch(HeartFiberWorkUnit& target);
+	void OnIdle(uint64_t start, uint64_t end);
+	void OnStackAllocated();
+	void OnStackReused();
+	void OnStackReleased();
+	void OnStackFreed();
+
+	// Move a work unit into state. Only from whichever thread the unit belongs to right now.
+	void SetUnitState(HeartFiberWorkUnit& unit, HeartFiberTraceState state);
+
+public:
+	HeartFiberTracer(HeartBaseAllocator& allocator = GetHeartDefaultAllocator(), uint32_t eventsPerThread = DefaultEventsPerThread);
+	~HeartFiberTracer();
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartFiberTracer);
+
+	// Current time in nanoseconds, from a monotonic clock
+	static uint64_t GetTimestamp();
+
+	// Whether to record events as well as the counters. There's one every time a work unit
+	// runs, so a thread's buffer fills up quickly. Off by default.
+	void SetEventsEnabled(bool enabled);
+
+	// Every thread's counters added up.
+	HeartFiberTraceStats GetTotals() const;
+
+	// Copy up to capacity threads' counters into stats. Returns how many threads there are.
+	uint32_t GetThreadStats(HeartFiberTraceStats* stats, uint32_t capacity) const;
+
+	uint64_t GetEventCount() const;
+	uint64_t GetDroppedEventCount() const;
+
+	// Throw away every event and counter. Must not be called while any fiber is running.
+	void Clear();
+
+	// Add every recorded event to the writer, one thread per fiber thread.
+	void ExportChromeTrace(HeartChromeTraceWriter& writer) const;
+};
+
+#define HEART_FIBER_TRACE(expression) expression
+
+#else
+
+#define HEART_FIBER_TRACE(expression)
+
+#endif
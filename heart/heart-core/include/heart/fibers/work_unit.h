@@ -14,6 +14,7 @@
 #include <heart/fibers/fwd.h>
 
 #include <heart/fibers/status.h>
+#include <heart/fibers/tracing.h>
 #include <heart/function/embedded_function.h>
 #include <heart/memory/intrusive_list.h>
 #include <heart/util/tag_type.h>
@@ -24,6 +25,16 @@
 
 struct HeartBaseAllocator;
 
+// How big a stack a work unit runs on. Anything which might call deep into a library
+// (eg SFML, which needs at least 256kb) should use Large.
+enum class HeartFiberStackClass : uint8_t
+{
+	Small, // 64kb
+	Large, // 1mb
+
+	Count,
+};
+
 class HeartFiberWorkUnit
 {
 public:
@@ -33,6 +44,11 @@ private:
 	HEART_DECLARE_TAG_TYPE(ConstructorSecret);
 	friend class HeartFiberContext;
 	friend class HeartFiberSystem;
+	friend class HeartFiberCounter;
+	friend class HeartFence;
+#if HEART_FIBER_TRACING
+	friend class HeartFiberTracer;
+#endif
 
 	HeartFiberWorkUnit() = default;
 
@@ -48,6 +64,34 @@ private:
 
 	HeartBaseAllocator* m_allocator = nullptr;
 
+	HeartFiberStackClass m_stackClass = HeartFiberStackClass::Large;
+
+	// When a sleeping work unit is due to wake up, in the system's sleep ticks
+	uint64_t m_sleepDeadline = 0;
+
+	// Which pump's sleep wheel a sleeping work unit is in
+	uint32_t m_sleepPumpIndex = 0;
+
+	// The value a parked work unit is waiting for, eg a HeartFiberCounter value or HeartFence revision
+	uint32_t m_waitTarget = 0;
+
+	// A counter to decrement when this work unit completes, if any
+	HeartFiberCounter* m_counter = nullptr;
+
+	// The system that runs this work unit, so that whatever it parks on can wake it from any thread
+	HeartFiberSystem* m_system = nullptr;
+
+	// Whatever a HeartFiberHost is running on this work unit. Never touched by the system.
+	void* m_hostData = nullptr;
+
+#if HEART_FIBER_TRACING
+	// Kept by the system's HeartFiberTracer as the work unit moves between states
+	HeartFiberUnitTimes m_traceTimes = {};
+	uint64_t m_traceStateStart = 0;
+	uint64_t m_traceId = 0;
+	HeartFiberTraceState m_traceState = HeartFiberTraceState::None;
+#endif
+
 public:
 	HeartFiberWorkUnit(ConstructorSecretT, HeartBaseAllocator* allocator = nullptr) :
 		HeartFiberWorkUnit(ConstructorSecretT {}, allocator, WorkerFunction {})
@@ -78,5 +122,29 @@ public:
 		return m_status;
 	}
 
+	HeartFiberStackClass GetStackClass() const
+	{
+		return m_stackClass;
+	}
+
+	void* GetHostData() const
+	{
+		return m_hostData;
+	}
+
+	void SetHostData(void* data)
+	{
+		m_hostData = data;
+	}
+
+#if HEART_FIBER_TRACING
+	// How long this work unit has spent running, runnable and parked so far. Only
+	// complete (and only safe to read from another thread) once it has finished.
+	const HeartFiberUnitTimes& GetTraceTimes() const
+	{
+		return m_traceTimes;
+	}
+#endif
+
 	typedef HeartIntrusiveList<HeartFiberWorkUnit, &HeartFiberWorkUnit::m_link> Queue;
 };
@@ -0,0 +1,28 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/io/io_cmd_list.h>
+#include <heart/io/io_cmd_queue.h>
+#include <heart/jobs/task.h>
+
+// Submit cmdList to queue with a signal of fence to revision on the end, and return something
+// a HeartTask can co_await to suspend until the queue has got through the whole list. The task
+// carries on in a job, not on the IO thread.
+//   co_await IoSubmitAndWait(queue, cmdList, fence, ++revision);
+inline HeartTaskFenceAwaiter IoSubmitAndWait(IoCmdQueue& queue, IoCmdList& cmdList, HeartFence& fence, uint32_t revision)
+{
+	cmdList.Signal(&fence, revision);
+	queue.Submit(&cmdList);
+
+	return HeartTaskWaitForFence(fence, revision);
+}
@@ -0,0 +1,116 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/allocator.h>
+#include <heart/copy_move_semantics.h>
+#include <heart/sync/mutex.h>
+#include <heart/types.h>
+
+// A slab allocator for fixed-size blocks in a small number of size classes, used by
+// HeartJobSystem for its jobs. Blocks are carved out of slabs from the backing allocator
+// and are never returned to it until the HeartJobAllocator itself is destroyed.
+//
+// Freed blocks go to a per-thread cache when the freeing thread has attached one
+// (the job system's workers each do), otherwise to a mutex-guarded central free list.
+// Caches that grow too large hand half their blocks back to the central list, and
+// empty caches refill from it in batches.
+class HeartJobAllocator
+{
+public:
+	static constexpr uint32_t SizeClassCount = 3;
+
+	// Every block is aligned to at least this.
+	static constexpr size_t BlockAlignment = 16;
+
+private:
+	// How many blocks to carve out of the backing allocator at once
+	static constexpr uint32_t SlabBlockCount = 64;
+
+	// How many blocks a cache can hold per size class before returning some to the central list
+	static constexpr uint32_t MaxCachedBlocks = 256;
+
+	// How many blocks to move from the central list to a cache when it runs dry
+	static constexpr uint32_t RefillBlockCount = 32;
+
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	struct FreeList
+	{
+		FreeBlock* head = nullptr;
+		uint32_t count = 0;
+	};
+
+	// Padded so that neighbouring caches don't share a cache line
+	static constexpr size_t CacheLineSize = 64;
+
+	struct ThreadCache
+	{
+		FreeList lists[SizeClassCount];
+		byte_t padding[CacheLineSize - (sizeof(FreeList) * SizeClassCount) % CacheLineSize];
+	};
+
+	// Precedes the blocks in every slab so that we can free them all later
+	struct alignas(BlockAlignment) SlabHeader
+	{
+		SlabHeader* next;
+		size_t size;
+	};
+
+	HeartBaseAllocator& m_allocator;
+	size_t m_blockSizes[SizeClassCount];
+
+	HeartMutex m_centralMutex;
+	FreeList m_central[SizeClassCount];
+	SlabHeader* m_slabs = nullptr;
+
+	ThreadCache* m_caches = nullptr;
+	uint32_t m_cacheCount = 0;
+
+	ThreadCache* GetCurrentCache();
+
+	// Moves up to count blocks from one list to another.
+	static void MoveBlocks(FreeList& from, FreeList& to, uint32_t count);
+
+	static void* PopBlock(FreeList& list);
+	static void PushBlock(FreeList& list, void* block);
+
+	// Allocates a new slab and puts every block in it into the given list.
+	// Must be called with m_centralMutex held.
+	void AllocateSlab(uint32_t sizeClass, FreeList& into);
+
+public:
+	// blockSizes must be ascending. Each is rounded up to BlockAlignment.
+	HeartJobAllocator(HeartBaseAllocator& allocator, const size_t (&blockSizes)[SizeClassCount]);
+	~HeartJobAllocator();
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartJobAllocator);
+
+	// Creates cacheCount thread caches which threads can then attach to with AttachThread.
+	// Must be called before any thread is attached.
+	void CreateThreadCaches(uint32_t cacheCount);
+
+	// Gives the calling thread exclusive use of the given cache until DetachThread.
+	void AttachThread(uint32_t cacheIndex);
+	void DetachThread();
+
+	size_t GetBlockSize(uint32_t sizeClass) const
+	{
+		return m_blockSizes[sizeClass];
+	}
+
+	void* Allocate(uint32_t sizeClass);
+	void Free(void* block, uint32_t sizeClass);
+};
@@ -12,19 +12,33 @@
 #pragma once
 
 #include <heart/allocator.h>
-#include <heart/function/embedded_function.h>
+#include <heart/fibers/host.h>
+#include <heart/function/details_function_base.h>
+#include <heart/jobs/job_allocator.h>
+#include <heart/jobs/tracing.h>
 #include <heart/memory/intrusive_list.h>
 #include <heart/memory/intrusive_ptr.h>
+#include <heart/memory/timer_wheel.h>
 #include <heart/memory/vector.h>
-#include <heart/sync/condition_variable.h>
+#include <heart/memory/work_stealing_deque.h>
+#include <heart/stl/move.h>
+#include <heart/stl/type_traits/add_remove_ref_cv.h>
+#include <heart/sync/event_count.h>
 #include <heart/sync/mutex.h>
 #include <heart/thread/thread.h>
+#include <heart/thread/topology.h>
 #include <heart/util/tag_type.h>
 
 #include <atomic>
+#include <initializer_list>
+#include <span>
 
 static constexpr size_t HeartJobStorage = 256;
 
+struct HeartJob;
+class HeartJobCounter;
+class HeartJobSystem;
+
 // Current status of a job. Any side effects of a job should not be
 // inspected until the status of the job is no longer Pending.
 enum class HeartJobStatus : uint8_t
@@ -66,6 +80,59 @@ enum HeartJobMask : uint32_t
 	HeartJobMaskAll = ~HeartJobMaskNone,
 };
 
+// How the job system distributes jobs between its worker threads.
+enum class HeartJobSchedulerMode : uint8_t
+{
+	// Every job goes through one set of mutex-guarded queues shared by all workers.
+	SharedQueue,
+
+	// Each worker owns a lock-free deque per priority. Jobs enqueued from a worker
+	// are pushed to (and popped from) that worker's deque LIFO, and idle workers steal
+	// from the other deques FIFO. Jobs enqueued from any other thread, and jobs with any
+	// mask but HeartJobMaskDefault, still go through the shared queues.
+	WorkStealing,
+};
+
+// How the job system binds its worker threads to CPUs.
+enum class HeartJobAffinityMode : uint8_t
+{
+	// Workers may run anywhere, and the OS moves them around as it sees fit.
+	None,
+
+	// Each worker is pinned to a single CPU from Settings::workerCpus, in order,
+	// wrapping around if there are more workers than CPUs.
+	CpuSet,
+
+	// Each worker is pinned to its own physical core (and all of that core's SMT siblings),
+	// in order, using only cores with a CPU in Settings::workerCpus, or every core if it is empty.
+	PhysicalCores,
+};
+
+// What the job system's workers run jobs on.
+enum class HeartJobExecutionMode : uint8_t
+{
+	// Straight on the worker's own stack. A job which has to wait for something blocks its
+	// worker, or in HeartJobSystem::Wait, runs other jobs on top of itself until it's done.
+	Threads,
+
+	// On fibers, so that a job can suspend: in HeartJobSystem::Wait, on a HeartFence, HeartEvent,
+	// HeartFiberCounter or HeartFiberMutex, or in HeartFiberContext::SleepFor. Its worker carries on
+	// with other jobs on a fresh fiber, and once the job can continue, the first worker free picks
+	// it up again. A job is simply run on whichever fiber its worker is on, so jobs that never
+	// suspend cost no more than with Threads. Affine jobs, and jobs run by threads helping out in
+	// Wait, still run on their thread's own stack.
+	Fibers,
+};
+
+// Links a job to something it is waiting on (another job or a HeartJobCounter).
+// Holds a reference to the waiting job until the prerequisite completes.
+struct HeartJobContinuation
+{
+	HeartJob* job = nullptr;
+	HeartJobSystem* system = nullptr;
+	HeartJobContinuation* next = nullptr;
+};
+
 // A pending job within the job system. Can only be constructed by the job system.
 struct HeartJob
 {
@@ -81,25 +148,93 @@ private:
 	// The mask for executing this job
 	uint32_t mask = HeartJobMaskDefault;
 
+	// The priority this job is queued with once it becomes runnable
+	HeartJobPriority priority = HeartJobPriority::Normal;
+
+	// Number of prerequisites (jobs or counters) which must complete before
+	// this job is queued. Jobs without prerequisites are queued immediately.
+	std::atomic<uint32_t> pendingPrerequisites = 0;
+
+	// Jobs waiting for this one to complete. Swapped for ClosedContinuations()
+	// once the job completes so that late dependents know not to wait.
+	std::atomic<HeartJobContinuation*> continuations = nullptr;
+
+	// Decremented when this job completes. We hold a reference to it until then.
+	HeartJobCounter* signalCounter = nullptr;
+
 	// Our intrusive link into the job queue
 	HeartIntrusiveListLink link;
 
-	// The allocator from which we were created
-	HeartBaseAllocator& allocator;
+	// When we were pushed to the shared queue. Used to find the oldest job across mask buckets.
+	uint64_t queueSequence = 0;
 
-	// Our actual job execution function
-	HeartEmbeddedFunction<HeartJobResult(), HeartJobStorage> worker = {};
+	// When we are due to be retried, and how many times we already have been
+	uint64_t retryDeadline = 0;
+	uint32_t retryCount = 0;
+
+	// Only ever run by the thread calling HeartJobSystem::PumpAffineJobs
+	bool affine = false;
+
+	// Which kinds of thread are blocked in HeartJobSystem::Wait on us. See HeartJobSystem::WaitFlags.
+	std::atomic<uint8_t> waitFlags = 0;
+
+	// The fiber we're suspended on, from when we're ready to carry on until a worker switches to it
+	HeartFiberWorkUnit* fiber = nullptr;
+
+	// The allocator from which we were created, and the size class of our block
+	HeartJobAllocator& allocator;
+	uint32_t sizeClass;
+
+#if HEART_JOB_TRACING
+	// The label active when we were created, and when we last became runnable
+	const char* traceLabel = nullptr;
+	uint64_t traceEnqueueTime = 0;
+#endif
+
+	using WorkerBase = heart_priv::HeartFunctionBase<HeartJobResult>;
 
-public:
 	template <typename F>
-	HeartJob(ConstructorSecretT, HeartBaseAllocator& a, F&& f, uint32_t m) :
-		worker(hrt::forward<F>(f)),
+	using WorkerImpl = heart_priv::HeartFunctionImpl<hrt::remove_cvref_t<F>, HeartJobResult>;
+
+	// Our actual job execution function. Constructed by the job system in the
+	// storage immediately following this job, and null once it has been cleared.
+	WorkerBase* worker = nullptr;
+
+	HeartJobResult RunWorker()
+	{
+		HEART_ASSERT(worker != nullptr);
+		return worker->Call();
+	}
+
+	void ClearWorker()
+	{
+		if (worker != nullptr)
+		{
+			worker->~WorkerBase();
+			worker = nullptr;
+		}
+	}
+
+	static HeartJobContinuation* ClosedContinuations()
+	{
+		return reinterpret_cast<HeartJobContinuation*>(uintptr_t(1));
+	}
+
+public:
+	HeartJob(ConstructorSecretT, HeartJobAllocator& a, uint32_t c, HeartJobPriority p, uint32_t m) :
 		allocator(a),
+		sizeClass(c),
 		mask(m),
+		priority(p),
 		status(HeartJobStatus::Pending)
 	{
 	}
 
+	~HeartJob()
+	{
+		ClearWorker();
+	}
+
 	// The status of this job. Side effects of the job should not
 	// be inspected until status does not equal Pending.
 	std::atomic<HeartJobStatus> status = HeartJobStatus::Pending;
@@ -113,7 +248,12 @@ public:
 	{
 		if (--useCount == 0)
 		{
-			allocator.DestroyAndFree(this);
+			HeartJob* self = const_cast<HeartJob*>(this);
+			HeartJobAllocator& a = allocator;
+			uint32_t c = sizeClass;
+
+			self->~HeartJob();
+			a.Free(self, c);
 		}
 	}
 
@@ -125,57 +265,577 @@ public:
 
 using HeartJobRef = HeartIntrusivePtr<HeartJob>;
 
-class HeartJobSystem final
+// An atomic counter that jobs can wait on and signal. Jobs enqueued against a counter
+// do not become runnable until it reaches zero. A counter can live on the stack, as long
+// as it outlives every job that references it, or be created by HeartJobSystem::CreateCounter.
+class HeartJobCounter
+{
+private:
+	friend class HeartJobSystem;
+
+	std::atomic<uint32_t> m_value = 0;
+
+	// Jobs waiting for m_value to reach zero
+	HeartMutex m_waitersMutex;
+	HeartJobContinuation* m_waiters = nullptr;
+
+	mutable std::atomic<uint32_t> m_useCount = 0;
+
+	// The allocator from which we were created, if any
+	HeartBaseAllocator* m_allocator = nullptr;
+
+	// Which kinds of thread are blocked in HeartJobSystem::Wait on us, and the system whose
+	// workers are. See HeartJobSystem::WaitFlags.
+	std::atomic<uint8_t> m_waitFlags = 0;
+	std::atomic<HeartJobSystem*> m_waitingSystem = nullptr;
+
+	// Decrement() calls which may still touch us after m_value changed. We can't be
+	// destroyed until they finish, even though a waiter may already have seen zero.
+	std::atomic<uint32_t> m_decrementsInFlight = 0;
+
+	// Add a waiting job. Returns false, without adding it, if the counter is already zero.
+	bool AddWaiter(HeartJobContinuation* waiter);
+
+public:
+	HeartJobCounter(uint32_t initialValue = 0, HeartBaseAllocator* allocator = nullptr) :
+		m_value(initialValue),
+		m_allocator(allocator)
+	{
+	}
+
+	~HeartJobCounter();
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartJobCounter);
+
+	void Increment(uint32_t count = 1);
+
+	// Decrement the counter. If it reaches zero, every waiting job becomes runnable.
+	void Decrement(uint32_t count = 1);
+
+	uint32_t GetValue() const
+	{
+		return m_value.load(std::memory_order_acquire);
+	}
+
+	void IncrementRef() const
+	{
+		++m_useCount;
+	}
+
+	void DecrementRef() const;
+
+	uint32_t GetRefCount() const
+	{
+		return m_useCount;
+	}
+};
+
+using HeartJobCounterRef = HeartIntrusivePtr<HeartJobCounter>;
+
+class HeartJobSystem final : private HeartFiberHost
 {
+	friend class HeartJobCounter;
+
 public:
 	struct Settings
 	{
 		// How many theads the job system will use.
 		uint8_t threadCount;
 
+		// If non-zero and less than threadCount, workers are parked and unparked between this many and
+		// threadCount as the load changes. Every scalingInterval microseconds, the backlog of queued
+		// jobs and how often workers come up empty decide whether one more or one fewer should run.
+		uint8_t minThreadCount;
+		uint32_t scalingInterval;
+
 		// The priority of the threads created by the job system.
 		HeartThread::Priority threadPriority;
+
+		// How jobs are distributed between the threads.
+		HeartJobSchedulerMode schedulerMode;
+
+		// How the threads are bound to CPUs, and which CPUs they can use.
+		HeartJobAffinityMode affinity;
+		HeartCpuSet workerCpus;
+
+		// If not empty, the thread dedicated to Urgent jobs is pinned to these CPUs
+		// instead, regardless of affinity. It then takes no CPU or core from the other workers.
+		HeartCpuSet urgentWorkerCpus;
+
+		// Jobs which return Retry are requeued after retryBackoffMin microseconds, doubling
+		// with every retry up to retryBackoffMax. Zero requeues them immediately.
+		// A job can pick its own delay with SetRetryDelay.
+		uint32_t retryBackoffMin;
+		uint32_t retryBackoffMax;
+
+		// What the workers run jobs on, and in Fibers mode, how big a stack each fiber gets.
+		HeartJobExecutionMode executionMode;
+		HeartFiberStackClass fiberStackClass;
 	};
 
-	// Constructs reasonable default settings based on available hardware concurrency.
+	// Constructs reasonable default settings based on the CPU topology of this machine.
+	// Workers are not pinned by default, but workerCpus excludes the cores reserved for
+	// the rest of the game, so switching affinity to PhysicalCores is enough to pin them.
 	static Settings GetDefaultSettings();
+	static Settings GetDefaultSettings(const HeartCpuTopology& topology);
+
+	// The CPUs that the given worker will be pinned to with these settings. Empty if it won't be pinned.
+	static HeartCpuSet GetWorkerCpus(const Settings& s, uint32_t workerIndex, const HeartCpuTopology& topology = HeartCpuTopology::Get());
 
 private:
 	typedef HeartIntrusiveList<HeartJob, &HeartJob::link> JobQueue;
 
+	// How many jobs each worker can hold locally per priority before
+	// falling back to the shared queues.
+	static constexpr uint32_t LocalQueueCapacity = 1024;
+
+	typedef HeartWorkStealingDeque<HeartJob, LocalQueueCapacity> LocalJobQueue;
+
+	// Set on a job or counter by threads which go to sleep in Wait
+	enum WaitFlags : uint8_t
+	{
+		// Blocked on the job's status or the counter's value with an atomic wait
+		ThreadWaiting = 1 << 0,
+
+		// A worker or the affine thread, parked on one of our events so that new work can wake it up too
+		WorkerWaiting = 1 << 1,
+	};
+
+	// Retry delays are measured in ticks of 2^RetryTickShift nanoseconds (about 65us)
+	static constexpr uint32_t RetryTickShift = 16;
+	static constexpr uint64_t NoRetryTick = ~uint64_t(0);
+
+	typedef HeartTimerWheel<HeartJob, &HeartJob::link, &HeartJob::retryDeadline> RetryTimerWheel;
+
+	// Bounds on how many times an idle worker looks for work before parking
+	static constexpr uint32_t MinWorkerSpinCount = 4;
+	static constexpr uint32_t MaxWorkerSpinCount = 64;
+
+	// How many samples in a row must agree before the active worker count grows or shrinks.
+	// Shrinking is slower so that a short lull between bursts doesn't cost us a worker.
+	static constexpr int32_t ScaleUpSamples = 2;
+	static constexpr int32_t ScaleDownSamples = 8;
+
+	// Busy workers report how many jobs they've run (and check on the scaling) this often
+	static constexpr uint32_t ScalingJobBatch = 32;
+
+	// The shared jobs of one priority, bucketed by mask so that a masked acquire never has to
+	// walk past jobs it can't take. Jobs whose mask is a single bit go in that bit's bucket,
+	// and a bitmap of non-empty buckets finds every candidate in a few instructions. Jobs with
+	// any other mask share one list, which is only scanned when a bit count shows that at
+	// least one job in it matches. Jobs come out oldest first across all of the buckets.
+	// Not thread safe; guarded by m_queueMutex.
+	class SharedJobQueue
+	{
+	private:
+		static constexpr uint32_t BucketCount = 32;
+
+		JobQueue m_buckets[BucketCount];
+		uint32_t m_occupiedBuckets = 0;
+
+		JobQueue m_multiMaskJobs;
+		uint32_t m_multiMaskBitCounts[BucketCount] = {};
+		uint32_t m_multiMaskBits = 0;
+
+		uint64_t m_nextSequence = 0;
+
+		JobQueue& GetQueueForMask(uint32_t mask);
+		void OnJobsAdded(uint32_t mask, uint32_t count);
+		void OnJobRemoved(uint32_t mask);
+
+	public:
+		void Push(HeartJob* job);
+
+		// Push every job in batch, all of which must have the given mask.
+		void PushBatch(JobQueue& batch, uint32_t mask);
+
+		// Remove and return the oldest job whose mask intersects the given one.
+		HeartJob* Pop(uint32_t mask);
+	};
+
+	// State owned by a single worker thread. Only allocated in WorkStealing mode.
+	// The deques only ever hold HeartJobMaskDefault jobs: a steal can only look at the oldest
+	// job, so a masked acquire could otherwise miss a match queued behind one that isn't.
+	struct WorkerState
+	{
+		LocalJobQueue queues[(uint32_t)HeartJobPriority::Count];
+	};
+
+	// Jobs are allocated with their worker function stored directly after them, in one of
+	// these sizes. Most jobs only capture a few pointers, so most jobs use the smallest class.
+	static constexpr size_t JobStorageSizes[HeartJobAllocator::SizeClassCount] = {32, 96, HeartJobStorage};
+
+	static constexpr size_t JobHeaderSize = (sizeof(HeartJob) + HeartJobAllocator::BlockAlignment - 1) & ~(HeartJobAllocator::BlockAlignment - 1);
+
+	static constexpr size_t JobBlockSizes[HeartJobAllocator::SizeClassCount] = {
+		JobHeaderSize + JobStorageSizes[0],
+		JobHeaderSize + JobStorageSizes[1],
+		JobHeaderSize + JobStorageSizes[2],
+	};
+
+	// The smallest size class whose storage fits a job running F
+	template <typename F>
+	static constexpr uint32_t GetJobSizeClass()
+	{
+		for (uint32_t i = 0; i < HeartJobAllocator::SizeClassCount - 1; ++i)
+		{
+			if (sizeof(HeartJob::WorkerImpl<F>) <= JobStorageSizes[i])
+				return i;
+		}
+
+		return HeartJobAllocator::SizeClassCount - 1;
+	}
+
 	// Our allocator. All allocations from the job system must come out of this allocator.
 	HeartBaseAllocator& m_allocator;
 
-	// Synchronization for the job queue and worker threads
+	// Where our jobs (and the continuations linking them) actually come from. Backed by m_allocator.
+	HeartJobAllocator m_jobAllocator;
+
+	// Synchronization for the job queue
 	HeartMutex m_queueMutex;
-	HeartConditionVariable m_conditionVar;
+
+	// Where idle workers park. The urgent worker parks separately so that waking it for a
+	// job it can't take never uses up a wakeup meant for the other workers.
+	HeartEventCount m_idleEvent;
+	HeartEventCount m_urgentIdleEvent;
+
+	// Jobs which may only run on the affine thread: whichever thread last called PumpAffineJobs, or Initialize before that.
+	// The affine thread parks on m_affineEvent when it has to wait for something.
+	HeartMutex m_affineMutex;
+	JobQueue m_affineQueue;
+	std::atomic<uint32_t> m_affineQueueSize = 0;
+	std::atomic<const void*> m_affineThread = nullptr;
+	HeartEventCount m_affineEvent;
 
 	// The queues. "Zero" allocation intrusive lists which link together our job nodes.
-	JobQueue m_queues[(uint32_t)HeartJobPriority::Count];
+	SharedJobQueue m_queues[(uint32_t)HeartJobPriority::Count];
+
+	// How many jobs are in each of m_queues. Lets callers skip taking the mutex when a queue is empty.
+	std::atomic<uint32_t> m_queueSizes[(uint32_t)HeartJobPriority::Count] = {};
 
 	// The vector of our workers
 	heart_priv::HeartVector<HeartThread> m_workerThreads;
 
+	// Per-worker state, indexed the same as m_workerThreads. Null in SharedQueue mode.
+	WorkerState* m_workerStates = nullptr;
+	uint32_t m_workerStateCount = 0;
+
+	// Jobs waiting out a retry delay. Each holds a "queue ref" while it is in here.
+	HeartMutex m_retryMutex;
+	RetryTimerWheel m_retryWheel;
+	std::atomic<uint32_t> m_retryJobCount = 0;
+
+	// No retry is due before this tick. Only written with m_retryMutex held.
+	std::atomic<uint64_t> m_nextRetryTick = NoRetryTick;
+
+	// The tick that the worker keeping watch over the retry timers will wake up at, or
+	// NoRetryTick if no worker is. Only one idle worker at a time sleeps with a timeout.
+	std::atomic<uint64_t> m_retryKeeperTick = NoRetryTick;
+
+	uint32_t m_retryBackoffMin = 0;
+	uint32_t m_retryBackoffMax = 0;
+
+	// Workers at or past m_activeWorkerLimit (by index) stay parked on m_suspendedEvent. The limit
+	// moves between m_minActiveWorkers and m_maxActiveWorkers, and never above m_activeWorkerCap.
+	// The urgent worker is always index 0, so it never gets suspended.
+	HeartMutex m_scalingMutex;
+	HeartEventCount m_suspendedEvent;
+	std::atomic<uint32_t> m_activeWorkerLimit = 0;
+	std::atomic<uint32_t> m_suspendedWorkerCount = 0;
+	uint32_t m_activeWorkerCap = UINT32_MAX;
+	uint32_t m_minActiveWorkers = 0;
+	uint32_t m_maxActiveWorkers = 0;
+
+	// Load since the last scaling sample, which is due at m_nextScalingTime (in microseconds).
+	// m_scalingTrend counts how many samples in a row asked to grow (positive) or shrink (negative),
+	// and is only touched by whichever thread claims the sample.
+	std::atomic<uint64_t> m_nextScalingTime = 0;
+	std::atomic<uint32_t> m_scalingJobCount = 0;
+	std::atomic<uint32_t> m_scalingFailureCount = 0;
+	int32_t m_scalingTrend = 0;
+	uint32_t m_scalingInterval = 0;
+
+	// Runs our workers on fibers in Fibers mode, otherwise null. We're its host.
+	HeartFiberSystem* m_fiberSystem = nullptr;
+
+	// Suspended jobs which are ready to carry on, each holding a "queue ref". Only workers take
+	// these, since only they can switch to the job's fiber, and they take them before any new job.
+	HeartMutex m_resumeMutex;
+	JobQueue m_resumedJobs[(uint32_t)HeartJobPriority::Count];
+	std::atomic<uint32_t> m_resumedJobCounts[(uint32_t)HeartJobPriority::Count] = {};
+
 	// Exit flag
 	std::atomic_bool m_exit = false;
 
+#if HEART_JOB_TRACING
+	// Records every job we run
+	HeartJobTracer m_tracer;
+#endif
+
 private:
 	// Thread entry point and workers for the job system threads
-	void ThreadWorker(HeartJobPriority lowestPriority);
+	void ThreadWorker(uint32_t workerIndex, HeartJobPriority lowestPriority);
+
+	// Run jobs on the calling worker until we exit. In Fibers mode, this is what every fiber on a
+	// worker runs, and one which was resumed returns as soon as its suspended job has finished.
+	void RunWorkerLoop();
+
+	// HeartFiberHost
+	HeartFiberResult RunHostedFiber() override;
+	void ResumeWorkUnit(HeartFiberWorkUnit& unit) override;
+	void ResumeWorkUnitAt(HeartFiberWorkUnit& unit, uint64_t deadline) override;
+	bool CancelResumeAt(HeartFiberWorkUnit& unit) override;
+
+	// Whether the calling thread is one of our workers, running on one of our fibers.
+	bool IsOnWorkerFiber() const;
 
-	// Insert a new job into the queue. Do NOT hold the mutex when calling this.
+	// Whether any job is suspended on a fiber, or ready to carry on but not yet picked up.
+	bool HasSuspendedJobs() const;
+
+	// Queue a suspended job whose fiber is ready to carry on, and wake a worker for it.
+	void PushResumedJob(HeartJob* job);
+
+	// Switch to a suspended job which is ready to carry on, if there is one of at least the
+	// given priority. Returns once it suspends again or finishes. Only from a worker's fiber.
+	bool TryResumeJob(HeartJobPriority lowestPri);
+
+	// What a fiber suspending in Wait is waiting for. Lives on the suspended fiber's stack.
+	struct FiberWait
+	{
+		HeartJobSystem* system;
+		const HeartJobRef* job;
+		HeartJobCounter* counter;
+	};
+
+	// Runs once a job has suspended in Wait, to make it runnable again once what it's waiting for is done.
+	static void AddFiberWaiter(HeartFiberWorkUnit* unit, void* wait);
+
+	// Returns the state of the calling thread if it is one of our workers in WorkStealing mode.
+	WorkerState* GetCurrentWorkerState();
+
+	// Push a new job to the calling worker's local queue if possible, otherwise to the shared queue.
+	// Do NOT hold the mutex when calling this.
+	void PushJob(HeartJob* rawJob, HeartJobPriority pri);
+
+	// Insert a new job into the shared queue. Do NOT hold the mutex when calling this.
 	void InsertJobIntoQueue(HeartJob* rawJob, HeartJobPriority pri);
 
-	// Remove a job from the queue. You MUST hold the mutex when calling this.
-	HeartJobRef RemoveJobFromQueue(JobQueue& queue, JobQueue::iterator iterator);
+	// Push every job in batch, each of which must already hold its queue ref and have the
+	// given mask, then wake enough workers to run them. Do NOT hold the mutex when calling this.
+	void PushJobs(JobQueue& batch, HeartJobPriority pri, uint32_t mask);
+
+	// Whether the active worker count is allowed to change with the load.
+	bool IsScalingEnabled() const
+	{
+		return m_minActiveWorkers < m_maxActiveWorkers;
+	}
+
+	// Take a scaling sample if one is due, and grow or shrink the active workers accordingly.
+	void UpdateActiveWorkers();
+
+	// Set the active worker limit, clamped to the cap and our bounds, and let the workers know.
+	// Call with m_scalingMutex held.
+	void SetActiveWorkerLimit(uint32_t limit);
+
+	// Park the calling worker until the active worker limit includes it again, or we exit.
+	void SuspendWorker(uint32_t workerIndex);
+
+	// How many jobs are queued for the workers right now, for scaling. Only a rough count.
+	uint32_t GetQueuedJobCount();
+
+	// Queue a job on the affine queue, instead of the queues the workers take from.
+	void PushAffineJob(HeartJob* rawJob);
+
+	// Whether the calling thread is the one that runs our affine jobs.
+	bool IsAffineThread() const;
+
+	// Returns the event that workers with the given lowest priority park on.
+	HeartEventCount& GetIdleEvent(HeartJobPriority lowestPriority);
+
+	// Wake up to jobCount idle workers that can run jobs of the given priority.
+	void WakeWorkers(size_t jobCount, HeartJobPriority pri);
+
+	// Take ownership of the "queue ref" of a job that was just removed from one of our queues.
+	HeartJobRef AdoptQueueRef(HeartJob* rawJob);
+
+	// Attempt to pop a job from the shared queue with the given mask and priority.
+	// Do NOT hold the mutex when calling this.
+	HeartJob* TryAcquireSharedJob(HeartJobPriority pri, uint32_t mask);
 
-	// Attempt to pop a job from the queue with the given mask and priority limit.
-	// Returns true if a job was successfully popped.
+	// Attempt to steal a job of the given priority and mask from any worker's local queue.
+	HeartJob* TryStealLocalJob(HeartJobPriority pri, uint32_t mask, WorkerState* thief);
+
+	// Returns true if any queue, shared or local, has a job of at least the given priority in it.
+	bool HasQueuedJobs(HeartJobPriority lowestPri = HeartJobPriority::Normal);
+
+	// Attempt to pop a job from the queues with the given mask and priority limit.
+	// Returns true if a job was successfully popped. Do NOT hold the mutex when calling this.
 	bool TryAcquireOneJob(HeartJobRef& outJob, HeartJobPriority& outPri, HeartJobPriority lowestPri, uint32_t mask = HeartJobMaskAll);
 
 	// Executes the provided job. If the job returns Retry, requeues it with the provided priority.
 	void ProcessOneJob(HeartJobRef job, HeartJobPriority priority);
 
+	// The current time, in retry timer ticks.
+	static uint64_t GetRetryTick();
+
+	// Requeue a job which returned Retry, after the given delay (in microseconds).
+	void RetryJob(HeartJob* job, uint32_t delay);
+
+	// Move every job whose retry delay has passed back into the queues.
+	void PromoteDueRetries();
+
+	// Park an idle worker, waking up in time for the next retry if it ends up keeping watch over them.
+	// Doesn't sleep if there is work, or if isDone() returns true. Returns whether it slept.
+	template <typename F>
+	bool ParkWorker(HeartEventCount& idleEvent, HeartJobPriority lowestPriority, F&& isDone);
+
+	// Wake every parked worker, eg because something one of them is waiting for has finished.
+	void WakeAllWorkers();
+
+	// Run jobs on the calling thread until isDone() returns true. Once there is nothing to run,
+	// sets our kind of WaitFlags in waitFlags and sleeps: workers park, so that new work still
+	// wakes them, and other threads call block(), which must do an atomic wait on the value
+	// that isDone() checks. Whoever makes isDone() true must wake us according to waitFlags.
+	template <typename IsDoneF, typename BlockF>
+	void HelpUntil(IsDoneF&& isDone, BlockF&& block, std::atomic<uint8_t>& waitFlags, HeartJobPriority lowestPriority, uint32_t mask);
+
+	// Marks a job as finished, releasing its dependents and signalling its counter.
+	void CompleteJob(HeartJob& job);
+
+	// Create a new job, but don't queue it.
+	template <typename F>
+	HeartJobRef CreateJob(F&& f, HeartJobPriority pri, uint32_t mask, HeartJobCounter* signalCounter)
+	{
+		using WorkerImpl = HeartJob::WorkerImpl<F>;
+		static_assert(sizeof(WorkerImpl) <= HeartJobStorage, "Job function is too large! Capture less, or capture a pointer to your data.");
+		static_assert(alignof(WorkerImpl) <= HeartJobAllocator::BlockAlignment, "Job function is over-aligned!");
+
+		constexpr uint32_t sizeClass = GetJobSizeClass<F>();
+		byte_t* block = static_cast<byte_t*>(m_jobAllocator.Allocate(sizeClass));
+
+		HeartJob* rawJob = new (block) HeartJob(HeartJob::ConstructorSecret, m_jobAllocator, sizeClass, pri, mask);
+		rawJob->worker = new (block + JobHeaderSize) WorkerImpl(hrt::remove_cvref_t<F>(hrt::forward<F>(f)));
+
+#if HEART_JOB_TRACING
+		rawJob->traceLabel = HeartJobTracer::GetCurrentLabel();
+		rawJob->traceEnqueueTime = HeartJobTracer::GetTimestamp();
+#endif
+
+		HeartJobRef newJob = rawJob;
+
+		if (signalCounter != nullptr)
+		{
+			signalCounter->Increment();
+			signalCounter->IncrementRef();
+			newJob->signalCounter = signalCounter;
+		}
+
+		return newJob;
+	}
+
+	// Create a continuation which will make job runnable (once all its other prerequisites are done).
+	HeartJobContinuation* CreateContinuation(HeartJob* job);
+
+	// Release a continuation created by CreateContinuation, freeing it.
+	void ReleaseContinuation(HeartJobContinuation* continuation);
+
+	// Resolve one of a job's prerequisites. If it was the last one, queues the job on this thread.
+	void ReleasePrerequisite(HeartJob* job);
+
+	// Queue a job created by CreateJob once all of the given prerequisites have completed.
+	void SubmitJobAfter(HeartJob* job, std::span<const HeartJobRef> prerequisites);
+
+	// Queue a job created by CreateJob once the given counter reaches zero.
+	void SubmitJobAfter(HeartJob* job, HeartJobCounter& counter);
+
+	// Shared by every job spawned from one ParallelRange call. Freed once the last of them is.
+	template <typename F>
+	struct ParallelRangeState
+	{
+		F function;
+		HeartJobCounterRef counter;
+		HeartBaseAllocator& allocator;
+		size_t grainSize;
+		HeartJobPriority priority;
+		uint32_t mask;
+
+		mutable std::atomic<uint32_t> useCount = 0;
+
+		template <typename T>
+		ParallelRangeState(T&& f, HeartJobCounterRef c, HeartBaseAllocator& a, size_t g, HeartJobPriority p, uint32_t m) :
+			function(hrt::forward<T>(f)),
+			counter(c),
+			allocator(a),
+			grainSize(g),
+			priority(p),
+			mask(m)
+		{
+		}
+
+		void IncrementRef() const
+		{
+			++useCount;
+		}
+
+		void DecrementRef() const
+		{
+			if (--useCount == 0)
+			{
+				allocator.DestroyAndFree(this);
+			}
+		}
+	};
+
+	template <typename F>
+	using ParallelRangeStateRef = HeartIntrusivePtr<ParallelRangeState<F>>;
+
+	// Returns true if a job pushed from this thread at the given priority is likely to be picked
+	// up by another thread soon, i.e. the queue it would land in is currently empty.
+	bool ShouldSplitWork(HeartJobPriority pri);
+
+	// Queue a job which processes [begin, end) of a ParallelRange.
+	template <typename F>
+	void EnqueueParallelRange(const ParallelRangeStateRef<F>& state, size_t begin, size_t end)
+	{
+		auto job = [this, state, begin, end]() {
+			RunParallelRange(state, begin, end);
+			return HeartJobResult::Success;
+		};
+
+		EnqueueJob(job, state->priority, state->mask, state->counter.Get());
+	}
+
+	// Process [begin, end) of a ParallelRange. Rather than splitting the whole range up front, we
+	// only hand off half of what's left when our queue has run dry (meaning other threads are
+	// likely looking for work) and otherwise chew through it one grain at a time. This keeps
+	// the job count low when everyone is busy and still spreads out quickly when they're not.
+	template <typename F>
+	void RunParallelRange(const ParallelRangeStateRef<F>& state, size_t begin, size_t end)
+	{
+		const size_t grainSize = state->grainSize;
+
+		while (end - begin > grainSize)
+		{
+			if (ShouldSplitWork(state->priority))
+			{
+				size_t middle = begin + (end - begin) / 2;
+				EnqueueParallelRange(state, middle, end);
+				end = middle;
+			}
+			else
+			{
+				state->function(begin, begin + grainSize);
+				begin += grainSize;
+			}
+		}
+
+		state->function(begin, end);
+	}
+
+	// Pick a grain size that gives each worker several chunks to balance with.
+	size_t GetParallelGrainSize(size_t count) const;
+
 public:
 	HeartJobSystem(HeartBaseAllocator& allocator = GetHeartDefaultAllocator());
 	~HeartJobSystem();
@@ -188,25 +848,190 @@ public:
 	// for there to be no pending jobs in the queue.
 	void Flush();
 
-	// Shutdown the job system. Waits for all pending work to complete.
+	// Shutdown the job system. Waits for all pending work to complete, running any
+	// affine jobs on the calling thread, so call it from the affine thread.
 	void Shutdown();
 
+	// Create a counter owned by the job system's allocator.
+	HeartJobCounterRef CreateCounter(uint32_t initialValue = 0);
+
 	// Insert a new job into the job system. F can be any invokable type
 	// as long as it fits within HeartJobStorage and returns a HeartJobResult.
+	// If signalCounter is provided, it is incremented now and decremented once the job completes.
 	template <typename F>
-	HeartJobRef EnqueueJob(F&& f, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault)
+	HeartJobRef EnqueueJob(F&& f, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault, HeartJobCounter* signalCounter = nullptr)
 	{
-		HeartJobRef newJob = m_allocator.AllocateAndConstruct<HeartJob>(HeartJob::ConstructorSecret, m_allocator, hrt::forward<F>(f), mask);
+		HeartJobRef newJob = CreateJob(hrt::forward<F>(f), pri, mask, signalCounter);
 
-		InsertJobIntoQueue(newJob.Get(), pri);
-		m_conditionVar.NotifyOne();
+		PushJob(newJob.Get(), pri);
+		WakeWorkers(1, pri);
+
+		return newJob;
+	}
 
+	// Insert a new job which does not become runnable until every prerequisite has completed,
+	// whether it succeeded or failed. The job is queued on the thread that completes the last
+	// prerequisite, so in WorkStealing mode it will usually run on that same worker.
+	template <typename F>
+	HeartJobRef EnqueueJob(F&& f, std::span<const HeartJobRef> prerequisites, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault, HeartJobCounter* signalCounter = nullptr)
+	{
+		HeartJobRef newJob = CreateJob(hrt::forward<F>(f), pri, mask, signalCounter);
+		SubmitJobAfter(newJob.Get(), prerequisites);
 		return newJob;
 	}
 
+	template <typename F>
+	HeartJobRef EnqueueJob(F&& f, std::initializer_list<HeartJobRef> prerequisites, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault, HeartJobCounter* signalCounter = nullptr)
+	{
+		return EnqueueJob(hrt::forward<F>(f), std::span<const HeartJobRef>(prerequisites.begin(), prerequisites.size()), pri, mask, signalCounter);
+	}
+
+	// Insert a new job which does not become runnable until waitCounter reaches zero.
+	// The job is queued on the thread that performs the final decrement.
+	template <typename F>
+	HeartJobRef EnqueueJob(F&& f, HeartJobCounter& waitCounter, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault, HeartJobCounter* signalCounter = nullptr)
+	{
+		HeartJobRef newJob = CreateJob(hrt::forward<F>(f), pri, mask, signalCounter);
+		SubmitJobAfter(newJob.Get(), waitCounter);
+		return newJob;
+	}
+
+	// Insert a new job which only ever runs on the affine thread, when it calls PumpAffineJobs.
+	// Use these for work that must stay on one thread (eg rendering or UI calls), so that
+	// everything leading up to it can still run on the workers.
+	template <typename F>
+	HeartJobRef EnqueueAffineJob(F&& f, HeartJobCounter* signalCounter = nullptr)
+	{
+		HeartJobRef newJob = CreateJob(hrt::forward<F>(f), HeartJobPriority::Normal, HeartJobMaskNone, signalCounter);
+		newJob->affine = true;
+
+		PushAffineJob(newJob.Get());
+		return newJob;
+	}
+
+	// Insert a new affine job which does not become runnable until every prerequisite has completed.
+	template <typename F>
+	HeartJobRef EnqueueAffineJob(F&& f, std::span<const HeartJobRef> prerequisites, HeartJobCounter* signalCounter = nullptr)
+	{
+		HeartJobRef newJob = CreateJob(hrt::forward<F>(f), HeartJobPriority::Normal, HeartJobMaskNone, signalCounter);
+		newJob->affine = true;
+
+		SubmitJobAfter(newJob.Get(), prerequisites);
+		return newJob;
+	}
+
+	template <typename F>
+	HeartJobRef EnqueueAffineJob(F&& f, std::initializer_list<HeartJobRef> prerequisites, HeartJobCounter* signalCounter = nullptr)
+	{
+		return EnqueueAffineJob(hrt::forward<F>(f), std::span<const HeartJobRef>(prerequisites.begin(), prerequisites.size()), signalCounter);
+	}
+
+	// How many workers are active, ie not parked by scaling or the cap. Lags behind a change in
+	// either while the workers involved finish their current job or wake up.
+	uint32_t GetActiveWorkerCount() const;
+
+	// Limit how many workers may run jobs at once, eg while other processes need the cores.
+	// Workers over the cap finish their current job and park until the cap is raised again.
+	// The cap never stops the job system from making progress; at least one worker that can run
+	// Normal jobs is always active. Pass UINT32_MAX to remove the cap.
+	void SetActiveWorkerCap(uint32_t cap);
+
+	// Run affine jobs on the calling thread, which becomes the affine thread (until then, it's the
+	// thread that called Initialize), until there are none left or budgetMicroseconds have passed.
+	// Always runs at least one job if there are any, and never runs jobs queued after it started.
+	// Returns how many jobs were run.
+	uint32_t PumpAffineJobs(uint32_t budgetMicroseconds = UINT32_MAX);
+
+	// Insert a batch of count jobs, running the callables returned by generator(0) through
+	// generator(count - 1). The whole batch is queued at once and only as many workers as
+	// there are jobs are woken up. Returns a counter which reaches zero once every job in
+	// the batch has completed.
+	template <typename G>
+	HeartJobCounterRef EnqueueJobs(size_t count, G&& generator, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault)
+	{
+		HeartJobCounterRef group = CreateCounter();
+		JobQueue batch;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			HeartJobRef job = CreateJob(generator(i), pri, mask, group.Get());
+
+			// This is the "queue ref", handed over to the queue by PushJobs
+			job->IncrementRef();
+			batch.PushBack(job.Get());
+		}
+
+		PushJobs(batch, pri, mask);
+		return group;
+	}
+
+	// Insert a batch of jobs, one for each callable in fns. See above.
+	template <typename F>
+	HeartJobCounterRef EnqueueJobs(std::span<F> fns, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault)
+	{
+		return EnqueueJobs(
+			fns.size(), [fns](size_t i) -> F& { return fns[i]; }, pri, mask);
+	}
+
+	// Split [begin, end) into jobs which call f(rangeBegin, rangeEnd) for disjoint sub-ranges.
+	// Ranges are split recursively as workers go idle, so there is no need to pick a grain size
+	// and nothing is allocated per element. Returns a counter which reaches zero once the
+	// entire range has been processed; pass it to Wait() to help out until then.
+	template <typename F>
+	HeartJobCounterRef ParallelRange(size_t begin, size_t end, F&& f, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault)
+	{
+		HeartJobCounterRef counter = CreateCounter();
+		if (begin >= end)
+			return counter;
+
+		size_t grainSize = GetParallelGrainSize(end - begin);
+
+		using State = ParallelRangeState<hrt::remove_cvref_t<F>>;
+		ParallelRangeStateRef<hrt::remove_cvref_t<F>> state =
+			m_allocator.AllocateAndConstruct<State>(hrt::forward<F>(f), counter, m_allocator, grainSize, pri, mask);
+
+		EnqueueParallelRange(state, begin, end);
+		return counter;
+	}
+
+	// Split [begin, end) into jobs which call f(i) for every i. See ParallelRange.
+	template <typename F>
+	HeartJobCounterRef ParallelFor(size_t begin, size_t end, F&& f, HeartJobPriority pri = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskDefault)
+	{
+		auto range = [f = hrt::forward<F>(f)](size_t rangeBegin, size_t rangeEnd) mutable {
+			for (size_t i = rangeBegin; i < rangeEnd; ++i)
+			{
+				f(i);
+			}
+		};
+
+		return ParallelRange(begin, end, hrt::move(range), pri, mask);
+	}
+
+	// Execute jobs on the calling thread until job completes, and return its final status.
+	// Once nothing is left that this thread can run, it sleeps until the job completes or,
+	// if it is one of our workers, until more work arrives. Safe to call from inside a job.
+	// In Fibers mode, a job run by one of our workers suspends instead, ignoring the filters.
+	HeartJobStatus Wait(const HeartJobRef& job, HeartJobPriority lowestPriority = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskAll);
+
+	// Execute jobs on the calling thread until counter reaches zero, sleeping (or suspending) as above.
+	void Wait(HeartJobCounter& counter, HeartJobPriority lowestPriority = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskAll);
+
+	// Called from inside a job which is about to return Retry, to requeue it after the given
+	// number of microseconds instead of the default backoff. Zero requeues it immediately.
+	static void SetRetryDelay(uint32_t microseconds);
+
 	// Attempt to steal work from the job system instead of waiting for it
 	// to execute on a job thread. The user can specify a mask and priority
 	// to limit what will be stolen.
 	// Returns whether or not a job was stolen.
 	bool TryStealJobWork(HeartJobPriority lowestPriority = HeartJobPriority::Normal, uint32_t mask = HeartJobMaskAll);
+
+#if HEART_JOB_TRACING
+	// Every job run by this system is recorded here. Label jobs with HEART_JOB_TRACE_LABEL.
+	HeartJobTracer& GetTracer()
+	{
+		return m_tracer;
+	}
+#endif
 };
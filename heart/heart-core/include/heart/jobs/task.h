@@ -0,0 +1,442 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/allocator.h>
+#include <heart/copy_move_semantics.h>
+#include <heart/debug/assert.h>
+#include <heart/jobs/system.h>
+#include <heart/stl/forward.h>
+#include <heart/stl/move.h>
+#include <heart/stl/type_traits/void.h>
+#include <heart/sync/fence.h>
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+// A coroutine run by a HeartJobSystem. Unlike a job on a fiber, a suspended task only holds on
+// to its coroutine frame, so it suits lots of small tasks which mostly wait (eg on IO).
+//
+// A task does nothing until it is either started with Start, or co_awaited by another task, which
+// runs it straight away on the same thread and carries on once it has finished. Inside a task,
+// co_await a HeartJobRef, a HeartJobCounter or HeartTaskWaitForFence() to suspend until it is done;
+// the task then carries on in a job of its own priority, on one of its system's workers.
+//
+// Frames come from HeartGetDefaultTaskAllocator(), unless the coroutine's first parameters (after
+// the object, for a member function) are std::allocator_arg and a HeartBaseAllocator&.
+template <typename T = void>
+class HeartTask;
+
+// Where the frames of tasks which aren't given an allocator come from. Null restores the default,
+// GetHeartDefaultAllocator(). Every frame is freed by the allocator it came from, so this can
+// change at any time.
+void HeartSetDefaultTaskAllocator(HeartBaseAllocator* allocator);
+HeartBaseAllocator& HeartGetDefaultTaskAllocator();
+
+namespace heart_priv
+{
+	class HeartTaskPromiseBase
+	{
+	private:
+		template <typename T>
+		friend class ::HeartTask;
+
+		// Each frame is prefixed with the allocator it came from
+		static constexpr size_t FrameHeaderSize = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+		// Where we run, and at which priority. Set once we're started or co_awaited.
+		HeartJobSystem* m_system = nullptr;
+		HeartJobPriority m_priority = HeartJobPriority::Normal;
+
+		// The task that co_awaited us, if any
+		std::coroutine_handle<> m_continuation = nullptr;
+
+		// Decremented once we finish, if we were started with one. We hold a reference to it until then.
+		HeartJobCounter* m_signalCounter = nullptr;
+
+		std::atomic<bool> m_done = false;
+
+		static void* AllocateFrame(size_t size, HeartBaseAllocator& allocator);
+
+	public:
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			template <typename Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+			{
+				return handle.promise().Finish();
+			}
+
+			void await_resume() noexcept
+			{
+			}
+		};
+
+		static void* operator new(size_t size);
+
+		template <typename... Args>
+		static void* operator new(size_t size, std::allocator_arg_t, HeartBaseAllocator& allocator, Args&...)
+		{
+			return AllocateFrame(size, allocator);
+		}
+
+		template <typename Class, typename... Args>
+		static void* operator new(size_t size, Class&, std::allocator_arg_t, HeartBaseAllocator& allocator, Args&...)
+		{
+			return AllocateFrame(size, allocator);
+		}
+
+		static void operator delete(void* frame, size_t size);
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		FinalAwaiter final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void unhandled_exception()
+		{
+			HEART_ASSERT(false, "HeartTask coroutines must not throw");
+			std::terminate();
+		}
+
+		// Queue a job on our system which resumes handle (our own coroutine)
+		void ResumeOnJob(std::coroutine_handle<> handle);
+
+		// Queue a job which resumes handle once job (or counter) completes
+		void ResumeAfter(std::coroutine_handle<> handle, const HeartJobRef& job);
+		void ResumeAfter(std::coroutine_handle<> handle, HeartJobCounter& counter);
+
+		// Signal that we're done. Returns the coroutine to carry on with.
+		std::coroutine_handle<> Finish() noexcept;
+	};
+
+	template <typename T>
+	class HeartTaskPromise final : public HeartTaskPromiseBase
+	{
+	private:
+		alignas(T) byte_t m_result[sizeof(T)];
+		bool m_hasResult = false;
+
+	public:
+		~HeartTaskPromise()
+		{
+			if (m_hasResult)
+				GetResult().~T();
+		}
+
+		HeartTask<T> get_return_object();
+
+		template <typename U = T>
+		void return_value(U&& value)
+		{
+			HEART_ASSERT(!m_hasResult);
+			new (m_result) T(hrt::forward<U>(value));
+			m_hasResult = true;
+		}
+
+		T& GetResult()
+		{
+			HEART_ASSERT(m_hasResult);
+			return *std::launder(reinterpret_cast<T*>(m_result));
+		}
+	};
+
+	template <>
+	class HeartTaskPromise<void> final : public HeartTaskPromiseBase
+	{
+	public:
+		HeartTask<void> get_return_object();
+
+		void return_void()
+		{
+		}
+
+		void GetResult()
+		{
+		}
+	};
+
+	template <typename Promise>
+	HeartTaskPromiseBase& GetTaskPromise(std::coroutine_handle<Promise> handle)
+	{
+		static_assert(std::is_base_of_v<HeartTaskPromiseBase, Promise>, "Only a HeartTask can co_await this");
+		return handle.promise();
+	}
+}
+
+template <typename T>
+class HeartTask
+{
+public:
+	using promise_type = heart_priv::HeartTaskPromise<T>;
+
+private:
+	std::coroutine_handle<promise_type> m_handle = nullptr;
+
+	struct Awaiter
+	{
+		std::coroutine_handle<promise_type> handle;
+
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		// Run the awaited task on this thread, with our system and priority, and carry on once it's done
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
+		{
+			heart_priv::HeartTaskPromiseBase& parent = heart_priv::GetTaskPromise(awaiting);
+			heart_priv::HeartTaskPromiseBase& child = handle.promise();
+
+			child.m_system = parent.m_system;
+			child.m_priority = parent.m_priority;
+			child.m_continuation = awaiting;
+			return handle;
+		}
+
+		T await_resume()
+		{
+			if constexpr (!hrt::is_void_v<T>)
+				return hrt::move(handle.promise().GetResult());
+		}
+	};
+
+	bool IsStarted() const
+	{
+		return m_handle.promise().m_system != nullptr;
+	}
+
+public:
+	HeartTask() = default;
+
+	explicit HeartTask(std::coroutine_handle<promise_type> handle) :
+		m_handle(handle)
+	{
+	}
+
+	HeartTask(HeartTask&& other) :
+		m_handle(other.m_handle)
+	{
+		other.m_handle = nullptr;
+	}
+
+	HeartTask& operator=(HeartTask&& other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			m_handle = other.m_handle;
+			other.m_handle = nullptr;
+		}
+
+		return *this;
+	}
+
+	DISABLE_COPY_SEMANTICS(HeartTask);
+
+	~HeartTask()
+	{
+		Reset();
+	}
+
+	// Destroy the coroutine. It must either have never started or have finished.
+	void Reset()
+	{
+		if (m_handle)
+		{
+			HEART_ASSERT(!IsStarted() || IsDone(), "Destroying a HeartTask that is still running");
+			m_handle.destroy();
+			m_handle = nullptr;
+		}
+	}
+
+	// Run the task in a job on system's workers. If signalCounter is provided, it is incremented
+	// now and decremented once the task finishes, so it can be passed to HeartJobSystem::Wait or
+	// used as a prerequisite. Keep the task alive until it's done.
+	void Start(HeartJobSystem& system, HeartJobPriority pri = HeartJobPriority::Normal, HeartJobCounter* signalCounter = nullptr)
+	{
+		HEART_ASSERT(m_handle && !IsStarted(), "A HeartTask can only be started once");
+
+		promise_type& promise = m_handle.promise();
+		promise.m_system = &system;
+		promise.m_priority = pri;
+
+		if (signalCounter != nullptr)
+		{
+			signalCounter->Increment();
+			signalCounter->IncrementRef();
+			promise.m_signalCounter = signalCounter;
+		}
+
+		promise.ResumeOnJob(m_handle);
+	}
+
+	bool IsValid() const
+	{
+		return bool(m_handle);
+	}
+
+	// Whether the task has finished. Its result can be inspected once this is true.
+	bool IsDone() const
+	{
+		return m_handle && m_handle.promise().m_done.load(std::memory_order_acquire);
+	}
+
+	decltype(auto) GetResult()
+	{
+		HEART_ASSERT(IsDone());
+		return m_handle.promise().GetResult();
+	}
+
+	// Only from inside another task. The result is moved out of this one.
+	Awaiter operator co_await() noexcept
+	{
+		HEART_ASSERT(m_handle && !IsStarted(), "A HeartTask can only be awaited once, and not once it has been started");
+		return Awaiter {m_handle};
+	}
+};
+
+template <typename T>
+HeartTask<T> heart_priv::HeartTaskPromise<T>::get_return_object()
+{
+	return HeartTask<T>(std::coroutine_handle<HeartTaskPromise<T>>::from_promise(*this));
+}
+
+inline HeartTask<void> heart_priv::HeartTaskPromise<void>::get_return_object()
+{
+	return HeartTask<void>(std::coroutine_handle<HeartTaskPromise<void>>::from_promise(*this));
+}
+
+// co_await a job from inside a task to suspend until it completes. Returns its final status.
+class HeartTaskJobAwaiter
+{
+private:
+	HeartJobRef m_job;
+
+public:
+	HeartTaskJobAwaiter(const HeartJobRef& job) :
+		m_job(job)
+	{
+	}
+
+	bool await_ready()
+	{
+		return m_job->status.load(std::memory_order_acquire) != HeartJobStatus::Pending;
+	}
+
+	template <typename Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		heart_priv::GetTaskPromise(handle).ResumeAfter(handle, m_job);
+	}
+
+	HeartJobStatus await_resume()
+	{
+		return m_job->status.load(std::memory_order_acquire);
+	}
+};
+
+inline HeartTaskJobAwaiter operator co_await(const HeartJobRef& job)
+{
+	return HeartTaskJobAwaiter(job);
+}
+
+// co_await a counter from inside a task to suspend until it reaches zero.
+class HeartTaskCounterAwaiter
+{
+private:
+	HeartJobCounter& m_counter;
+
+public:
+	HeartTaskCounterAwaiter(HeartJobCounter& counter) :
+		m_counter(counter)
+	{
+	}
+
+	bool await_ready()
+	{
+		return m_counter.GetValue() == 0;
+	}
+
+	template <typename Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		heart_priv::GetTaskPromise(handle).ResumeAfter(handle, m_counter);
+	}
+
+	void await_resume()
+	{
+	}
+};
+
+inline HeartTaskCounterAwaiter operator co_await(HeartJobCounter& counter)
+{
+	return HeartTaskCounterAwaiter(counter);
+}
+
+// Suspends a task until a fence reaches a revision. See HeartTaskWaitForFence.
+class HeartTaskFenceAwaiter : private HeartFenceWaiter
+{
+private:
+	HeartFence& m_fence;
+	heart_priv::HeartTaskPromiseBase* m_promise = nullptr;
+	std::coroutine_handle<> m_handle = nullptr;
+
+	// Runs on whichever thread signals the fence
+	static void OnSignalled(HeartFenceWaiter& waiter);
+
+public:
+	HeartTaskFenceAwaiter(HeartFence& fence, uint32_t revision);
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartTaskFenceAwaiter);
+
+	bool await_ready()
+	{
+		return m_fence.Test(revision);
+	}
+
+	template <typename Promise>
+	bool await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		m_promise = &heart_priv::GetTaskPromise(handle);
+		m_handle = handle;
+
+		// Signalled since await_ready, so carry straight on
+		return m_fence.AddWaiter(*this);
+	}
+
+	void await_resume()
+	{
+	}
+};
+
+// co_await from inside a task to suspend until fence reaches revision, without blocking a thread.
+// The task carries on in a job, even if the fence is signalled by some other thread (eg IO).
+inline HeartTaskFenceAwaiter HeartTaskWaitForFence(HeartFence& fence, uint32_t revision)
+{
+	return HeartTaskFenceAwaiter(fence, revision);
+}
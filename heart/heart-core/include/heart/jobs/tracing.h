@@ -0,0 +1,166 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/config.h>
+
+#if HEART_JOB_TRACING
+
+#include <heart/allocator.h>
+#include <heart/copy_move_semantics.h>
+#include <heart/types.h>
+
+#include <atomic>
+
+class HeartChromeTraceWriter;
+
+// Defined in heart/jobs/system.h
+enum class HeartJobPriority : uint32_t;
+enum class HeartJobResult : uint8_t;
+
+// Durations counted in power-of-two nanosecond buckets. Bucket 0 holds [0, 2)ns,
+// and every bucket i after that holds [2^i, 2^(i+1))ns.
+struct HeartJobTraceHistogram
+{
+	static constexpr uint32_t BucketCount = 40;
+
+	uint64_t buckets[BucketCount] = {};
+
+	static uint32_t GetBucket(uint64_t nanoseconds);
+
+	// The exclusive upper bound of a bucket, in nanoseconds.
+	static uint64_t GetBucketLimit(uint32_t bucket);
+
+	uint64_t GetCount() const;
+
+	// Returns the upper bound (in nanoseconds) of the bucket holding the given percentile, from 0 to 100.
+	uint64_t GetPercentile(double percentile) const;
+};
+
+// One execution of a job. Timestamps come from HeartJobTracer::GetTimestamp().
+struct HeartJobTraceEvent
+{
+	static constexpr uint32_t NotAWorker = ~0u;
+
+	const char* label;
+
+	// When the job became runnable, started executing, and finished executing
+	uint64_t enqueueTime;
+	uint64_t startTime;
+	uint64_t endTime;
+
+	// The index of the worker which ran the job, or NotAWorker if it was stolen by another thread
+	uint32_t workerId;
+
+	HeartJobPriority priority;
+	HeartJobResult result;
+};
+
+// Collects HeartJobTraceEvents from every thread that runs jobs. Each thread records into
+// its own fixed-size buffer without taking any locks; events which don't fit are counted
+// and dropped. Queue-wait and run-time histograms are kept per priority and never drop.
+class HeartJobTracer
+{
+public:
+	static constexpr uint32_t PriorityCount = 3;
+	static constexpr uint32_t DefaultEventsPerThread = 4 * Kilo;
+
+private:
+	typedef std::atomic<uint64_t> AtomicHistogram[HeartJobTraceHistogram::BucketCount];
+	typedef AtomicHistogram PriorityHistograms[PriorityCount];
+
+	// Only ever written by the thread that owns it
+	struct ThreadBuffer
+	{
+		ThreadBuffer* next = nullptr;
+		const void* owner = nullptr;
+		uint32_t threadIndex = 0;
+		uint32_t workerId = HeartJobTraceEvent::NotAWorker;
+
+		std::atomic<uint32_t> eventCount = 0;
+		std::atomic<uint64_t> droppedCount = 0;
+		HeartJobTraceEvent* events = nullptr;
+
+		PriorityHistograms queueWait = {};
+		PriorityHistograms runTime = {};
+	};
+
+	HeartBaseAllocator& m_allocator;
+	uint32_t m_eventsPerThread;
+	uint64_t m_startTime;
+
+	// Unique to this tracer, so that threads can't confuse it with an earlier one at the same address
+	uint64_t m_id;
+
+	// Every buffer ever created. Only ever pushed to until we are destroyed.
+	std::atomic<ThreadBuffer*> m_buffers = nullptr;
+	std::atomic<uint32_t> m_threadCount = 0;
+
+	ThreadBuffer* GetThreadBuffer();
+
+	HeartJobTraceHistogram GetHistogram(PriorityHistograms ThreadBuffer::*histograms, HeartJobPriority priority) const;
+
+public:
+	HeartJobTracer(HeartBaseAllocator& allocator = GetHeartDefaultAllocator(), uint32_t eventsPerThread = DefaultEventsPerThread);
+	~HeartJobTracer();
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartJobTracer);
+
+	// Current time in nanoseconds, from a monotonic clock
+	static uint64_t GetTimestamp();
+
+	// The label for jobs created on this thread right now. See HEART_JOB_TRACE_LABEL.
+	static const char* GetCurrentLabel();
+
+	// Create the calling thread's buffer ahead of time, so that recording never allocates.
+	// Workers call this when they start, and are named after their worker index in traces.
+	void AttachThread(uint32_t workerId = HeartJobTraceEvent::NotAWorker);
+
+	// Record an event on the calling thread's buffer.
+	void Record(const HeartJobTraceEvent& event);
+
+	HeartJobTraceHistogram GetQueueWaitHistogram(HeartJobPriority priority) const;
+	HeartJobTraceHistogram GetRunTimeHistogram(HeartJobPriority priority) const;
+
+	uint64_t GetEventCount() const;
+	uint64_t GetDroppedEventCount() const;
+
+	// Throw away every event and histogram. Must not be called while any job is running.
+	void Clear();
+
+	// Add every recorded event to the writer, one thread per recording thread.
+	void ExportChromeTrace(HeartChromeTraceWriter& writer) const;
+};
+
+// Sets the trace label of every job created on this thread for as long as it is alive.
+// The label must outlive the tracer; typically it is a string literal.
+class HeartJobTraceLabelScope
+{
+private:
+	const char* m_previous;
+
+public:
+	HeartJobTraceLabelScope(const char* label);
+	~HeartJobTraceLabelScope();
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartJobTraceLabelScope);
+};
+
+#define ___HEART_JOB_TRACE_LABEL(a, b) a##b
+#define _HEART_JOB_TRACE_LABEL(x, n) ___HEART_JOB_TRACE_LABEL(x, n)
+#define HEART_JOB_TRACE_LABEL(label) HeartJobTraceLabelScope _HEART_JOB_TRACE_LABEL(HeartJobTraceLabel_, __COUNTER__)(label)
+
+#else
+
+#define HEART_JOB_TRACE_LABEL(label)
+
+#endif
@@ -138,6 +138,26 @@ public:
 		RemoveLink(iterator.link);
 	}
 
+	// Move every element of other onto the back of this list in constant time, leaving other empty
+	void SpliceBack(HeartIntrusiveList& other)
+	{
+		if (other.IsEmpty())
+			return;
+
+		link_type* first = other.m_root.next;
+		link_type* last = other.m_root.prev;
+
+		first->prev = m_root.prev;
+		m_root.prev->next = first;
+		last->next = &m_root;
+		m_root.prev = last;
+		m_size += other.m_size;
+
+		other.m_root.next = &other.m_root;
+		other.m_root.prev = &other.m_root;
+		other.m_size = 0;
+	}
+
 	void Clear()
 	{
 		while (!IsEmpty())
@@ -0,0 +1,186 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/copy_move_semantics.h>
+#include <heart/memory/intrusive_list.h>
+#include <heart/types.h>
+
+// A hashed timer wheel of intrusively linked items. Each item is due at the tick stored
+// in its DeadlinePointer member, and lives in slot (deadline % SlotCount) until it expires.
+// Deadlines more than SlotCount ticks away simply stay in their slot for several turns
+// of the wheel. Scheduling is O(1), and advancing is O(slots passed + items in them).
+// The earliest deadline is cached, and only searched for again once it has expired or
+// been removed.
+//
+// Ticks are whatever unit the owner likes. The wheel is not thread safe.
+template <typename T, HeartIntrusiveListLink T::*LinkPointer, uint64_t T::*DeadlinePointer, uint32_t SlotCount = 256>
+class HeartTimerWheel
+{
+	static_assert((SlotCount & (SlotCount - 1)) == 0, "SlotCount must be a power of two!");
+
+public:
+	using ItemList = HeartIntrusiveList<T, LinkPointer>;
+
+	static constexpr uint64_t NoDeadline = ~uint64_t(0);
+
+private:
+	ItemList m_slots[SlotCount];
+
+	// Every tick before this one has been processed
+	uint64_t m_currentTick;
+	size_t m_size = 0;
+
+	// The earliest deadline in the wheel, unless m_nextTickStale is set
+	mutable uint64_t m_nextTick = NoDeadline;
+	mutable bool m_nextTickStale = false;
+
+	ItemList& GetSlot(uint64_t tick)
+	{
+		return m_slots[tick & (SlotCount - 1)];
+	}
+
+	uint64_t FindNextTick() const
+	{
+		uint64_t earliest = NoDeadline;
+		if (m_size == 0)
+			return earliest;
+
+		// Within one turn the slots are in deadline order, so the first item due this turn is
+		// the earliest. Past that, every item is a turn or more away and needs looking at.
+		for (uint64_t i = 0; i < SlotCount; ++i)
+		{
+			for (const T& item : m_slots[(m_currentTick + i) & (SlotCount - 1)])
+			{
+				if (item.*DeadlinePointer < earliest)
+					earliest = item.*DeadlinePointer;
+			}
+
+			if (earliest <= m_currentTick + i)
+				break;
+		}
+
+		return earliest;
+	}
+
+public:
+	HeartTimerWheel(uint64_t currentTick = 0) :
+		m_currentTick(currentTick)
+	{
+	}
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartTimerWheel);
+
+	// Add an item, due at item->*DeadlinePointer. Items which are already due expire on the next Advance(),
+	// and have their deadline brought forward to the current tick.
+	void Schedule(T* item)
+	{
+		if (item->*DeadlinePointer < m_currentTick)
+			item->*DeadlinePointer = m_currentTick;
+
+		GetSlot(item->*DeadlinePointer).PushBack(item);
+		++m_size;
+
+		if (!m_nextTickStale && item->*DeadlinePointer < m_nextTick)
+			m_nextTick = item->*DeadlinePointer;
+	}
+
+	// Take back an item which was scheduled on this wheel. Returns false, and leaves it alone, if it has
+	// already expired. A removed item's deadline is reset to zero, so that it reads as expired from then on.
+	bool Remove(T* item)
+	{
+		if (item->*DeadlinePointer < m_currentTick)
+			return false;
+
+		if (item->*DeadlinePointer == m_nextTick)
+			m_nextTickStale = true;
+
+		GetSlot(item->*DeadlinePointer).Remove(item);
+		item->*DeadlinePointer = 0;
+		--m_size;
+		return true;
+	}
+
+	// Move time forward to tick, moving every item due by then onto expired (in no particular order).
+	// Returns how many items expired.
+	size_t Advance(uint64_t tick, ItemList& expired)
+	{
+		if (tick < m_currentTick)
+			return 0;
+
+		size_t expiredCount = 0;
+
+		// Past one full turn, every slot has been passed through
+		uint64_t slotsPassed = tick - m_currentTick + 1;
+		uint64_t slotsToVisit = slotsPassed < SlotCount ? slotsPassed : SlotCount;
+
+		for (uint64_t i = 0; i < slotsToVisit && m_size != expiredCount; ++i)
+		{
+			ItemList& slot = GetSlot(m_currentTick + i);
+			if (slot.IsEmpty())
+				continue;
+
+			// Anything left in the slot afterwards is due on a later turn of the wheel
+			ItemList pending;
+			pending.SpliceBack(slot);
+
+			while (T* item = pending.PopFront())
+			{
+				if (item->*DeadlinePointer <= tick)
+				{
+					expired.PushBack(item);
+					++expiredCount;
+				}
+				else
+				{
+					slot.PushBack(item);
+				}
+			}
+		}
+
+		m_size -= expiredCount;
+		m_currentTick = tick + 1;
+
+		// Nothing expiring means the earliest deadline is still to come
+		if (expiredCount != 0)
+			m_nextTickStale = true;
+
+		return expiredCount;
+	}
+
+	// The earliest deadline of any item in the wheel, or NoDeadline if it is empty.
+	uint64_t GetNextTick() const
+	{
+		if (m_nextTickStale)
+		{
+			m_nextTick = FindNextTick();
+			m_nextTickStale = false;
+		}
+
+		return m_nextTick;
+	}
+
+	uint64_t GetCurrentTick() const
+	{
+		return m_currentTick;
+	}
+
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+	bool IsEmpty() const
+	{
+		return m_size == 0;
+	}
+};
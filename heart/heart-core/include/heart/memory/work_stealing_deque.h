@@ -0,0 +1,135 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/copy_move_semantics.h>
+#include <heart/types.h>
+
+#include <atomic>
+
+// A fixed-capacity, lock-free Chase-Lev deque.
+// https://www.di.ens.fr/~zappa/readings/ppopp13.pdf
+//
+// Exactly one thread (the "owner") may call Push() and Pop(), which operate LIFO
+// on the bottom of the deque. Any thread may call Steal(), which operates FIFO on the top.
+//
+// The deque never grows. Push() returns false when it is full so that the owner can
+// fall back to some other storage.
+template <typename T, uint32_t Capacity>
+class HeartWorkStealingDeque
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "HeartWorkStealingDeque capacity must be a power of 2");
+
+private:
+	static constexpr int64_t IndexMask = int64_t(Capacity) - 1;
+
+	// Keep the two indices on separate cache lines; the owner hammers bottom, thieves hammer top.
+	// Padded rather than aligned so that the deque can live in memory from any HeartBaseAllocator.
+	static constexpr size_t CacheLineSize = 64;
+
+	std::atomic<int64_t> m_top = 0;
+	byte_t m_topPadding[CacheLineSize - sizeof(std::atomic<int64_t>)] = {};
+	std::atomic<int64_t> m_bottom = 0;
+	byte_t m_bottomPadding[CacheLineSize - sizeof(std::atomic<int64_t>)] = {};
+	std::atomic<T*> m_slots[Capacity] = {};
+
+public:
+	HeartWorkStealingDeque() = default;
+	~HeartWorkStealingDeque() = default;
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartWorkStealingDeque);
+
+	// Owner only. Returns false if the deque is full.
+	bool Push(T* item)
+	{
+		int64_t b = m_bottom.load(std::memory_order_relaxed);
+		int64_t t = m_top.load(std::memory_order_acquire);
+		if (b - t >= int64_t(Capacity))
+		{
+			return false;
+		}
+
+		m_slots[b & IndexMask].store(item, std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_release);
+		m_bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Owner only. Returns the most recently pushed item, or nullptr if empty.
+	T* Pop()
+	{
+		int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+		m_bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = m_top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			// Empty, restore bottom
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		T* item = m_slots[b & IndexMask].load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// Last item - race any thieves for it
+			if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				item = nullptr;
+			}
+
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		return item;
+	}
+
+	// Any thread. Returns the oldest item, or nullptr if empty.
+	// Can spuriously return nullptr if another thread won the race for the item.
+	T* Steal()
+	{
+		int64_t t = m_top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = m_bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+		{
+			return nullptr;
+		}
+
+		// If top moves after this load the CAS below fails and we discard what we read,
+		// so a stale item is never acted upon.
+		T* item = m_slots[t & IndexMask].load(std::memory_order_relaxed);
+
+		if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return nullptr;
+		}
+
+		return item;
+	}
+
+	// Approximate when called from anything but the owner.
+	uint32_t Size() const
+	{
+		int64_t b = m_bottom.load(std::memory_order_relaxed);
+		int64_t t = m_top.load(std::memory_order_relaxed);
+		return b > t ? uint32_t(b - t) : 0;
+	}
+
+	bool IsEmpty() const
+	{
+		return Size() == 0;
+	}
+};
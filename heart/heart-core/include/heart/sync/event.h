@@ -11,11 +11,18 @@
 */
 #pragma once
 
+#include <heart/fibers/fwd.h>
+#include <heart/fibers/work_unit.h>
+#include <heart/memory/intrusive_list.h>
+#include <heart/sync/condition_variable.h>
+#include <heart/sync/mutex.h>
 #include <heart/types.h>
 
 #include <heart/copy_move_semantics.h>
 
-// TODO!
+// An event which threads and fibers can wait on. A waiting thread blocks; a waiting fiber
+// parks, leaving its thread free to run other fibers. An Automatic event releases one waiter
+// per Set and then resets itself, whereas a Manual event releases everybody until Reset.
 class HeartEvent
 {
 public:
@@ -26,31 +33,57 @@ public:
 	};
 
 private:
-	uintptr_t m_handle = 0;
-
-	uintptr_t* NativeHandle()
+	// A fiber parked in Wait. Lives on the fiber's own stack; the unit's link may be
+	// busy in its system's sleep wheel, so the event keeps these in its list instead.
+	struct FiberWaiter
 	{
-		return &m_handle;
-	}
+		HeartIntrusiveListLink link = {};
+		HeartEvent* event = nullptr;
+		HeartFiberSystem* system = nullptr;
+		HeartFiberWorkUnit* unit = nullptr;
 
-	template <typename T>
-	T& GetNativeHandleAs()
-	{
-		return *(T*)NativeHandle();
-	}
+		// In sleep ticks, for a timed Wait; zero to wait forever
+		uint64_t deadline = 0;
+
+		// An event to Set in the same step as starting to wait, for SignalAndWait
+		HeartEvent* signal = nullptr;
+
+		// Set is done with the waiter, and handed it the signal
+		bool signalled = false;
+	};
+
+	HeartConditionVariable m_cv;
+	HeartMutex m_mutex;
+	bool m_manualReset = false;
+	bool m_isSet = false;
+
+	HeartIntrusiveList<FiberWaiter, &FiberWaiter::link> m_fiberWaiters;
+
+	// Only call with m_mutex held and m_isSet true
+	void Consume();
+
+	// The body of Set, with m_mutex held. Fibers to resume once it is let go go onto ready.
+	void SetLocked(HeartFiberWorkUnit::Queue& ready);
+
+	// Park the current fiber until it is handed the signal, or the deadline passes.
+	// Sets signal, if any, as it parks. Returns whether it was signalled.
+	bool WaitOnFiber(HeartFiberSystem* system, uint64_t deadline, HeartEvent* signal = nullptr);
+
+	// Runs on the pump once a fiber has parked in Wait
+	static void AddFiberWaiter(HeartFiberWorkUnit* unit, void* waiter);
 
 public:
 	HeartEvent(ResetType rt = ResetType::Automatic);
 	~HeartEvent();
 
-	DISABLE_COPY_SEMANTICS(HeartEvent);
-
-	USE_DEFAULT_MOVE_SEMANTICS(HeartEvent);
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartEvent);
 
 	void Set();
 	void Reset();
 	void Wait();
 	void Wait(uint32_t waitDurationMs);
 
+	// Set this event and wait on other as one step: nobody can Set and consume other
+	// in between, as both events' mutexes are held throughout.
 	void SignalAndWait(HeartEvent& other);
 };
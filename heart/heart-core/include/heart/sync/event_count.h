@@ -0,0 +1,70 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/sync/condition_variable.h>
+#include <heart/sync/mutex.h>
+
+#include <atomic>
+
+// An "event count" lets threads sleep until some condition they checked without a lock may
+// have changed, without losing wakeups and without notifiers paying for a lock or syscall
+// when nobody is waiting. Waiters follow this pattern:
+//
+//   HeartEventCount::Key key = eventCount.PrepareWait();
+//   if (ConditionIsMet())
+//       eventCount.CancelWait();
+//   else
+//       eventCount.Wait(key);
+//
+// and notifiers make the condition true *before* calling Notify(). A thread which is between
+// PrepareWait() and Wait() when a notify happens will not go to sleep.
+class HeartEventCount
+{
+public:
+	typedef uint32_t Key;
+
+private:
+	// Threads between PrepareWait() and the end of Wait() or CancelWait()
+	std::atomic<uint32_t> m_waiters = 0;
+
+	// Bumped by every notify which found a waiter
+	std::atomic<uint32_t> m_epoch = 0;
+
+	HeartMutex m_mutex;
+	HeartConditionVariable m_cv;
+
+public:
+	HeartEventCount() = default;
+	~HeartEventCount() = default;
+
+	DISABLE_COPY_AND_MOVE_SEMANTICS(HeartEventCount);
+
+	Key PrepareWait();
+	void CancelWait();
+
+	// Sleep until a Notify() after the matching PrepareWait() wakes this thread.
+	void Wait(Key key);
+
+	// As Wait(), but give up after roughly the given number of milliseconds.
+	// Returns false if we were not notified. May return false early.
+	bool TryWaitFor(Key key, uint32_t milliseconds);
+
+	// Wake up to count sleeping threads.
+	void Notify(uint32_t count = 1);
+	void NotifyAll();
+
+	uint32_t GetWaiterCount() const
+	{
+		return m_waiters.load(std::memory_order_relaxed);
+	}
+};
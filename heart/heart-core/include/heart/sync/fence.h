@@ -11,9 +11,22 @@
 */
 #pragma once
 
+#include <heart/fibers/work_unit.h>
+#include <heart/memory/intrusive_list.h>
 #include <heart/sync/condition_variable.h>
 #include <heart/sync/mutex.h>
 
+// Waits on a HeartFence without blocking or parking anything, eg for a HeartTask. The fence
+// calls callback from whichever thread signals it to at least revision.
+struct HeartFenceWaiter
+{
+	HeartIntrusiveListLink link = {};
+	uint32_t revision = 0;
+	void (*callback)(HeartFenceWaiter& waiter) = nullptr;
+};
+
+// Wait blocks the calling thread until the fence is signalled to at least the given revision.
+// Called from a fiber, it parks just that fiber instead, leaving the thread to run others.
 class HeartFence
 {
 private:
@@ -21,6 +34,15 @@ private:
 	HeartMutex m_mutex;
 	uint32_t m_currentRevision = 0;
 
+	// Fibers parked in Wait, each with the revision it wants in m_waitTarget
+	HeartFiberWorkUnit::Queue m_fiberWaiters;
+
+	// Waiters added with AddWaiter
+	HeartIntrusiveList<HeartFenceWaiter, &HeartFenceWaiter::link> m_callbackWaiters;
+
+	// Runs on the pump once a fiber has parked in Wait
+	static void AddFiberWaiter(HeartFiberWorkUnit* unit, void* fence);
+
 public:
 	HeartFence() = default;
 	~HeartFence() = default;
@@ -31,4 +53,8 @@ public:
 	void Wait(uint32_t revision);
 
 	bool Test(uint32_t revision);
+
+	// Call waiter.callback once the fence reaches waiter.revision. Returns false, without adding
+	// it, if it already has. The waiter must stay where it is until it has been called back.
+	bool AddWaiter(HeartFenceWaiter& waiter);
 };
@@ -15,6 +15,8 @@
 
 #include <heart/copy_move_semantics.h>
 
+class HeartCpuSet;
+
 class HeartThread
 {
 private:
@@ -47,6 +49,11 @@ public:
 	void Detach();
 	void SetName(const char* name);
 
+	// Restrict the thread to the given CPUs. Windows threads can only be bound within one
+	// processor group, so only the CPUs in the lowest group present in the set are used.
+	// Returns false if the set is empty or the OS refused.
+	bool SetAffinity(const HeartCpuSet& cpus);
+
 	void** GetNativeHandle()
 	{
 		return &m_handle;
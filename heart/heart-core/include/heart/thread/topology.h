@@ -0,0 +1,127 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#pragma once
+
+#include <heart/types.h>
+
+// A set of logical CPUs, by index. On Windows, index = (processor group * 64) + processor number.
+class HeartCpuSet
+{
+public:
+	static constexpr uint32_t MaxCpuCount = 256;
+	static constexpr uint32_t InvalidCpu = ~0u;
+
+private:
+	static constexpr uint32_t WordCount = MaxCpuCount / 64;
+
+	uint64_t m_words[WordCount] = {};
+
+public:
+	// Parse a CPU list like "0-3,8,10-11", as found in /sys/devices/system/cpu.
+	// Returns an empty set if the list is malformed.
+	static HeartCpuSet Parse(const char* list);
+
+	void Add(uint32_t cpu);
+	void Add(const HeartCpuSet& other);
+	void Remove(uint32_t cpu);
+
+	// Remove every CPU which is not also in other.
+	void Intersect(const HeartCpuSet& other);
+
+	bool Contains(uint32_t cpu) const;
+
+	bool IsEmpty() const;
+	uint32_t GetCount() const;
+
+	// The lowest CPU in the set which is >= start, or InvalidCpu.
+	uint32_t GetNext(uint32_t start = 0) const;
+
+	// The nth lowest CPU in the set, or InvalidCpu.
+	uint32_t GetNth(uint32_t n) const;
+
+	// The 64 CPUs starting at CPU word * 64, as a bitmask. Windows calls this a processor group.
+	uint64_t GetWord(uint32_t word) const
+	{
+		return word < WordCount ? m_words[word] : 0;
+	}
+
+	friend bool operator==(const HeartCpuSet& a, const HeartCpuSet& b);
+	friend bool operator!=(const HeartCpuSet& a, const HeartCpuSet& b)
+	{
+		return !(a == b);
+	}
+};
+
+// The physical cores and packages of the machine, and which logical CPUs belong to them.
+class HeartCpuTopology
+{
+public:
+	static constexpr uint32_t MaxCoreCount = HeartCpuSet::MaxCpuCount;
+
+	struct Core
+	{
+		// Every logical CPU of this core. More than one means SMT (hyperthreading).
+		HeartCpuSet cpus;
+		uint32_t package = 0;
+	};
+
+private:
+	Core m_cores[MaxCoreCount];
+	uint32_t m_coreCount = 0;
+	uint32_t m_packageCount = 0;
+	HeartCpuSet m_allCpus;
+
+public:
+	// The topology of this machine, detected on first use. If detection fails,
+	// every logical CPU reported by the OS is treated as its own core.
+	static const HeartCpuTopology& Get();
+
+	// Detect the topology of this machine, without caching it.
+	static HeartCpuTopology Detect();
+
+	// Add a core. Cores are kept in the order they are added, which should follow their lowest CPU.
+	void AddCore(uint32_t package, const HeartCpuSet& cpus);
+
+	uint32_t GetCoreCount() const
+	{
+		return m_coreCount;
+	}
+
+	uint32_t GetPackageCount() const
+	{
+		return m_packageCount;
+	}
+
+	uint32_t GetLogicalCpuCount() const
+	{
+		return m_allCpus.GetCount();
+	}
+
+	const Core& GetCore(uint32_t index) const
+	{
+		return m_cores[index];
+	}
+
+	const HeartCpuSet& GetAllCpus() const
+	{
+		return m_allCpus;
+	}
+
+	// Whether any core has more than one logical CPU.
+	bool HasSmt() const
+	{
+		return GetLogicalCpuCount() > m_coreCount;
+	}
+
+	// The index of the core which owns the given CPU, or HeartCpuSet::InvalidCpu.
+	uint32_t FindCore(uint32_t cpu) const;
+};
@@ -19,3 +19,10 @@ project "heart-core"
 	includedirs {
 		get_root_location() .. "external/rapidjson/include",
 	}
+
+	-- The fiber context switch is written once per ABI
+	filter { "system:windows" }
+		removefiles { "src/fibers/*.S" }
+	filter { "system:not windows" }
+		removefiles { "src/fibers/*.asm" }
+	filter {}
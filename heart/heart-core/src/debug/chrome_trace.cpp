@@ -0,0 +1,170 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/debug/chrome_trace.h"
+
+#include "heart/debug/assert.h"
+#include "heart/file.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+HeartChromeTraceWriter::HeartChromeTraceWriter(HeartBaseAllocator& allocator) :
+	m_buffer(allocator)
+{
+	Append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+}
+
+void HeartChromeTraceWriter::Append(const char* text)
+{
+	for (const char* c = text; *c != '\0'; ++c)
+	{
+		m_buffer.EmplaceBack(*c);
+	}
+}
+
+void HeartChromeTraceWriter::AppendFormat(const char* format, ...)
+{
+	char text[256];
+
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	HEART_ASSERT(written >= 0 && size_t(written) < sizeof(text), "Chrome trace formatting was truncated!");
+	Append(text);
+}
+
+void HeartChromeTraceWriter::AppendEscaped(const char* text)
+{
+	m_buffer.EmplaceBack('"');
+
+	for (const char* c = text != nullptr ? text : ""; *c != '\0'; ++c)
+	{
+		switch (*c)
+		{
+		case '"':
+			Append("\\\"");
+			break;
+		case '\\':
+			Append("\\\\");
+			break;
+		case '\n':
+			Append("\\n");
+			break;
+		case '\t':
+			Append("\\t");
+			break;
+		default:
+			if (uint8_t(*c) < 0x20)
+				AppendFormat("\\u%04x", uint32_t(*c));
+			else
+				m_buffer.EmplaceBack(*c);
+			break;
+		}
+	}
+
+	m_buffer.EmplaceBack('"');
+}
+
+void HeartChromeTraceWriter::AppendArgs(Args args)
+{
+	if (args.size() == 0)
+		return;
+
+	Append(",\"args\":{");
+
+	bool first = true;
+	for (const Arg& arg : args)
+	{
+		if (!first)
+			m_buffer.EmplaceBack(',');
+
+		first = false;
+
+		AppendEscaped(arg.name);
+		m_buffer.EmplaceBack(':');
+
+		if (arg.stringValue != nullptr)
+			AppendEscaped(arg.stringValue);
+		else
+			AppendFormat("%.17g", arg.numberValue);
+	}
+
+	m_buffer.EmplaceBack('}');
+}
+
+void HeartChromeTraceWriter::BeginEvent(const char* name, const char* category, char phase, uint32_t threadId, double timestamp)
+{
+	HEART_ASSERT(!m_finished, "Cannot add events to a finished trace!");
+
+	if (m_hasEvents)
+		m_buffer.EmplaceBack(',');
+
+	m_hasEvents = true;
+
+	Append("{\"name\":");
+	AppendEscaped(name);
+
+	if (category != nullptr)
+	{
+		Append(",\"cat\":");
+		AppendEscaped(category);
+	}
+
+	AppendFormat(",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%.3f", phase, threadId, timestamp);
+}
+
+void HeartChromeTraceWriter::AddCompleteEvent(const char* name, const char* category, uint32_t threadId, double start, double duration, Args args)
+{
+	BeginEvent(name, category, 'X', threadId, start);
+	AppendFormat(",\"dur\":%.3f", duration);
+	AppendArgs(args);
+	m_buffer.EmplaceBack('}');
+}
+
+void HeartChromeTraceWriter::AddInstantEvent(const char* name, const char* category, uint32_t threadId, double timestamp, Args args)
+{
+	BeginEvent(name, category, 'i', threadId, timestamp);
+	Append(",\"s\":\"t\"");
+	AppendArgs(args);
+	m_buffer.EmplaceBack('}');
+}
+
+void HeartChromeTraceWriter::AddCounterEvent(const char* name, double timestamp, Args args)
+{
+	BeginEvent(name, nullptr, 'C', 0, timestamp);
+	AppendArgs(args);
+	m_buffer.EmplaceBack('}');
+}
+
+void HeartChromeTraceWriter::AddThreadName(uint32_t threadId, const char* name)
+{
+	BeginEvent("thread_name", nullptr, 'M', threadId, 0.0);
+	AppendArgs({Arg("name", name)});
+	m_buffer.EmplaceBack('}');
+}
+
+void HeartChromeTraceWriter::Finish()
+{
+	if (m_finished)
+		return;
+
+	Append("]}");
+	m_finished = true;
+}
+
+bool HeartChromeTraceWriter::WriteToFile(HeartFile& file)
+{
+	Finish();
+	return HeartWriteFile(file, reinterpret_cast<byte_t*>(m_buffer.begin()), m_buffer.Size());
+}
@@ -11,14 +11,23 @@
 */
 #include "heart/fibers/context.h"
 
+#include "heart/fibers/counter.h"
 #include "heart/fibers/system.h"
 
+#include <thread>
+
 HeartFiberContext& HeartFiberContext::Get()
 {
 	static thread_local HeartFiberContext context;
 	return context;
 }
 
+HeartFiberWorkUnit* HeartFiberContext::GetCurrentWorkUnit()
+{
+	HeartFiberContext& ctx = Get();
+	return ctx.currentSystem != nullptr ? ctx.currentWorkUnit : nullptr;
+}
+
 void HeartFiberContext::Yield()
 {
 	HeartFiberContext& ctx = Get();
@@ -30,3 +39,35 @@ void HeartFiberContext::Yield()
 
 	ctx.currentSystem->YieldUnit(*ctx.currentWorkUnit);
 }
+
+void HeartFiberContext::SleepFor(uint32_t microseconds)
+{
+	SleepUntil(std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds));
+}
+
+void HeartFiberContext::SleepUntil(std::chrono::steady_clock::time_point deadline)
+{
+	HeartFiberContext& ctx = Get();
+	if (!ctx.currentWorkUnit || !ctx.currentSystem)
+	{
+		std::this_thread::sleep_until(deadline);
+		return;
+	}
+
+	ctx.currentSystem->SleepUnit(*ctx.currentWorkUnit, HeartFiberSystem::ToSleepTick(deadline));
+}
+
+void HeartFiberContext::WaitForCounter(HeartFiberCounter& counter, uint32_t value)
+{
+	counter.Wait(value);
+}
+
+bool HeartFiberContext::Park(void (*park)(HeartFiberWorkUnit*, void*), void* argument)
+{
+	HeartFiberContext& ctx = Get();
+	if (!ctx.currentWorkUnit || !ctx.currentSystem)
+		return false;
+
+	ctx.currentSystem->ParkUnit(*ctx.currentWorkUnit, park, argument);
+	return true;
+}
@@ -0,0 +1,123 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/fibers/counter.h"
+
+#include "heart/fibers/context.h"
+#include "heart/fibers/system.h"
+
+#include "heart/debug/assert.h"
+#include "heart/sleep.h"
+
+HeartFiberCounter::~HeartFiberCounter()
+{
+	// Whoever brought us down might still be looking for waiters
+	while (m_decrementsInFlight.load(std::memory_order_acquire) != 0)
+	{
+		HeartYield();
+	}
+
+	HEART_ASSERT(m_waiters.IsEmpty(), "A fiber counter was destroyed while fibers were still waiting on it!");
+}
+
+void HeartFiberCounter::Increment(uint32_t count)
+{
+	m_value.fetch_add(count, std::memory_order_relaxed);
+}
+
+void HeartFiberCounter::Decrement(uint32_t count)
+{
+	m_decrementsInFlight.fetch_add(1, std::memory_order_relaxed);
+
+	uint32_t previous = m_value.fetch_sub(count, std::memory_order_seq_cst);
+	HEART_ASSERT(previous >= count, "HeartFiberCounter went below zero!");
+	(void)previous;
+
+	// Pairs with AddWaiter: either it sees our new value, or we see its waiter
+	if (m_waiterCount.load(std::memory_order_seq_cst) == 0)
+	{
+		m_decrementsInFlight.fetch_sub(1, std::memory_order_release);
+		return;
+	}
+
+	HeartFiberWorkUnit::Queue ready;
+	{
+		HeartLockGuard lock(m_waitersMutex);
+
+		// Someone else may have changed it again since
+		uint32_t value = m_value.load(std::memory_order_acquire);
+
+		HeartFiberWorkUnit::Queue stillWaiting;
+		while (HeartFiberWorkUnit* waiter = m_waiters.PopFront())
+		{
+			if (value <= waiter->m_waitTarget)
+			{
+				ready.PushBack(waiter);
+				m_waiterCount.fetch_sub(1, std::memory_order_relaxed);
+			}
+			else
+			{
+				stillWaiting.PushBack(waiter);
+			}
+		}
+
+		m_waiters.SpliceBack(stillWaiting);
+	}
+
+	while (HeartFiberWorkUnit* waiter = ready.PopFront())
+	{
+		HeartFiberSystem::ResumeWorkUnit(*waiter);
+	}
+
+	m_decrementsInFlight.fetch_sub(1, std::memory_order_release);
+}
+
+void HeartFiberCounter::Wait(uint32_t value)
+{
+	if (m_value.load(std::memory_order_acquire) <= value)
+		return;
+
+	HeartFiberWorkUnit* unit = HeartFiberContext::Get().currentWorkUnit;
+	if (unit == nullptr || HeartFiberContext::Get().currentSystem == nullptr)
+	{
+		// Not on a fiber, so there's nothing to park
+		while (m_value.load(std::memory_order_acquire) > value)
+			HeartYield();
+
+		return;
+	}
+
+	unit->m_waitTarget = value;
+	HeartFiberContext::Park(&HeartFiberCounter::AddWaiter, this);
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void HeartFiberCounter::AddWaiter(HeartFiberWorkUnit* unit, void* counterPointer)
+{
+	HeartFiberCounter* counter = reinterpret_cast<HeartFiberCounter*>(counterPointer);
+
+	{
+		HeartLockGuard lock(counter->m_waitersMutex);
+
+		// Announce ourselves before the final check, so that a Decrement which we miss has to see us
+		counter->m_waiterCount.fetch_add(1, std::memory_order_seq_cst);
+		if (counter->m_value.load(std::memory_order_seq_cst) > unit->m_waitTarget)
+		{
+			counter->m_waiters.PushBack(unit);
+			return;
+		}
+
+		counter->m_waiterCount.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	HeartFiberSystem::ResumeWorkUnit(*unit);
+}
@@ -12,39 +12,95 @@
 #include "heart/fibers/mutex.h"
 
 #include "heart/fibers/context.h"
+#include "heart/fibers/system.h"
 
 #include "heart/debug/assert.h"
 
-// TODO: for ultimate perf, these operations probably do not need to be seq_cst
-constexpr static std::memory_order ExchangeMemoryOrder = std::memory_order_seq_cst;
-constexpr static std::memory_order FenceMemoryOrder = std::memory_order_seq_cst;
-
 void HeartFiberMutex::LockExclusive(YieldToFiberT)
 {
-	while (value.exchange(LockedValue, ExchangeMemoryOrder) != UnlockedValue)
+	int32_t expected = UnlockedValue;
+	if (value.compare_exchange_strong(expected, LockedValue, std::memory_order_acquire, std::memory_order_relaxed))
+		return;
+
+	// When we come back, whoever unlocked has handed the lock to us
+	if (!HeartFiberContext::Park(&HeartFiberMutex::AddWaiter, this))
 	{
-		HeartFiberContext::Yield();
+		// Not on a fiber, so there's nothing to park
+		LockExclusive(NeverYield);
+		return;
 	}
-	std::atomic_thread_fence(FenceMemoryOrder);
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	HEART_ASSERT(value.load(std::memory_order_relaxed) != UnlockedValue);
 }
 
 void HeartFiberMutex::LockExclusive(NeverYieldT)
 {
-	while (value.exchange(LockedValue, ExchangeMemoryOrder) != UnlockedValue)
+	int32_t expected = UnlockedValue;
+	while (!value.compare_exchange_weak(expected, LockedValue, std::memory_order_acquire, std::memory_order_relaxed))
 	{
+		expected = UnlockedValue;
 	}
-	std::atomic_thread_fence(FenceMemoryOrder);
 }
 
 bool HeartFiberMutex::TryLockExclusive()
 {
-	bool success = (value.exchange(LockedValue, ExchangeMemoryOrder) == UnlockedValue);
-	std::atomic_thread_fence(FenceMemoryOrder);
-	return success;
+	int32_t expected = UnlockedValue;
+	return value.compare_exchange_strong(expected, LockedValue, std::memory_order_acquire, std::memory_order_relaxed);
 }
 
 void HeartFiberMutex::Unlock()
 {
-	HEART_ASSERT(value.load() == LockedValue);
-	value.exchange(UnlockedValue, ExchangeMemoryOrder);
+	int32_t expected = LockedValue;
+	if (value.compare_exchange_strong(expected, UnlockedValue, std::memory_order_release, std::memory_order_relaxed))
+		return;
+
+	HEART_ASSERT(expected == ContendedValue);
+
+	HeartFiberWorkUnit* next = nullptr;
+	{
+		HeartLockGuard lock(m_waitersMutex);
+		next = m_waiters.PopFront();
+		HEART_ASSERT(next != nullptr);
+
+		// The lock stays held; it's next's now
+		if (m_waiters.IsEmpty())
+			value.store(LockedValue, std::memory_order_relaxed);
+	}
+
+	std::atomic_thread_fence(std::memory_order_release);
+	HeartFiberSystem::ResumeWorkUnit(*next);
+}
+
+void HeartFiberMutex::AddWaiter(HeartFiberWorkUnit* unit, void* mutexPointer)
+{
+	HeartFiberMutex* mutex = reinterpret_cast<HeartFiberMutex*>(mutexPointer);
+
+	{
+		HeartLockGuard lock(mutex->m_waitersMutex);
+
+		int32_t current = mutex->value.load(std::memory_order_relaxed);
+		while (current != ContendedValue)
+		{
+			// It was unlocked while we were parking, so take it ourselves and carry on
+			if (current == UnlockedValue)
+			{
+				if (mutex->value.compare_exchange_weak(current, LockedValue, std::memory_order_acquire, std::memory_order_relaxed))
+					break;
+			}
+			else if (mutex->value.compare_exchange_weak(current, ContendedValue, std::memory_order_relaxed, std::memory_order_relaxed))
+			{
+				current = ContendedValue;
+			}
+		}
+
+		if (current == ContendedValue)
+		{
+			mutex->m_waiters.PushBack(unit);
+			return;
+		}
+	}
+
+	HeartFiberSystem::ResumeWorkUnit(*unit);
 }
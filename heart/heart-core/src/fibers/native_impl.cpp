@@ -12,6 +12,7 @@
 #include "fibers/native_impl.h"
 
 #include "heart/fibers/context.h"
+#include "heart/fibers/stack_provider.h"
 #include "heart/fibers/status.h"
 #include "heart/fibers/system.h"
 #include "heart/fibers/work_unit.h"
@@ -22,68 +23,59 @@
 
 #include <stdio.h>
 
-// TODO: Large stack and small stack fibers
-// SFML requires a fairly deep stack (at least 256kb) so default to large for now
-constexpr uint32_t StackSize = 1u * Meg;
+// Indexed by HeartFiberStackClass. SFML requires a fairly deep stack (at least 256kb),
+// so anything that might touch it has to be Large.
+constexpr size_t StackSizes[] = {64 * Kilo, 1u * Meg};
+static_assert(sizeof(StackSizes) / sizeof(StackSizes[0]) == uint32_t(HeartFiberStackClass::Count));
 
-#if !HEART_USE_OS_FIBERS
-#include <xmmintrin.h>
-
-struct HeartFiberAbiContext
-{
-	uintptr_t rip = 0;
-	uintptr_t rsp = 0;
-	uintptr_t rbx = 0;
-	uintptr_t rbp = 0;
-	uintptr_t r12 = 0;
-	uintptr_t r13 = 0;
-	uintptr_t r14 = 0;
-	uintptr_t r15 = 0;
-	uintptr_t rdi = 0;
-	uintptr_t rsi = 0;
-	__m128 xmm6 = {};
-	__m128 xmm7 = {};
-	__m128 xmm8 = {};
-	__m128 xmm9 = {};
-	__m128 xmm10 = {};
-	__m128 xmm11 = {};
-	__m128 xmm12 = {};
-	__m128 xmm13 = {};
-	__m128 xmm14 = {};
-	__m128 xmm15 = {};
-
-	// Extra
-	byte_t* allocated = nullptr;
-};
-
-extern "C" void heart_swap_fiber_context(HeartFiberAbiContext* from, HeartFiberAbiContext* to);
-
-void HeartFiberSystem::InitializeEntryFiber()
+byte_t* HeartFiberSystem::AllocateStack(size_t size)
 {
-	auto* startupAbi = m_allocator.AllocateAndConstruct<HeartFiberAbiContext>();
-	HeartFiberContext::Get().entryUnit.m_nativeHandle = startupAbi;
+	if (m_stackProvider != nullptr)
+		return m_stackProvider->AllocateStack(size);
+
+	byte_t* stack = m_allocator.allocate<byte_t>(size);
+
+#if !HEART_STRICT_PERF
+	// Zero the whole buffer if we're not in strict perf. Only new stacks, though;
+	// doing this on every reuse would cost as much as the allocation we're avoiding.
+	// Providers hand out zeroed memory already, usually without touching it.
+	memset(stack, 0, size);
+#endif
+
+	return stack;
 }
 
-void HeartFiberSystem::ReleaseEntryFiber()
+void HeartFiberSystem::FreeStack(byte_t* stack, size_t size)
 {
-	ReleaseWorkUnitNativeHandle(HeartFiberContext::Get().entryUnit);
+	if (m_stackProvider != nullptr)
+		m_stackProvider->FreeStack(stack, size);
+	else
+		m_allocator.deallocate(stack);
 }
 
-void HeartFiberSystem::InitializeWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
-{
-	// We can only create fibers from a fiber!
-	HEART_ASSERT(HeartFiberContext::Get().currentSystem != nullptr);
+#if !HEART_USE_OS_FIBERS
+#include "heart/fibers/abi_context.h"
 
-	// TODO: Large stack and small stack fibers
-	// SFML requires a fairly deep stack (at least 256kb) so default to large for now
-	byte_t* stackStart = m_allocator.allocate<byte_t>(StackSize);
+#include <stddef.h>
 
-	HeartFiberAbiContext* ctx = m_allocator.AllocateAndConstruct<HeartFiberAbiContext>();
-	ctx->allocated = stackStart;
+// How many finished stacks of each class a thread keeps around for reuse
+constexpr uint32_t StackPoolLimits[] = {64, 8};
+
+#if !defined(_WIN32)
+// heart_swap_fiber_context in fibercontext_sysv.S relies on this layout
+static_assert(offsetof(HeartFiberAbiContext, rsp) == 8 * 1);
+static_assert(offsetof(HeartFiberAbiContext, r15) == 8 * 7);
+static_assert(offsetof(HeartFiberAbiContext, mxcsr) == 8 * 8);
+static_assert(offsetof(HeartFiberAbiContext, x87ControlWord) == 8 * 8 + 4);
+#endif
+
+void HeartInitializeFiberAbiContext(HeartFiberAbiContext& ctx, byte_t* stackStart, size_t stackSize, void (*entry)(void*))
+{
+	// Stacks grow downward, so start from the end of the buffer
+	byte_t* stackEnd = stackStart + stackSize;
 
-	// Stacks grow downward, point to the end of our buffer, and "allocate"
-	// required Windows "red zone" space of 4 64bit values
-	byte_t* stackEnd = stackStart + StackSize;
+#if defined(_WIN32)
+	// "Allocate" the required Windows "red zone" space of 4 64bit values
 	byte_t* rsp = stackEnd - (4 * sizeof(uint64_t));
 	if ((uintptr_t(rsp) & 8L) != 8L)
 	{
@@ -97,21 +89,89 @@ void HeartFiberSystem::InitializeWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
 		rsp -= 8;
 	}
 
-#if !HEART_STRICT_PERF
-	// Zero the whole buffer if we're not in strict perf
-	memset(stackStart, 0, StackSize);
+	ctx.rbp = uintptr_t(rsp);
 #else
-	// Zero just the area between our stack pointer and the end if we're in release
+	// System V has no shadow space, but entry still expects to find rsp 8 bytes past
+	// a 16 byte boundary, where a call would have pushed the return address. A null
+	// return address (and frame pointer) there tells debuggers the stack ends here.
+	byte_t* rsp = reinterpret_cast<byte_t*>(uintptr_t(stackEnd) & ~uintptr_t(15)) - sizeof(uintptr_t);
+	*reinterpret_cast<uintptr_t*>(rsp) = 0;
+
+	ctx.rbp = 0;
+#endif
+
+	ctx.rsp = uintptr_t(rsp);
+	ctx.rip = uintptr_t(entry);
+}
+
+static void RewindAbiContext(HeartFiberAbiContext* ctx, size_t stackSize, void (*entry)(void*))
+{
+	byte_t* stackStart = ctx->allocated;
+
+	// Whatever the fiber left in its registers is meaningless now
+	*ctx = HeartFiberAbiContext {};
+	ctx->allocated = stackStart;
+
+	// Zero the top of the stack, where the first few frames will go.
 	// This isn't strictly necessary, but debugging is already hard enough in
 	// optimized builds, we don't need a nonsense garbage stack to contend with too.
-	memset(rsp, 0, stackEnd - rsp);
-#endif
+	memset(stackStart + stackSize - 64, 0, 64);
+
+	HeartInitializeFiberAbiContext(*ctx, stackStart, stackSize, entry);
+}
+
+void HeartFiberSystem::InitializeEntryFiber()
+{
+	auto* startupAbi = m_allocator.AllocateAndConstruct<HeartFiberAbiContext>();
+	HeartFiberContext::Get().entryUnit.m_nativeHandle = startupAbi;
+}
+
+void HeartFiberSystem::ReleaseEntryFiber()
+{
+	ReleaseWorkUnitNativeHandle(HeartFiberContext::Get().entryUnit);
+}
 
-	ctx->rsp = uintptr_t(rsp);
-	ctx->rbp = uintptr_t(rsp);
-	ctx->rip = uintptr_t(&HeartFiberStartRoutine);
+void HeartFiberSystem::InitializeWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
+{
+	// We can only create fibers from a fiber!
+	HEART_ASSERT(HeartFiberContext::Get().currentSystem != nullptr);
+
+	HeartFiberContext& fiberContext = HeartFiberContext::Get();
+	uint32_t stackClass = uint32_t(unit.m_stackClass);
+	size_t stackSize = StackSizes[stackClass];
+
+	// Reuse a stack left behind by a finished work unit if we can, so that most fibers cost a pop
+	HeartFiberAbiContext* ctx = fiberContext.stackPool[stackClass];
+	if (ctx != nullptr)
+	{
+		fiberContext.stackPool[stackClass] = ctx->nextPooled;
+		fiberContext.stackPoolSize[stackClass]--;
+		HEART_FIBER_TRACE(m_tracer.OnStackReused());
+	}
+	else
+	{
+		ctx = m_allocator.AllocateAndConstruct<HeartFiberAbiContext>();
+		ctx->allocated = AllocateStack(stackSize);
+		HEART_FIBER_TRACE(m_tracer.OnStackAllocated());
+	}
 
 	unit.m_nativeHandle = ctx;
+	RewindAbiContext(ctx, stackSize, &HeartFiberStartRoutine);
+}
+
+void HeartFiberSystem::ResetWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
+{
+	HeartFiberAbiContext* ctx = reinterpret_cast<HeartFiberAbiContext*>(unit.m_nativeHandle);
+	size_t stackSize = StackSizes[uint32_t(unit.m_stackClass)];
+
+	// As far as the provider is concerned, the old run is over and a new one is starting
+	if (m_stackProvider != nullptr)
+		m_stackProvider->OnStackReleased(ctx->allocated, stackSize, unit.m_stackClass);
+
+	HEART_FIBER_TRACE(m_tracer.OnStackReleased());
+	HEART_FIBER_TRACE(m_tracer.OnStackReused());
+
+	RewindAbiContext(ctx, stackSize, &HeartFiberStartRoutine);
 }
 
 void HeartFiberSystem::ReleaseWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
@@ -121,8 +181,32 @@ void HeartFiberSystem::ReleaseWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
 	HeartFiberAbiContext* ctx = reinterpret_cast<HeartFiberAbiContext*>(unit.m_nativeHandle);
 	unit.m_nativeHandle = nullptr;
 
+	// The entry fiber runs on the thread's own stack, so it has nothing to give back.
+	HeartFiberContext& fiberContext = HeartFiberContext::Get();
+	uint32_t stackClass = uint32_t(unit.m_stackClass);
+	if (ctx->allocated != nullptr && m_stackProvider != nullptr)
+		m_stackProvider->OnStackReleased(ctx->allocated, StackSizes[stackClass], unit.m_stackClass);
+
+#if HEART_FIBER_TRACING
+	if (ctx->allocated != nullptr)
+		m_tracer.OnStackReleased();
+#endif
+
+	// Keep the stack for the next work unit on this thread, unless we already have plenty.
+	if (ctx->allocated != nullptr && fiberContext.stackPoolSize[stackClass] < StackPoolLimits[stackClass])
+	{
+		ctx->nextPooled = fiberContext.stackPool[stackClass];
+		fiberContext.stackPool[stackClass] = ctx;
+		fiberContext.stackPoolSize[stackClass]++;
+		return;
+	}
+
 	// Free the stack
-	m_allocator.deallocate(ctx->allocated);
+	if (ctx->allocated != nullptr)
+	{
+		FreeStack(ctx->allocated, StackSizes[stackClass]);
+		HEART_FIBER_TRACE(m_tracer.OnStackFreed());
+	}
 	ctx->allocated = nullptr;
 
 	// Free the actual abi context
@@ -130,6 +214,25 @@ void HeartFiberSystem::ReleaseWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
 	ctx = nullptr;
 }
 
+void HeartFiberSystem::ReleaseStackPool()
+{
+	HeartFiberContext& fiberContext = HeartFiberContext::Get();
+
+	for (uint32_t stackClass = 0; stackClass < uint32_t(HeartFiberStackClass::Count); ++stackClass)
+	{
+		while (HeartFiberAbiContext* ctx = fiberContext.stackPool[stackClass])
+		{
+			fiberContext.stackPool[stackClass] = ctx->nextPooled;
+
+			FreeStack(ctx->allocated, StackSizes[stackClass]);
+			m_allocator.DestroyAndFree<HeartFiberAbiContext>(ctx);
+			HEART_FIBER_TRACE(m_tracer.OnStackFreed());
+		}
+
+		fiberContext.stackPoolSize[stackClass] = 0;
+	}
+}
+
 void HeartFiberSystem::NativeSwitchToFiber(HeartFiberWorkUnit& target)
 {
 	// Get where we're coming from
@@ -140,6 +243,8 @@ void HeartFiberSystem::NativeSwitchToFiber(HeartFiberWorkUnit& target)
 	HEART_ASSERT(HeartFiberContext::Get().currentSystem == this);
 	HeartFiberContext::Get().currentWorkUnit = &target;
 
+	HEART_FIBER_TRACE(m_tracer.OnSwitch(target));
+
 	// Execute
 	HeartFiberAbiContext* to_abi = reinterpret_cast<HeartFiberAbiContext*>(target.m_nativeHandle);
 	heart_swap_fiber_context(from_abi, to_abi);
@@ -166,13 +271,30 @@ void HeartFiberSystem::InitializeWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
 	// We can only create fibers from a fiber!
 	HEART_ASSERT(HeartFiberContext::Get().currentSystem != nullptr);
 
-	unit.m_nativeHandle = ::CreateFiberEx(StackSize, StackSize, 0, &HeartFiberStartRoutine, NULL);
+	size_t stackSize = StackSizes[uint32_t(unit.m_stackClass)];
+	unit.m_nativeHandle = ::CreateFiberEx(stackSize, stackSize, 0, &HeartFiberStartRoutine, NULL);
+	HEART_FIBER_TRACE(m_tracer.OnStackAllocated());
 }
 
 void HeartFiberSystem::ReleaseWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
 {
 	::DeleteFiber(unit.m_nativeHandle);
 	unit.m_nativeHandle = nullptr;
+
+	// Windows frees the stack along with the fiber
+	HEART_FIBER_TRACE(m_tracer.OnStackReleased());
+	HEART_FIBER_TRACE(m_tracer.OnStackFreed());
+}
+
+void HeartFiberSystem::ResetWorkUnitNativeHandle(HeartFiberWorkUnit& unit)
+{
+	// A Windows fiber can't be rewound, so let the pump create a new one when it next runs
+	ReleaseWorkUnitNativeHandle(unit);
+}
+
+void HeartFiberSystem::ReleaseStackPool()
+{
+	// Windows owns the fiber stacks, and a fiber can't be restarted once its routine is done, so there's no pool
 }
 
 void HeartFiberSystem::NativeSwitchToFiber(HeartFiberWorkUnit& target)
@@ -181,6 +303,8 @@ void HeartFiberSystem::NativeSwitchToFiber(HeartFiberWorkUnit& target)
 	HEART_ASSERT(HeartFiberContext::Get().currentSystem == this);
 	HeartFiberContext::Get().currentWorkUnit = &target;
 
+	HEART_FIBER_TRACE(m_tracer.OnSwitch(target));
+
 	// Execute
 	::SwitchToFiber(target.m_nativeHandle);
 }
@@ -0,0 +1,205 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/fibers/stack_provider.h"
+
+#include "heart/debug/assert.h"
+
+#include <bit>
+
+#if defined(_WIN32)
+#include "priv/SlimWin32.h"
+
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// How many pages we ask the OS about at once when measuring a stack
+constexpr size_t ResidencyBatchSize = 64;
+
+#if defined(_WIN32)
+
+static size_t GetOSPageSize()
+{
+	SYSTEM_INFO info;
+	::GetSystemInfo(&info);
+	return size_t(info.dwPageSize);
+}
+
+byte_t* HeartVirtualFiberStackProvider::AllocateStack(size_t size)
+{
+	HEART_ASSERT(size % m_pageSize == 0, "Fiber stacks must be a whole number of pages");
+
+	// Reserve the guard page along with the stack, but only commit the stack. Committing
+	// charges the commit limit; Windows still doesn't back a page until it's first touched.
+	byte_t* base = reinterpret_cast<byte_t*>(::VirtualAlloc(NULL, size + m_pageSize, MEM_RESERVE, PAGE_NOACCESS));
+	HEART_ASSERT(base != nullptr, "Failed to reserve a fiber stack");
+
+	byte_t* stack = base + m_pageSize;
+	void* committed = ::VirtualAlloc(stack, size, MEM_COMMIT, PAGE_READWRITE);
+	HEART_ASSERT(committed == stack, "Failed to commit a fiber stack");
+
+	return stack;
+}
+
+void HeartVirtualFiberStackProvider::FreeStack(byte_t* stack, size_t size)
+{
+	::VirtualFree(stack - m_pageSize, 0, MEM_RELEASE);
+}
+
+static void ResetStackPages(byte_t* stack, size_t size)
+{
+	// Decommitting throws the pages away, and committing them again gives back zeroed pages on demand
+	::VirtualFree(stack, size, MEM_DECOMMIT);
+	::VirtualAlloc(stack, size, MEM_COMMIT, PAGE_READWRITE);
+}
+
+size_t HeartVirtualFiberStackProvider::MeasureHighWaterMark(const byte_t* stack, size_t size) const
+{
+	size_t pageCount = size / m_pageSize;
+
+	// Find the lowest page in the working set; everything above it is assumed touched
+	PSAPI_WORKING_SET_EX_INFORMATION info[ResidencyBatchSize];
+	for (size_t first = 0; first < pageCount; first += ResidencyBatchSize)
+	{
+		size_t batch = pageCount - first < ResidencyBatchSize ? pageCount - first : ResidencyBatchSize;
+		for (size_t i = 0; i < batch; ++i)
+		{
+			info[i].VirtualAddress = const_cast<byte_t*>(stack + (first + i) * m_pageSize);
+		}
+
+		if (!::QueryWorkingSetEx(::GetCurrentProcess(), info, DWORD(batch * sizeof(info[0]))))
+			return 0;
+
+		for (size_t i = 0; i < batch; ++i)
+		{
+			if (info[i].VirtualAttributes.Valid)
+				return size - (first + i) * m_pageSize;
+		}
+	}
+
+	return 0;
+}
+
+#else
+
+static size_t GetOSPageSize()
+{
+	return size_t(::sysconf(_SC_PAGESIZE));
+}
+
+byte_t* HeartVirtualFiberStackProvider::AllocateStack(size_t size)
+{
+	HEART_ASSERT(size % m_pageSize == 0, "Fiber stacks must be a whole number of pages");
+
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_NORESERVE)
+	// Don't count the whole stack against overcommit; most of it will never be touched
+	flags |= MAP_NORESERVE;
+#endif
+#if defined(MAP_STACK)
+	flags |= MAP_STACK;
+#endif
+
+	void* base = ::mmap(nullptr, size + m_pageSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+	HEART_ASSERT(base != MAP_FAILED, "Failed to map a fiber stack");
+
+	// Stacks grow down, so the guard goes at the bottom
+	int result = ::mprotect(base, m_pageSize, PROT_NONE);
+	HEART_ASSERT(result == 0, "Failed to protect a fiber stack's guard page");
+	(void)result;
+
+	return reinterpret_cast<byte_t*>(base) + m_pageSize;
+}
+
+void HeartVirtualFiberStackProvider::FreeStack(byte_t* stack, size_t size)
+{
+	::munmap(stack - m_pageSize, size + m_pageSize);
+}
+
+static void ResetStackPages(byte_t* stack, size_t size)
+{
+	// Private anonymous pages read back as zero once they've been dropped
+	::madvise(stack, size, MADV_DONTNEED);
+}
+
+size_t HeartVirtualFiberStackProvider::MeasureHighWaterMark(const byte_t* stack, size_t size) const
+{
+	size_t pageCount = size / m_pageSize;
+
+	// Find the lowest resident page; everything above it is assumed touched
+	unsigned char residency[ResidencyBatchSize];
+	for (size_t first = 0; first < pageCount; first += ResidencyBatchSize)
+	{
+		size_t batch = pageCount - first < ResidencyBatchSize ? pageCount - first : ResidencyBatchSize;
+
+		void* address = const_cast<byte_t*>(stack + first * m_pageSize);
+		if (::mincore(address, batch * m_pageSize, residency) != 0)
+			return 0;
+
+		for (size_t i = 0; i < batch; ++i)
+		{
+			if (residency[i] & 1)
+				return size - (first + i) * m_pageSize;
+		}
+	}
+
+	return 0;
+}
+
+#endif
+
+HeartVirtualFiberStackProvider::HeartVirtualFiberStackProvider(bool resetPagesOnRelease) :
+	m_pageSize(GetOSPageSize()),
+	m_resetPagesOnRelease(resetPagesOnRelease)
+{
+}
+
+void HeartVirtualFiberStackProvider::OnStackReleased(byte_t* stack, size_t size, HeartFiberStackClass stackClass)
+{
+	size_t highWaterMark = MeasureHighWaterMark(stack, size);
+
+	AtomicStats& stats = m_stats[uint32_t(stackClass)];
+	stats.releaseCount.fetch_add(1, std::memory_order_relaxed);
+
+	size_t previousMax = stats.maxHighWaterMark.load(std::memory_order_relaxed);
+	while (previousMax < highWaterMark && !stats.maxHighWaterMark.compare_exchange_weak(previousMax, highWaterMark, std::memory_order_relaxed))
+	{
+	}
+
+	size_t pages = (highWaterMark + m_pageSize - 1) / m_pageSize;
+	uint32_t bucket = pages <= 1 ? 0 : uint32_t(std::bit_width(pages - 1));
+	if (bucket >= HistogramBucketCount)
+		bucket = HistogramBucketCount - 1;
+
+	stats.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+
+	// Keep the top page: the next fiber on this stack is going to need it straight away
+	if (m_resetPagesOnRelease && size > m_pageSize)
+		ResetStackPages(stack, size - m_pageSize);
+}
+
+HeartVirtualFiberStackProvider::Stats HeartVirtualFiberStackProvider::GetStats(HeartFiberStackClass stackClass) const
+{
+	const AtomicStats& stats = m_stats[uint32_t(stackClass)];
+
+	Stats result;
+	result.releaseCount = stats.releaseCount.load(std::memory_order_relaxed);
+	result.maxHighWaterMark = stats.maxHighWaterMark.load(std::memory_order_relaxed);
+	for (uint32_t i = 0; i < HistogramBucketCount; ++i)
+	{
+		result.histogram[i] = stats.histogram[i].load(std::memory_order_relaxed);
+	}
+
+	return result;
+}
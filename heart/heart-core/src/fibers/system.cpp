@@ -12,6 +12,7 @@
 #include "heart/fibers/system.h"
 
 #include "heart/fibers/context.h"
+#include "heart/fibers/host.h"
 #include "heart/fibers/result.h"
 #include "heart/fibers/status.h"
 #include "heart/fibers/work_unit.h"
@@ -27,7 +28,10 @@ void HeartFiberSystem::HeartFiberThreadEntry()
 {
 	// Prepare the context for this thread
 	HeartFiberContext::Get().currentSystem = this;
+	HeartFiberContext::Get().pumpIndex = m_nextPumpIndex.fetch_add(1, std::memory_order_relaxed);
 	HeartFiberContext::Get().pump.m_worker = []() { return HeartFiberContext::Get().currentSystem->PumpRoutine(); };
+	HeartFiberContext::Get().pump.m_stackClass = HeartFiberStackClass::Small;
+	HEART_FIBER_TRACE(m_tracer.AttachThread(HeartFiberContext::Get().pumpIndex));
 
 	// Allocate a startup abi so that the system has something to jump away from
 	InitializeEntryFiber();
@@ -40,6 +44,7 @@ void HeartFiberSystem::HeartFiberThreadEntry()
 	// We've returned from the pump, time to cleanup and kill the thread.
 	HEART_ASSERT(m_exit == true);
 	ReleaseWorkUnitNativeHandle(HeartFiberContext::Get().pump);
+	ReleaseStackPool();
 
 	// Release the entry fiber - actual behavior is implementation-dependent (since we're currently *on* it).
 	ReleaseEntryFiber();
@@ -67,6 +72,8 @@ void HeartFiberSystem::HeartFiberStartRoutine(void*)
 	}
 	else if (result == HeartFiberResult::Success || result == HeartFiberResult::Failure)
 	{
+		// Before the status, so that whoever sees it sees the final times too
+		HEART_FIBER_TRACE(system->m_tracer.SetUnitState(workUnit, HeartFiberTraceState::Done));
 		workUnit.m_status = (result == HeartFiberResult::Success) ? HeartFiberWorkUnitStatus::Success : HeartFiberWorkUnitStatus::Failure;
 
 		// Otherwise, if it completed, tell the system it's done.
@@ -83,24 +90,16 @@ void HeartFiberSystem::HeartFiberStartRoutine(void*)
 
 HeartFiberResult HeartFiberSystem::PumpRoutine()
 {
-	auto canExit = [&]() {
-		if (!m_exit)
-			return false;
+	HeartFiberContext& context = HeartFiberContext::Get();
+	PumpState& pump = m_pumpStates[context.pumpIndex];
 
-		bool destroyEmpty = HeartFiberContext::Get().destroyQueue.IsEmpty();
-		if (!destroyEmpty)
-			return false;
-
-		HeartLockGuard lock(m_pendingQueueMutex);
-		return m_pendingQueue.IsEmpty();
-	};
-
-	while (!canExit())
+	uint32_t runCount = 0;
+	while (true)
 	{
 		// Destroy any fibers that completed on this thread.
-		while (!HeartFiberContext::Get().destroyQueue.IsEmpty())
+		while (!context.destroyQueue.IsEmpty())
 		{
-			HeartFiberWorkUnit* unit = HeartFiberContext::Get().destroyQueue.PopFront();
+			HeartFiberWorkUnit* unit = context.destroyQueue.PopFront();
 			ReleaseWorkUnitNativeHandle(*unit);
 
 			// We manually decrement the ref count here. This is the "queue ref"
@@ -109,13 +108,39 @@ HeartFiberResult HeartFiberSystem::PumpRoutine()
 			unit = nullptr;
 		}
 
-		// Grab our next work unit
-		HeartFiberWorkUnit* next = nullptr;
+		// Start over any fibers that asked to be retried on this thread. They keep their queue ref.
+		while (!context.requeueQueue.IsEmpty())
 		{
-			HeartLockGuard lock(m_pendingQueueMutex);
-			next = m_pendingQueue.PopFront();
+			HeartFiberWorkUnit* unit = context.requeueQueue.PopFront();
+			ResetWorkUnitNativeHandle(*unit);
+			PushWorkUnit(unit);
+		}
+
+		// A yielding fiber goes to the back of our queue, and anything waiting in
+		// the shared queue gets to go before it.
+		bool yielded = context.yieldedUnit != nullptr;
+		if (yielded)
+		{
+			PushWorkUnit(context.yieldedUnit);
+			context.yieldedUnit = nullptr;
+		}
+
+		// Hand off a fiber that parked, now that nothing is running on its stack
+		if (context.parkedUnit != nullptr)
+		{
+			HeartFiberWorkUnit* unit = context.parkedUnit;
+			context.parkedUnit = nullptr;
+
+			m_parkedUnitCount.fetch_add(1, std::memory_order_relaxed);
+			context.parkFunction(unit, context.parkArgument);
 		}
 
+		// Wake any fibers whose sleep is over
+		if (pump.sleeperCount.load(std::memory_order_acquire) != 0)
+			WakeSleepingUnits(pump);
+
+		// Grab our next work unit
+		HeartFiberWorkUnit* next = FindWorkUnit(pump, yielded || ++runCount % SharedQueueInterval == 0);
 		if (next != nullptr)
 		{
 			if (next->m_nativeHandle == nullptr)
@@ -125,18 +150,270 @@ HeartFiberResult HeartFiberSystem::PumpRoutine()
 
 			NativeSwitchToFiber(*next);
 			next = nullptr;
+			continue;
+		}
+
+		// Everything this thread owed has been cleaned up above. A parked work unit
+		// could still come back, though, and there may be nobody else to run it.
+		if (m_exit && m_parkedUnitCount.load(std::memory_order_acquire) == 0)
+			break;
+
+		// Nothing to do anywhere, so sleep until someone pushes a work unit or one of ours wakes up
+		HeartEventCount::Key key = m_idleEvent.PrepareWait();
+		if ((m_exit && m_parkedUnitCount.load(std::memory_order_acquire) == 0) || HasQueuedWork())
+		{
+			m_idleEvent.CancelWait();
+		}
+		else if (pump.sleeperCount.load(std::memory_order_acquire) == 0)
+		{
+			HEART_FIBER_TRACE(uint64_t idleStart = HeartFiberTracer::GetTimestamp());
+			m_idleEvent.Wait(key);
+			HEART_FIBER_TRACE(m_tracer.OnIdle(idleStart, HeartFiberTracer::GetTimestamp()));
 		}
 		else
 		{
-			HeartSleep(5);
+			uint64_t now = GetSleepTick();
+			uint64_t nextTick;
+			{
+				HeartLockGuard lock(pump.sleepWheelMutex);
+				nextTick = pump.sleepWheel.GetNextTick();
+			}
+
+			if (nextTick <= now)
+			{
+				m_idleEvent.CancelWait();
+			}
+			else
+			{
+				// Round up, so that we don't wake up just before the sleeper is due
+				uint64_t milliseconds = (nextTick - now + 999) / 1000;
+				HEART_FIBER_TRACE(uint64_t idleStart = HeartFiberTracer::GetTimestamp());
+				m_idleEvent.TryWaitFor(key, milliseconds < UINT32_MAX ? uint32_t(milliseconds) : UINT32_MAX);
+				HEART_FIBER_TRACE(m_tracer.OnIdle(idleStart, HeartFiberTracer::GetTimestamp()));
+			}
+		}
+	}
+
+	return HeartFiberResult::Success;
+}
+
+HeartFiberResult HeartFiberSystem::HostedPumpRoutine()
+{
+	HeartFiberContext& context = HeartFiberContext::Get();
+
+	while (true)
+	{
+		// Host fibers only return when they're done for good, or to give the thread back to the one standing by
+		bool returned = !context.destroyQueue.IsEmpty();
+		while (HeartFiberWorkUnit* unit = context.destroyQueue.PopFront())
+		{
+			ReleaseWorkUnitNativeHandle(*unit);
+			unit->DecrementRef();
+		}
+
+		// We have no run queue to put a yielding fiber at the back of, so the host requeues it
+		if (context.yieldedUnit != nullptr)
+		{
+			HeartFiberWorkUnit* unit = context.yieldedUnit;
+			context.yieldedUnit = nullptr;
+
+			m_parkedUnitCount.fetch_add(1, std::memory_order_relaxed);
+			m_host->ResumeWorkUnit(*unit);
+		}
+
+		if (context.parkedUnit != nullptr)
+		{
+			HeartFiberWorkUnit* unit = context.parkedUnit;
+			context.parkedUnit = nullptr;
+
+			m_parkedUnitCount.fetch_add(1, std::memory_order_relaxed);
+			context.parkFunction(unit, context.parkArgument);
+		}
+
+		HeartFiberWorkUnit* next = context.standbyUnit;
+		context.standbyUnit = nullptr;
+
+		if (next == nullptr)
+		{
+			if (returned)
+				break;
+
+			// The host fiber parked (or we're just starting), so start another to keep the thread busy
+			next = m_allocator.AllocateAndConstruct<HeartFiberWorkUnit>(
+				HeartFiberWorkUnit::ConstructorSecret,
+				&m_allocator,
+				[host = m_host]() { return host->RunHostedFiber(); });
+			next->m_stackClass = m_hostStackClass;
+			next->m_system = this;
+
+			// Our ref, dropped once the fiber returns
+			next->IncrementRef();
+			InitializeWorkUnitNativeHandle(*next);
 		}
+
+		NativeSwitchToFiber(*next);
 	}
 
 	return HeartFiberResult::Success;
 }
 
+void HeartFiberSystem::RunHostedThread()
+{
+	HEART_ASSERT(m_host != nullptr, "Only a hosted fiber system can run on its host's threads!");
+
+	// Much like HeartFiberThreadEntry, except that the thread is the host's to keep once we're done
+	HeartFiberContext::Get().currentSystem = this;
+	HeartFiberContext::Get().pump.m_worker = []() { return HeartFiberContext::Get().currentSystem->HostedPumpRoutine(); };
+	HeartFiberContext::Get().pump.m_stackClass = HeartFiberStackClass::Small;
+
+	InitializeEntryFiber();
+	HeartFiberContext::Get().currentWorkUnit = &HeartFiberContext::Get().entryUnit;
+
+	InitializeWorkUnitNativeHandle(HeartFiberContext::Get().pump);
+	NativeSwitchToFiber(HeartFiberContext::Get().pump);
+
+	ReleaseWorkUnitNativeHandle(HeartFiberContext::Get().pump);
+	ReleaseStackPool();
+	ReleaseEntryFiber();
+
+	HeartFiberContext::Get().currentWorkUnit = nullptr;
+	HeartFiberContext::Get().currentSystem = nullptr;
+}
+
+void HeartFiberSystem::SwitchToHostedUnit(HeartFiberWorkUnit& unit)
+{
+	HeartFiberContext& context = HeartFiberContext::Get();
+	HEART_ASSERT(context.currentSystem == this && m_host != nullptr);
+	HEART_ASSERT(context.standbyUnit == nullptr, "A resumed fiber can't resume another!");
+
+	m_parkedUnitCount.fetch_sub(1, std::memory_order_release);
+
+	// Straight there; the pump brings us back once the unit is off its stack again
+	context.standbyUnit = context.currentWorkUnit;
+	HEART_FIBER_TRACE(m_tracer.SetUnitState(*context.standbyUnit, HeartFiberTraceState::Parked));
+	NativeSwitchToFiber(unit);
+}
+
+bool HeartFiberSystem::IsResumedHostedFiber() const
+{
+	return HeartFiberContext::Get().standbyUnit != nullptr;
+}
+
+void HeartFiberSystem::WakeSleepingUnits(PumpState& pump)
+{
+	uint64_t now = GetSleepTick();
+
+	SleepTimerWheel::ItemList due;
+	{
+		HeartLockGuard lock(pump.sleepWheelMutex);
+		if (now < pump.sleepWheel.GetNextTick())
+			return;
+
+		size_t expiredCount = pump.sleepWheel.Advance(now, due);
+		pump.sleeperCount.fetch_sub(uint32_t(expiredCount), std::memory_order_relaxed);
+	}
+
+	while (HeartFiberWorkUnit* unit = due.PopFront())
+	{
+		ResumeWorkUnit(*unit);
+	}
+}
+
+uint64_t HeartFiberSystem::GetSleepTick()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+}
+
+uint64_t HeartFiberSystem::ToSleepTick(std::chrono::steady_clock::time_point deadline)
+{
+	// Round up, so that a sleeper is never woken before its deadline
+	return uint64_t(std::chrono::ceil<std::chrono::microseconds>(deadline.time_since_epoch()).count());
+}
+
+void HeartFiberSystem::PushWorkUnit(HeartFiberWorkUnit* unit)
+{
+	HeartFiberContext& context = HeartFiberContext::Get();
+
+	// Before it's in a queue, where another thread could pick it up
+	HEART_FIBER_TRACE(m_tracer.SetUnitState(*unit, HeartFiberTraceState::Runnable));
+
+	bool pushed = context.currentSystem == this && m_pumpStates[context.pumpIndex].runQueue.Push(unit);
+	if (!pushed)
+	{
+		HeartLockGuard lock(m_pendingQueueMutex);
+		m_pendingQueue.PushBack(unit);
+		m_pendingQueueSize.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	m_idleEvent.Notify();
+}
+
+HeartFiberWorkUnit* HeartFiberSystem::FindWorkUnit(PumpState& pump, bool sharedFirst)
+{
+	if (sharedFirst)
+	{
+		if (HeartFiberWorkUnit* unit = PopSharedWorkUnit())
+			return unit;
+	}
+
+	// Steal can fail spuriously if a thief beats us to our own oldest work unit
+	while (!pump.runQueue.IsEmpty())
+	{
+		if (HeartFiberWorkUnit* unit = pump.runQueue.Steal())
+			return unit;
+	}
+
+	if (!sharedFirst)
+	{
+		if (HeartFiberWorkUnit* unit = PopSharedWorkUnit())
+			return unit;
+	}
+
+	// Start with the thread after ours so that thieves spread out over their victims
+	uint32_t start = uint32_t(&pump - m_pumpStates) + 1;
+	for (uint32_t i = 0; i < m_pumpStateCount - 1; ++i)
+	{
+		if (HeartFiberWorkUnit* unit = m_pumpStates[(start + i) % m_pumpStateCount].runQueue.Steal())
+			return unit;
+	}
+
+	return nullptr;
+}
+
+HeartFiberWorkUnit* HeartFiberSystem::PopSharedWorkUnit()
+{
+	if (m_pendingQueueSize.load(std::memory_order_relaxed) == 0)
+		return nullptr;
+
+	HeartLockGuard lock(m_pendingQueueMutex);
+	HeartFiberWorkUnit* unit = m_pendingQueue.PopFront();
+	if (unit != nullptr)
+		m_pendingQueueSize.fetch_sub(1, std::memory_order_relaxed);
+
+	return unit;
+}
+
+bool HeartFiberSystem::HasQueuedWork() const
+{
+	if (m_pendingQueueSize.load(std::memory_order_relaxed) != 0)
+		return true;
+
+	for (uint32_t i = 0; i < m_pumpStateCount; ++i)
+	{
+		if (!m_pumpStates[i].runQueue.IsEmpty())
+			return true;
+	}
+
+	return false;
+}
+
 void HeartFiberSystem::CompleteWorkUnit(HeartFiberWorkUnit& unit)
 {
+	// Whoever is waiting on the counter can run as soon as this is done; they don't need our stack
+	if (unit.m_counter != nullptr)
+		unit.m_counter->Decrement();
+
 	HeartFiberContext::Get().destroyQueue.PushBack(&unit);
 
 	NativeSwitchToFiberNoReturn(HeartFiberContext::Get().pump);
@@ -144,9 +421,12 @@ void HeartFiberSystem::CompleteWorkUnit(HeartFiberWorkUnit& unit)
 
 void HeartFiberSystem::RequeueWorkUnit(HeartFiberWorkUnit& unit)
 {
-	EnqueueWork(hrt::move(unit.m_worker));
+	HEART_FIBER_TRACE(m_tracer.SetUnitState(unit, HeartFiberTraceState::Runnable));
 
-	CompleteWorkUnit(unit);
+	// We can't rewind the fiber while we're still running on it, so leave that to the pump
+	HeartFiberContext::Get().requeueQueue.PushBack(&unit);
+
+	NativeSwitchToFiberNoReturn(HeartFiberContext::Get().pump);
 }
 
 void HeartFiberSystem::YieldUnit(HeartFiberWorkUnit& unit)
@@ -154,10 +434,10 @@ void HeartFiberSystem::YieldUnit(HeartFiberWorkUnit& unit)
 	// Verify upon leaving that we have a valid stack
 	HEART_FIBER_VERIFY_STACK();
 
-	{
-		HeartLockGuard lock(m_pendingQueueMutex);
-		m_pendingQueue.PushBack(&unit);
-	}
+	HEART_FIBER_TRACE(m_tracer.SetUnitState(unit, HeartFiberTraceState::Runnable));
+
+	// We can't be made runnable while we're still on our own stack, so leave that to the pump
+	HeartFiberContext::Get().yieldedUnit = &unit;
 
 	NativeSwitchToFiber(HeartFiberContext::Get().pump);
 
@@ -165,6 +445,91 @@ void HeartFiberSystem::YieldUnit(HeartFiberWorkUnit& unit)
 	HEART_FIBER_VERIFY_STACK();
 }
 
+void HeartFiberSystem::ParkUnit(HeartFiberWorkUnit& unit, ParkFunction park, void* argument)
+{
+	HEART_FIBER_VERIFY_STACK();
+
+	// Whoever resumes us could be on another thread as soon as the pump hands us over
+	HEART_FIBER_TRACE(m_tracer.SetUnitState(unit, HeartFiberTraceState::Parked));
+
+	HeartFiberContext& context = HeartFiberContext::Get();
+	context.parkedUnit = &unit;
+	context.parkFunction = park;
+	context.parkArgument = argument;
+
+	NativeSwitchToFiber(context.pump);
+
+	HEART_FIBER_VERIFY_STACK();
+}
+
+void HeartFiberSystem::SleepUnit(HeartFiberWorkUnit& unit, uint64_t deadline)
+{
+	unit.m_sleepDeadline = deadline;
+
+	ParkUnit(
+		unit,
+		[](HeartFiberWorkUnit* sleeper, void*) { sleeper->m_system->ScheduleWakeUp(*sleeper, sleeper->m_sleepDeadline); },
+		nullptr);
+}
+
+void HeartFiberSystem::ScheduleWakeUp(HeartFiberWorkUnit& unit, uint64_t deadline)
+{
+	// The host keeps its own timers
+	if (m_host != nullptr)
+	{
+		m_host->ResumeWorkUnitAt(unit, deadline);
+		return;
+	}
+
+	// Park functions run on the pump, so the unit sleeps in the wheel of whichever thread it parked on
+	HeartFiberContext& context = HeartFiberContext::Get();
+	PumpState& pump = m_pumpStates[context.pumpIndex];
+
+	unit.m_sleepDeadline = deadline;
+	unit.m_sleepPumpIndex = context.pumpIndex;
+
+	HeartLockGuard lock(pump.sleepWheelMutex);
+	pump.sleepWheel.Schedule(&unit);
+	pump.sleeperCount.fetch_add(1, std::memory_order_release);
+}
+
+bool HeartFiberSystem::CancelWakeUp(HeartFiberWorkUnit& unit)
+{
+	HeartFiberSystem* system = unit.m_system;
+	if (system->m_host != nullptr)
+		return system->m_host->CancelResumeAt(unit);
+
+	PumpState& pump = system->m_pumpStates[unit.m_sleepPumpIndex];
+
+	HeartLockGuard lock(pump.sleepWheelMutex);
+	if (!pump.sleepWheel.Remove(&unit))
+		return false;
+
+	pump.sleeperCount.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+void HeartFiberSystem::ResumeWorkUnit(HeartFiberWorkUnit& unit)
+{
+	HeartFiberSystem* system = unit.m_system;
+
+	// A host decides for itself where the unit runs. It stays parked as far as we're concerned until it does.
+	if (system->m_host != nullptr)
+	{
+		HEART_FIBER_TRACE(system->m_tracer.SetUnitState(unit, HeartFiberTraceState::Runnable));
+		system->m_host->ResumeWorkUnit(unit);
+		return;
+	}
+
+	system->PushWorkUnit(&unit);
+
+	// Only once it's in a queue, so that a pump can't miss it in both places and exit early.
+	// The unit may already be running (or gone) by now, hence holding on to the system.
+	// If it was the last one a shutdown was waiting for, the idle pumps can go.
+	if (system->m_parkedUnitCount.fetch_sub(1, std::memory_order_release) == 1 && system->m_exit)
+		system->m_idleEvent.NotifyAll();
+}
+
 void HeartFiberSystem::NativeSwitchToFiberNoReturn(HeartFiberWorkUnit& target)
 {
 	// Switch to the fiber. It should never return to us.
@@ -178,6 +543,9 @@ void HeartFiberSystem::NativeSwitchToFiberNoReturn(HeartFiberWorkUnit& target)
 
 HeartFiberSystem::HeartFiberSystem(HeartBaseAllocator& allocator) :
 	m_allocator(allocator),
+#if HEART_FIBER_TRACING
+	m_tracer(allocator),
+#endif
 	m_threads(allocator)
 {
 }
@@ -191,6 +559,24 @@ HeartFiberSystem::~HeartFiberSystem()
 void HeartFiberSystem::Initialize(Settings s)
 {
 	m_exit = false;
+	m_stackProvider = s.stackProvider;
+	m_host = s.host;
+	m_hostStackClass = s.hostStackClass;
+
+	// A host brings its own threads, and its own queues and timers to go with them
+	if (m_host != nullptr)
+		return;
+
+	// Pump states must exist before any thread starts; pumps steal from each other immediately.
+	uint64_t currentTick = GetSleepTick();
+	m_pumpStateCount = s.threadCount;
+	m_pumpStates = m_allocator.allocate<PumpState>(m_pumpStateCount);
+	for (uint32_t i = 0; i < m_pumpStateCount; ++i)
+	{
+		new (&m_pumpStates[i]) PumpState(currentTick);
+	}
+
+	m_nextPumpIndex.store(0, std::memory_order_relaxed);
 
 	m_threads.Reserve(s.threadCount);
 	for (uint32_t i = 0; i < s.threadCount; ++i)
@@ -198,7 +584,7 @@ void HeartFiberSystem::Initialize(Settings s)
 		HeartThread& thread = m_threads.EmplaceBack(HeartThreadMemberBootstrap(this, &HeartFiberSystem::HeartFiberThreadEntry));
 
 		char buffer[64];
-		sprintf_s(buffer, "HeartFiber Thread %u", i + 1);
+		snprintf(buffer, sizeof(buffer), "HeartFiber Thread %u", i + 1);
 		thread.SetName(buffer);
 	}
 }
@@ -206,9 +592,22 @@ void HeartFiberSystem::Initialize(Settings s)
 void HeartFiberSystem::Shutdown()
 {
 	m_exit = true;
+	m_idleEvent.NotifyAll();
 
 	for (auto& thread : m_threads)
 		thread.Join();
 
 	m_threads.Clear();
+
+	if (m_pumpStates == nullptr)
+		return;
+
+	for (uint32_t i = 0; i < m_pumpStateCount; ++i)
+	{
+		m_pumpStates[i].~PumpState();
+	}
+
+	m_allocator.deallocate(m_pumpStates, m_pumpStateCount);
+	m_pumpStates = nullptr;
+	m_pumpStateCount = 0;
 }
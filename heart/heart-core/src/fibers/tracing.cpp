@@ -0,0 +1,360 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/fibers/tracing.h"
+
+#if HEART_FIBER_TRACING
+
+#include "heart/debug/chrome_trace.h"
+#include "heart/fibers/work_unit.h"
+
+#include <chrono>
+#include <stdio.h>
+
+namespace
+{
+	// Identifies the current thread to every tracer. Only its address is used.
+	thread_local char t_threadToken;
+
+	// The buffer most recently used by this thread, to skip searching for it
+	struct HeartFiberTracerBinding
+	{
+		uint64_t tracerId = 0;
+		void* buffer = nullptr;
+	};
+
+	std::atomic<uint64_t> s_nextTracerId = 1;
+
+	thread_local HeartFiberTracerBinding t_binding;
+
+	// We are the only writer, so a plain load and store is enough to keep these readable from other threads
+	void Add(std::atomic<uint64_t>& value, uint64_t amount)
+	{
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+}
+
+HeartFiberTracer::HeartFiberTracer(HeartBaseAllocator& allocator, uint32_t eventsPerThread) :
+	m_allocator(allocator),
+	m_eventsPerThread(eventsPerThread),
+	m_startTime(GetTimestamp()),
+	m_id(s_nextTracerId.fetch_add(1, std::memory_order_relaxed))
+{
+}
+
+HeartFiberTracer::~HeartFiberTracer()
+{
+	ThreadBuffer* buffer = m_buffers.exchange(nullptr);
+	while (buffer != nullptr)
+	{
+		ThreadBuffer* next = buffer->next;
+
+		if (HeartFiberTraceEvent* events = buffer->events.load(std::memory_order_relaxed))
+			m_allocator.deallocate(events, m_eventsPerThread);
+
+		m_allocator.DestroyAndFree(buffer);
+		buffer = next;
+	}
+}
+
+uint64_t HeartFiberTracer::GetTimestamp()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+void HeartFiberTracer::SetEventsEnabled(bool enabled)
+{
+	m_eventsEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+HeartFiberTracer::ThreadBuffer* HeartFiberTracer::GetThreadBuffer()
+{
+	if (t_binding.tracerId == m_id)
+		return static_cast<ThreadBuffer*>(t_binding.buffer);
+
+	// This thread might have recorded for us before, and then for some other tracer
+	ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire);
+	while (buffer != nullptr && buffer->owner != &t_threadToken)
+	{
+		buffer = buffer->next;
+	}
+
+	if (buffer == nullptr)
+	{
+		buffer = m_allocator.AllocateAndConstruct<ThreadBuffer>();
+		buffer->owner = &t_threadToken;
+		buffer->threadIndex = m_threadCount.fetch_add(1, std::memory_order_relaxed);
+
+		ThreadBuffer* head = m_buffers.load(std::memory_order_relaxed);
+		do
+		{
+			buffer->next = head;
+		} while (!m_buffers.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	t_binding.tracerId = m_id;
+	t_binding.buffer = buffer;
+	return buffer;
+}
+
+void HeartFiberTracer::RecordEvent(ThreadBuffer& buffer, HeartFiberTraceEvent::Type type, uint64_t start, uint64_t end, uint64_t unitId)
+{
+	if (!m_eventsEnabled.load(std::memory_order_relaxed))
+		return;
+
+	uint32_t index = buffer.eventCount.load(std::memory_order_relaxed);
+	if (index >= m_eventsPerThread)
+	{
+		Add(buffer.droppedCount, 1);
+		return;
+	}
+
+	HeartFiberTraceEvent* events = buffer.events.load(std::memory_order_relaxed);
+	if (events == nullptr)
+	{
+		events = m_allocator.allocate<HeartFiberTraceEvent>(m_eventsPerThread);
+		buffer.events.store(events, std::memory_order_relaxed);
+	}
+
+	events[index] = {start, end, unitId, type};
+
+	// Publishes the event (and the buffer it's in) to readers
+	buffer.eventCount.store(index + 1, std::memory_order_release);
+}
+
+void HeartFiberTracer::AttachThread(uint32_t pumpIndex)
+{
+	GetThreadBuffer()->pumpIndex = pumpIndex;
+}
+
+void HeartFiberTracer::OnSwitch(HeartFiberWorkUnit& target)
+{
+	Add(GetThreadBuffer()->switchCount, 1);
+	SetUnitState(target, HeartFiberTraceState::Running);
+}
+
+void HeartFiberTracer::OnIdle(uint64_t start, uint64_t end)
+{
+	ThreadBuffer* buffer = GetThreadBuffer();
+	Add(buffer->idleTime, end - start);
+	Add(buffer->idleCount, 1);
+	RecordEvent(*buffer, HeartFiberTraceEvent::Type::Idle, start, end, 0);
+}
+
+void HeartFiberTracer::OnStackAllocated()
+{
+	Add(GetThreadBuffer()->stacksAllocated, 1);
+}
+
+void HeartFiberTracer::OnStackReused()
+{
+	Add(GetThreadBuffer()->stacksReused, 1);
+}
+
+void HeartFiberTracer::OnStackReleased()
+{
+	Add(GetThreadBuffer()->stacksReleased, 1);
+}
+
+void HeartFiberTracer::OnStackFreed()
+{
+	Add(GetThreadBuffer()->stacksFreed, 1);
+}
+
+void HeartFiberTracer::SetUnitState(HeartFiberWorkUnit& unit, HeartFiberTraceState state)
+{
+	// The pump and entry fibers belong to the thread rather than the system, and aren't work units as such
+	if (unit.m_system == nullptr)
+		return;
+
+	uint64_t now = GetTimestamp();
+	uint64_t elapsed = now - unit.m_traceStateStart;
+	ThreadBuffer* buffer = GetThreadBuffer();
+
+	switch (unit.m_traceState)
+	{
+	case HeartFiberTraceState::None:
+		unit.m_traceId = m_nextUnitId.fetch_add(1, std::memory_order_relaxed);
+		break;
+	case HeartFiberTraceState::Runnable:
+		unit.m_traceTimes.runnable += elapsed;
+		break;
+	case HeartFiberTraceState::Running:
+		unit.m_traceTimes.running += elapsed;
+		Add(buffer->runTime, elapsed);
+		RecordEvent(*buffer, HeartFiberTraceEvent::Type::Run, unit.m_traceStateStart, now, unit.m_traceId);
+		break;
+	case HeartFiberTraceState::Parked:
+		unit.m_traceTimes.parked += elapsed;
+		break;
+	case HeartFiberTraceState::Done:
+		HEART_ASSERT(false, "A work unit can't do anything once it's done");
+		break;
+	}
+
+	unit.m_traceState = state;
+	unit.m_traceStateStart = now;
+
+	if (state == HeartFiberTraceState::Done)
+	{
+		Add(buffer->completedUnitCount, 1);
+		Add(buffer->completedRunning, unit.m_traceTimes.running);
+		Add(buffer->completedRunnable, unit.m_traceTimes.runnable);
+		Add(buffer->completedParked, unit.m_traceTimes.parked);
+	}
+}
+
+HeartFiberTraceStats HeartFiberTracer::GetStats(const ThreadBuffer& buffer)
+{
+	HeartFiberTraceStats stats;
+	stats.threadIndex = buffer.threadIndex;
+	stats.pumpIndex = buffer.pumpIndex;
+	stats.switchCount = buffer.switchCount.load(std::memory_order_relaxed);
+	stats.runTime = buffer.runTime.load(std::memory_order_relaxed);
+	stats.idleTime = buffer.idleTime.load(std::memory_order_relaxed);
+	stats.idleCount = buffer.idleCount.load(std::memory_order_relaxed);
+	stats.stacksAllocated = buffer.stacksAllocated.load(std::memory_order_relaxed);
+	stats.stacksReused = buffer.stacksReused.load(std::memory_order_relaxed);
+	stats.stacksReleased = buffer.stacksReleased.load(std::memory_order_relaxed);
+	stats.stacksFreed = buffer.stacksFreed.load(std::memory_order_relaxed);
+	stats.completedUnitCount = buffer.completedUnitCount.load(std::memory_order_relaxed);
+	stats.completedUnitTimes.running = buffer.completedRunning.load(std::memory_order_relaxed);
+	stats.completedUnitTimes.runnable = buffer.completedRunnable.load(std::memory_order_relaxed);
+	stats.completedUnitTimes.parked = buffer.completedParked.load(std::memory_order_relaxed);
+	return stats;
+}
+
+HeartFiberTraceStats HeartFiberTracer::GetTotals() const
+{
+	HeartFiberTraceStats totals;
+
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		HeartFiberTraceStats stats = GetStats(*buffer);
+		totals.switchCount += stats.switchCount;
+		totals.runTime += stats.runTime;
+		totals.idleTime += stats.idleTime;
+		totals.idleCount += stats.idleCount;
+		totals.stacksAllocated += stats.stacksAllocated;
+		totals.stacksReused += stats.stacksReused;
+		totals.stacksReleased += stats.stacksReleased;
+		totals.stacksFreed += stats.stacksFreed;
+		totals.completedUnitCount += stats.completedUnitCount;
+		totals.completedUnitTimes.running += stats.completedUnitTimes.running;
+		totals.completedUnitTimes.runnable += stats.completedUnitTimes.runnable;
+		totals.completedUnitTimes.parked += stats.completedUnitTimes.parked;
+	}
+
+	return totals;
+}
+
+uint32_t HeartFiberTracer::GetThreadStats(HeartFiberTraceStats* stats, uint32_t capacity) const
+{
+	uint32_t count = 0;
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		if (count < capacity)
+			stats[count] = GetStats(*buffer);
+
+		++count;
+	}
+
+	return count;
+}
+
+uint64_t HeartFiberTracer::GetEventCount() const
+{
+	uint64_t count = 0;
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		count += buffer->eventCount.load(std::memory_order_acquire);
+	}
+
+	return count;
+}
+
+uint64_t HeartFiberTracer::GetDroppedEventCount() const
+{
+	uint64_t count = 0;
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		count += buffer->droppedCount.load(std::memory_order_relaxed);
+	}
+
+	return count;
+}
+
+void HeartFiberTracer::Clear()
+{
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		std::atomic<uint64_t>* counters[] = {
+			&buffer->switchCount,
+			&buffer->runTime,
+			&buffer->idleTime,
+			&buffer->idleCount,
+			&buffer->stacksAllocated,
+			&buffer->stacksReused,
+			&buffer->stacksReleased,
+			&buffer->stacksFreed,
+			&buffer->completedUnitCount,
+			&buffer->completedRunning,
+			&buffer->completedRunnable,
+			&buffer->completedParked,
+			&buffer->droppedCount,
+		};
+
+		for (std::atomic<uint64_t>* counter : counters)
+		{
+			counter->store(0, std::memory_order_relaxed);
+		}
+
+		buffer->eventCount.store(0, std::memory_order_relaxed);
+	}
+
+	m_startTime = GetTimestamp();
+}
+
+void HeartFiberTracer::ExportChromeTrace(HeartChromeTraceWriter& writer) const
+{
+	auto toMicroseconds = [this](uint64_t timestamp) {
+		return timestamp >= m_startTime ? double(timestamp - m_startTime) / 1000.0 : 0.0;
+	};
+
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		char threadName[64];
+		if (buffer->pumpIndex != HeartFiberTraceStats::NotAPump)
+			snprintf(threadName, sizeof(threadName), "HeartFiber Thread %u", buffer->pumpIndex + 1);
+		else
+			snprintf(threadName, sizeof(threadName), "Thread %u", buffer->threadIndex);
+
+		writer.AddThreadName(buffer->threadIndex, threadName);
+
+		uint32_t count = buffer->eventCount.load(std::memory_order_acquire);
+		const HeartFiberTraceEvent* events = buffer->events.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const HeartFiberTraceEvent& event = events[i];
+
+			double start = toMicroseconds(event.startTime);
+			double duration = double(event.endTime - event.startTime) / 1000.0;
+
+			if (event.type == HeartFiberTraceEvent::Type::Run)
+				writer.AddCompleteEvent("Fiber", "fiber", buffer->threadIndex, start, duration, {{"unit", event.unitId}});
+			else
+				writer.AddCompleteEvent("Idle", "fiber", buffer->threadIndex, start, duration);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,202 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/jobs/job_allocator.h"
+
+#include "heart/debug/assert.h"
+
+namespace
+{
+	// The cache attached to the current thread, if any
+	struct HeartJobAllocatorBinding
+	{
+		HeartJobAllocator* allocator = nullptr;
+		uint32_t index = 0;
+	};
+
+	thread_local HeartJobAllocatorBinding t_binding;
+}
+
+HeartJobAllocator::HeartJobAllocator(HeartBaseAllocator& allocator, const size_t (&blockSizes)[SizeClassCount]) :
+	m_allocator(allocator)
+{
+	for (uint32_t i = 0; i < SizeClassCount; ++i)
+	{
+		m_blockSizes[i] = (blockSizes[i] + BlockAlignment - 1) & ~(BlockAlignment - 1);
+		HEART_ASSERT(i == 0 || m_blockSizes[i] > m_blockSizes[i - 1], "HeartJobAllocator size classes must be ascending!");
+	}
+}
+
+HeartJobAllocator::~HeartJobAllocator()
+{
+	while (m_slabs != nullptr)
+	{
+		SlabHeader* next = m_slabs->next;
+		m_allocator.deallocate(m_slabs, m_slabs->size);
+		m_slabs = next;
+	}
+
+	if (m_caches != nullptr)
+	{
+		m_allocator.deallocate(m_caches, m_cacheCount);
+	}
+}
+
+void HeartJobAllocator::CreateThreadCaches(uint32_t cacheCount)
+{
+	HEART_ASSERT(m_caches == nullptr, "HeartJobAllocator thread caches were already created!");
+
+	m_cacheCount = cacheCount;
+	m_caches = m_allocator.allocate<ThreadCache>(cacheCount);
+	for (uint32_t i = 0; i < cacheCount; ++i)
+	{
+		new (&m_caches[i]) ThreadCache();
+	}
+}
+
+void HeartJobAllocator::AttachThread(uint32_t cacheIndex)
+{
+	HEART_ASSERT(cacheIndex < m_cacheCount);
+
+	t_binding.allocator = this;
+	t_binding.index = cacheIndex;
+}
+
+void HeartJobAllocator::DetachThread()
+{
+	ThreadCache* cache = GetCurrentCache();
+	if (cache == nullptr)
+		return;
+
+	// Give everything back so that whichever thread attaches next starts fresh
+	{
+		HeartLockGuard lock(m_centralMutex);
+		for (uint32_t i = 0; i < SizeClassCount; ++i)
+		{
+			MoveBlocks(cache->lists[i], m_central[i], cache->lists[i].count);
+		}
+	}
+
+	t_binding = {};
+}
+
+HeartJobAllocator::ThreadCache* HeartJobAllocator::GetCurrentCache()
+{
+	if (t_binding.allocator != this)
+		return nullptr;
+
+	return &m_caches[t_binding.index];
+}
+
+void HeartJobAllocator::MoveBlocks(FreeList& from, FreeList& to, uint32_t count)
+{
+	for (uint32_t i = 0; i < count && from.head != nullptr; ++i)
+	{
+		PushBlock(to, PopBlock(from));
+	}
+}
+
+void* HeartJobAllocator::PopBlock(FreeList& list)
+{
+	FreeBlock* block = list.head;
+	if (block != nullptr)
+	{
+		list.head = block->next;
+		list.count--;
+	}
+
+	return block;
+}
+
+void HeartJobAllocator::PushBlock(FreeList& list, void* block)
+{
+	FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+	freeBlock->next = list.head;
+	list.head = freeBlock;
+	list.count++;
+}
+
+void HeartJobAllocator::AllocateSlab(uint32_t sizeClass, FreeList& into)
+{
+	size_t blockSize = m_blockSizes[sizeClass];
+	size_t slabSize = sizeof(SlabHeader) + blockSize * SlabBlockCount;
+
+	SlabHeader* slab = reinterpret_cast<SlabHeader*>(m_allocator.allocate<byte_t>(slabSize));
+	slab->next = m_slabs;
+	slab->size = slabSize;
+	m_slabs = slab;
+
+	// Push in reverse so that the blocks come back out in address order
+	byte_t* blocks = reinterpret_cast<byte_t*>(slab + 1);
+	for (uint32_t i = SlabBlockCount; i > 0; --i)
+	{
+		PushBlock(into, blocks + (i - 1) * blockSize);
+	}
+}
+
+void* HeartJobAllocator::Allocate(uint32_t sizeClass)
+{
+	HEART_ASSERT(sizeClass < SizeClassCount);
+
+	ThreadCache* cache = GetCurrentCache();
+	if (cache != nullptr)
+	{
+		FreeList& local = cache->lists[sizeClass];
+		if (local.head == nullptr)
+		{
+			HeartLockGuard lock(m_centralMutex);
+			if (m_central[sizeClass].head == nullptr)
+			{
+				AllocateSlab(sizeClass, local);
+			}
+			else
+			{
+				MoveBlocks(m_central[sizeClass], local, RefillBlockCount);
+			}
+		}
+
+		return PopBlock(local);
+	}
+
+	HeartLockGuard lock(m_centralMutex);
+	if (m_central[sizeClass].head == nullptr)
+	{
+		AllocateSlab(sizeClass, m_central[sizeClass]);
+	}
+
+	return PopBlock(m_central[sizeClass]);
+}
+
+void HeartJobAllocator::Free(void* block, uint32_t sizeClass)
+{
+	HEART_ASSERT(sizeClass < SizeClassCount);
+
+	if (block == nullptr)
+		return;
+
+	ThreadCache* cache = GetCurrentCache();
+	if (cache != nullptr)
+	{
+		FreeList& local = cache->lists[sizeClass];
+		PushBlock(local, block);
+
+		if (local.count > MaxCachedBlocks)
+		{
+			HeartLockGuard lock(m_centralMutex);
+			MoveBlocks(local, m_central[sizeClass], MaxCachedBlocks / 2);
+		}
+
+		return;
+	}
+
+	HeartLockGuard lock(m_centralMutex);
+	PushBlock(m_central[sizeClass], block);
+}
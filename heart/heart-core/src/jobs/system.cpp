@@ -11,21 +11,54 @@
 */
 #include "heart/jobs/system.h"
 
+#include "heart/fibers/context.h"
+#include "heart/fibers/result.h"
+#include "heart/fibers/system.h"
+#include "heart/fibers/work_unit.h"
+
 #include "heart/sleep.h"
 #include "heart/thread/bootstrap.h"
 
 #include <algorithm>
-#include <thread>
+#include <bit>
+#include <chrono>
+
+namespace
+{
+	// Identifies the job system worker running on the current thread, if any.
+	struct HeartJobWorkerIdentity
+	{
+		HeartJobSystem* system = nullptr;
+		uint32_t index = 0;
+		HeartJobPriority lowestPriority = HeartJobPriority::Normal;
+	};
+
+	thread_local HeartJobWorkerIdentity t_workerIdentity;
+
+	// Identifies the affine thread to every job system. Only its address is used.
+	thread_local char t_affineThreadToken;
+
+	// The delay requested by the running job through SetRetryDelay
+	constexpr uint32_t UseRetryBackoff = ~0u;
+	thread_local uint32_t t_retryDelay = UseRetryBackoff;
+}
 
 HeartJobSystem::Settings HeartJobSystem::GetDefaultSettings()
+{
+	return GetDefaultSettings(HeartCpuTopology::Get());
+}
+
+HeartJobSystem::Settings HeartJobSystem::GetDefaultSettings(const HeartCpuTopology& topology)
 {
 	Settings defaultSettings;
 
-	// Start with the actual physical concurrency
-	uint32_t coreCount = std::thread::hardware_concurrency();
+	// Start with the physical cores. SMT siblings share caches and execution units,
+	// so a second worker on the same core mostly just competes with the first.
+	uint32_t coreCount = topology.GetCoreCount();
 
-	// Assume the game is going to have some threads of their own, eg audio, file io, and the main thread
-	const uint32_t ReservedCount = 4;
+	// Leave the main thread a core of its own. The game's other threads (eg audio and file io)
+	// can live on the SMT siblings of our cores if there are any, otherwise they need cores too.
+	const uint32_t ReservedCount = topology.HasSmt() ? 1 : std::clamp(coreCount / 4, 1u, 3u);
 
 	// No matter what, we'll need at least 1 job thread
 	const uint32_t MinimumCount = 1;
@@ -34,14 +67,103 @@ HeartJobSystem::Settings HeartJobSystem::GetDefaultSettings()
 	// be creating thread_local resources and probably isn't expecting hundreds of them on a Threadripper.
 	const uint32_t MaximumCount = 16;
 
-	defaultSettings.threadCount = uint8_t(std::clamp(coreCount - ReservedCount, MinimumCount, MaximumCount));
+	uint32_t availableCount = coreCount > ReservedCount ? coreCount - ReservedCount : 0;
+	defaultSettings.threadCount = uint8_t(std::clamp(availableCount, MinimumCount, MaximumCount));
+	defaultSettings.minThreadCount = 0;
+	defaultSettings.scalingInterval = 1000;
 	defaultSettings.threadPriority = HeartThread::Priority::High;
+	defaultSettings.schedulerMode = HeartJobSchedulerMode::SharedQueue;
+	defaultSettings.affinity = HeartJobAffinityMode::None;
+	defaultSettings.retryBackoffMin = 50;
+	defaultSettings.retryBackoffMax = 4000;
+	defaultSettings.executionMode = HeartJobExecutionMode::Threads;
+	defaultSettings.fiberStackClass = HeartFiberStackClass::Large;
+
+	// The reserved cores are the first ones, where the OS tends to put the main thread and interrupts
+	for (uint32_t i = ReservedCount; i < coreCount; ++i)
+	{
+		defaultSettings.workerCpus.Add(topology.GetCore(i).cpus);
+	}
+
 	return defaultSettings;
 }
 
+HeartCpuSet HeartJobSystem::GetWorkerCpus(const Settings& s, uint32_t workerIndex, const HeartCpuTopology& topology)
+{
+	// Must match Initialize
+	uint32_t urgentThreadCount = s.threadCount > 1 ? 1 : 0;
+
+	if (workerIndex < urgentThreadCount && !s.urgentWorkerCpus.IsEmpty())
+		return s.urgentWorkerCpus;
+
+	// A separately pinned urgent worker doesn't use up a slot
+	uint32_t slot = s.urgentWorkerCpus.IsEmpty() ? workerIndex : workerIndex - urgentThreadCount;
+
+	switch (s.affinity)
+	{
+	case HeartJobAffinityMode::CpuSet:
+	{
+		uint32_t count = s.workerCpus.GetCount();
+		if (count == 0)
+			break;
+
+		HeartCpuSet cpus;
+		cpus.Add(s.workerCpus.GetNth(slot % count));
+		return cpus;
+	}
+
+	case HeartJobAffinityMode::PhysicalCores:
+	{
+		auto isUsable = [&](const HeartCpuTopology::Core& core) {
+			if (s.workerCpus.IsEmpty())
+				return true;
+
+			HeartCpuSet usable = core.cpus;
+			usable.Intersect(s.workerCpus);
+			return !usable.IsEmpty();
+		};
+
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < topology.GetCoreCount(); ++i)
+		{
+			count += isUsable(topology.GetCore(i)) ? 1 : 0;
+		}
+
+		if (count == 0)
+			break;
+
+		uint32_t target = slot % count;
+		for (uint32_t i = 0; i < topology.GetCoreCount(); ++i)
+		{
+			const HeartCpuTopology::Core& core = topology.GetCore(i);
+			if (!isUsable(core) || target-- != 0)
+				continue;
+
+			HeartCpuSet cpus = core.cpus;
+			if (!s.workerCpus.IsEmpty())
+				cpus.Intersect(s.workerCpus);
+
+			return cpus;
+		}
+
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return {};
+}
+
 HeartJobSystem::HeartJobSystem(HeartBaseAllocator& allocator) :
 	m_allocator(allocator),
+	m_jobAllocator(allocator, JobBlockSizes),
 	m_workerThreads(allocator)
+#if HEART_JOB_TRACING
+	,
+	m_tracer(allocator)
+#endif
 {
 }
 
@@ -58,12 +180,55 @@ void HeartJobSystem::Initialize(Settings s)
 	int threadCount = s.threadCount < 1 ? 1 : s.threadCount;
 	int urgentThreadCount = threadCount > 1 ? 1 : 0;
 
+	// Until someone else pumps them, affine jobs belong to whoever started us (usually the main thread)
+	m_affineThread.store(&t_affineThreadToken, std::memory_order_relaxed);
+
+	if (s.schedulerMode == HeartJobSchedulerMode::WorkStealing)
+	{
+		// Worker states must exist before any thread starts; workers steal from each other immediately.
+		m_workerStateCount = uint32_t(threadCount);
+		m_workerStates = m_allocator.allocate<WorkerState>(m_workerStateCount);
+		for (uint32_t i = 0; i < m_workerStateCount; ++i)
+		{
+			new (&m_workerStates[i]) WorkerState();
+		}
+	}
+
+	m_jobAllocator.CreateThreadCaches(uint32_t(threadCount));
+
+	m_retryBackoffMin = s.retryBackoffMin;
+	m_retryBackoffMax = std::max(s.retryBackoffMin, s.retryBackoffMax);
+
+	// Start small and let the load bring more workers in. Whatever happens, someone has to be able to run Normal jobs.
+	uint32_t minThreadCount = s.minThreadCount == 0 ? uint32_t(threadCount) : s.minThreadCount;
+	m_maxActiveWorkers = uint32_t(threadCount);
+	m_minActiveWorkers = std::clamp(minThreadCount, uint32_t(urgentThreadCount) + 1, m_maxActiveWorkers);
+	m_activeWorkerLimit.store(m_minActiveWorkers, std::memory_order_relaxed);
+	m_scalingInterval = std::max(s.scalingInterval, 1u);
+
+	if (s.executionMode == HeartJobExecutionMode::Fibers)
+	{
+		HeartFiberSystem::Settings fiberSettings;
+		fiberSettings.threadCount = uint32_t(threadCount);
+		fiberSettings.host = this;
+		fiberSettings.hostStackClass = s.fiberStackClass;
+
+		m_fiberSystem = m_allocator.AllocateAndConstruct<HeartFiberSystem>(m_allocator);
+		m_fiberSystem->Initialize(fiberSettings);
+	}
+
 	m_workerThreads.Reserve(threadCount);
 	for (int i = 0; i < threadCount; ++i)
 	{
 		auto lowestPriority = i < urgentThreadCount ? HeartJobPriority::Urgent : HeartJobPriority::Normal;
-		HeartThread& thread = m_workerThreads.EmplaceBack(HeartThreadMemberBootstrap(this, &HeartJobSystem::ThreadWorker, lowestPriority));
+		HeartThread& thread = m_workerThreads.EmplaceBack(HeartThreadMemberBootstrap(this, &HeartJobSystem::ThreadWorker, uint32_t(i), lowestPriority));
 		thread.SetName("HeartJobSystem Thread");
+
+		HeartCpuSet cpus = GetWorkerCpus(s, uint32_t(i));
+		if (!cpus.IsEmpty())
+		{
+			thread.SetAffinity(cpus);
+		}
 	}
 }
 
@@ -73,19 +238,9 @@ void HeartJobSystem::Flush()
 
 	while (any)
 	{
-		any = false;
-
-		{
-			HeartLockGuard lock(m_queueMutex);
-			for (auto& q : m_queues)
-			{
-				if (!q.IsEmpty())
-				{
-					any = true;
-					break;
-				}
-			}
-		}
+		// Workers only promote retries when they're idle, so help them out
+		PromoteDueRetries();
+		any = HasQueuedJobs() || m_retryJobCount.load(std::memory_order_acquire) != 0;
 
 		if (any)
 		{
@@ -96,10 +251,24 @@ void HeartJobSystem::Flush()
 
 void HeartJobSystem::Shutdown()
 {
-	Flush();
+	// Affine jobs can queue more work for the workers and vice versa, and a suspended job
+	// can be waiting on either, so keep going until all of them are done
+	while (true)
+	{
+		Flush();
+
+		if (PumpAffineJobs() != 0)
+			continue;
+
+		if (!HasSuspendedJobs())
+			break;
+
+		HeartYield();
+	}
 
 	m_exit = true;
-	m_conditionVar.NotifyAll();
+	WakeAllWorkers();
+	m_suspendedEvent.NotifyAll();
 
 	for (HeartThread& workerThread : m_workerThreads)
 	{
@@ -107,116 +276,1302 @@ void HeartJobSystem::Shutdown()
 	}
 
 	m_workerThreads.Clear();
+
+	if (m_fiberSystem != nullptr)
+	{
+		m_fiberSystem->Shutdown();
+		m_allocator.DestroyAndFree(m_fiberSystem);
+		m_fiberSystem = nullptr;
+	}
+
+	if (m_workerStates != nullptr)
+	{
+		for (uint32_t i = 0; i < m_workerStateCount; ++i)
+		{
+			m_workerStates[i].~WorkerState();
+		}
+
+		m_allocator.deallocate(m_workerStates, m_workerStateCount);
+		m_workerStates = nullptr;
+		m_workerStateCount = 0;
+	}
+}
+
+void HeartJobSystem::ThreadWorker(uint32_t workerIndex, HeartJobPriority lowestPriority)
+{
+	t_workerIdentity.system = this;
+	t_workerIdentity.index = workerIndex;
+	t_workerIdentity.lowestPriority = lowestPriority;
+	m_jobAllocator.AttachThread(workerIndex);
+
+#if HEART_JOB_TRACING
+	m_tracer.AttachThread(workerIndex);
+#endif
+
+	if (m_fiberSystem != nullptr)
+		m_fiberSystem->RunHostedThread();
+	else
+		RunWorkerLoop();
+
+	m_jobAllocator.DetachThread();
+	t_workerIdentity = {};
 }
 
-void HeartJobSystem::ThreadWorker(HeartJobPriority lowestPriority)
+void HeartJobSystem::RunWorkerLoop()
 {
+	// In Fibers mode, a fiber only ever runs this loop on the thread it started on
+	const uint32_t workerIndex = t_workerIdentity.index;
+	const HeartJobPriority lowestPriority = t_workerIdentity.lowestPriority;
+
 	HeartJobRef currentJob = nullptr;
 	HeartJobPriority currentPriority = HeartJobPriority::Count;
 
-	while (m_exit.load(std::memory_order_acquire) == false)
+	HeartEventCount& idleEvent = GetIdleEvent(lowestPriority);
+	uint32_t spinLimit = MinWorkerSpinCount;
+	uint32_t unreportedJobCount = 0;
+
+	// A suspended job still needs a worker to finish it, even once we're exiting
+	while (m_exit.load(std::memory_order_acquire) == false || HasSuspendedJobs())
 	{
+		if (workerIndex >= m_activeWorkerLimit.load(std::memory_order_acquire))
+		{
+			SuspendWorker(workerIndex);
+			continue;
+		}
+
+		// Jobs which have already started come first, so that their fibers are given back sooner
+		if (m_fiberSystem != nullptr && TryResumeJob(lowestPriority))
+			continue;
+
+		if (TryAcquireOneJob(currentJob, currentPriority, lowestPriority))
 		{
-			HeartLockGuard lock(m_queueMutex);
+			ProcessOneJob(currentJob, currentPriority);
+			currentJob = nullptr;
 
-			while (m_exit.load(std::memory_order_acquire) == false && !TryAcquireOneJob(currentJob, currentPriority, lowestPriority))
+			// If the job suspended, we're now on whichever worker resumed it, and the fiber
+			// which did so is waiting to carry on as that worker
+			if (m_fiberSystem != nullptr && m_fiberSystem->IsResumedHostedFiber())
+				return;
+
+			if (IsScalingEnabled() && ++unreportedJobCount == ScalingJobBatch)
 			{
-				m_conditionVar.TryWaitFor(m_queueMutex, 10);
+				m_scalingJobCount.fetch_add(unreportedJobCount, std::memory_order_relaxed);
+				unreportedJobCount = 0;
+				UpdateActiveWorkers();
 			}
+
+			continue;
 		}
 
-		if (currentJob)
+		if (IsScalingEnabled())
 		{
-			ProcessOneJob(currentJob, currentPriority);
-			currentJob = nullptr;
+			m_scalingFailureCount.fetch_add(1, std::memory_order_relaxed);
+			UpdateActiveWorkers();
 		}
+
+		// Work often shows up again shortly after we run out (eg the next stage of a frame),
+		// so look for a little while before parking. The spin grows while it keeps paying off
+		// and shrinks while it doesn't.
+		bool foundWork = false;
+		for (uint32_t spin = 0; spin < spinLimit && !foundWork; ++spin)
+		{
+			HeartYield();
+			foundWork = HasQueuedJobs(lowestPriority);
+		}
+
+		if (foundWork)
+		{
+			spinLimit = std::min(spinLimit * 2, MaxWorkerSpinCount);
+			continue;
+		}
+
+		spinLimit = std::max(spinLimit / 2, MinWorkerSpinCount);
+		// Checked after we start waiting, so that we can't sleep through the limit dropping below us
+		ParkWorker(idleEvent, lowestPriority, [this, workerIndex]() {
+			return workerIndex >= m_activeWorkerLimit.load(std::memory_order_acquire);
+		});
 	}
 }
 
-void HeartJobSystem::InsertJobIntoQueue(HeartJob* rawJob, HeartJobPriority pri)
+HeartFiberResult HeartJobSystem::RunHostedFiber()
 {
-	HeartLockGuard lock(m_queueMutex);
-	m_queues[int(pri)].PushBack(rawJob);
+	RunWorkerLoop();
+	return HeartFiberResult::Success;
+}
 
-	// We manually increment the ref count here. This is the "queue ref"
-	// since the queue itself holds raw pointers, not intrusive pointers
-	rawJob->IncrementRef();
+void HeartJobSystem::ResumeWorkUnit(HeartFiberWorkUnit& unit)
+{
+	HeartJob* job = static_cast<HeartJob*>(unit.GetHostData());
+	HEART_ASSERT(job != nullptr, "A worker's fiber parked outside of a job!");
+
+	job->fiber = &unit;
+	PushResumedJob(job);
 }
 
-HeartJobRef HeartJobSystem::RemoveJobFromQueue(JobQueue& queue, JobQueue::iterator iterator)
+void HeartJobSystem::ResumeWorkUnitAt(HeartFiberWorkUnit& unit, uint64_t deadline)
 {
-	// PRE-CONDITION: The caller *must* be holding the queue mutex!
+	HeartJob* job = static_cast<HeartJob*>(unit.GetHostData());
+	HEART_ASSERT(job != nullptr, "A worker's fiber parked outside of a job!");
 
-	HeartJob* rawPtr = iterator.operator->();
-	HeartJobRef strongRef = rawPtr;
+	job->fiber = &unit;
 
-	// We manually decrement the ref count here. This is the "queue ref"
-	// since the queue itself holds raw pointers, not intrusive pointers.
-	// This must come *after* we assign strongRef above, or else it could
-	// cause the job to be deleted before we return it.
-	rawPtr->DecrementRef();
+	// A sleeping job waits out its time with the retries
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	uint64_t nowMicroseconds = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+	if (deadline <= nowMicroseconds)
+		PushResumedJob(job);
+	else
+		RetryJob(job, uint32_t(std::min<uint64_t>(deadline - nowMicroseconds, UINT32_MAX)));
+}
 
-	queue.Remove(iterator);
+bool HeartJobSystem::CancelResumeAt(HeartFiberWorkUnit& unit)
+{
+	HeartJob* job = static_cast<HeartJob*>(unit.GetHostData());
+	HEART_ASSERT(job != nullptr, "A worker's fiber parked outside of a job!");
 
-	return strongRef;
+	// A job that was already due went straight to the resumed queue, and can't be taken back
+	{
+		HeartLockGuard lock(m_retryMutex);
+		if (!m_retryWheel.Remove(job))
+			return false;
+
+		m_retryJobCount.fetch_sub(1, std::memory_order_seq_cst);
+	}
+
+	// Drop the wheel's ref. The job's fiber is still parked, and keeps it alive until it finishes.
+	job->DecrementRef();
+	return true;
 }
 
-bool HeartJobSystem::TryAcquireOneJob(HeartJobRef& outJob, HeartJobPriority& outPri, HeartJobPriority lowestPri, uint32_t mask)
+bool HeartJobSystem::IsOnWorkerFiber() const
 {
-	// PRE-CONDITION: The caller *must* be holding the queue mutex!
+	return m_fiberSystem != nullptr && t_workerIdentity.system == this;
+}
 
-	outJob = nullptr;
+bool HeartJobSystem::HasSuspendedJobs() const
+{
+	return m_fiberSystem != nullptr && m_fiberSystem->GetParkedWorkUnitCount() != 0;
+}
+
+void HeartJobSystem::PushResumedJob(HeartJob* job)
+{
+	HeartJobPriority pri = job->priority;
+
+	{
+		HeartLockGuard lock(m_resumeMutex);
+		m_resumedJobs[int(pri)].PushBack(job);
+		m_resumedJobCounts[int(pri)].fetch_add(1, std::memory_order_relaxed);
+
+		// This is the "queue ref", same as InsertJobIntoQueue
+		job->IncrementRef();
+	}
 
+	WakeWorkers(1, pri);
+}
+
+bool HeartJobSystem::TryResumeJob(HeartJobPriority lowestPri)
+{
 	for (int i = int(HeartJobPriority::Maximum); i >= int(lowestPri); --i)
 	{
-		auto& q = m_queues[i];
+		if (m_resumedJobCounts[i].load(std::memory_order_relaxed) == 0)
+			continue;
 
-		for (auto iter = q.begin(); iter != q.end(); ++iter)
+		HeartJob* rawJob = nullptr;
 		{
-			HeartJob& job = *iter;
-			if (job.mask & mask)
+			HeartLockGuard lock(m_resumeMutex);
+			rawJob = m_resumedJobs[i].PopFront();
+			if (rawJob != nullptr)
+				m_resumedJobCounts[i].fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		if (rawJob == nullptr)
+			continue;
+
+		// The job's own ProcessOneJob, further up the fiber's stack, holds a ref until it's done
+		HeartJobRef job = AdoptQueueRef(rawJob);
+		HeartFiberWorkUnit* fiber = job->fiber;
+		job->fiber = nullptr;
+		job = nullptr;
+
+		m_fiberSystem->SwitchToHostedUnit(*fiber);
+		return true;
+	}
+
+	return false;
+}
+
+void HeartJobSystem::AddFiberWaiter(HeartFiberWorkUnit* unit, void* waitPointer)
+{
+	// The wait lives on the suspended fiber's stack, which may be resumed (and gone) once the job is submitted
+	FiberWait& wait = *reinterpret_cast<FiberWait*>(waitPointer);
+	HeartJobSystem* system = wait.system;
+
+	HeartJob* waiter = static_cast<HeartJob*>(unit->GetHostData());
+	waiter->fiber = unit;
+
+	// Goes through the same continuations as any other job waiting on a prerequisite, and
+	// once they're done, ReleasePrerequisite sees the fiber and resumes it
+	if (wait.job != nullptr)
+		system->SubmitJobAfter(waiter, std::span<const HeartJobRef>(wait.job, 1));
+	else
+		system->SubmitJobAfter(waiter, *wait.counter);
+}
+
+template <typename F>
+bool HeartJobSystem::ParkWorker(HeartEventCount& idleEvent, HeartJobPriority lowestPriority, F&& isDone)
+{
+	// Anything pushed after this point will notify us, so this final check can't miss a job
+	HeartEventCount::Key key = idleEvent.PrepareWait();
+	if (m_exit.load(std::memory_order_acquire) || HasQueuedJobs(lowestPriority) || isDone())
+	{
+		idleEvent.CancelWait();
+		return false;
+	}
+
+	// The urgent worker can't run most retried jobs, so it never keeps watch over them
+	if (lowestPriority == HeartJobPriority::Normal && m_retryJobCount.load(std::memory_order_seq_cst) != 0)
+	{
+		uint64_t nextTick = m_nextRetryTick.load(std::memory_order_seq_cst);
+		uint64_t noKeeper = NoRetryTick;
+
+		if (nextTick != NoRetryTick && m_retryKeeperTick.compare_exchange_strong(noKeeper, nextTick, std::memory_order_seq_cst))
+		{
+			// RetryJob publishes its deadline before checking ours, so one of us sees the other
+			uint64_t now = GetRetryTick();
+			if (m_nextRetryTick.load(std::memory_order_seq_cst) < nextTick || nextTick <= now)
 			{
-				outPri = HeartJobPriority(i);
-				outJob = RemoveJobFromQueue(q, iter);
-				return true;
+				m_retryKeeperTick.store(NoRetryTick, std::memory_order_seq_cst);
+				idleEvent.CancelWait();
+				PromoteDueRetries();
+				return false;
 			}
+
+			// Round up, so that we don't wake up just before the retry is due
+			uint64_t nanoseconds = (nextTick - now) << RetryTickShift;
+			uint32_t milliseconds = uint32_t(std::min<uint64_t>((nanoseconds + 999999) / 1000000, UINT32_MAX));
+
+			idleEvent.TryWaitFor(key, milliseconds);
+			m_retryKeeperTick.store(NoRetryTick, std::memory_order_seq_cst);
+
+			PromoteDueRetries();
+			return true;
 		}
 	}
 
-	return false;
+	// Parked workers don't take scaling samples, so while there are workers to spare, wake up
+	// now and then to report that we're still idle. Otherwise we'd never scale back down.
+	if (IsScalingEnabled() && lowestPriority == HeartJobPriority::Normal && m_activeWorkerLimit.load(std::memory_order_relaxed) > m_minActiveWorkers)
+	{
+		idleEvent.TryWaitFor(key, (m_scalingInterval + 999) / 1000);
+		return true;
+	}
+
+	idleEvent.Wait(key);
+	return true;
 }
 
-void HeartJobSystem::ProcessOneJob(HeartJobRef job, HeartJobPriority priority)
+void HeartJobSystem::WakeAllWorkers()
 {
-	auto result = job->worker();
-	if (result == HeartJobResult::Success)
+	m_idleEvent.NotifyAll();
+	m_urgentIdleEvent.NotifyAll();
+	m_affineEvent.NotifyAll();
+}
+
+HeartJobSystem::WorkerState* HeartJobSystem::GetCurrentWorkerState()
+{
+	if (m_workerStates == nullptr || t_workerIdentity.system != this)
+		return nullptr;
+
+	return &m_workerStates[t_workerIdentity.index];
+}
+
+void HeartJobSystem::PushJob(HeartJob* rawJob, HeartJobPriority pri)
+{
+	if (rawJob->affine)
 	{
-		job->worker.Clear();
-		job->status = HeartJobStatus::Success;
+		PushAffineJob(rawJob);
+		return;
 	}
-	else if (result == HeartJobResult::Failure)
+
+	// Masked jobs go where a masked acquire can find them; see WorkerState
+	WorkerState* worker = GetCurrentWorkerState();
+	if (worker != nullptr && rawJob->mask == HeartJobMaskDefault)
 	{
-		job->worker.Clear();
-		job->status = HeartJobStatus::Failure;
+		// This is the "queue ref", same as InsertJobIntoQueue
+		rawJob->IncrementRef();
+		if (worker->queues[int(pri)].Push(rawJob))
+		{
+			return;
+		}
+
+		// Our local queue is full, hand the job to everyone instead
+		rawJob->DecrementRef();
 	}
-	else if (result == HeartJobResult::Retry)
+
+	InsertJobIntoQueue(rawJob, pri);
+}
+
+void HeartJobSystem::InsertJobIntoQueue(HeartJob* rawJob, HeartJobPriority pri)
+{
+	if (rawJob->affine)
 	{
-		InsertJobIntoQueue(job.Get(), priority);
-		m_conditionVar.NotifyOne();
+		PushAffineJob(rawJob);
+		return;
 	}
+
+	HeartLockGuard lock(m_queueMutex);
+	m_queues[int(pri)].Push(rawJob);
+	m_queueSizes[int(pri)].fetch_add(1, std::memory_order_relaxed);
+
+	// We manually increment the ref count here. This is the "queue ref"
+	// since the queue itself holds raw pointers, not intrusive pointers
+	rawJob->IncrementRef();
 }
 
-bool HeartJobSystem::TryStealJobWork(HeartJobPriority lowestPriority, uint32_t mask)
+void HeartJobSystem::PushJobs(JobQueue& batch, HeartJobPriority pri, uint32_t mask)
 {
-	HeartJobRef job;
-	HeartJobPriority pri;
+	size_t jobCount = batch.Size();
+	if (jobCount == 0)
+		return;
+
+	WorkerState* worker = GetCurrentWorkerState();
+	if (worker != nullptr && mask == HeartJobMaskDefault)
+	{
+		auto& local = worker->queues[int(pri)];
+
+		// Unlink before pushing; once pushed, a thief could run and free the job at any moment
+		while (HeartJob* job = batch.PopFront())
+		{
+			if (!local.Push(job))
+			{
+				batch.PushFront(job);
+				break;
+			}
+		}
+	}
 
+	if (!batch.IsEmpty())
 	{
 		HeartLockGuard lock(m_queueMutex);
-		if (!TryAcquireOneJob(job, pri, lowestPriority, mask))
-			return false;
+		m_queueSizes[int(pri)].fetch_add(uint32_t(batch.Size()), std::memory_order_relaxed);
+		m_queues[int(pri)].PushBatch(batch, mask);
 	}
 
-	ProcessOneJob(job, pri);
-	return true;
+	WakeWorkers(jobCount, pri);
+}
+
+void HeartJobSystem::PushAffineJob(HeartJob* rawJob)
+{
+	{
+		HeartLockGuard lock(m_affineMutex);
+		m_affineQueue.PushBack(rawJob);
+		m_affineQueueSize.fetch_add(1, std::memory_order_relaxed);
+
+		// This is the "queue ref", same as InsertJobIntoQueue
+		rawJob->IncrementRef();
+	}
+
+	// In case the affine thread is waiting for something in Wait
+	m_affineEvent.Notify();
+}
+
+bool HeartJobSystem::IsAffineThread() const
+{
+	return m_affineThread.load(std::memory_order_relaxed) == &t_affineThreadToken;
+}
+
+uint32_t HeartJobSystem::PumpAffineJobs(uint32_t budgetMicroseconds)
+{
+	HEART_ASSERT(t_workerIdentity.system != this, "Workers cannot be the affine thread!");
+	m_affineThread.store(&t_affineThreadToken, std::memory_order_relaxed);
+
+	if (m_affineQueueSize.load(std::memory_order_relaxed) == 0)
+		return 0;
+
+	// Only take what's already queued, so that jobs which queue more affine jobs can't keep us here forever
+	JobQueue pending;
+	{
+		HeartLockGuard lock(m_affineMutex);
+		pending.SpliceBack(m_affineQueue);
+		m_affineQueueSize.fetch_sub(uint32_t(pending.Size()), std::memory_order_relaxed);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	auto budget = std::chrono::microseconds(budgetMicroseconds);
+	uint32_t jobCount = 0;
+
+	while (HeartJob* job = pending.PopFront())
+	{
+		HeartJobRef strongRef = AdoptQueueRef(job);
+		ProcessOneJob(strongRef, job->priority);
+		++jobCount;
+
+		if (budgetMicroseconds != UINT32_MAX && std::chrono::steady_clock::now() - start >= budget)
+			break;
+	}
+
+	if (!pending.IsEmpty())
+	{
+		// Whatever we didn't get to goes back in front of anything queued since
+		HeartLockGuard lock(m_affineMutex);
+		m_affineQueueSize.fetch_add(uint32_t(pending.Size()), std::memory_order_relaxed);
+		pending.SpliceBack(m_affineQueue);
+		m_affineQueue.SpliceBack(pending);
+	}
+
+	return jobCount;
+}
+
+void HeartJobSystem::SuspendWorker(uint32_t workerIndex)
+{
+	m_suspendedWorkerCount.fetch_add(1, std::memory_order_relaxed);
+
+	// We may have been woken up for a job (or left some in our local queues), or been keeping
+	// watch over the retries, so pass that on to someone who's staying
+	if (HasQueuedJobs() || m_retryJobCount.load(std::memory_order_seq_cst) != 0)
+		WakeWorkers(1, HeartJobPriority::Normal);
+
+	while (true)
+	{
+		HeartEventCount::Key key = m_suspendedEvent.PrepareWait();
+		if (m_exit.load(std::memory_order_acquire) || workerIndex < m_activeWorkerLimit.load(std::memory_order_acquire))
+		{
+			m_suspendedEvent.CancelWait();
+			break;
+		}
+
+		m_suspendedEvent.Wait(key);
+	}
+
+	m_suspendedWorkerCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+uint32_t HeartJobSystem::GetQueuedJobCount()
+{
+	uint32_t count = 0;
+	for (int pri = int(HeartJobPriority::Normal); pri <= int(HeartJobPriority::Maximum); ++pri)
+	{
+		count += m_queueSizes[pri].load(std::memory_order_relaxed);
+		count += m_resumedJobCounts[pri].load(std::memory_order_relaxed);
+
+		for (uint32_t i = 0; i < m_workerStateCount; ++i)
+		{
+			count += m_workerStates[i].queues[pri].Size();
+		}
+	}
+
+	return count;
+}
+
+void HeartJobSystem::UpdateActiveWorkers()
+{
+	uint64_t now = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+
+	// Only one thread takes each sample
+	uint64_t sampleTime = m_nextScalingTime.load(std::memory_order_relaxed);
+	if (now < sampleTime || !m_nextScalingTime.compare_exchange_strong(sampleTime, now + m_scalingInterval, std::memory_order_acq_rel))
+		return;
+
+	uint32_t jobCount = m_scalingJobCount.exchange(0, std::memory_order_relaxed);
+	uint32_t failureCount = m_scalingFailureCount.exchange(0, std::memory_order_relaxed);
+	uint32_t backlog = GetQueuedJobCount();
+	uint32_t activeLimit = m_activeWorkerLimit.load(std::memory_order_relaxed);
+
+	// More jobs waiting than workers to take them means we're falling behind. No backlog, and
+	// workers coming up empty more often than they find something, means we have too many.
+	if (backlog > activeLimit)
+		m_scalingTrend = std::max(m_scalingTrend, 0) + 1;
+	else if (backlog == 0 && failureCount > jobCount)
+		m_scalingTrend = std::min(m_scalingTrend, 0) - 1;
+	else
+		m_scalingTrend = 0;
+
+	if (m_scalingTrend >= ScaleUpSamples && activeLimit < m_maxActiveWorkers)
+	{
+		m_scalingTrend = 0;
+
+		HeartLockGuard lock(m_scalingMutex);
+		SetActiveWorkerLimit(m_activeWorkerLimit.load(std::memory_order_relaxed) + 1);
+	}
+	else if (m_scalingTrend <= -ScaleDownSamples && activeLimit > m_minActiveWorkers)
+	{
+		m_scalingTrend = 0;
+
+		HeartLockGuard lock(m_scalingMutex);
+		SetActiveWorkerLimit(m_activeWorkerLimit.load(std::memory_order_relaxed) - 1);
+	}
+}
+
+void HeartJobSystem::SetActiveWorkerLimit(uint32_t limit)
+{
+	// The cap wins over the minimum, but never over having one worker for Normal jobs
+	uint32_t floor = std::min(m_minActiveWorkers, m_activeWorkerCap);
+	uint32_t ceiling = std::min(m_maxActiveWorkers, m_activeWorkerCap);
+	uint32_t progressFloor = m_maxActiveWorkers > 1 ? 2u : 1u;
+
+	limit = std::clamp(limit, std::max(floor, progressFloor), std::max(ceiling, progressFloor));
+
+	uint32_t oldLimit = m_activeWorkerLimit.exchange(limit, std::memory_order_acq_rel);
+	if (limit > oldLimit)
+	{
+		m_suspendedEvent.NotifyAll();
+	}
+	else if (limit < oldLimit)
+	{
+		// Get idle workers over the limit off the idle event, so that they don't swallow wakeups
+		m_idleEvent.NotifyAll();
+	}
+}
+
+uint32_t HeartJobSystem::GetActiveWorkerCount() const
+{
+	return m_maxActiveWorkers - m_suspendedWorkerCount.load(std::memory_order_relaxed);
+}
+
+void HeartJobSystem::SetActiveWorkerCap(uint32_t cap)
+{
+	HeartLockGuard lock(m_scalingMutex);
+	m_activeWorkerCap = cap;
+
+	// Without scaling, nothing else would ever bring the workers back once the cap is raised
+	uint32_t limit = m_activeWorkerLimit.load(std::memory_order_relaxed);
+	SetActiveWorkerLimit(IsScalingEnabled() ? limit : m_maxActiveWorkers);
+}
+
+HeartEventCount& HeartJobSystem::GetIdleEvent(HeartJobPriority lowestPriority)
+{
+	return lowestPriority == HeartJobPriority::Urgent ? m_urgentIdleEvent : m_idleEvent;
+}
+
+void HeartJobSystem::WakeWorkers(size_t jobCount, HeartJobPriority pri)
+{
+	uint32_t count = uint32_t(std::min<size_t>(jobCount, UINT32_MAX));
+
+	// Urgent jobs go to the dedicated urgent worker first, if it's idle
+	if (pri == HeartJobPriority::Urgent)
+	{
+		uint32_t urgentIdle = m_urgentIdleEvent.GetWaiterCount();
+		m_urgentIdleEvent.Notify(count);
+		count = count > urgentIdle ? count - urgentIdle : 0;
+	}
+
+	// Nobody idle to take the work, so we might need another worker
+	if (IsScalingEnabled() && m_idleEvent.GetWaiterCount() == 0)
+		UpdateActiveWorkers();
+
+	m_idleEvent.Notify(count);
+}
+
+HeartJobRef HeartJobSystem::AdoptQueueRef(HeartJob* rawJob)
+{
+	HeartJobRef strongRef = rawJob;
+
+	// We manually decrement the ref count here. This is the "queue ref"
+	// since the queue itself holds raw pointers, not intrusive pointers.
+	// This must come *after* we assign strongRef above, or else it could
+	// cause the job to be deleted before we return it.
+	rawJob->DecrementRef();
+
+	return strongRef;
+}
+
+HeartJob* HeartJobSystem::TryAcquireSharedJob(HeartJobPriority pri, uint32_t mask)
+{
+	auto& size = m_queueSizes[int(pri)];
+	if (size.load(std::memory_order_relaxed) == 0)
+		return nullptr;
+
+	HeartLockGuard lock(m_queueMutex);
+
+	HeartJob* job = m_queues[int(pri)].Pop(mask);
+	if (job != nullptr)
+	{
+		size.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	return job;
+}
+
+HeartJobSystem::JobQueue& HeartJobSystem::SharedJobQueue::GetQueueForMask(uint32_t mask)
+{
+	// Zero or more than one bit set
+	if (!std::has_single_bit(mask))
+		return m_multiMaskJobs;
+
+	return m_buckets[std::countr_zero(mask)];
+}
+
+void HeartJobSystem::SharedJobQueue::OnJobsAdded(uint32_t mask, uint32_t count)
+{
+	if (std::has_single_bit(mask))
+	{
+		m_occupiedBuckets |= mask;
+		return;
+	}
+
+	m_multiMaskBits |= mask;
+	for (uint32_t bits = mask; bits != 0; bits &= bits - 1)
+	{
+		m_multiMaskBitCounts[std::countr_zero(bits)] += count;
+	}
+}
+
+void HeartJobSystem::SharedJobQueue::OnJobRemoved(uint32_t mask)
+{
+	if (std::has_single_bit(mask))
+	{
+		if (m_buckets[std::countr_zero(mask)].IsEmpty())
+			m_occupiedBuckets &= ~mask;
+
+		return;
+	}
+
+	for (uint32_t bits = mask; bits != 0; bits &= bits - 1)
+	{
+		uint32_t bit = std::countr_zero(bits);
+		if (--m_multiMaskBitCounts[bit] == 0)
+			m_multiMaskBits &= ~(1u << bit);
+	}
+}
+
+void HeartJobSystem::SharedJobQueue::Push(HeartJob* job)
+{
+	job->queueSequence = m_nextSequence++;
+	GetQueueForMask(job->mask).PushBack(job);
+	OnJobsAdded(job->mask, 1);
+}
+
+void HeartJobSystem::SharedJobQueue::PushBatch(JobQueue& batch, uint32_t mask)
+{
+	uint32_t count = uint32_t(batch.Size());
+	for (HeartJob& job : batch)
+	{
+		HEART_ASSERT(job.mask == mask, "Every job in a batch must share a mask!");
+		job.queueSequence = m_nextSequence++;
+	}
+
+	GetQueueForMask(mask).SpliceBack(batch);
+	OnJobsAdded(mask, count);
+}
+
+HeartJob* HeartJobSystem::SharedJobQueue::Pop(uint32_t mask)
+{
+	HeartJob* oldest = nullptr;
+
+	for (uint32_t candidates = m_occupiedBuckets & mask; candidates != 0; candidates &= candidates - 1)
+	{
+		HeartJob* front = m_buckets[std::countr_zero(candidates)].Front();
+		if (oldest == nullptr || front->queueSequence < oldest->queueSequence)
+			oldest = front;
+	}
+
+	if ((m_multiMaskBits & mask) != 0)
+	{
+		for (HeartJob& job : m_multiMaskJobs)
+		{
+			// Everything after this is newer than what we already found
+			if (oldest != nullptr && job.queueSequence > oldest->queueSequence)
+				break;
+
+			if (job.mask & mask)
+			{
+				oldest = &job;
+				break;
+			}
+		}
+	}
+
+	if (oldest != nullptr)
+	{
+		GetQueueForMask(oldest->mask).Remove(oldest);
+		OnJobRemoved(oldest->mask);
+	}
+
+	return oldest;
+}
+
+HeartJob* HeartJobSystem::TryStealLocalJob(HeartJobPriority pri, uint32_t mask, WorkerState* thief)
+{
+	// Local queues only hold default jobs, so any job in them matches if that does
+	if (m_workerStates == nullptr || (mask & HeartJobMaskDefault) == 0)
+		return nullptr;
+
+	// Start with the worker after the thief so that thieves spread out over their victims
+	uint32_t start = thief != nullptr ? uint32_t(thief - m_workerStates) + 1 : 0;
+	for (uint32_t i = 0; i < m_workerStateCount; ++i)
+	{
+		WorkerState& victim = m_workerStates[(start + i) % m_workerStateCount];
+		if (&victim == thief)
+			continue;
+
+		if (HeartJob* job = victim.queues[int(pri)].Steal())
+			return job;
+	}
+
+	return nullptr;
+}
+
+bool HeartJobSystem::HasQueuedJobs(HeartJobPriority lowestPri)
+{
+	for (int pri = int(lowestPri); pri <= int(HeartJobPriority::Maximum); ++pri)
+	{
+		if (m_queueSizes[pri].load(std::memory_order_relaxed) != 0 || m_resumedJobCounts[pri].load(std::memory_order_relaxed) != 0)
+			return true;
+
+		for (uint32_t i = 0; i < m_workerStateCount; ++i)
+		{
+			if (!m_workerStates[i].queues[pri].IsEmpty())
+				return true;
+		}
+	}
+
+	return false;
+}
+
+bool HeartJobSystem::TryAcquireOneJob(HeartJobRef& outJob, HeartJobPriority& outPri, HeartJobPriority lowestPri, uint32_t mask)
+{
+	outJob = nullptr;
+
+	PromoteDueRetries();
+
+	WorkerState* worker = GetCurrentWorkerState();
+
+	for (int i = int(HeartJobPriority::Maximum); i >= int(lowestPri); --i)
+	{
+		HeartJobPriority pri = HeartJobPriority(i);
+		HeartJob* job = nullptr;
+
+		// Our own jobs first, newest first; they're the most likely to be in cache.
+		// They're all default jobs, so there's nothing to look for if the mask excludes those.
+		if (worker != nullptr && (mask & HeartJobMaskDefault) != 0)
+			job = worker->queues[i].Pop();
+
+		if (job == nullptr)
+			job = TryAcquireSharedJob(pri, mask);
+
+		if (job == nullptr)
+			job = TryStealLocalJob(pri, mask, worker);
+
+		if (job != nullptr)
+		{
+			outPri = pri;
+			outJob = AdoptQueueRef(job);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void HeartJobSystem::ProcessOneJob(HeartJobRef job, HeartJobPriority priority)
+{
+#if HEART_JOB_TRACING
+	uint64_t startTime = HeartJobTracer::GetTimestamp();
+#endif
+
+	// Jobs can run other jobs while they wait for something, so keep the outer job's request
+	uint32_t outerRetryDelay = t_retryDelay;
+	t_retryDelay = UseRetryBackoff;
+
+	// Whatever the job suspends on finds it again through its fiber; see ResumeWorkUnit
+	HeartFiberWorkUnit* fiber = nullptr;
+	void* outerJob = nullptr;
+	if (IsOnWorkerFiber())
+	{
+		fiber = HeartFiberContext::GetCurrentWorkUnit();
+		outerJob = fiber->GetHostData();
+		fiber->SetHostData(job.Get());
+	}
+
+	auto result = job->RunWorker();
+
+	if (fiber != nullptr)
+		fiber->SetHostData(outerJob);
+
+	uint32_t retryDelay = t_retryDelay;
+	t_retryDelay = outerRetryDelay;
+
+#if HEART_JOB_TRACING
+	HeartJobTraceEvent event = {};
+	event.label = job->traceLabel;
+	event.enqueueTime = job->traceEnqueueTime;
+	event.startTime = startTime;
+	event.endTime = HeartJobTracer::GetTimestamp();
+	event.workerId = t_workerIdentity.system == this ? t_workerIdentity.index : HeartJobTraceEvent::NotAWorker;
+	event.priority = priority;
+	event.result = result;
+	m_tracer.Record(event);
+#endif
+
+	if (result == HeartJobResult::Success)
+	{
+		job->ClearWorker();
+		job->status = HeartJobStatus::Success;
+		CompleteJob(*job);
+	}
+	else if (result == HeartJobResult::Failure)
+	{
+		job->ClearWorker();
+		job->status = HeartJobStatus::Failure;
+		CompleteJob(*job);
+	}
+	else if (result == HeartJobResult::Retry)
+	{
+		if (retryDelay == UseRetryBackoff)
+		{
+			uint32_t shift = std::min(job->retryCount, 31u);
+			retryDelay = uint32_t(std::min<uint64_t>(uint64_t(m_retryBackoffMin) << shift, m_retryBackoffMax));
+		}
+
+		++job->retryCount;
+
+		if (retryDelay == 0)
+		{
+#if HEART_JOB_TRACING
+			job->traceEnqueueTime = HeartJobTracer::GetTimestamp();
+#endif
+			InsertJobIntoQueue(job.Get(), priority);
+
+			if (!job->affine)
+				WakeWorkers(1, priority);
+		}
+		else
+		{
+			RetryJob(job.Get(), retryDelay);
+		}
+	}
+}
+
+uint64_t HeartJobSystem::GetRetryTick()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()) >> RetryTickShift;
+}
+
+void HeartJobSystem::RetryJob(HeartJob* job, uint32_t delay)
+{
+	// Round the deadline itself up, not just the delay, so that the job is never retried early
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	uint64_t deadline = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()) + uint64_t(delay) * 1000;
+	job->retryDeadline = (deadline + (uint64_t(1) << RetryTickShift) - 1) >> RetryTickShift;
+
+	// The wheel holds a "queue ref", just like the queues
+	job->IncrementRef();
+
+	{
+		HeartLockGuard lock(m_retryMutex);
+		m_retryWheel.Schedule(job);
+
+		if (job->retryDeadline < m_nextRetryTick.load(std::memory_order_relaxed))
+			m_nextRetryTick.store(job->retryDeadline, std::memory_order_seq_cst);
+
+		m_retryJobCount.fetch_add(1, std::memory_order_seq_cst);
+	}
+
+	// Make sure some worker will wake up for this job. If we are a worker that could keep
+	// watch ourselves, we'll do so when we run out of work; otherwise wake somebody up.
+	uint64_t keeperTick = m_retryKeeperTick.load(std::memory_order_seq_cst);
+	if (keeperTick == NoRetryTick)
+	{
+		bool canKeepWatch = t_workerIdentity.system == this && t_workerIdentity.lowestPriority == HeartJobPriority::Normal;
+		if (!canKeepWatch)
+			m_idleEvent.Notify(1);
+	}
+	else if (keeperTick > job->retryDeadline)
+	{
+		// The keeper is oversleeping. We can't wake it alone, but there are rarely many sleepers.
+		m_idleEvent.NotifyAll();
+	}
+}
+
+void HeartJobSystem::PromoteDueRetries()
+{
+	if (m_retryJobCount.load(std::memory_order_relaxed) == 0)
+		return;
+
+	uint64_t now = GetRetryTick();
+	if (now < m_nextRetryTick.load(std::memory_order_acquire))
+		return;
+
+	JobQueue due;
+
+	{
+		// Whoever gets here first can promote everything
+		HeartUniqueLock lock(m_retryMutex, HeartLockMethod::TryLock);
+		if (!lock.OwnsLock())
+			return;
+
+		m_retryWheel.Advance(now, due);
+		m_nextRetryTick.store(m_retryWheel.GetNextTick(), std::memory_order_seq_cst);
+	}
+
+	if (due.IsEmpty())
+		return;
+
+	m_retryJobCount.fetch_sub(uint32_t(due.Size()), std::memory_order_seq_cst);
+
+	uint32_t dueCounts[uint32_t(HeartJobPriority::Count)] = {};
+	while (HeartJob* job = due.PopFront())
+	{
+#if HEART_JOB_TRACING
+		job->traceEnqueueTime = HeartJobTracer::GetTimestamp();
+#endif
+		// A suspended job sleeping in here picks up where it left off, rather than starting again.
+		// Pushing it wakes a worker, and a worker could be running it (and clear fiber) right after.
+		if (job->fiber != nullptr)
+		{
+			PushResumedJob(job);
+		}
+		else
+		{
+			InsertJobIntoQueue(job, job->priority);
+
+			if (!job->affine)
+				dueCounts[uint32_t(job->priority)]++;
+		}
+
+		// The queue took its own ref
+		job->DecrementRef();
+	}
+
+	for (uint32_t pri = 0; pri < uint32_t(HeartJobPriority::Count); ++pri)
+	{
+		if (dueCounts[pri] != 0)
+			WakeWorkers(dueCounts[pri], HeartJobPriority(pri));
+	}
+}
+
+void HeartJobSystem::SetRetryDelay(uint32_t microseconds)
+{
+	t_retryDelay = microseconds;
+}
+
+void HeartJobSystem::CompleteJob(HeartJob& job)
+{
+	// Our status has already been set. Pairs with the flags being set in HelpUntil.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	uint8_t waitFlags = job.waitFlags.load(std::memory_order_relaxed);
+
+	if ((waitFlags & ThreadWaiting) != 0)
+		job.status.notify_all();
+
+	if ((waitFlags & WorkerWaiting) != 0)
+		WakeAllWorkers();
+
+	// Close our continuation list so that anything added from now on sees we're done,
+	// then release everything that was already waiting on us.
+	HeartJobContinuation* continuation = job.continuations.exchange(HeartJob::ClosedContinuations(), std::memory_order_acq_rel);
+	while (continuation != nullptr)
+	{
+		HeartJobContinuation* next = continuation->next;
+		ReleaseContinuation(continuation);
+		continuation = next;
+	}
+
+	if (job.signalCounter != nullptr)
+	{
+		HeartJobCounter* counter = job.signalCounter;
+		job.signalCounter = nullptr;
+
+		counter->Decrement();
+		counter->DecrementRef();
+	}
+}
+
+HeartJobContinuation* HeartJobSystem::CreateContinuation(HeartJob* job)
+{
+	static_assert(sizeof(HeartJobContinuation) <= JobBlockSizes[0]);
+
+	void* block = m_jobAllocator.Allocate(0);
+	HeartJobContinuation* continuation = new (block) HeartJobContinuation();
+	continuation->job = job;
+	continuation->system = this;
+
+	// The continuation keeps the job alive while it is waiting
+	job->IncrementRef();
+
+	return continuation;
+}
+
+void HeartJobSystem::ReleaseContinuation(HeartJobContinuation* continuation)
+{
+	HeartJob* job = continuation->job;
+	continuation->~HeartJobContinuation();
+	m_jobAllocator.Free(continuation, 0);
+
+	ReleasePrerequisite(job);
+	job->DecrementRef();
+}
+
+void HeartJobSystem::ReleasePrerequisite(HeartJob* job)
+{
+	if (job->pendingPrerequisites.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+#if HEART_JOB_TRACING
+		job->traceEnqueueTime = HeartJobTracer::GetTimestamp();
+#endif
+		// A job suspended in Wait carries on from where it was, rather than starting over
+		if (job->fiber != nullptr)
+		{
+			PushResumedJob(job);
+			return;
+		}
+
+		PushJob(job, job->priority);
+
+		if (!job->affine)
+			WakeWorkers(1, job->priority);
+	}
+}
+
+void HeartJobSystem::SubmitJobAfter(HeartJob* job, std::span<const HeartJobRef> prerequisites)
+{
+	// The extra prerequisite is released at the end of this function. It keeps the
+	// job from being queued while we're still adding continuations.
+	job->pendingPrerequisites.store(uint32_t(prerequisites.size()) + 1, std::memory_order_relaxed);
+
+	for (const HeartJobRef& prerequisite : prerequisites)
+	{
+		HeartJobContinuation* continuation = CreateContinuation(job);
+
+		auto& head = prerequisite->continuations;
+		HeartJobContinuation* expected = head.load(std::memory_order_acquire);
+		bool added = false;
+
+		while (expected != HeartJob::ClosedContinuations())
+		{
+			continuation->next = expected;
+			if (head.compare_exchange_weak(expected, continuation, std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				added = true;
+				break;
+			}
+		}
+
+		if (!added)
+		{
+			// The prerequisite already completed
+			ReleaseContinuation(continuation);
+		}
+	}
+
+	ReleasePrerequisite(job);
+}
+
+void HeartJobSystem::SubmitJobAfter(HeartJob* job, HeartJobCounter& counter)
+{
+	job->pendingPrerequisites.store(2, std::memory_order_relaxed);
+
+	HeartJobContinuation* continuation = CreateContinuation(job);
+	if (!counter.AddWaiter(continuation))
+	{
+		ReleaseContinuation(continuation);
+	}
+
+	ReleasePrerequisite(job);
+}
+
+HeartJobCounterRef HeartJobSystem::CreateCounter(uint32_t initialValue)
+{
+	return m_allocator.AllocateAndConstruct<HeartJobCounter>(initialValue, &m_allocator);
+}
+
+bool HeartJobSystem::ShouldSplitWork(HeartJobPriority pri)
+{
+	if (WorkerState* state = GetCurrentWorkerState())
+		return state->queues[uint32_t(pri)].IsEmpty();
+
+	return m_queueSizes[uint32_t(pri)].load(std::memory_order_relaxed) == 0;
+}
+
+size_t HeartJobSystem::GetParallelGrainSize(size_t count) const
+{
+	// Aim for a handful of chunks per worker so that uneven work still balances out,
+	// counting the thread that is waiting on the result as well.
+	const size_t ChunksPerThread = 4;
+	size_t threadCount = m_workerThreads.Size() + 1;
+
+	return std::max<size_t>(count / (threadCount * ChunksPerThread), 1);
+}
+
+template <typename IsDoneF, typename BlockF>
+void HeartJobSystem::HelpUntil(IsDoneF&& isDone, BlockF&& block, std::atomic<uint8_t>& waitFlags, HeartJobPriority lowestPriority, uint32_t mask)
+{
+	bool isWorker = t_workerIdentity.system == this;
+	bool isAffineThread = !isWorker && IsAffineThread();
+
+	while (!isDone())
+	{
+		if (TryStealJobWork(lowestPriority, mask))
+			continue;
+
+		// Nobody else can run our affine jobs, and we might be waiting on one
+		if (isAffineThread && PumpAffineJobs(0) != 0)
+			continue;
+
+		// Set before checking isDone() one last time, so that whoever finishes sees it
+		waitFlags.fetch_or(isWorker || isAffineThread ? WorkerWaiting : ThreadWaiting, std::memory_order_seq_cst);
+
+		if (isWorker)
+		{
+			// Sleeping like any other idle worker means new work wakes us up, so a worker
+			// waiting on a long job doesn't leave its core idle. We only fail to sleep when
+			// there's work we didn't take (eg it's masked out), so give its owner a chance.
+			if (!ParkWorker(GetIdleEvent(t_workerIdentity.lowestPriority), t_workerIdentity.lowestPriority, isDone))
+				HeartYield();
+		}
+		else if (isAffineThread)
+		{
+			HeartEventCount::Key key = m_affineEvent.PrepareWait();
+			if (isDone() || m_affineQueueSize.load(std::memory_order_relaxed) != 0)
+				m_affineEvent.CancelWait();
+			else
+				m_affineEvent.Wait(key);
+		}
+		else if (!isDone())
+		{
+			block();
+		}
+	}
+}
+
+HeartJobStatus HeartJobSystem::Wait(const HeartJobRef& job, HeartJobPriority lowestPriority, uint32_t mask)
+{
+	HEART_ASSERT(job != nullptr);
+
+	std::atomic<HeartJobStatus>& status = job->status;
+
+	if (IsOnWorkerFiber())
+	{
+		if (status.load(std::memory_order_acquire) == HeartJobStatus::Pending)
+		{
+			FiberWait wait = {this, &job, nullptr};
+			HeartFiberContext::Park(&HeartJobSystem::AddFiberWaiter, &wait);
+		}
+
+		return status.load(std::memory_order_acquire);
+	}
+
+	HelpUntil([&status]() { return status.load(std::memory_order_seq_cst) != HeartJobStatus::Pending; },
+		[&status]() { status.wait(HeartJobStatus::Pending, std::memory_order_seq_cst); },
+		job->waitFlags, lowestPriority, mask);
+
+	return status.load(std::memory_order_acquire);
+}
+
+void HeartJobSystem::Wait(HeartJobCounter& counter, HeartJobPriority lowestPriority, uint32_t mask)
+{
+	if (IsOnWorkerFiber())
+	{
+		if (counter.GetValue() != 0)
+		{
+			FiberWait wait = {this, nullptr, &counter};
+			HeartFiberContext::Park(&HeartJobSystem::AddFiberWaiter, &wait);
+		}
+
+		return;
+	}
+
+	if (t_workerIdentity.system == this || IsAffineThread())
+		counter.m_waitingSystem.store(this, std::memory_order_relaxed);
+
+	std::atomic<uint32_t>& value = counter.m_value;
+	HelpUntil([&value]() { return value.load(std::memory_order_seq_cst) == 0; },
+		[&value]() {
+			uint32_t current = value.load(std::memory_order_seq_cst);
+			if (current != 0)
+				value.wait(current, std::memory_order_seq_cst);
+		},
+		counter.m_waitFlags, lowestPriority, mask);
+}
+
+bool HeartJobSystem::TryStealJobWork(HeartJobPriority lowestPriority, uint32_t mask)
+{
+	HeartJobRef job;
+	HeartJobPriority pri;
+
+	if (!TryAcquireOneJob(job, pri, lowestPriority, mask))
+		return false;
+
+	ProcessOneJob(job, pri);
+	return true;
+}
+
+HeartJobCounter::~HeartJobCounter()
+{
+	// Whoever brought us to zero might still be notifying waiters
+	while (m_decrementsInFlight.load(std::memory_order_acquire) != 0)
+	{
+		HeartYield();
+	}
+
+	HEART_ASSERT(m_waiters == nullptr, "HeartJobCounter destroyed while jobs are still waiting on it!");
+}
+
+bool HeartJobCounter::AddWaiter(HeartJobContinuation* waiter)
+{
+	HeartLockGuard lock(m_waitersMutex);
+
+	// Checked under the lock so that we can't slip in after Decrement() has released the waiters
+	if (m_value.load(std::memory_order_acquire) == 0)
+		return false;
+
+	waiter->next = m_waiters;
+	m_waiters = waiter;
+	return true;
+}
+
+void HeartJobCounter::Increment(uint32_t count)
+{
+	m_value.fetch_add(count, std::memory_order_acq_rel);
+}
+
+void HeartJobCounter::Decrement(uint32_t count)
+{
+	m_decrementsInFlight.fetch_add(1, std::memory_order_relaxed);
+
+	uint32_t previous = m_value.fetch_sub(count, std::memory_order_seq_cst);
+	HEART_ASSERT(previous >= count, "HeartJobCounter decremented below zero!");
+
+	if (previous != count)
+	{
+		m_decrementsInFlight.fetch_sub(1, std::memory_order_release);
+		return;
+	}
+
+	HeartJobContinuation* waiters = nullptr;
+	{
+		HeartLockGuard lock(m_waitersMutex);
+		waiters = m_waiters;
+		m_waiters = nullptr;
+	}
+
+	while (waiters != nullptr)
+	{
+		HeartJobContinuation* next = waiters->next;
+		waiters->system->ReleaseContinuation(waiters);
+		waiters = next;
+	}
+
+	// Pairs with the flags being set in HeartJobSystem::HelpUntil
+	uint8_t waitFlags = m_waitFlags.load(std::memory_order_seq_cst);
+
+	if ((waitFlags & HeartJobSystem::ThreadWaiting) != 0)
+		m_value.notify_all();
+
+	if ((waitFlags & HeartJobSystem::WorkerWaiting) != 0)
+	{
+		if (HeartJobSystem* system = m_waitingSystem.load(std::memory_order_relaxed))
+			system->WakeAllWorkers();
+	}
+
+	m_decrementsInFlight.fetch_sub(1, std::memory_order_release);
+}
+
+void HeartJobCounter::DecrementRef() const
+{
+	if (--m_useCount == 0 && m_allocator != nullptr)
+	{
+		m_allocator->DestroyAndFree(this);
+	}
 }
@@ -0,0 +1,106 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/jobs/task.h"
+
+namespace
+{
+	std::atomic<HeartBaseAllocator*> s_defaultTaskAllocator = nullptr;
+
+	HeartJobResult ResumeTask(std::coroutine_handle<> handle)
+	{
+		// The task may well finish, and be destroyed by whoever was waiting on it, in here
+		handle.resume();
+		return HeartJobResult::Success;
+	}
+}
+
+void HeartSetDefaultTaskAllocator(HeartBaseAllocator* allocator)
+{
+	s_defaultTaskAllocator.store(allocator, std::memory_order_release);
+}
+
+HeartBaseAllocator& HeartGetDefaultTaskAllocator()
+{
+	HeartBaseAllocator* allocator = s_defaultTaskAllocator.load(std::memory_order_acquire);
+	return allocator != nullptr ? *allocator : GetHeartDefaultAllocator();
+}
+
+void* heart_priv::HeartTaskPromiseBase::AllocateFrame(size_t size, HeartBaseAllocator& allocator)
+{
+	static_assert(FrameHeaderSize >= sizeof(HeartBaseAllocator*));
+
+	byte_t* block = reinterpret_cast<byte_t*>(allocator.RawAllocate(size + FrameHeaderSize));
+	HEART_ASSERT(block != nullptr, "Failed to allocate a HeartTask frame");
+
+	*reinterpret_cast<HeartBaseAllocator**>(block) = &allocator;
+	return block + FrameHeaderSize;
+}
+
+void* heart_priv::HeartTaskPromiseBase::operator new(size_t size)
+{
+	return AllocateFrame(size, HeartGetDefaultTaskAllocator());
+}
+
+void heart_priv::HeartTaskPromiseBase::operator delete(void* frame, size_t size)
+{
+	byte_t* block = reinterpret_cast<byte_t*>(frame) - FrameHeaderSize;
+	HeartBaseAllocator* allocator = *reinterpret_cast<HeartBaseAllocator**>(block);
+	allocator->RawDeallocate(block, size + FrameHeaderSize);
+}
+
+void heart_priv::HeartTaskPromiseBase::ResumeOnJob(std::coroutine_handle<> handle)
+{
+	HEART_ASSERT(m_system != nullptr, "HeartTask was never started");
+	m_system->EnqueueJob([handle]() { return ResumeTask(handle); }, m_priority);
+}
+
+void heart_priv::HeartTaskPromiseBase::ResumeAfter(std::coroutine_handle<> handle, const HeartJobRef& job)
+{
+	HEART_ASSERT(m_system != nullptr, "HeartTask was never started");
+	m_system->EnqueueJob([handle]() { return ResumeTask(handle); }, {job}, m_priority);
+}
+
+void heart_priv::HeartTaskPromiseBase::ResumeAfter(std::coroutine_handle<> handle, HeartJobCounter& counter)
+{
+	HEART_ASSERT(m_system != nullptr, "HeartTask was never started");
+	m_system->EnqueueJob([handle]() { return ResumeTask(handle); }, counter, m_priority);
+}
+
+std::coroutine_handle<> heart_priv::HeartTaskPromiseBase::Finish() noexcept
+{
+	std::coroutine_handle<> continuation = m_continuation;
+	HeartJobCounter* counter = m_signalCounter;
+
+	// Whoever owns us may destroy us as soon as they see this, so it's the last thing we touch
+	m_done.store(true, std::memory_order_release);
+
+	if (counter != nullptr)
+	{
+		counter->Decrement();
+		counter->DecrementRef();
+	}
+
+	return continuation ? continuation : std::noop_coroutine();
+}
+
+HeartTaskFenceAwaiter::HeartTaskFenceAwaiter(HeartFence& fence, uint32_t r) :
+	m_fence(fence)
+{
+	revision = r;
+	callback = &HeartTaskFenceAwaiter::OnSignalled;
+}
+
+void HeartTaskFenceAwaiter::OnSignalled(HeartFenceWaiter& waiter)
+{
+	HeartTaskFenceAwaiter& self = static_cast<HeartTaskFenceAwaiter&>(waiter);
+	self.m_promise->ResumeOnJob(self.m_handle);
+}
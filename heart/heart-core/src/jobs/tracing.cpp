@@ -0,0 +1,331 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/jobs/tracing.h"
+
+#if HEART_JOB_TRACING
+
+#include "heart/debug/chrome_trace.h"
+#include "heart/jobs/system.h"
+
+#include <bit>
+#include <chrono>
+#include <stdio.h>
+
+static_assert(HeartJobTracer::PriorityCount == uint32_t(HeartJobPriority::Count), "HeartJobTracer::PriorityCount is out of date!");
+
+namespace
+{
+	// Identifies the current thread to every tracer. Only its address is used.
+	thread_local char t_threadToken;
+
+	// The buffer most recently used by this thread, to skip searching for it
+	struct HeartJobTracerBinding
+	{
+		uint64_t tracerId = 0;
+		void* buffer = nullptr;
+	};
+
+	std::atomic<uint64_t> s_nextTracerId = 1;
+
+	thread_local HeartJobTracerBinding t_binding;
+
+	thread_local const char* t_currentLabel = nullptr;
+
+	const char* DefaultLabel = "HeartJob";
+
+	const char* GetPriorityName(HeartJobPriority priority)
+	{
+		switch (priority)
+		{
+		case HeartJobPriority::Normal:
+			return "Normal";
+		case HeartJobPriority::High:
+			return "High";
+		case HeartJobPriority::Urgent:
+			return "Urgent";
+		default:
+			return "Unknown";
+		}
+	}
+
+	const char* GetResultName(HeartJobResult result)
+	{
+		switch (result)
+		{
+		case HeartJobResult::Failure:
+			return "Failure";
+		case HeartJobResult::Success:
+			return "Success";
+		case HeartJobResult::Retry:
+			return "Retry";
+		default:
+			return "Unknown";
+		}
+	}
+}
+
+uint32_t HeartJobTraceHistogram::GetBucket(uint64_t nanoseconds)
+{
+	if (nanoseconds < 2)
+		return 0;
+
+	uint32_t bucket = uint32_t(std::bit_width(nanoseconds) - 1);
+	return bucket < BucketCount ? bucket : BucketCount - 1;
+}
+
+uint64_t HeartJobTraceHistogram::GetBucketLimit(uint32_t bucket)
+{
+	return uint64_t(1) << (bucket + 1);
+}
+
+uint64_t HeartJobTraceHistogram::GetCount() const
+{
+	uint64_t count = 0;
+	for (uint64_t b : buckets)
+	{
+		count += b;
+	}
+
+	return count;
+}
+
+uint64_t HeartJobTraceHistogram::GetPercentile(double percentile) const
+{
+	uint64_t total = GetCount();
+	if (total == 0)
+		return 0;
+
+	uint64_t target = uint64_t(double(total) * percentile / 100.0);
+	uint64_t seen = 0;
+
+	for (uint32_t i = 0; i < BucketCount; ++i)
+	{
+		seen += buckets[i];
+		if (seen > target || seen == total)
+			return GetBucketLimit(i);
+	}
+
+	return GetBucketLimit(BucketCount - 1);
+}
+
+HeartJobTracer::HeartJobTracer(HeartBaseAllocator& allocator, uint32_t eventsPerThread) :
+	m_allocator(allocator),
+	m_eventsPerThread(eventsPerThread),
+	m_startTime(GetTimestamp()),
+	m_id(s_nextTracerId.fetch_add(1, std::memory_order_relaxed))
+{
+}
+
+HeartJobTracer::~HeartJobTracer()
+{
+	ThreadBuffer* buffer = m_buffers.exchange(nullptr);
+	while (buffer != nullptr)
+	{
+		ThreadBuffer* next = buffer->next;
+
+		m_allocator.deallocate(buffer->events, m_eventsPerThread);
+		m_allocator.DestroyAndFree(buffer);
+
+		buffer = next;
+	}
+}
+
+uint64_t HeartJobTracer::GetTimestamp()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+const char* HeartJobTracer::GetCurrentLabel()
+{
+	return t_currentLabel != nullptr ? t_currentLabel : DefaultLabel;
+}
+
+HeartJobTracer::ThreadBuffer* HeartJobTracer::GetThreadBuffer()
+{
+	if (t_binding.tracerId == m_id)
+		return static_cast<ThreadBuffer*>(t_binding.buffer);
+
+	// This thread might have recorded for us before, and then for some other tracer
+	ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire);
+	while (buffer != nullptr && buffer->owner != &t_threadToken)
+	{
+		buffer = buffer->next;
+	}
+
+	if (buffer == nullptr)
+	{
+		buffer = m_allocator.AllocateAndConstruct<ThreadBuffer>();
+		buffer->owner = &t_threadToken;
+		buffer->threadIndex = m_threadCount.fetch_add(1, std::memory_order_relaxed);
+		buffer->events = m_allocator.allocate<HeartJobTraceEvent>(m_eventsPerThread);
+
+		ThreadBuffer* head = m_buffers.load(std::memory_order_relaxed);
+		do
+		{
+			buffer->next = head;
+		} while (!m_buffers.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	t_binding.tracerId = m_id;
+	t_binding.buffer = buffer;
+	return buffer;
+}
+
+void HeartJobTracer::AttachThread(uint32_t workerId)
+{
+	GetThreadBuffer()->workerId = workerId;
+}
+
+void HeartJobTracer::Record(const HeartJobTraceEvent& event)
+{
+	ThreadBuffer* buffer = GetThreadBuffer();
+
+	// We are the only writer, so a plain load and store is enough to keep these readable from other threads
+	auto add = [](std::atomic<uint64_t>& value) {
+		value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	};
+
+	uint32_t pri = uint32_t(event.priority);
+	if (event.startTime >= event.enqueueTime)
+		add(buffer->queueWait[pri][HeartJobTraceHistogram::GetBucket(event.startTime - event.enqueueTime)]);
+
+	add(buffer->runTime[pri][HeartJobTraceHistogram::GetBucket(event.endTime - event.startTime)]);
+
+	uint32_t index = buffer->eventCount.load(std::memory_order_relaxed);
+	if (index >= m_eventsPerThread)
+	{
+		add(buffer->droppedCount);
+		return;
+	}
+
+	buffer->events[index] = event;
+
+	// Publishes the event to readers
+	buffer->eventCount.store(index + 1, std::memory_order_release);
+}
+
+HeartJobTraceHistogram HeartJobTracer::GetHistogram(PriorityHistograms ThreadBuffer::*histograms, HeartJobPriority priority) const
+{
+	HeartJobTraceHistogram result;
+
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		const AtomicHistogram& source = (buffer->*histograms)[uint32_t(priority)];
+		for (uint32_t i = 0; i < HeartJobTraceHistogram::BucketCount; ++i)
+		{
+			result.buckets[i] += source[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	return result;
+}
+
+HeartJobTraceHistogram HeartJobTracer::GetQueueWaitHistogram(HeartJobPriority priority) const
+{
+	return GetHistogram(&ThreadBuffer::queueWait, priority);
+}
+
+HeartJobTraceHistogram HeartJobTracer::GetRunTimeHistogram(HeartJobPriority priority) const
+{
+	return GetHistogram(&ThreadBuffer::runTime, priority);
+}
+
+uint64_t HeartJobTracer::GetEventCount() const
+{
+	uint64_t count = 0;
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		count += buffer->eventCount.load(std::memory_order_acquire);
+	}
+
+	return count;
+}
+
+uint64_t HeartJobTracer::GetDroppedEventCount() const
+{
+	uint64_t count = 0;
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		count += buffer->droppedCount.load(std::memory_order_relaxed);
+	}
+
+	return count;
+}
+
+void HeartJobTracer::Clear()
+{
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		buffer->eventCount.store(0, std::memory_order_relaxed);
+		buffer->droppedCount.store(0, std::memory_order_relaxed);
+
+		for (uint32_t pri = 0; pri < PriorityCount; ++pri)
+		{
+			for (uint32_t i = 0; i < HeartJobTraceHistogram::BucketCount; ++i)
+			{
+				buffer->queueWait[pri][i].store(0, std::memory_order_relaxed);
+				buffer->runTime[pri][i].store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	m_startTime = GetTimestamp();
+}
+
+void HeartJobTracer::ExportChromeTrace(HeartChromeTraceWriter& writer) const
+{
+	auto toMicroseconds = [this](uint64_t timestamp) {
+		return timestamp >= m_startTime ? double(timestamp - m_startTime) / 1000.0 : 0.0;
+	};
+
+	for (ThreadBuffer* buffer = m_buffers.load(std::memory_order_acquire); buffer != nullptr; buffer = buffer->next)
+	{
+		char threadName[64];
+		if (buffer->workerId != HeartJobTraceEvent::NotAWorker)
+			snprintf(threadName, sizeof(threadName), "HeartJobSystem Worker %u", buffer->workerId);
+		else
+			snprintf(threadName, sizeof(threadName), "Thread %u", buffer->threadIndex);
+
+		writer.AddThreadName(buffer->threadIndex, threadName);
+
+		uint32_t count = buffer->eventCount.load(std::memory_order_acquire);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const HeartJobTraceEvent& event = buffer->events[i];
+
+			double start = toMicroseconds(event.startTime);
+			double duration = double(event.endTime - event.startTime) / 1000.0;
+			double queueWait = event.startTime >= event.enqueueTime ? double(event.startTime - event.enqueueTime) / 1000.0 : 0.0;
+
+			writer.AddCompleteEvent(event.label, "job", buffer->threadIndex, start, duration,
+				{
+					{"priority", GetPriorityName(event.priority)},
+					{"result", GetResultName(event.result)},
+					{"queueWaitUs", queueWait},
+				});
+		}
+	}
+}
+
+HeartJobTraceLabelScope::HeartJobTraceLabelScope(const char* label) :
+	m_previous(t_currentLabel)
+{
+	t_currentLabel = label;
+}
+
+HeartJobTraceLabelScope::~HeartJobTraceLabelScope()
+{
+	t_currentLabel = m_previous;
+}
+
+#endif
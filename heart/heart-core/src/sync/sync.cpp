@@ -11,9 +11,17 @@
 */
 #include "heart/sync/condition_variable.h"
 #include "heart/sync/event.h"
+#include "heart/sync/event_count.h"
 #include "heart/sync/fence.h"
 #include "heart/sync/mutex.h"
 
+#include "heart/debug/assert.h"
+#include "heart/fibers/context.h"
+#include "heart/fibers/system.h"
+
+#include <algorithm>
+#include <chrono>
+
 // https://docs.microsoft.com/en-us/archive/msdn-magazine/2012/november/windows-with-c-the-evolution-of-synchronization-in-windows-and-c#slim-readerwriter-lock
 #include "priv/SlimWin32.h"
 
@@ -116,16 +124,64 @@ void HeartMutex::UnlockShared()
 
 void HeartFence::Signal(uint32_t revision)
 {
+	HeartFiberWorkUnit::Queue ready;
+	decltype(m_callbackWaiters) readyCallbacks;
 	{
 		HeartLockGuard lock(m_mutex);
 		m_currentRevision = revision;
+
+		HeartFiberWorkUnit::Queue stillWaiting;
+		while (HeartFiberWorkUnit* unit = m_fiberWaiters.PopFront())
+		{
+			if (unit->m_waitTarget <= revision)
+				ready.PushBack(unit);
+			else
+				stillWaiting.PushBack(unit);
+		}
+
+		m_fiberWaiters.SpliceBack(stillWaiting);
+
+		decltype(m_callbackWaiters) stillWaitingCallbacks;
+		while (HeartFenceWaiter* waiter = m_callbackWaiters.PopFront())
+		{
+			if (waiter->revision <= revision)
+				readyCallbacks.PushBack(waiter);
+			else
+				stillWaitingCallbacks.PushBack(waiter);
+		}
+
+		m_callbackWaiters.SpliceBack(stillWaitingCallbacks);
 	}
 
 	m_cv.NotifyAll();
+
+	while (HeartFiberWorkUnit* unit = ready.PopFront())
+	{
+		HeartFiberSystem::ResumeWorkUnit(*unit);
+	}
+
+	// A waiter may be gone as soon as its callback starts, so take it off the list first
+	while (HeartFenceWaiter* waiter = readyCallbacks.PopFront())
+	{
+		waiter->callback(*waiter);
+	}
 }
 
 void HeartFence::Wait(uint32_t revision)
 {
+	HeartFiberContext& context = HeartFiberContext::Get();
+	if (context.currentWorkUnit != nullptr && context.currentSystem != nullptr)
+	{
+		// Blocking here would stall every other fiber on this thread, so park instead
+		if (!Test(revision))
+		{
+			context.currentWorkUnit->m_waitTarget = revision;
+			HeartFiberContext::Park(&HeartFence::AddFiberWaiter, this);
+		}
+
+		return;
+	}
+
 	HeartLockGuard lock(m_mutex);
 
 	while (m_currentRevision < revision)
@@ -134,51 +190,360 @@ void HeartFence::Wait(uint32_t revision)
 	}
 }
 
+void HeartFence::AddFiberWaiter(HeartFiberWorkUnit* unit, void* fencePointer)
+{
+	HeartFence* fence = reinterpret_cast<HeartFence*>(fencePointer);
+
+	{
+		HeartLockGuard lock(fence->m_mutex);
+		if (fence->m_currentRevision < unit->m_waitTarget)
+		{
+			fence->m_fiberWaiters.PushBack(unit);
+			return;
+		}
+	}
+
+	// Signalled while we were parking
+	HeartFiberSystem::ResumeWorkUnit(*unit);
+}
+
 bool HeartFence::Test(uint32_t revision)
 {
 	HeartLockGuard lock(m_mutex);
 	return m_currentRevision >= revision;
 }
 
-HeartEvent::HeartEvent(ResetType rt)
+bool HeartFence::AddWaiter(HeartFenceWaiter& waiter)
+{
+	HEART_ASSERT(waiter.callback != nullptr);
+
+	HeartLockGuard lock(m_mutex);
+	if (m_currentRevision >= waiter.revision)
+		return false;
+
+	m_callbackWaiters.PushBack(&waiter);
+	return true;
+}
+
+HeartEventCount::Key HeartEventCount::PrepareWait()
+{
+	m_waiters.fetch_add(1, std::memory_order_seq_cst);
+
+	// Pairs with the fence in Notify(). Either the notifier sees us waiting,
+	// or we see whatever it changed before notifying.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	return m_epoch.load(std::memory_order_acquire);
+}
+
+void HeartEventCount::CancelWait()
+{
+	m_waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void HeartEventCount::Wait(Key key)
+{
+	{
+		HeartLockGuard lock(m_mutex);
+
+		while (m_epoch.load(std::memory_order_relaxed) == key)
+		{
+			m_cv.Wait(m_mutex);
+		}
+	}
+
+	m_waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool HeartEventCount::TryWaitFor(Key key, uint32_t milliseconds)
+{
+	bool notified = false;
+
+	{
+		HeartLockGuard lock(m_mutex);
+
+		// A single timed wait; callers re-check their condition anyway, so waking early is harmless
+		if (m_epoch.load(std::memory_order_relaxed) == key)
+			m_cv.TryWaitFor(m_mutex, milliseconds);
+
+		notified = m_epoch.load(std::memory_order_relaxed) != key;
+	}
+
+	m_waiters.fetch_sub(1, std::memory_order_relaxed);
+	return notified;
+}
+
+void HeartEventCount::Notify(uint32_t count)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	uint32_t waiters = m_waiters.load(std::memory_order_relaxed);
+	if (waiters == 0 || count == 0)
+		return;
+
+	{
+		// Bumping the epoch under the lock means a waiter can't check it and then miss our notify
+		HeartLockGuard lock(m_mutex);
+		m_epoch.fetch_add(1, std::memory_order_release);
+	}
+
+	if (count >= waiters)
+	{
+		m_cv.NotifyAll();
+		return;
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		m_cv.NotifyOne();
+	}
+}
+
+void HeartEventCount::NotifyAll()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (m_waiters.load(std::memory_order_relaxed) == 0)
+		return;
+
+	{
+		HeartLockGuard lock(m_mutex);
+		m_epoch.fetch_add(1, std::memory_order_release);
+	}
+
+	m_cv.NotifyAll();
+}
+
+// Lock two events' mutexes in a consistent order, so that two SignalAndWaits on the same pair of
+// events can't deadlock. They can be one and the same, in which case it's only locked once.
+static void LockEventMutexes(HeartMutex& a, HeartMutex& b)
+{
+	HeartMutex* first = &a < &b ? &a : &b;
+	HeartMutex* second = &a < &b ? &b : &a;
+
+	first->LockExclusive();
+	if (second != first)
+		second->LockExclusive();
+}
+
+HeartEvent::HeartEvent(ResetType rt) :
+	m_manualReset(rt == ResetType::Manual)
 {
-	HANDLE& handle = GetNativeHandleAs<HANDLE>();
-	handle = ::CreateEvent(NULL, rt == ResetType::Manual ? TRUE : FALSE, FALSE, NULL);
 }
 
 HeartEvent::~HeartEvent()
 {
-	HANDLE& handle = GetNativeHandleAs<HANDLE>();
-	CloseHandle(handle);
-	handle = NULL;
+	HEART_ASSERT(m_fiberWaiters.IsEmpty(), "A HeartEvent was destroyed while fibers were still waiting on it!");
+}
+
+void HeartEvent::Consume()
+{
+	if (!m_manualReset)
+		m_isSet = false;
 }
 
 void HeartEvent::Set()
 {
-	HANDLE& handle = GetNativeHandleAs<HANDLE>();
-	::SetEvent(handle);
+	HeartFiberWorkUnit::Queue ready;
+	{
+		HeartLockGuard lock(m_mutex);
+		SetLocked(ready);
+	}
+
+	while (HeartFiberWorkUnit* unit = ready.PopFront())
+	{
+		HeartFiberSystem::ResumeWorkUnit(*unit);
+	}
+}
+
+void HeartEvent::SetLocked(HeartFiberWorkUnit::Queue& ready)
+{
+	// An Automatic event hands the signal straight to one fiber, and stays reset
+	bool handedOver = false;
+	while (!handedOver || m_manualReset)
+	{
+		FiberWaiter* waiter = m_fiberWaiters.PopFront();
+		if (waiter == nullptr)
+			break;
+
+		// The waiter is gone as soon as its fiber gets the mutex, so only keep hold of the unit.
+		// A timed waiter whose timer already fired is on its way back, and will find the signal.
+		HeartFiberWorkUnit* unit = waiter->unit;
+		bool resume = waiter->deadline == 0 || HeartFiberSystem::CancelWakeUp(*unit);
+		waiter->signalled = true;
+		handedOver = true;
+
+		if (resume)
+			ready.PushBack(unit);
+	}
+
+	if (m_manualReset || !handedOver)
+		m_isSet = true;
+
+	// Under the mutex, as a woken thread is free to destroy the event once it has returned
+	if (m_manualReset)
+		m_cv.NotifyAll();
+	else if (!handedOver)
+		m_cv.NotifyOne();
 }
 
 void HeartEvent::Reset()
 {
-	HANDLE& handle = GetNativeHandleAs<HANDLE>();
-	::ResetEvent(handle);
+	HeartLockGuard lock(m_mutex);
+	m_isSet = false;
 }
 
 void HeartEvent::Wait()
 {
-	HANDLE& handle = GetNativeHandleAs<HANDLE>();
-	::WaitForSingleObject(handle, INFINITE);
+	HeartFiberContext& context = HeartFiberContext::Get();
+	if (context.currentWorkUnit != nullptr && context.currentSystem != nullptr)
+	{
+		// Blocking here would stall every other fiber on this thread, so park instead
+		WaitOnFiber(context.currentSystem, 0);
+		return;
+	}
+
+	HeartLockGuard lock(m_mutex);
+
+	while (!m_isSet)
+	{
+		m_cv.Wait(m_mutex);
+	}
+
+	Consume();
 }
 
 void HeartEvent::Wait(uint32_t waitDurationMs)
 {
-	HANDLE& handle = GetNativeHandleAs<HANDLE>();
-	::WaitForSingleObject(handle, DWORD(waitDurationMs));
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(waitDurationMs);
+
+	HeartFiberContext& context = HeartFiberContext::Get();
+	if (context.currentWorkUnit != nullptr && context.currentSystem != nullptr)
+	{
+		WaitOnFiber(context.currentSystem, HeartFiberSystem::ToSleepTick(deadline));
+		return;
+	}
+
+	HeartLockGuard lock(m_mutex);
+
+	while (!m_isSet)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now >= deadline)
+			return;
+
+		auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - now);
+		m_cv.TryWaitFor(m_mutex, uint32_t(remaining.count()));
+	}
+
+	Consume();
 }
 
 void HeartEvent::SignalAndWait(HeartEvent& other)
 {
-	HANDLE& handle = GetNativeHandleAs<HANDLE>();
-	::SignalObjectAndWait(GetNativeHandleAs<HANDLE>(), other.GetNativeHandleAs<HANDLE>(), INFINITE, FALSE);
+	HeartFiberContext& context = HeartFiberContext::Get();
+	if (context.currentWorkUnit != nullptr && context.currentSystem != nullptr)
+	{
+		// Set this once the fiber has parked, under the same locks that add it to other's waiters
+		other.WaitOnFiber(context.currentSystem, 0, this);
+		return;
+	}
+
+	HeartFiberWorkUnit::Queue ready;
+	LockEventMutexes(m_mutex, other.m_mutex);
+	SetLocked(ready);
+
+	if (this != &other)
+		m_mutex.Unlock();
+
+	// Other stays locked until the condition variable lets go of it, so no Set can slip in first
+	HeartUniqueLock lock(other.m_mutex, HeartLockMethod::Adopt);
+
+	while (HeartFiberWorkUnit* unit = ready.PopFront())
+	{
+		HeartFiberSystem::ResumeWorkUnit(*unit);
+	}
+
+	while (!other.m_isSet)
+	{
+		other.m_cv.Wait(other.m_mutex);
+	}
+
+	other.Consume();
+}
+
+bool HeartEvent::WaitOnFiber(HeartFiberSystem* system, uint64_t deadline, HeartEvent* signal)
+{
+	FiberWaiter waiter;
+	waiter.event = this;
+	waiter.system = system;
+	waiter.deadline = deadline;
+	waiter.signal = signal;
+
+	// Setting signal has to wait until we're parked
+	if (signal == nullptr)
+	{
+		HeartLockGuard lock(m_mutex);
+		if (m_isSet)
+		{
+			Consume();
+			return true;
+		}
+	}
+
+	HeartFiberContext::Park(&HeartEvent::AddFiberWaiter, &waiter);
+
+	// Whichever of Set and the timer came first resumed us. If it was the timer, nobody
+	// has taken the waiter off the list yet, and Set can't until we let go of the mutex.
+	HeartLockGuard lock(m_mutex);
+	if (!waiter.signalled)
+		m_fiberWaiters.Remove(&waiter);
+
+	return waiter.signalled;
+}
+
+void HeartEvent::AddFiberWaiter(HeartFiberWorkUnit* unit, void* waiterPointer)
+{
+	FiberWaiter* waiter = reinterpret_cast<FiberWaiter*>(waiterPointer);
+	HeartEvent* event = waiter->event;
+	HeartEvent* signal = waiter->signal;
+
+	HeartFiberWorkUnit::Queue ready;
+	if (signal != nullptr)
+	{
+		LockEventMutexes(signal->m_mutex, event->m_mutex);
+		signal->SetLocked(ready);
+
+		if (signal != event)
+			signal->m_mutex.Unlock();
+	}
+	else
+	{
+		event->m_mutex.LockExclusive();
+	}
+
+	{
+		HeartUniqueLock lock(event->m_mutex, HeartLockMethod::Adopt);
+		if (!event->m_isSet)
+		{
+			waiter->unit = unit;
+			event->m_fiberWaiters.PushBack(waiter);
+
+			// Still under the mutex, so that Set can't try to cancel the wake-up before it exists
+			if (waiter->deadline != 0)
+				waiter->system->ScheduleWakeUp(*unit, waiter->deadline);
+		}
+		else
+		{
+			// Set while we were parking
+			event->Consume();
+			waiter->signalled = true;
+			ready.PushBack(unit);
+		}
+	}
+
+	while (HeartFiberWorkUnit* readyUnit = ready.PopFront())
+	{
+		HeartFiberSystem::ResumeWorkUnit(*readyUnit);
+	}
 }
@@ -12,6 +12,7 @@
 #include "heart/thread/thread.h"
 
 #include "heart/debug/assert.h"
+#include "heart/thread/topology.h"
 
 #include <atomic>
 #include <malloc.h>
@@ -120,6 +121,22 @@ void HeartThread::SetName(const char* name)
 	::SetThreadDescription(HANDLE(m_handle), buffer);
 }
 
+bool HeartThread::SetAffinity(const HeartCpuSet& cpus)
+{
+	if (!m_handle)
+		return false;
+
+	uint32_t first = cpus.GetNext();
+	if (first == HeartCpuSet::InvalidCpu)
+		return false;
+
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = WORD(first / 64);
+	affinity.Mask = KAFFINITY(cpus.GetWord(first / 64));
+
+	return ::SetThreadGroupAffinity(HANDLE(m_handle), &affinity, nullptr) != FALSE;
+}
+
 HeartThread::operator bool() const
 {
 	return (m_handle != nullptr);
@@ -0,0 +1,369 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include "heart/thread/topology.h"
+
+#include "heart/allocator.h"
+#include "heart/debug/assert.h"
+
+#include <bit>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+#if defined(_WIN32)
+#include "priv/SlimWin32.h"
+#endif
+
+HeartCpuSet HeartCpuSet::Parse(const char* list)
+{
+	HeartCpuSet result;
+
+	const char* c = list;
+	while (*c != '\0' && *c != '\n')
+	{
+		char* end = nullptr;
+		unsigned long first = strtoul(c, &end, 10);
+		if (end == c)
+			return {};
+
+		unsigned long last = first;
+		c = end;
+
+		if (*c == '-')
+		{
+			++c;
+			last = strtoul(c, &end, 10);
+			if (end == c || last < first)
+				return {};
+
+			c = end;
+		}
+
+		if (last >= MaxCpuCount)
+			return {};
+
+		for (unsigned long cpu = first; cpu <= last; ++cpu)
+		{
+			result.Add(uint32_t(cpu));
+		}
+
+		if (*c == ',')
+			++c;
+		else if (*c != '\0' && *c != '\n')
+			return {};
+	}
+
+	return result;
+}
+
+void HeartCpuSet::Add(uint32_t cpu)
+{
+	HEART_ASSERT(cpu < MaxCpuCount, "CPU index is out of range!");
+	m_words[cpu / 64] |= uint64_t(1) << (cpu % 64);
+}
+
+void HeartCpuSet::Add(const HeartCpuSet& other)
+{
+	for (uint32_t i = 0; i < WordCount; ++i)
+	{
+		m_words[i] |= other.m_words[i];
+	}
+}
+
+void HeartCpuSet::Remove(uint32_t cpu)
+{
+	HEART_ASSERT(cpu < MaxCpuCount, "CPU index is out of range!");
+	m_words[cpu / 64] &= ~(uint64_t(1) << (cpu % 64));
+}
+
+void HeartCpuSet::Intersect(const HeartCpuSet& other)
+{
+	for (uint32_t i = 0; i < WordCount; ++i)
+	{
+		m_words[i] &= other.m_words[i];
+	}
+}
+
+bool HeartCpuSet::Contains(uint32_t cpu) const
+{
+	if (cpu >= MaxCpuCount)
+		return false;
+
+	return (m_words[cpu / 64] & (uint64_t(1) << (cpu % 64))) != 0;
+}
+
+bool HeartCpuSet::IsEmpty() const
+{
+	for (uint64_t word : m_words)
+	{
+		if (word != 0)
+			return false;
+	}
+
+	return true;
+}
+
+uint32_t HeartCpuSet::GetCount() const
+{
+	uint32_t count = 0;
+	for (uint64_t word : m_words)
+	{
+		count += uint32_t(std::popcount(word));
+	}
+
+	return count;
+}
+
+uint32_t HeartCpuSet::GetNext(uint32_t start) const
+{
+	for (uint32_t i = start / 64; i < WordCount; ++i)
+	{
+		uint64_t word = m_words[i];
+
+		// Ignore the CPUs before start in its own word
+		if (i == start / 64)
+			word &= ~uint64_t(0) << (start % 64);
+
+		if (word != 0)
+			return i * 64 + uint32_t(std::countr_zero(word));
+	}
+
+	return InvalidCpu;
+}
+
+uint32_t HeartCpuSet::GetNth(uint32_t n) const
+{
+	for (uint32_t cpu = GetNext(0); cpu != InvalidCpu; cpu = GetNext(cpu + 1))
+	{
+		if (n-- == 0)
+			return cpu;
+	}
+
+	return InvalidCpu;
+}
+
+bool operator==(const HeartCpuSet& a, const HeartCpuSet& b)
+{
+	for (uint32_t i = 0; i < HeartCpuSet::WordCount; ++i)
+	{
+		if (a.m_words[i] != b.m_words[i])
+			return false;
+	}
+
+	return true;
+}
+
+void HeartCpuTopology::AddCore(uint32_t package, const HeartCpuSet& cpus)
+{
+	HEART_ASSERT(m_coreCount < MaxCoreCount, "Too many cores!");
+	HEART_ASSERT(!cpus.IsEmpty(), "A core must have at least one CPU!");
+
+	Core& core = m_cores[m_coreCount++];
+	core.cpus = cpus;
+	core.package = package;
+
+	m_allCpus.Add(cpus);
+	if (package >= m_packageCount)
+		m_packageCount = package + 1;
+}
+
+uint32_t HeartCpuTopology::FindCore(uint32_t cpu) const
+{
+	for (uint32_t i = 0; i < m_coreCount; ++i)
+	{
+		if (m_cores[i].cpus.Contains(cpu))
+			return i;
+	}
+
+	return HeartCpuSet::InvalidCpu;
+}
+
+namespace
+{
+	// Every logical CPU is its own core, in one package
+	void DetectFallbackTopology(HeartCpuTopology& topology)
+	{
+		uint32_t count = std::thread::hardware_concurrency();
+		count = count == 0 ? 1 : (count > HeartCpuSet::MaxCpuCount ? HeartCpuSet::MaxCpuCount : count);
+
+		for (uint32_t cpu = 0; cpu < count; ++cpu)
+		{
+			HeartCpuSet cpus;
+			cpus.Add(cpu);
+			topology.AddCore(0, cpus);
+		}
+	}
+
+#if defined(_WIN32)
+	bool DetectPlatformTopology(HeartCpuTopology& topology)
+	{
+		DWORD length = 0;
+		GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+		if (GetLastError() != ERROR_INSUFFICIENT_BUFFER || length == 0)
+			return false;
+
+		HeartBaseAllocator& allocator = GetHeartDefaultAllocator();
+		byte_t* buffer = allocator.allocate<byte_t>(length);
+
+		auto toCpuSet = [](const GROUP_AFFINITY* masks, WORD count) {
+			HeartCpuSet cpus;
+			for (WORD i = 0; i < count; ++i)
+			{
+				for (uint64_t bits = masks[i].Mask; bits != 0; bits &= bits - 1)
+				{
+					uint32_t cpu = uint32_t(masks[i].Group) * 64 + uint32_t(std::countr_zero(bits));
+					if (cpu < HeartCpuSet::MaxCpuCount)
+						cpus.Add(cpu);
+				}
+			}
+
+			return cpus;
+		};
+
+		bool success = false;
+		if (GetLogicalProcessorInformationEx(RelationAll, reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer), &length))
+		{
+			// Packages first, so that cores can look up which one they belong to
+			HeartCpuSet packages[HeartCpuTopology::MaxCoreCount];
+			uint32_t packageCount = 0;
+
+			for (DWORD offset = 0; offset < length;)
+			{
+				auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer + offset);
+				if (info->Relationship == RelationProcessorPackage && packageCount < HeartCpuTopology::MaxCoreCount)
+					packages[packageCount++] = toCpuSet(info->Processor.GroupMask, info->Processor.GroupCount);
+
+				offset += info->Size;
+			}
+
+			for (DWORD offset = 0; offset < length;)
+			{
+				auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer + offset);
+				if (info->Relationship == RelationProcessorCore)
+				{
+					HeartCpuSet cpus = toCpuSet(info->Processor.GroupMask, info->Processor.GroupCount);
+
+					uint32_t package = 0;
+					while (package < packageCount && !packages[package].Contains(cpus.GetNext()))
+					{
+						++package;
+					}
+
+					if (!cpus.IsEmpty() && topology.GetCoreCount() < HeartCpuTopology::MaxCoreCount)
+						topology.AddCore(package < packageCount ? package : 0, cpus);
+				}
+
+				offset += info->Size;
+			}
+
+			success = topology.GetCoreCount() > 0;
+		}
+
+		allocator.deallocate(buffer, length);
+		return success;
+	}
+#elif defined(__linux__)
+	// Read the first line of a file in /sys into buffer
+	bool ReadSysfsLine(const char* path, char* buffer, int size)
+	{
+		FILE* file = fopen(path, "r");
+		if (file == nullptr)
+			return false;
+
+		bool success = fgets(buffer, size, file) != nullptr;
+		fclose(file);
+		return success;
+	}
+
+	bool DetectPlatformTopology(HeartCpuTopology& topology)
+	{
+		char line[1024];
+		char path[128];
+
+		if (!ReadSysfsLine("/sys/devices/system/cpu/online", line, sizeof(line)))
+			return false;
+
+		HeartCpuSet online = HeartCpuSet::Parse(line);
+		if (online.IsEmpty())
+			return false;
+
+		// physical_package_id can be sparse, so packages are renumbered in the order we find them
+		uint32_t packageIds[HeartCpuTopology::MaxCoreCount];
+		uint32_t packageCount = 0;
+
+		HeartCpuSet assigned;
+		for (uint32_t cpu = online.GetNext(); cpu != HeartCpuSet::InvalidCpu; cpu = online.GetNext(cpu + 1))
+		{
+			if (assigned.Contains(cpu))
+				continue;
+
+			// The SMT siblings of this CPU, including itself. Only the online ones matter.
+			HeartCpuSet cpus;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+			if (ReadSysfsLine(path, line, sizeof(line)))
+			{
+				HeartCpuSet siblings = HeartCpuSet::Parse(line);
+				for (uint32_t sibling = siblings.GetNext(); sibling != HeartCpuSet::InvalidCpu; sibling = siblings.GetNext(sibling + 1))
+				{
+					if (online.Contains(sibling) && !assigned.Contains(sibling))
+						cpus.Add(sibling);
+				}
+			}
+
+			if (!cpus.Contains(cpu))
+				cpus.Add(cpu);
+
+			uint32_t packageId = 0;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+			if (ReadSysfsLine(path, line, sizeof(line)))
+				packageId = uint32_t(strtoul(line, nullptr, 10));
+
+			uint32_t package = 0;
+			while (package < packageCount && packageIds[package] != packageId)
+			{
+				++package;
+			}
+
+			if (package == packageCount)
+				packageIds[packageCount++] = packageId;
+
+			assigned.Add(cpus);
+			topology.AddCore(package, cpus);
+		}
+
+		return topology.GetCoreCount() > 0;
+	}
+#else
+	bool DetectPlatformTopology(HeartCpuTopology&)
+	{
+		return false;
+	}
+#endif
+}
+
+HeartCpuTopology HeartCpuTopology::Detect()
+{
+	HeartCpuTopology topology;
+	if (!DetectPlatformTopology(topology))
+	{
+		topology = {};
+		DetectFallbackTopology(topology);
+	}
+
+	return topology;
+}
+
+const HeartCpuTopology& HeartCpuTopology::Get()
+{
+	static const HeartCpuTopology s_topology = Detect();
+	return s_topology;
+}
@@ -0,0 +1,272 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/sync/event.h>
+
+#include <heart/fibers/context.h>
+#include <heart/fibers/result.h>
+#include <heart/fibers/system.h>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+TEST(HeartEvent, AutomaticReset)
+{
+	HeartEvent event(HeartEvent::ResetType::Automatic);
+	std::atomic_int wakeCount = 0;
+
+	auto t = std::thread([&]() {
+		event.Wait();
+		wakeCount++;
+		event.Wait();
+		wakeCount++;
+	});
+
+	event.Set();
+	while (wakeCount < 1)
+		std::this_thread::yield();
+
+	// The first Set was used up by the first Wait
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_EQ(wakeCount, 1);
+
+	event.Set();
+	t.join();
+	EXPECT_EQ(wakeCount, 2);
+
+	// Nobody waiting, so the event stays set until someone takes it
+	event.Set();
+	event.Wait();
+}
+
+TEST(HeartEvent, ManualReset)
+{
+	HeartEvent event(HeartEvent::ResetType::Manual);
+
+	event.Set();
+	event.Wait();
+	event.Wait();
+
+	event.Reset();
+	auto begin = std::chrono::steady_clock::now();
+	event.Wait(10);
+	EXPECT_GE(std::chrono::steady_clock::now() - begin, std::chrono::milliseconds(10));
+}
+
+TEST(HeartEvent, FiberWait)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	HeartEvent event(HeartEvent::ResetType::Manual);
+	std::atomic_int wakeCount = 0;
+	bool setBeforeWake = false;
+	std::atomic_bool set = false;
+
+	// Both park on the event rather than blocking the only fiber thread
+	for (int i = 0; i < 2; ++i)
+	{
+		system.EnqueueWork([&]() {
+			event.Wait();
+			setBeforeWake = set;
+			wakeCount++;
+			return HeartFiberResult::Success;
+		});
+	}
+
+	system.EnqueueWork([&]() {
+		set = true;
+		event.Set();
+		return HeartFiberResult::Success;
+	});
+
+	system.Shutdown();
+
+	EXPECT_EQ(wakeCount, 2);
+	EXPECT_TRUE(setBeforeWake);
+}
+
+TEST(HeartEvent, FiberTimedWait)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	HeartEvent neverSet(HeartEvent::ResetType::Automatic);
+	HeartEvent event(HeartEvent::ResetType::Automatic);
+	std::chrono::steady_clock::duration timedOut = {};
+	std::chrono::steady_clock::duration signalled = {};
+	std::atomic_bool waiting = false;
+
+	// Runs out of time
+	system.EnqueueWork([&]() {
+		auto begin = std::chrono::steady_clock::now();
+		neverSet.Wait(10);
+		timedOut = std::chrono::steady_clock::now() - begin;
+		return HeartFiberResult::Success;
+	});
+
+	// Gets woken by Set long before its time is up
+	system.EnqueueWork([&]() {
+		auto begin = std::chrono::steady_clock::now();
+		waiting = true;
+		event.Wait(60000);
+		signalled = std::chrono::steady_clock::now() - begin;
+		return HeartFiberResult::Success;
+	});
+
+	system.EnqueueWork([&]() {
+		while (!waiting)
+			HeartFiberContext::Yield();
+
+		HeartFiberContext::SleepFor(2000);
+		event.Set();
+		return HeartFiberResult::Success;
+	});
+
+	system.Shutdown();
+
+	EXPECT_GE(timedOut, std::chrono::milliseconds(10));
+	EXPECT_LT(signalled, std::chrono::seconds(10));
+
+	// The waiter took the signal, so the event is back to reset
+	auto begin = std::chrono::steady_clock::now();
+	event.Wait(5);
+	EXPECT_GE(std::chrono::steady_clock::now() - begin, std::chrono::milliseconds(5));
+}
+
+TEST(HeartEvent, FiberTimedWaitRace)
+{
+	const int UnitCount = 32;
+	const int WaitCount = 50;
+
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 4;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	// Sets land around the waiters' deadlines, so Set and the timer race for each of them
+	HeartEvent event(HeartEvent::ResetType::Automatic);
+	std::atomic_int doneCount = 0;
+
+	for (int i = 0; i < UnitCount; ++i)
+	{
+		system.EnqueueWork([&]() {
+			for (int j = 0; j < WaitCount; ++j)
+			{
+				event.Wait(1);
+			}
+
+			doneCount++;
+			return HeartFiberResult::Success;
+		});
+	}
+
+	while (doneCount < UnitCount)
+	{
+		event.Set();
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+
+	system.Shutdown();
+	EXPECT_EQ(doneCount, UnitCount);
+}
+
+TEST(HeartEvent, DestroyAfterWait)
+{
+	// The waiter frees the event as soon as it wakes, while Set may still be returning
+	for (int i = 0; i < 200; ++i)
+	{
+		auto event = std::make_unique<HeartEvent>(i % 2 == 0 ? HeartEvent::ResetType::Manual : HeartEvent::ResetType::Automatic);
+		HeartEvent* raw = event.get();
+
+		auto t = std::thread([raw]() { raw->Set(); });
+
+		event->Wait();
+		event.reset();
+
+		t.join();
+	}
+}
+
+TEST(HeartEvent, SignalAndWait)
+{
+	const int RoundCount = 1000;
+
+	HeartEvent ping(HeartEvent::ResetType::Automatic);
+	HeartEvent pong(HeartEvent::ResetType::Automatic);
+	int count = 0;
+
+	auto t = std::thread([&]() {
+		for (int i = 0; i < RoundCount; ++i)
+		{
+			ping.Wait();
+			count++;
+			pong.Set();
+		}
+	});
+
+	// Each round only carries on once the other side has answered
+	for (int i = 0; i < RoundCount; ++i)
+	{
+		ping.SignalAndWait(pong);
+		EXPECT_EQ(count, i + 1);
+	}
+
+	t.join();
+}
+
+TEST(HeartEvent, FiberSignalAndWait)
+{
+	const int RoundCount = 1000;
+
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 2;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	HeartEvent ping(HeartEvent::ResetType::Automatic);
+	HeartEvent pong(HeartEvent::ResetType::Automatic);
+	std::atomic_int count = 0;
+	std::atomic_int mismatches = 0;
+
+	system.EnqueueWork([&]() {
+		for (int i = 0; i < RoundCount; ++i)
+		{
+			ping.SignalAndWait(pong);
+			if (count != i + 1)
+				mismatches++;
+		}
+
+		return HeartFiberResult::Success;
+	});
+
+	system.EnqueueWork([&]() {
+		for (int i = 0; i < RoundCount; ++i)
+		{
+			ping.Wait();
+			count++;
+			pong.Set();
+		}
+
+		return HeartFiberResult::Success;
+	});
+
+	system.Shutdown();
+
+	EXPECT_EQ(count, RoundCount);
+	EXPECT_EQ(mismatches, 0);
+}
@@ -0,0 +1,120 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/sync/event_count.h>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+TEST(HeartEventCount, NotifyBeforeWait)
+{
+	HeartEventCount eventCount;
+
+	// A notify between PrepareWait and Wait must not be lost
+	HeartEventCount::Key key = eventCount.PrepareWait();
+	EXPECT_EQ(eventCount.GetWaiterCount(), 1);
+
+	eventCount.Notify();
+	eventCount.Wait(key);
+
+	EXPECT_EQ(eventCount.GetWaiterCount(), 0);
+}
+
+TEST(HeartEventCount, CancelWait)
+{
+	HeartEventCount eventCount;
+
+	eventCount.PrepareWait();
+	eventCount.CancelWait();
+	EXPECT_EQ(eventCount.GetWaiterCount(), 0);
+
+	// Nobody is waiting, so this shouldn't do anything
+	eventCount.Notify();
+}
+
+TEST(HeartEventCount, ProducerConsumer)
+{
+	const int ItemCount = 20000;
+	const int ConsumerCount = 4;
+
+	HeartEventCount eventCount;
+	std::atomic_int available = 0;
+	std::atomic_int consumed = 0;
+	std::atomic_bool done = false;
+
+	auto tryConsume = [&]() {
+		int current = available.load();
+		while (current > 0)
+		{
+			if (available.compare_exchange_weak(current, current - 1))
+				return true;
+		}
+
+		return false;
+	};
+
+	std::vector<std::thread> consumers;
+	for (int i = 0; i < ConsumerCount; ++i)
+	{
+		consumers.emplace_back([&]() {
+			while (true)
+			{
+				if (tryConsume())
+				{
+					consumed++;
+					continue;
+				}
+
+				HeartEventCount::Key key = eventCount.PrepareWait();
+				if (available.load() > 0 || done)
+				{
+					eventCount.CancelWait();
+					if (done && available.load() == 0)
+						break;
+
+					continue;
+				}
+
+				eventCount.Wait(key);
+			}
+		});
+	}
+
+	for (int i = 0; i < ItemCount; ++i)
+	{
+		available++;
+		eventCount.Notify();
+
+		if ((i % 1000) == 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	while (consumed < ItemCount)
+	{
+		std::this_thread::yield();
+	}
+
+	done = true;
+	eventCount.NotifyAll();
+
+	for (auto& t : consumers)
+	{
+		t.join();
+	}
+
+	EXPECT_EQ(consumed.load(), ItemCount);
+}
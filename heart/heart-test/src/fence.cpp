@@ -11,6 +11,9 @@
 */
 #include <heart/sync/fence.h>
 
+#include <heart/fibers/result.h>
+#include <heart/fibers/system.h>
+
 #include <gtest/gtest.h>
 
 #include <thread>
@@ -45,3 +48,32 @@ TEST(HeartFence, Synchronization)
 
 	t.join();
 }
+
+TEST(HeartFence, FiberWait)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	HeartFence fence;
+	bool signalledBeforeWake = false;
+	std::atomic_bool signalled = false;
+
+	system.EnqueueWork([&]() {
+		fence.Wait(2);
+		signalledBeforeWake = signalled;
+		return HeartFiberResult::Success;
+	});
+
+	// Shares the only fiber thread with the waiter, so the waiter mustn't be blocking it
+	system.EnqueueWork([&]() {
+		fence.Signal(1);
+		signalled = true;
+		fence.Signal(2);
+		return HeartFiberResult::Success;
+	});
+
+	system.Shutdown();
+
+	EXPECT_TRUE(signalledBeforeWake);
+	EXPECT_TRUE(fence.Test(2));
+}
@@ -0,0 +1,174 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/debug/chrome_trace.h>
+#include <heart/fibers/context.h>
+#include <heart/fibers/result.h>
+#include <heart/fibers/system.h>
+#include <heart/fibers/tracing.h>
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#if HEART_FIBER_TRACING
+
+TEST(HeartFiberTracer, UnitTimes)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	HeartFiberWorkUnitRef sleeper = system.EnqueueWork([]() {
+		HeartFiberContext::Yield();
+		HeartFiberContext::SleepFor(10000);
+		return HeartFiberResult::Success;
+	});
+
+	HeartFiberWorkUnitRef other = system.EnqueueWork([]() {
+		return HeartFiberResult::Success;
+	});
+
+	system.Shutdown();
+
+	// 10ms asleep, with nothing else to run for most of it
+	const HeartFiberUnitTimes& times = sleeper->GetTraceTimes();
+	EXPECT_GE(times.parked, 10000000u);
+	EXPECT_GT(times.running, 0u);
+	EXPECT_GT(times.runnable, 0u);
+	EXPECT_EQ(other->GetTraceTimes().parked, 0u);
+
+	HeartFiberTracer& tracer = system.GetTracer();
+	HeartFiberTraceStats totals = tracer.GetTotals();
+	EXPECT_EQ(totals.completedUnitCount, 2u);
+	EXPECT_EQ(totals.completedUnitTimes.parked, times.parked);
+	EXPECT_GE(totals.idleTime, 5000000u);
+	EXPECT_GT(totals.idleCount, 0u);
+
+	// Into the sleeper three times, the other once, and back to the pump after each
+	EXPECT_GE(totals.switchCount, 8u);
+	EXPECT_GE(totals.runTime, totals.completedUnitTimes.running);
+
+	// The pump's thread, and ours (for enqueueing)
+	HeartFiberTraceStats stats[4];
+	ASSERT_EQ(tracer.GetThreadStats(stats, 4), 2u);
+
+	uint32_t pumps = 0;
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		if (stats[i].pumpIndex == HeartFiberTraceStats::NotAPump)
+		{
+			EXPECT_EQ(stats[i].switchCount, 0u);
+			continue;
+		}
+
+		EXPECT_EQ(stats[i].pumpIndex, 0u);
+		EXPECT_EQ(stats[i].switchCount, totals.switchCount);
+		++pumps;
+	}
+
+	EXPECT_EQ(pumps, 1u);
+
+	// Events are opt in
+	EXPECT_EQ(tracer.GetEventCount(), 0u);
+
+	tracer.Clear();
+	EXPECT_EQ(tracer.GetTotals().switchCount, 0u);
+	EXPECT_EQ(tracer.GetTotals().completedUnitCount, 0u);
+}
+
+TEST(HeartFiberTracer, LongSleepIdlesOnce)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	system.EnqueueWork([]() {
+		HeartFiberContext::SleepFor(50000);
+		return HeartFiberResult::Success;
+	});
+
+	system.Shutdown();
+
+	// The pump waits out the whole sleep in one go, rather than waking up to check on it.
+	// Allow for a spurious wake-up or two, and for the wait coming back a touch early.
+	HeartFiberTraceStats totals = system.GetTracer().GetTotals();
+	EXPECT_GE(totals.idleTime, 40000000u);
+	EXPECT_LE(totals.idleCount, 5u);
+}
+
+TEST(HeartFiberTracer, StackCounts)
+{
+	const int UnitCount = 200;
+
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 2;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	for (int i = 0; i < UnitCount; ++i)
+	{
+		// Only some yield, so that the rest finish before the next one needs a stack
+		system.EnqueueWork(
+			[i]() {
+				if (i % 4 == 0)
+					HeartFiberContext::Yield();
+
+				return HeartFiberResult::Success;
+			},
+			i % 2 == 0 ? HeartFiberStackClass::Small : HeartFiberStackClass::Large);
+	}
+
+	system.Shutdown();
+
+	HeartFiberTraceStats totals = system.GetTracer().GetTotals();
+	EXPECT_EQ(totals.completedUnitCount, UnitCount);
+
+	// Every work unit (and pump) gave its stack back, and every stack was freed in the end
+	EXPECT_EQ(totals.stacksReleased, totals.stacksAllocated + totals.stacksReused);
+	EXPECT_EQ(totals.stacksFreed, totals.stacksAllocated);
+	EXPECT_GE(totals.stacksAllocated + totals.stacksReused, UnitCount + 2);
+	EXPECT_GT(totals.stacksReused, 0u);
+}
+
+TEST(HeartFiberTracer, ExportChromeTrace)
+{
+	const int UnitCount = 16;
+
+	HeartFiberSystem system;
+	system.GetTracer().SetEventsEnabled(true);
+	system.Initialize({});
+
+	for (int i = 0; i < UnitCount; ++i)
+	{
+		system.EnqueueWork([]() {
+			HeartFiberContext::Yield();
+			return HeartFiberResult::Success;
+		});
+	}
+
+	system.Shutdown();
+
+	// One for each time a unit ran
+	HeartFiberTracer& tracer = system.GetTracer();
+	EXPECT_GE(tracer.GetEventCount(), UnitCount * 2);
+	EXPECT_EQ(tracer.GetDroppedEventCount(), 0u);
+
+	HeartChromeTraceWriter writer;
+	tracer.ExportChromeTrace(writer);
+	writer.Finish();
+
+	std::string json(writer.GetData(), writer.GetSize());
+	EXPECT_NE(json.find("\"name\":\"Fiber\""), std::string::npos);
+	EXPECT_NE(json.find("\"unit\":1"), std::string::npos);
+	EXPECT_NE(json.find("HeartFiber Thread 1"), std::string::npos);
+}
+
+#endif
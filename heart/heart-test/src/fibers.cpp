@@ -9,9 +9,12 @@
 * https://github.com/growlitheharpo/heart-engine-playground
 *
 */
+#include <heart/fibers/abi_context.h>
 #include <heart/fibers/context.h>
+#include <heart/fibers/counter.h>
 #include <heart/fibers/mutex.h>
 #include <heart/fibers/result.h>
+#include <heart/fibers/stack_provider.h>
 #include <heart/fibers/system.h>
 
 #include <heart/sync/mutex.h>
@@ -20,10 +23,13 @@
 
 #include "utils/tracking_allocator.h"
 
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+#include <xmmintrin.h>
+
 TEST(Fibers, BasicStartupShutdown)
 {
 	HeartFiberSystem system;
@@ -143,6 +149,40 @@ TEST(Fibers, Requeue)
 	EXPECT_EQ(counter, 5);
 }
 
+TEST(Fibers, RequeueReusesWorkUnit)
+{
+	TestTrackingAllocator allocator;
+
+	{
+		HeartFiberSystem system(allocator);
+		system.Initialize({});
+
+		// Like a game's main loop; retrying shouldn't allocate anything once it's running
+		int32_t counter = 0;
+		uint64_t allocatedCounts[8] = {};
+		HeartFiberWorkUnitRef unit = system.EnqueueWork([&]() {
+			allocatedCounts[counter] = allocator.m_allocatedCount;
+			return ++counter < 8 ? HeartFiberResult::Retry : HeartFiberResult::Success;
+		});
+
+		while (unit->GetStatus() == HeartFiberWorkUnitStatus::Pending)
+			std::this_thread::yield();
+
+		EXPECT_EQ(unit->GetStatus(), HeartFiberWorkUnitStatus::Success);
+		EXPECT_EQ(counter, 8);
+
+		for (uint64_t allocatedCount : allocatedCounts)
+		{
+			EXPECT_EQ(allocatedCount, allocatedCounts[0]);
+		}
+
+		unit = nullptr;
+		system.Shutdown();
+	}
+
+	EXPECT_EQ(allocator.m_allocatedCount, 0);
+}
+
 TEST(Fibers, FourThreads)
 {
 	HeartFiberSystem::Settings settings;
@@ -188,6 +228,335 @@ TEST(Fibers, FourThreads)
 	system.Shutdown();
 }
 
+TEST(Fibers, WorkStealing)
+{
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 4;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	const int JobCount = 64;
+	std::atomic_int doneCount = 0;
+
+	std::mutex threadIdsMutex;
+	std::vector<std::thread::id> threadIds;
+
+	// Everything is enqueued from one fiber, so it all lands in that thread's run queue.
+	// The other threads only get a look in by stealing.
+	system.EnqueueWork([&]() {
+		for (int i = 0; i < JobCount; ++i)
+		{
+			system.EnqueueWork([&]() {
+				{
+					std::lock_guard lock(threadIdsMutex);
+					if (std::find(threadIds.begin(), threadIds.end(), std::this_thread::get_id()) == threadIds.end())
+					{
+						threadIds.push_back(std::this_thread::get_id());
+					}
+				}
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				doneCount++;
+
+				return HeartFiberResult::Success;
+			});
+		}
+
+		return HeartFiberResult::Success;
+	});
+
+	while (doneCount < JobCount)
+		std::this_thread::yield();
+
+	EXPECT_GT(threadIds.size(), 1);
+
+	system.Shutdown();
+}
+
+TEST(Fibers, SleepFor)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	std::atomic_bool otherFinished = false;
+	bool otherFinishedFirst = false;
+	std::chrono::steady_clock::duration slept = {};
+
+	system.EnqueueWork([&]() {
+		auto begin = std::chrono::steady_clock::now();
+		HeartFiberContext::SleepFor(20000);
+		slept = std::chrono::steady_clock::now() - begin;
+
+		otherFinishedFirst = otherFinished;
+		return HeartFiberResult::Success;
+	});
+
+	// Shares the only thread with the sleeper, so this can only run while it's asleep
+	system.EnqueueWork([&]() {
+		otherFinished = true;
+		return HeartFiberResult::Success;
+	});
+
+	// Shutdown waits for sleeping fibers too
+	system.Shutdown();
+
+	EXPECT_TRUE(otherFinishedFirst);
+	EXPECT_GE(slept, std::chrono::milliseconds(20));
+}
+
+TEST(Fibers, SleepUntilWakesInOrder)
+{
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 2;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	auto start = std::chrono::steady_clock::now();
+	const int Delays[] = {30, 10, 40, 20};
+
+	HeartMutex orderMutex;
+	std::vector<int> order;
+
+	for (int delay : Delays)
+	{
+		system.EnqueueWork([&, delay]() {
+			auto deadline = start + std::chrono::milliseconds(delay);
+			HeartFiberContext::SleepUntil(deadline);
+			EXPECT_GE(std::chrono::steady_clock::now(), deadline);
+
+			HeartLockGuard lock(orderMutex);
+			order.push_back(delay);
+			return HeartFiberResult::Success;
+		},
+			HeartFiberStackClass::Small);
+	}
+
+	system.Shutdown();
+
+	EXPECT_EQ(order, std::vector<int>({10, 20, 30, 40}));
+}
+
+TEST(HeartFiberCounter, FanOut)
+{
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 4;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	const int ChildCount = 64;
+	std::atomic_int childDoneCount = 0;
+	int childDoneCountAfterWait = 0;
+
+	system.EnqueueWork([&]() {
+		HeartFiberCounter counter;
+		for (int i = 0; i < ChildCount; ++i)
+		{
+			system.EnqueueWork(
+				[&]() {
+					HeartFiberContext::SleepFor(100);
+					childDoneCount++;
+					return HeartFiberResult::Success;
+				},
+				counter,
+				HeartFiberStackClass::Small);
+		}
+
+		HeartFiberContext::WaitForCounter(counter);
+		childDoneCountAfterWait = childDoneCount;
+		return HeartFiberResult::Success;
+	});
+
+	system.Shutdown();
+
+	EXPECT_EQ(childDoneCountAfterWait, ChildCount);
+}
+
+TEST(HeartFiberCounter, DestroyAfterWait)
+{
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 4;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	const int RoundCount = 200;
+	const int ChildCount = 32;
+	std::atomic_int roundsDone = 0;
+
+	for (int round = 0; round < RoundCount; ++round)
+	{
+		system.EnqueueWork([&]() {
+			// On the heap, so that anything touching it once it's gone shows up under a sanitizer
+			std::unique_ptr<HeartFiberCounter> counter = std::make_unique<HeartFiberCounter>();
+			std::atomic_bool go = false;
+
+			for (int i = 0; i < ChildCount; ++i)
+			{
+				system.EnqueueWork(
+					[&]() {
+						// Finish all at once, so that the last few decrements overlap
+						while (!go)
+							HeartFiberContext::Yield();
+
+						return HeartFiberResult::Success;
+					},
+					*counter,
+					HeartFiberStackClass::Small);
+			}
+
+			go = true;
+			HeartFiberContext::WaitForCounter(*counter);
+
+			// Straight away, while the other decrements may still be on their way out
+			counter.reset();
+			roundsDone++;
+			return HeartFiberResult::Success;
+		});
+	}
+
+	system.Shutdown();
+
+	EXPECT_EQ(roundsDone, RoundCount);
+}
+
+TEST(HeartFiberCounter, WaitForValue)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	HeartFiberCounter counter(4);
+	std::vector<int> order;
+
+	system.EnqueueWork([&]() {
+		HeartFiberContext::WaitForCounter(counter, 2);
+		order.push_back(2);
+
+		HeartFiberContext::WaitForCounter(counter, 0);
+		order.push_back(0);
+		return HeartFiberResult::Success;
+	});
+
+	// Counting down from outside the fibers resumes the waiter each time it gets far enough
+	counter.Decrement();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_TRUE(order.empty());
+
+	counter.Decrement();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_EQ(order, std::vector<int>({2}));
+
+	counter.Decrement(2);
+	system.Shutdown();
+
+	EXPECT_EQ(order, std::vector<int>({2, 0}));
+	EXPECT_EQ(counter.GetValue(), 0);
+}
+
+TEST(Fibers, StackClasses)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	// Run one work unit at a time, each reporting roughly where its stack is
+	auto runOne = [&](HeartFiberStackClass stackClass) {
+		uintptr_t stackAddress = 0;
+		HeartFiberWorkUnitRef unit = system.EnqueueWork([&]() {
+			int local = 0;
+			stackAddress = uintptr_t(&local);
+			return HeartFiberResult::Success;
+		},
+			stackClass);
+
+		EXPECT_EQ(unit->GetStackClass(), stackClass);
+		while (unit->GetStatus() == HeartFiberWorkUnitStatus::Pending)
+			std::this_thread::yield();
+
+		return stackAddress;
+	};
+
+	// A finished work unit's stack goes to the next one of the same class on that thread
+	uintptr_t small = runOne(HeartFiberStackClass::Small);
+	uintptr_t large = runOne(HeartFiberStackClass::Large);
+	EXPECT_NE(small, large);
+
+	for (int i = 0; i < 8; ++i)
+	{
+		EXPECT_EQ(runOne(HeartFiberStackClass::Small), small);
+		EXPECT_EQ(runOne(HeartFiberStackClass::Large), large);
+	}
+
+	system.Shutdown();
+}
+
+TEST(Fibers, VirtualStackProvider)
+{
+	HeartVirtualFiberStackProvider provider;
+	size_t pageSize = provider.GetPageSize();
+	size_t size = 16 * pageSize;
+
+	// Nothing is resident until it's touched, and then only from the top down to the deepest write
+	byte_t* stack = provider.AllocateStack(size);
+	EXPECT_EQ(provider.MeasureHighWaterMark(stack, size), 0);
+
+	stack[size - 1] = 1;
+	stack[size - 3 * pageSize] = 1;
+	EXPECT_EQ(provider.MeasureHighWaterMark(stack, size), 3 * pageSize);
+
+	// Releasing records the mark, then drops everything but the top page
+	provider.OnStackReleased(stack, size, HeartFiberStackClass::Small);
+	EXPECT_EQ(provider.MeasureHighWaterMark(stack, size), pageSize);
+	EXPECT_EQ(stack[size - 3 * pageSize], 0);
+
+	HeartVirtualFiberStackProvider::Stats stats = provider.GetStats(HeartFiberStackClass::Small);
+	EXPECT_EQ(stats.releaseCount, 1);
+	EXPECT_EQ(stats.maxHighWaterMark, 3 * pageSize);
+	EXPECT_EQ(stats.histogram[2], 1);
+
+	EXPECT_EQ(provider.GetStats(HeartFiberStackClass::Large).releaseCount, 0);
+
+	provider.FreeStack(stack, size);
+}
+
+#if !HEART_USE_OS_FIBERS
+TEST(Fibers, VirtualStackHighWaterMark)
+{
+	HeartVirtualFiberStackProvider provider;
+
+	HeartFiberSystem::Settings settings;
+	settings.stackProvider = &provider;
+
+	{
+		HeartFiberSystem system;
+		system.Initialize(settings);
+
+		// Each work unit goes a little deeper than the last
+		for (size_t depth = 1; depth <= 4; ++depth)
+		{
+			HeartFiberWorkUnitRef unit = system.EnqueueWork([depth]() {
+				volatile byte_t buffer[40 * Kilo];
+				buffer[sizeof(buffer) - depth * 8 * Kilo] = 1;
+				return HeartFiberResult::Success;
+			},
+				HeartFiberStackClass::Small);
+
+			while (unit->GetStatus() == HeartFiberWorkUnitStatus::Pending)
+				std::this_thread::yield();
+		}
+
+		system.Shutdown();
+	}
+
+	// The pump's stack is Small too, and gets released once at shutdown
+	HeartVirtualFiberStackProvider::Stats stats = provider.GetStats(HeartFiberStackClass::Small);
+	EXPECT_EQ(stats.releaseCount, 5);
+	EXPECT_GE(stats.maxHighWaterMark, 32 * Kilo);
+	EXPECT_LT(stats.maxHighWaterMark, 64 * Kilo);
+}
+#endif
+
 TEST(HeartFiberMutex, ExclusiveLock)
 {
 	HeartFiberSystem::Settings settings;
@@ -238,6 +607,83 @@ TEST(HeartFiberMutex, LockGuard)
 	mutex.Unlock();
 }
 
+TEST(HeartFiberMutex, HandOffInOrder)
+{
+	HeartFiberSystem system;
+	system.Initialize({});
+
+	HeartFiberMutex mutex;
+	mutex.LockExclusive(HeartFiberMutex::NeverYield);
+
+	const int WaiterCount = 4;
+	std::atomic_int arrivedCount = 0;
+	std::vector<int> order;
+
+	for (int i = 0; i < WaiterCount; ++i)
+	{
+		system.EnqueueWork([&, i]() {
+			arrivedCount++;
+			mutex.LockExclusive(HeartFiberMutex::YieldToFiber);
+			order.push_back(i);
+			mutex.Unlock();
+			return HeartFiberResult::Success;
+		},
+			HeartFiberStackClass::Small);
+	}
+
+	// Parked waiters don't spin, so once they've all arrived the thread goes quiet
+	while (arrivedCount < WaiterCount)
+		std::this_thread::yield();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	EXPECT_TRUE(order.empty());
+
+	// Each waiter is handed the lock in the order it asked for it
+	mutex.Unlock();
+	system.Shutdown();
+
+	ASSERT_EQ(order.size(), WaiterCount);
+	for (int i = 0; i < WaiterCount; ++i)
+	{
+		EXPECT_EQ(order[i], i);
+	}
+
+	EXPECT_TRUE(mutex.TryLockExclusive());
+	mutex.Unlock();
+}
+
+TEST(HeartFiberMutex, Contention)
+{
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 4;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	const int FiberCount = 32;
+	const int IncrementCount = 1000;
+
+	HeartFiberMutex mutex;
+	int counter = 0;
+
+	for (int i = 0; i < FiberCount; ++i)
+	{
+		system.EnqueueWork([&]() {
+			for (int j = 0; j < IncrementCount; ++j)
+			{
+				HeartLockGuard lock(mutex, HeartFiberMutex::YieldToFiber);
+				counter++;
+			}
+
+			return HeartFiberResult::Success;
+		},
+			HeartFiberStackClass::Small);
+	}
+
+	system.Shutdown();
+
+	EXPECT_EQ(counter, FiberCount * IncrementCount);
+}
+
 TEST(Fibers, ShouldNotLeakMemory)
 {
 	TestTrackingAllocator allocator;
@@ -263,3 +709,43 @@ TEST(Fibers, ShouldNotLeakMemory)
 	EXPECT_EQ(allocator.m_allocatedCount, 0);
 	EXPECT_EQ(allocator.m_allocatedSize, 0);
 }
+
+#if !HEART_USE_OS_FIBERS
+namespace
+{
+	HeartFiberAbiContext s_mainContext;
+	HeartFiberAbiContext s_fiberContext;
+	uint32_t s_fiberCsr = 0;
+
+	void RoundingFiber(void*)
+	{
+		// Round toward zero in here; whoever switched to us shouldn't notice
+		_mm_setcsr((_mm_getcsr() & ~_MM_ROUND_MASK) | _MM_ROUND_TOWARD_ZERO);
+
+		// Fibers started this way can't return, so just keep reporting back
+		while (true)
+		{
+			s_fiberCsr = _mm_getcsr();
+			heart_swap_fiber_context(&s_fiberContext, &s_mainContext);
+		}
+	}
+}
+
+TEST(Fibers, AbiContextSwitch)
+{
+	std::vector<byte_t> stack(64 * Kilo);
+	HeartInitializeFiberAbiContext(s_fiberContext, stack.data(), stack.size(), &RoundingFiber);
+
+	uint32_t mainCsr = _mm_getcsr();
+	heart_swap_fiber_context(&s_mainContext, &s_fiberContext);
+
+	EXPECT_EQ(s_fiberCsr & _MM_ROUND_MASK, uint32_t(_MM_ROUND_TOWARD_ZERO));
+	EXPECT_EQ(_mm_getcsr(), mainCsr);
+
+	// The fiber gets its own control state back when it resumes
+	s_fiberCsr = 0;
+	heart_swap_fiber_context(&s_mainContext, &s_fiberContext);
+	EXPECT_EQ(s_fiberCsr & _MM_ROUND_MASK, uint32_t(_MM_ROUND_TOWARD_ZERO));
+	EXPECT_EQ(_mm_getcsr(), mainCsr);
+}
+#endif
@@ -0,0 +1,149 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/fibers/abi_context.h>
+#include <heart/fibers/result.h>
+#include <heart/fibers/status.h>
+#include <heart/fibers/system.h>
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__)
+#include <ucontext.h>
+#endif
+
+// These are benchmarks, not tests. They are disabled by default; run them with
+//   heart-test --gtest_also_run_disabled_tests --gtest_filter=HeartFiberBenchmark.*
+
+#if !HEART_USE_OS_FIBERS
+
+namespace
+{
+	constexpr size_t BenchmarkStackSize = 64 * Kilo;
+	constexpr int SwitchCount = 1000000;
+
+	// Each round trip is two switches: into the fiber and back out again
+	double ToNanosecondsPerSwitch(std::chrono::steady_clock::duration elapsed)
+	{
+		return std::chrono::duration<double, std::nano>(elapsed).count() / (SwitchCount * 2.0);
+	}
+
+	HeartFiberAbiContext s_heartMain;
+	HeartFiberAbiContext s_heartFiber;
+
+	void HeartPingPong(void*)
+	{
+		while (true)
+		{
+			heart_swap_fiber_context(&s_heartFiber, &s_heartMain);
+		}
+	}
+
+	double MeasureHeartSwitch()
+	{
+		std::vector<byte_t> stack(BenchmarkStackSize);
+		HeartInitializeFiberAbiContext(s_heartFiber, stack.data(), stack.size(), &HeartPingPong);
+
+		auto begin = std::chrono::steady_clock::now();
+		for (int i = 0; i < SwitchCount; ++i)
+		{
+			heart_swap_fiber_context(&s_heartMain, &s_heartFiber);
+		}
+
+		return ToNanosecondsPerSwitch(std::chrono::steady_clock::now() - begin);
+	}
+
+#if defined(__unix__)
+	ucontext_t s_ucontextMain;
+	ucontext_t s_ucontextFiber;
+
+	void UcontextPingPong()
+	{
+		while (true)
+		{
+			swapcontext(&s_ucontextFiber, &s_ucontextMain);
+		}
+	}
+
+	double MeasureUcontextSwitch()
+	{
+		std::vector<byte_t> stack(BenchmarkStackSize);
+
+		getcontext(&s_ucontextFiber);
+		s_ucontextFiber.uc_stack.ss_sp = stack.data();
+		s_ucontextFiber.uc_stack.ss_size = stack.size();
+		s_ucontextFiber.uc_link = nullptr;
+		makecontext(&s_ucontextFiber, &UcontextPingPong, 0);
+
+		auto begin = std::chrono::steady_clock::now();
+		for (int i = 0; i < SwitchCount; ++i)
+		{
+			swapcontext(&s_ucontextMain, &s_ucontextFiber);
+		}
+
+		return ToNanosecondsPerSwitch(std::chrono::steady_clock::now() - begin);
+	}
+#endif
+}
+
+TEST(HeartFiberBenchmark, DISABLED_ContextSwitch)
+{
+	printf("%-24s %12s\n", "switch", "ns/switch");
+	printf("%-24s %12.1f\n", "heart_swap_fiber_context", MeasureHeartSwitch());
+
+#if defined(__unix__)
+	// swapcontext also saves and restores the signal mask, which costs a syscall every time
+	printf("%-24s %12.1f\n", "swapcontext", MeasureUcontextSwitch());
+#endif
+}
+
+#endif
+
+TEST(HeartFiberBenchmark, DISABLED_EnqueueLatency)
+{
+	constexpr int RoundCount = 1000;
+
+	HeartFiberSystem::Settings settings;
+	settings.threadCount = 2;
+
+	HeartFiberSystem system;
+	system.Initialize(settings);
+
+	// How long a work unit enqueued from outside takes to start running, with the pumps parked
+	double totalMicroseconds = 0.0;
+	for (int i = 0; i < RoundCount; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+		std::chrono::steady_clock::time_point started;
+		auto begin = std::chrono::steady_clock::now();
+		HeartFiberWorkUnitRef unit = system.EnqueueWork([&]() {
+			started = std::chrono::steady_clock::now();
+			return HeartFiberResult::Success;
+		},
+			HeartFiberStackClass::Small);
+
+		while (unit->GetStatus() == HeartFiberWorkUnitStatus::Pending)
+			std::this_thread::yield();
+
+		totalMicroseconds += std::chrono::duration<double, std::micro>(started - begin).count();
+	}
+
+	system.Shutdown();
+
+	printf("%-24s %12s\n", "fiber", "us/start");
+	printf("%-24s %12.1f\n", "EnqueueWork", totalMicroseconds / RoundCount);
+}
@@ -442,3 +442,38 @@ TEST(IntrusveList, MoveAssignment)
 	}
 	EXPECT_EQ(count, 0);
 }
+
+TEST(IntrusiveList, SpliceBack)
+{
+	SimpleListEntryType a {'a'};
+	SimpleListEntryType b {'b'};
+	SimpleListEntryType c {'c'};
+
+	SimpleHeartIntrusiveList listA;
+	listA.PushBack(&a);
+
+	SimpleHeartIntrusiveList listB;
+	listB.PushBack(&b);
+	listB.PushBack(&c);
+
+	listA.SpliceBack(listB);
+
+	EXPECT_EQ(listA.Size(), 3);
+	EXPECT_TRUE(listB.IsEmpty());
+	EXPECT_TRUE(listB.begin() == listB.end());
+
+	EXPECT_EQ(listA.PopFront(), &a);
+	EXPECT_EQ(listA.PopFront(), &b);
+	EXPECT_EQ(listA.PopFront(), &c);
+	EXPECT_TRUE(listA.IsEmpty());
+
+	// Splicing an empty list is a no-op, and splicing into an empty list takes everything
+	listB.PushBack(&a);
+	listB.SpliceBack(listA);
+	EXPECT_EQ(listB.Size(), 1);
+
+	listA.SpliceBack(listB);
+	EXPECT_EQ(listA.Size(), 1);
+	EXPECT_EQ(listA.Back(), &a);
+	EXPECT_TRUE(listB.IsEmpty());
+}
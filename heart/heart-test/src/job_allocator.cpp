@@ -0,0 +1,135 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/jobs/job_allocator.h>
+
+#include <gtest/gtest.h>
+
+#include "utils/tracking_allocator.h"
+
+#include <cstring>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	const size_t TestBlockSizes[HeartJobAllocator::SizeClassCount] = {40, 100, 300};
+}
+
+TEST(HeartJobAllocator, BlockSizes)
+{
+	HeartJobAllocator allocator(GetHeartDefaultAllocator(), TestBlockSizes);
+
+	// Sizes are rounded up to keep every block aligned
+	EXPECT_EQ(allocator.GetBlockSize(0), 48);
+	EXPECT_EQ(allocator.GetBlockSize(1), 112);
+	EXPECT_EQ(allocator.GetBlockSize(2), 304);
+
+	for (uint32_t c = 0; c < HeartJobAllocator::SizeClassCount; ++c)
+	{
+		void* block = allocator.Allocate(c);
+		EXPECT_EQ(uintptr_t(block) % HeartJobAllocator::BlockAlignment, 0);
+		allocator.Free(block, c);
+	}
+}
+
+TEST(HeartJobAllocator, Reuse)
+{
+	TestTrackingAllocator tracking;
+
+	{
+		HeartJobAllocator allocator(tracking, TestBlockSizes);
+
+		std::vector<void*> blocks;
+		std::set<void*> unique;
+		for (int i = 0; i < 200; ++i)
+		{
+			void* block = allocator.Allocate(1);
+			blocks.push_back(block);
+			unique.insert(block);
+
+			// Scribble over the whole block to catch any overlap
+			memset(block, 0xCD, allocator.GetBlockSize(1));
+		}
+
+		EXPECT_EQ(unique.size(), blocks.size());
+		EXPECT_LT(tracking.m_allocatedCount, blocks.size()) << "Blocks should be carved out of slabs";
+
+		uint64_t count = tracking.m_allocatedCount;
+		for (void* block : blocks)
+		{
+			allocator.Free(block, 1);
+		}
+
+		for (int i = 0; i < 200; ++i)
+		{
+			EXPECT_TRUE(unique.count(allocator.Allocate(1)) == 1) << "Freed blocks should be reused";
+		}
+
+		EXPECT_EQ(tracking.m_allocatedCount, count);
+	}
+
+	EXPECT_EQ(tracking.m_allocatedCount, 0);
+}
+
+TEST(HeartJobAllocator, ThreadCaches)
+{
+	const int ThreadCount = 4;
+	const int Iterations = 10000;
+
+	HeartJobAllocator allocator(GetHeartDefaultAllocator(), TestBlockSizes);
+	allocator.CreateThreadCaches(ThreadCount);
+
+	// Each thread holds on to enough blocks at a time that its cache overflows when they're
+	// freed, so blocks also move through the central list between threads.
+	std::vector<std::thread> threads;
+	for (int t = 0; t < ThreadCount; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			allocator.AttachThread(t);
+
+			std::vector<void*> held;
+			for (int i = 0; i < Iterations; ++i)
+			{
+				uint32_t sizeClass = uint32_t(i % HeartJobAllocator::SizeClassCount);
+				uint32_t* block = static_cast<uint32_t*>(allocator.Allocate(sizeClass));
+				block[0] = uint32_t(t);
+				block[1] = sizeClass;
+				held.push_back(block);
+
+				if (held.size() > 1000)
+				{
+					for (void* p : held)
+					{
+						uint32_t* b = static_cast<uint32_t*>(p);
+						EXPECT_EQ(b[0], uint32_t(t)) << "Block was handed out twice";
+						allocator.Free(p, b[1]);
+					}
+
+					held.clear();
+				}
+			}
+
+			for (void* p : held)
+			{
+				allocator.Free(p, static_cast<uint32_t*>(p)[1]);
+			}
+
+			allocator.DetachThread();
+		});
+	}
+
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+}
@@ -0,0 +1,133 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/debug/chrome_trace.h>
+#include <heart/jobs/system.h>
+#include <heart/jobs/tracing.h>
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+
+TEST(HeartChromeTraceWriter, Escaping)
+{
+	HeartChromeTraceWriter writer;
+	writer.AddInstantEvent("quote\" slash\\ newline\n", "test", 0, 1.5, {{"count", 3}, {"name", "a\tb"}});
+	writer.Finish();
+
+	std::string json(writer.GetData(), writer.GetSize());
+	EXPECT_EQ(json,
+		"{\"displayTimeUnit\":\"ns\",\"traceEvents\":["
+		"{\"name\":\"quote\\\" slash\\\\ newline\\n\",\"cat\":\"test\",\"ph\":\"i\",\"pid\":1,\"tid\":0,\"ts\":1.500,\"s\":\"t\","
+		"\"args\":{\"count\":3,\"name\":\"a\\tb\"}}"
+		"]}");
+}
+
+#if HEART_JOB_TRACING
+
+TEST(HeartJobTracer, HistogramBuckets)
+{
+	EXPECT_EQ(HeartJobTraceHistogram::GetBucket(0), 0);
+	EXPECT_EQ(HeartJobTraceHistogram::GetBucket(1), 0);
+	EXPECT_EQ(HeartJobTraceHistogram::GetBucket(2), 1);
+	EXPECT_EQ(HeartJobTraceHistogram::GetBucket(3), 1);
+	EXPECT_EQ(HeartJobTraceHistogram::GetBucket(1024), 10);
+	EXPECT_EQ(HeartJobTraceHistogram::GetBucket(~0ull), HeartJobTraceHistogram::BucketCount - 1);
+
+	HeartJobTraceHistogram histogram;
+	histogram.buckets[HeartJobTraceHistogram::GetBucket(100)] = 90;
+	histogram.buckets[HeartJobTraceHistogram::GetBucket(10000)] = 10;
+
+	EXPECT_EQ(histogram.GetCount(), 100);
+	EXPECT_EQ(histogram.GetPercentile(50), 128);
+	EXPECT_EQ(histogram.GetPercentile(95), 16384);
+	EXPECT_EQ(histogram.GetPercentile(100), 16384);
+}
+
+TEST(HeartJobTracer, DroppedEvents)
+{
+	HeartJobTracer tracer(GetHeartDefaultAllocator(), 4);
+
+	HeartJobTraceEvent event = {};
+	event.label = "Dropped";
+	event.workerId = HeartJobTraceEvent::NotAWorker;
+	event.priority = HeartJobPriority::High;
+	event.result = HeartJobResult::Success;
+
+	for (int i = 0; i < 10; ++i)
+	{
+		tracer.Record(event);
+	}
+
+	// Histograms keep counting once the event buffer is full
+	EXPECT_EQ(tracer.GetEventCount(), 4);
+	EXPECT_EQ(tracer.GetDroppedEventCount(), 6);
+	EXPECT_EQ(tracer.GetRunTimeHistogram(HeartJobPriority::High).GetCount(), 10);
+	EXPECT_EQ(tracer.GetRunTimeHistogram(HeartJobPriority::Normal).GetCount(), 0);
+
+	tracer.Clear();
+	EXPECT_EQ(tracer.GetEventCount(), 0);
+	EXPECT_EQ(tracer.GetDroppedEventCount(), 0);
+	EXPECT_EQ(tracer.GetRunTimeHistogram(HeartJobPriority::High).GetCount(), 0);
+}
+
+TEST(HeartJobTracer, SystemRecordsJobs)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	const int JobCount = 32;
+	HeartJobCounterRef counter = system.CreateCounter();
+
+	{
+		HEART_JOB_TRACE_LABEL("TracedJob");
+		for (int i = 0; i < JobCount; ++i)
+		{
+			system.EnqueueJob([]() {
+				return HeartJobResult::Success;
+			},
+				HeartJobPriority::High, HeartJobMaskDefault, counter.Get());
+		}
+	}
+
+	system.Wait(*counter);
+
+	// The last job can still be recording after it signals the counter
+	while (system.GetTracer().GetEventCount() < JobCount)
+	{
+		std::this_thread::yield();
+	}
+
+	system.Shutdown();
+
+	HeartJobTracer& tracer = system.GetTracer();
+	EXPECT_EQ(tracer.GetEventCount(), JobCount);
+	EXPECT_EQ(tracer.GetDroppedEventCount(), 0);
+	EXPECT_EQ(tracer.GetQueueWaitHistogram(HeartJobPriority::High).GetCount(), JobCount);
+	EXPECT_EQ(tracer.GetRunTimeHistogram(HeartJobPriority::High).GetCount(), JobCount);
+	EXPECT_EQ(tracer.GetRunTimeHistogram(HeartJobPriority::Normal).GetCount(), 0);
+
+	HeartChromeTraceWriter writer;
+	tracer.ExportChromeTrace(writer);
+	writer.Finish();
+
+	std::string json(writer.GetData(), writer.GetSize());
+	EXPECT_NE(json.find("\"name\":\"TracedJob\""), std::string::npos);
+	EXPECT_NE(json.find("\"priority\":\"High\""), std::string::npos);
+	EXPECT_NE(json.find("\"thread_name\""), std::string::npos);
+	EXPECT_EQ(json.find("\"name\":\"HeartJob\""), std::string::npos);
+}
+
+#endif
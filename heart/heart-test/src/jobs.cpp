@@ -11,15 +11,22 @@
 */
 #include <heart/jobs/system.h>
 
+#include <heart/fibers/context.h>
+#include <heart/sync/event.h>
+#include <heart/sync/fence.h>
+
 #include <gtest/gtest.h>
 
 #include "utils/tracking_allocator.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <mutex>
 #include <numeric>
 #include <thread>
+#include <vector>
 
 TEST(HeartJobSystem, OneThread)
 {
@@ -111,28 +118,36 @@ TEST(HeartJobSystem, Allocation)
 
 		const int JobCount = 512;
 		std::vector<HeartJobRef> jobs;
-		std::generate_n(std::back_inserter(jobs), JobCount, [&]() {
-			return system.EnqueueJob([]() {
-				return HeartJobResult::Success;
+
+		auto runJobs = [&]() {
+			std::generate_n(std::back_inserter(jobs), JobCount, [&]() {
+				return system.EnqueueJob([]() {
+					return HeartJobResult::Success;
+				});
 			});
-		});
 
-		EXPECT_GE(allocator.m_allocatedCount, JobCount);
+			// Wait for them to finish, and for the workers to let go of them
+			while (std::any_of(std::begin(jobs), std::end(jobs), [](HeartJobRef& j) { return j->status == HeartJobStatus::Pending || j->GetRefCount() > 1; }))
+			{
+				std::this_thread::yield();
+			}
+		};
 
-		// Wait for them to finish
-		while (std::any_of(std::begin(jobs), std::end(jobs), [](const HeartJobRef& j) { return j->status == HeartJobStatus::Pending; }))
-		{
-			std::this_thread::yield();
-		}
+		uint64_t initialCount = allocator.m_allocatedCount;
+		runJobs();
 
-		// We still hold a ref, so nothing should've expired
-		EXPECT_GE(allocator.m_allocatedCount, JobCount);
+		EXPECT_GT(allocator.m_allocatedCount, initialCount);
+		EXPECT_LT(allocator.m_allocatedCount - initialCount, JobCount) << "Jobs should be allocated in slabs, not one by one";
 
-		uint64_t previousCount = allocator.m_allocatedCount;
+		// Losing our refs returns the jobs to the pool, not the allocator
+		uint64_t pooledCount = allocator.m_allocatedCount;
+		jobs.clear();
+		EXPECT_EQ(allocator.m_allocatedCount, pooledCount);
 
-		// Lose our refs
+		// In steady state, jobs should come entirely out of the pool
+		runJobs();
 		jobs.clear();
-		EXPECT_EQ(allocator.m_allocatedCount, previousCount - JobCount);
+		EXPECT_EQ(allocator.m_allocatedCount, pooledCount);
 
 		system.Shutdown();
 	}
@@ -317,6 +332,111 @@ TEST(HeartJobSystem, RetryStatus)
 	system.Shutdown();
 }
 
+TEST(HeartJobSystem, RetryBackoff)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+	settings.retryBackoffMin = 1000;
+	settings.retryBackoffMax = 2000;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_int runCount = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	auto job = system.EnqueueJob([&]() {
+		return ++runCount < 5 ? HeartJobResult::Retry : HeartJobResult::Success;
+	});
+
+	while (job->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	// Waits of 1ms, 2ms, 2ms and 2ms between the five runs
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	EXPECT_GE(elapsed, std::chrono::milliseconds(7));
+	EXPECT_EQ(runCount.load(), 5);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, RetryDelay)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_bool ready = false;
+	std::atomic_int pollCount = 0;
+
+	auto job = system.EnqueueJob([&]() {
+		if (ready)
+			return HeartJobResult::Success;
+
+		pollCount++;
+		HeartJobSystem::SetRetryDelay(5000);
+		return HeartJobResult::Retry;
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	ready = true;
+
+	while (job->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	// Polling every 5ms instead of as fast as possible
+	EXPECT_GE(pollCount.load(), 1);
+	EXPECT_LE(pollCount.load(), 11);
+
+	// A zero delay requeues immediately, like before
+	std::atomic_int immediateCount = 0;
+	auto immediate = system.EnqueueJob([&]() {
+		HeartJobSystem::SetRetryDelay(0);
+		return ++immediateCount < 100 ? HeartJobResult::Retry : HeartJobResult::Success;
+	});
+
+	while (immediate->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(immediateCount.load(), 100);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, ShutdownWithDelayedRetry)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+
+	std::atomic_int runCount = 0;
+	HeartJobRef job;
+
+	{
+		HeartJobSystem system;
+		system.Initialize(settings);
+
+		job = system.EnqueueJob([&]() {
+			HeartJobSystem::SetRetryDelay(10000);
+			return ++runCount < 3 ? HeartJobResult::Retry : HeartJobResult::Success;
+		});
+
+		// Shutdown flushes jobs that are waiting to be retried, too
+		system.Shutdown();
+		EXPECT_EQ(job->status, HeartJobStatus::Success);
+		EXPECT_EQ(runCount.load(), 3);
+
+		job = nullptr;
+	}
+}
+
 TEST(HeartJobSystem, LargeJob)
 {
 	const size_t MagicAssumedVtableSize = 8;
@@ -352,3 +472,1051 @@ TEST(HeartJobSystem, LargeJob)
 	EXPECT_EQ(job->status.load(), HeartJobStatus::Success);
 	system.Shutdown();
 }
+
+TEST(HeartJobSystem, WorkStealingNestedJobs)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	const int ParentCount = 16;
+	const int ChildCount = 64;
+	std::atomic_int doneCount = 0;
+
+	std::vector<HeartJobRef> parents;
+	std::generate_n(std::back_inserter(parents), ParentCount, [&]() {
+		return system.EnqueueJob([&]() {
+			// These go to the local queue of whichever worker is running us
+			for (int i = 0; i < ChildCount; ++i)
+			{
+				system.EnqueueJob([&]() {
+					doneCount++;
+					return HeartJobResult::Success;
+				});
+			}
+
+			return HeartJobResult::Success;
+		});
+	});
+
+	while (doneCount < ParentCount * ChildCount)
+	{
+		std::this_thread::yield();
+	}
+
+	for (auto& job : parents)
+	{
+		EXPECT_EQ(job->status.load(), HeartJobStatus::Success);
+	}
+
+	EXPECT_EQ(doneCount, ParentCount * ChildCount);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, WorkStealingPriorities)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_int completeCount = 0;
+	int completeOrder[3] = {};
+
+	// Enqueue everything from the worker itself so that it all lands in the local queues
+	auto job = system.EnqueueJob([&]() {
+		system.EnqueueJob([&]() {
+			completeOrder[0] = ++completeCount;
+			return HeartJobResult::Success;
+		},
+			HeartJobPriority::Normal);
+
+		system.EnqueueJob([&]() {
+			completeOrder[1] = ++completeCount;
+			return HeartJobResult::Success;
+		},
+			HeartJobPriority::High);
+
+		system.EnqueueJob([&]() {
+			completeOrder[2] = ++completeCount;
+			return HeartJobResult::Success;
+		},
+			HeartJobPriority::Urgent);
+
+		return HeartJobResult::Success;
+	});
+
+	while (completeCount < 3)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(completeOrder[0], 3);
+	EXPECT_EQ(completeOrder[1], 2);
+	EXPECT_EQ(completeOrder[2], 1);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, WorkStealingMaskedSteal)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	const uint32_t MaskA = 1 << 1;
+	const uint32_t MaskB = 1 << 2;
+
+	std::atomic_bool release = false;
+	std::atomic_bool queued = false;
+	HeartJobRef jobA, jobB;
+
+	// Occupy the only worker while it enqueues the masked jobs
+	system.EnqueueJob([&]() {
+		jobA = system.EnqueueJob([]() { return HeartJobResult::Success; }, HeartJobPriority::Normal, MaskA);
+		jobB = system.EnqueueJob([]() { return HeartJobResult::Success; }, HeartJobPriority::Normal, MaskB);
+		queued = true;
+
+		while (!release)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		return HeartJobResult::Success;
+	});
+
+	while (!queued)
+	{
+		std::this_thread::yield();
+	}
+
+	// jobB is queued behind jobA, which doesn't match MaskB
+	EXPECT_TRUE(system.TryStealJobWork(HeartJobPriority::Normal, MaskB)) << "Masked steal must find a matching job behind one that doesn't match";
+	EXPECT_EQ(jobA->status.load(), HeartJobStatus::Pending);
+	EXPECT_EQ(jobB->status.load(), HeartJobStatus::Success);
+
+	EXPECT_FALSE(system.TryStealJobWork(HeartJobPriority::Normal, MaskB)) << "Masked steal must not take a job that doesn't match";
+	EXPECT_EQ(jobA->status.load(), HeartJobStatus::Pending);
+
+	EXPECT_TRUE(system.TryStealJobWork(HeartJobPriority::Normal, MaskA));
+	EXPECT_EQ(jobA->status.load(), HeartJobStatus::Success);
+
+	release = true;
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, MaskedAcquisitionOrder)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	const uint32_t MaskA = 1 << 3;
+	const uint32_t MaskB = 1 << 7;
+	const uint32_t MaskAB = MaskA | MaskB;
+
+	std::atomic_bool release = false;
+	std::atomic_bool started = false;
+
+	// Occupy the only worker so that everything below stays in the shared queue
+	system.EnqueueJob([&]() {
+		started = true;
+		while (!release)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		return HeartJobResult::Success;
+	});
+
+	while (!started)
+	{
+		std::this_thread::yield();
+	}
+
+	std::vector<int> order;
+	auto makeJob = [&](int id) {
+		return [&order, id]() {
+			order.push_back(id);
+			return HeartJobResult::Success;
+		};
+	};
+
+	system.EnqueueJob(makeJob(0), HeartJobPriority::Normal, MaskA);
+	system.EnqueueJob(makeJob(1), HeartJobPriority::Normal, MaskB);
+	system.EnqueueJob(makeJob(2), HeartJobPriority::Normal, MaskAB);
+	system.EnqueueJob(makeJob(3), HeartJobPriority::Normal, MaskA);
+	system.EnqueueJob(makeJob(4), HeartJobPriority::Normal, MaskB);
+
+	// Jobs that can't be taken with the given mask are left alone
+	EXPECT_FALSE(system.TryStealJobWork(HeartJobPriority::Normal, 1 << 12));
+
+	// Narrow masks take the oldest job they match, including ones with several bits
+	EXPECT_TRUE(system.TryStealJobWork(HeartJobPriority::Normal, MaskB));
+	EXPECT_TRUE(system.TryStealJobWork(HeartJobPriority::Normal, MaskB));
+	EXPECT_TRUE(system.TryStealJobWork(HeartJobPriority::Normal, MaskB));
+	EXPECT_FALSE(system.TryStealJobWork(HeartJobPriority::Normal, MaskB));
+
+	// An unmasked acquire takes the oldest job of all
+	EXPECT_TRUE(system.TryStealJobWork(HeartJobPriority::Normal, HeartJobMaskAll));
+	EXPECT_TRUE(system.TryStealJobWork(HeartJobPriority::Normal, HeartJobMaskAll));
+	EXPECT_FALSE(system.TryStealJobWork(HeartJobPriority::Normal, HeartJobMaskAll));
+
+	ASSERT_EQ(order.size(), 5);
+	EXPECT_EQ(order[0], 1);
+	EXPECT_EQ(order[1], 2);
+	EXPECT_EQ(order[2], 4);
+	EXPECT_EQ(order[3], 0);
+	EXPECT_EQ(order[4], 3);
+
+	release = true;
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, Prerequisites)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_bool release = false;
+	std::atomic_int prerequisitesDone = 0;
+	std::atomic_int seenByDependent = -1;
+
+	auto prerequisite = [&]() {
+		while (!release)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		prerequisitesDone++;
+		return HeartJobResult::Success;
+	};
+
+	auto jobA = system.EnqueueJob(prerequisite);
+	auto jobB = system.EnqueueJob(prerequisite);
+	auto jobC = system.EnqueueJob([&]() {
+		seenByDependent = prerequisitesDone.load();
+		return HeartJobResult::Success;
+	},
+		{jobA, jobB});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(jobC->status.load(), HeartJobStatus::Pending) << "Dependent job ran before its prerequisites";
+
+	release = true;
+	while (jobC->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(jobC->status.load(), HeartJobStatus::Success);
+	EXPECT_EQ(seenByDependent.load(), 2);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, CompletedAndFailedPrerequisites)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	auto failed = system.EnqueueJob([]() { return HeartJobResult::Failure; });
+	while (failed->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	// A prerequisite that has already finished (even unsuccessfully) shouldn't hold anything up
+	auto dependent = system.EnqueueJob([]() { return HeartJobResult::Success; }, {failed});
+	while (dependent->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(dependent->status.load(), HeartJobStatus::Success);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, CounterWait)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	const int JobCount = 64;
+	std::atomic_int doneCount = 0;
+	std::atomic_int seenByDependent = -1;
+
+	HeartJobCounterRef counter = system.CreateCounter();
+	for (int i = 0; i < JobCount; ++i)
+	{
+		system.EnqueueJob([&]() {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			doneCount++;
+			return HeartJobResult::Success;
+		},
+			HeartJobPriority::Normal, HeartJobMaskDefault, counter.Get());
+	}
+
+	auto dependent = system.EnqueueJob([&]() {
+		seenByDependent = doneCount.load();
+		return HeartJobResult::Success;
+	},
+		*counter);
+
+	while (dependent->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(seenByDependent.load(), JobCount);
+	EXPECT_EQ(counter->GetValue(), 0);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, ManualCounter)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	HeartJobCounter counter(1);
+
+	auto dependent = system.EnqueueJob([]() { return HeartJobResult::Success; }, counter);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_EQ(dependent->status.load(), HeartJobStatus::Pending);
+
+	counter.Decrement();
+	while (dependent->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(dependent->status.load(), HeartJobStatus::Success);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, WaitForJob)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_bool done = false;
+	auto job = system.EnqueueJob([&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		done = true;
+		return HeartJobResult::Success;
+	});
+
+	// Nothing else to run, so this has to sleep until the job is done
+	EXPECT_EQ(system.Wait(job), HeartJobStatus::Success);
+	EXPECT_TRUE(done.load());
+
+	auto failed = system.EnqueueJob([]() {
+		return HeartJobResult::Failure;
+	});
+
+	EXPECT_EQ(system.Wait(failed), HeartJobStatus::Failure);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, WaitFromWorker)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// With one worker, waiting inside a job only works if the waiter runs the jobs itself
+	std::atomic_int innerCount = 0;
+	auto outer = system.EnqueueJob([&]() {
+		HeartJobCounterRef counter = system.CreateCounter();
+		for (int i = 0; i < 16; ++i)
+		{
+			system.EnqueueJob([&]() {
+				innerCount++;
+				return HeartJobResult::Success;
+			},
+				HeartJobPriority::Normal, HeartJobMaskDefault, counter.Get());
+		}
+
+		system.Wait(*counter);
+
+		// Delayed retries are still promoted while the only worker is waiting
+		int retries = 0;
+		auto retried = system.EnqueueJob([&retries]() {
+			HeartJobSystem::SetRetryDelay(1000);
+			return ++retries < 3 ? HeartJobResult::Retry : HeartJobResult::Success;
+		});
+
+		return system.Wait(retried) == HeartJobStatus::Success ? HeartJobResult::Success : HeartJobResult::Failure;
+	});
+
+	EXPECT_EQ(system.Wait(outer), HeartJobStatus::Success);
+	EXPECT_EQ(innerCount.load(), 16);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, WaitForStackCounter)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// The counter goes out of scope as soon as the wait returns, which must not race with the last decrement
+	for (int round = 0; round < 100; ++round)
+	{
+		HeartJobCounter counter;
+		for (int i = 0; i < 4; ++i)
+		{
+			system.EnqueueJob([]() {
+				return HeartJobResult::Success;
+			},
+				HeartJobPriority::Normal, HeartJobMaskDefault, &counter);
+		}
+
+		system.Wait(counter, HeartJobPriority::Urgent);
+		EXPECT_EQ(counter.GetValue(), 0);
+	}
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, FibersSuspendOnFence)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+	settings.executionMode = HeartJobExecutionMode::Fibers;
+	settings.fiberStackClass = HeartFiberStackClass::Small;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// With one worker, the waiter has to get out of the way for the signaller to run at all
+	HeartFence fence;
+	std::atomic_bool signalled = false;
+	bool signalledBeforeWake = false;
+
+	auto waiter = system.EnqueueJob([&]() {
+		fence.Wait(1);
+		signalledBeforeWake = signalled;
+		return HeartJobResult::Success;
+	});
+
+	auto signaller = system.EnqueueJob([&]() {
+		signalled = true;
+		fence.Signal(1);
+		return HeartJobResult::Success;
+	});
+
+	// Not Wait(), which would let this thread run the signaller itself
+	while (waiter->status == HeartJobStatus::Pending || signaller->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(waiter->status.load(), HeartJobStatus::Success);
+	EXPECT_TRUE(signalledBeforeWake);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, FibersWaitSuspends)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+	settings.executionMode = HeartJobExecutionMode::Fibers;
+	settings.fiberStackClass = HeartFiberStackClass::Small;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// The inner job must run on a fiber of its own, rather than on top of the waiting job
+	HeartFiberWorkUnit* outerFiber = nullptr;
+	HeartFiberWorkUnit* innerFiber = nullptr;
+	std::atomic_bool outerDone = false;
+
+	system.EnqueueJob([&]() {
+		outerFiber = HeartFiberContext::GetCurrentWorkUnit();
+
+		auto inner = system.EnqueueJob([&]() {
+			innerFiber = HeartFiberContext::GetCurrentWorkUnit();
+			return HeartJobResult::Success;
+		});
+
+		HeartJobCounter counter;
+		system.EnqueueJob([]() { return HeartJobResult::Success; }, HeartJobPriority::Normal, HeartJobMaskDefault, &counter);
+
+		bool succeeded = system.Wait(inner) == HeartJobStatus::Success;
+		system.Wait(counter);
+
+		// Resumed on the fiber we started on
+		succeeded = succeeded && HeartFiberContext::GetCurrentWorkUnit() == outerFiber && counter.GetValue() == 0;
+
+		outerDone = succeeded;
+		return succeeded ? HeartJobResult::Success : HeartJobResult::Failure;
+	});
+
+	while (!outerDone)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_NE(outerFiber, nullptr);
+	EXPECT_NE(innerFiber, nullptr);
+	EXPECT_NE(outerFiber, innerFiber);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, FibersSleep)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+	settings.executionMode = HeartJobExecutionMode::Fibers;
+	settings.fiberStackClass = HeartFiberStackClass::Small;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_int order = 0;
+	int sleeperOrder = -1;
+	int otherOrder = -1;
+	std::chrono::steady_clock::duration slept = {};
+
+	auto sleeper = system.EnqueueJob([&]() {
+		auto begin = std::chrono::steady_clock::now();
+		HeartFiberContext::SleepFor(2000);
+		slept = std::chrono::steady_clock::now() - begin;
+		sleeperOrder = order++;
+		return HeartJobResult::Success;
+	});
+
+	auto other = system.EnqueueJob([&]() {
+		otherOrder = order++;
+		return HeartJobResult::Success;
+	});
+
+	// Shutdown waits for the sleeper like any other job
+	system.Shutdown();
+
+	EXPECT_EQ(sleeper->status.load(), HeartJobStatus::Success);
+	EXPECT_EQ(other->status.load(), HeartJobStatus::Success);
+	EXPECT_EQ(otherOrder, 0);
+	EXPECT_EQ(sleeperOrder, 1);
+	EXPECT_GE(slept, std::chrono::microseconds(2000));
+}
+
+TEST(HeartJobSystem, FibersTimedEventWait)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+	settings.executionMode = HeartJobExecutionMode::Fibers;
+	settings.fiberStackClass = HeartFiberStackClass::Small;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	HeartEvent event(HeartEvent::ResetType::Automatic);
+	std::atomic_bool waiting = false;
+	std::chrono::steady_clock::duration timedOut = {};
+	std::chrono::steady_clock::duration signalled = {};
+
+	// Waits out its time with the retries
+	auto timer = system.EnqueueJob([&]() {
+		auto begin = std::chrono::steady_clock::now();
+		event.Wait(5);
+		timedOut = std::chrono::steady_clock::now() - begin;
+		return HeartJobResult::Success;
+	});
+
+	while (timer->status == HeartJobStatus::Pending)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_GE(timedOut, std::chrono::milliseconds(5));
+
+	// Set takes it back out of the retry wheel
+	auto waiter = system.EnqueueJob([&]() {
+		auto begin = std::chrono::steady_clock::now();
+		waiting = true;
+		event.Wait(60000);
+		signalled = std::chrono::steady_clock::now() - begin;
+		return HeartJobResult::Success;
+	});
+
+	while (!waiting)
+	{
+		std::this_thread::yield();
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	event.Set();
+
+	system.Shutdown();
+
+	EXPECT_EQ(timer->status.load(), HeartJobStatus::Success);
+	EXPECT_EQ(waiter->status.load(), HeartJobStatus::Success);
+	EXPECT_LT(signalled, std::chrono::seconds(10));
+}
+
+TEST(HeartJobSystem, FibersManySuspended)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+	settings.executionMode = HeartJobExecutionMode::Fibers;
+	settings.fiberStackClass = HeartFiberStackClass::Small;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// Far more suspended jobs than workers, all released at once and resumed wherever there's room
+	const int JobCount = 256;
+	HeartEvent event(HeartEvent::ResetType::Manual);
+	std::atomic_int suspendedCount = 0;
+	std::atomic_int doneCount = 0;
+
+	HeartJobCounterRef counter = system.EnqueueJobs(JobCount, [&](size_t) {
+		return [&]() {
+			suspendedCount++;
+			event.Wait();
+			doneCount++;
+			return HeartJobResult::Success;
+		};
+	});
+
+	while (suspendedCount < JobCount)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(doneCount.load(), 0);
+	event.Set();
+
+	while (counter->GetValue() != 0)
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(doneCount.load(), JobCount);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, AffineJobs)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// Affine jobs never run until the affine thread pumps them, and only ever run there
+	std::atomic_int runCount = 0;
+	std::atomic_int wrongThreadCount = 0;
+	std::thread::id thisThread = std::this_thread::get_id();
+
+	for (int i = 0; i < 8; ++i)
+	{
+		system.EnqueueAffineJob([&]() {
+			if (std::this_thread::get_id() != thisThread)
+				wrongThreadCount++;
+
+			runCount++;
+			return HeartJobResult::Success;
+		});
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	EXPECT_EQ(runCount.load(), 0);
+
+	EXPECT_EQ(system.PumpAffineJobs(), 8);
+	EXPECT_EQ(runCount.load(), 8);
+	EXPECT_EQ(wrongThreadCount.load(), 0);
+	EXPECT_EQ(system.PumpAffineJobs(), 0);
+
+	// A retried affine job goes back on the affine queue, and waits for the next pump
+	int retries = 0;
+	auto retried = system.EnqueueAffineJob([&]() {
+		HeartJobSystem::SetRetryDelay(0);
+		return ++retries < 3 ? HeartJobResult::Retry : HeartJobResult::Success;
+	});
+
+	EXPECT_EQ(system.PumpAffineJobs(), 1);
+	EXPECT_EQ(system.PumpAffineJobs(), 1);
+	EXPECT_EQ(system.PumpAffineJobs(), 1);
+	EXPECT_EQ(retried->status.load(), HeartJobStatus::Success);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, AffineJobBudget)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_int runCount = 0;
+	for (int i = 0; i < 10; ++i)
+	{
+		system.EnqueueAffineJob([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			runCount++;
+			return HeartJobResult::Success;
+		});
+	}
+
+	// At least one job always runs, however small the budget
+	EXPECT_EQ(system.PumpAffineJobs(0), 1);
+
+	uint32_t pumped = system.PumpAffineJobs(5000);
+	EXPECT_GE(pumped, 1);
+	EXPECT_LT(pumped, 9);
+
+	// Whatever was left over still runs, in order, on a later pump
+	EXPECT_EQ(system.PumpAffineJobs() + pumped + 1, 10);
+	EXPECT_EQ(runCount.load(), 10);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, AffineJobPrerequisites)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// Decode on the workers, then upload on the affine thread once decoding is done
+	std::atomic_int decodedCount = 0;
+	std::atomic_int uploadedCount = 0;
+	std::thread::id thisThread = std::this_thread::get_id();
+	HeartJobCounterRef uploads = system.CreateCounter();
+
+	for (int i = 0; i < 4; ++i)
+	{
+		auto decode = system.EnqueueJob([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			decodedCount++;
+			return HeartJobResult::Success;
+		});
+
+		system.EnqueueAffineJob([&]() {
+			EXPECT_EQ(std::this_thread::get_id(), thisThread);
+			EXPECT_GT(decodedCount.load(), 0);
+			uploadedCount++;
+			return HeartJobResult::Success;
+		},
+			{decode}, uploads.Get());
+	}
+
+	// Waiting on the affine thread runs the uploads as their decodes finish
+	system.Wait(*uploads);
+	EXPECT_EQ(decodedCount.load(), 4);
+	EXPECT_EQ(uploadedCount.load(), 4);
+
+	// Waiting on an affine job from the affine thread runs it rather than deadlocking
+	auto upload = system.EnqueueAffineJob([]() {
+		return HeartJobResult::Success;
+	});
+
+	EXPECT_EQ(system.Wait(upload), HeartJobStatus::Success);
+
+	system.Shutdown();
+}
+
+namespace
+{
+	// Workers take a moment to notice a change in how many of them should be active
+	bool WaitForActiveWorkerCount(HeartJobSystem& system, uint32_t count)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (system.GetActiveWorkerCount() != count)
+		{
+			if (std::chrono::steady_clock::now() > deadline)
+				return false;
+
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+
+		return true;
+	}
+}
+
+TEST(HeartJobSystem, ScaleWithLoad)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+	settings.minThreadCount = 2;
+	settings.scalingInterval = 200;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// The urgent worker plus one for everything else
+	EXPECT_TRUE(WaitForActiveWorkerCount(system, 2));
+
+	// A backlog brings in the rest of the workers
+	HeartJobCounterRef counter = system.CreateCounter();
+	for (int i = 0; i < 400; ++i)
+	{
+		system.EnqueueJob([]() {
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			return HeartJobResult::Success;
+		},
+			HeartJobPriority::Normal, HeartJobMaskDefault, counter.Get());
+	}
+
+	uint32_t maxActiveCount = 0;
+	while (counter->GetValue() != 0)
+	{
+		maxActiveCount = std::max(maxActiveCount, system.GetActiveWorkerCount());
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	EXPECT_EQ(maxActiveCount, 4);
+
+	// And once it's gone, they're parked again
+	EXPECT_TRUE(WaitForActiveWorkerCount(system, 2));
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, ActiveWorkerCap)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+	EXPECT_EQ(system.GetActiveWorkerCount(), 4);
+
+	// The urgent worker can't run Normal jobs, so it never goes below two
+	system.SetActiveWorkerCap(1);
+	EXPECT_TRUE(WaitForActiveWorkerCount(system, 2));
+
+	std::atomic_int doneCount = 0;
+	HeartJobCounterRef counter = system.ParallelFor(0, 256, [&](size_t) {
+		doneCount++;
+	});
+
+	system.Wait(*counter);
+	EXPECT_EQ(doneCount.load(), 256);
+
+	system.SetActiveWorkerCap(3);
+	EXPECT_TRUE(WaitForActiveWorkerCount(system, 3));
+
+	system.SetActiveWorkerCap(UINT32_MAX);
+	EXPECT_TRUE(WaitForActiveWorkerCount(system, 4));
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, ParallelFor)
+{
+	const HeartJobSchedulerMode Modes[] = {HeartJobSchedulerMode::SharedQueue, HeartJobSchedulerMode::WorkStealing};
+
+	for (HeartJobSchedulerMode mode : Modes)
+	{
+		HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+		settings.threadCount = 4;
+		settings.schedulerMode = mode;
+
+		HeartJobSystem system;
+		system.Initialize(settings);
+
+		const size_t Count = 100000;
+		std::vector<std::atomic_int> visits(Count);
+
+		auto counter = system.ParallelFor(0, Count, [&](size_t i) { visits[i]++; });
+		system.Wait(*counter);
+
+		for (auto& v : visits)
+		{
+			EXPECT_EQ(v.load(), 1);
+		}
+
+		system.Shutdown();
+	}
+}
+
+TEST(HeartJobSystem, ParallelRange)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic<size_t> total = 0;
+	std::atomic_int rangeCount = 0;
+
+	auto counter = system.ParallelRange(10, 5010, [&](size_t begin, size_t end) {
+		EXPECT_LT(begin, end);
+
+		size_t sum = 0;
+		for (size_t i = begin; i < end; ++i)
+		{
+			sum += i;
+		}
+
+		total += sum;
+		rangeCount++;
+	});
+
+	system.Wait(*counter);
+
+	EXPECT_EQ(total.load(), size_t(5009 * 5010 / 2 - 9 * 10 / 2));
+	EXPECT_GT(rangeCount.load(), 1) << "Range was never split";
+
+	auto empty = system.ParallelRange(5, 5, [&](size_t, size_t) { ADD_FAILURE() << "Empty range should not invoke the function"; });
+	EXPECT_EQ(empty->GetValue(), 0);
+	system.Wait(*empty);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, NestedParallelFor)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+	settings.schedulerMode = HeartJobSchedulerMode::WorkStealing;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_int total = 0;
+
+	// Waiting from inside a job should help out rather than deadlock
+	auto outer = system.ParallelFor(0, 16, [&](size_t) {
+		auto inner = system.ParallelFor(0, 100, [&](size_t) { total++; });
+		system.Wait(*inner);
+	});
+
+	system.Wait(*outer);
+	EXPECT_EQ(total.load(), 1600);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystem, EnqueueJobs)
+{
+	const HeartJobSchedulerMode Modes[] = {HeartJobSchedulerMode::SharedQueue, HeartJobSchedulerMode::WorkStealing};
+
+	for (HeartJobSchedulerMode mode : Modes)
+	{
+		HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+		settings.threadCount = 4;
+		settings.schedulerMode = mode;
+
+		HeartJobSystem system;
+		system.Initialize(settings);
+
+		const size_t JobCount = 2000;
+		std::vector<std::atomic_int> visits(JobCount);
+
+		auto group = system.EnqueueJobs(JobCount, [&](size_t i) {
+			return [&visits, i]() {
+				visits[i]++;
+				return HeartJobResult::Success;
+			};
+		});
+
+		system.Wait(*group);
+
+		for (auto& v : visits)
+		{
+			EXPECT_EQ(v.load(), 1);
+		}
+
+		// Batches submitted from a worker go through its local queue first
+		std::atomic_int nestedCount = 0;
+		auto outer = system.EnqueueJob([&]() {
+			auto inner = system.EnqueueJobs(JobCount, [&](size_t) {
+				return [&]() {
+					nestedCount++;
+					return HeartJobResult::Success;
+				};
+			});
+
+			system.Wait(*inner);
+			return HeartJobResult::Success;
+		});
+
+		while (outer->status == HeartJobStatus::Pending)
+		{
+			std::this_thread::yield();
+		}
+
+		EXPECT_EQ(nestedCount.load(), int(JobCount));
+
+		system.Shutdown();
+	}
+}
+
+TEST(HeartJobSystem, EnqueueJobsSpan)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 2;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_int total = 0;
+	auto addOne = [&]() {
+		total += 1;
+		return HeartJobResult::Success;
+	};
+
+	std::vector<decltype(addOne)> jobs(64, addOne);
+	auto group = system.EnqueueJobs(std::span(jobs));
+	system.Wait(*group);
+
+	EXPECT_EQ(total.load(), 64);
+
+	auto empty = system.EnqueueJobs(std::span(jobs.data(), 0));
+	EXPECT_EQ(empty->GetValue(), 0);
+
+	system.Shutdown();
+}
@@ -0,0 +1,284 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/jobs/system.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+// These are benchmarks, not tests. They are disabled by default; run them with
+//   heart-test --gtest_also_run_disabled_tests --gtest_filter=HeartJobSystemBenchmark.*
+
+namespace
+{
+	// Something for a job to chew on that the optimizer can't throw away
+	uint32_t SpinWork(uint32_t seed, uint32_t iterations)
+	{
+		for (uint32_t i = 0; i < iterations; ++i)
+		{
+			seed = seed * 1664525u + 1013904223u;
+		}
+
+		return seed;
+	}
+
+	// Simulates a frame: a handful of root jobs each fan out many small jobs from a worker.
+	// Returns the average frame time in microseconds.
+	double RunFanOutFrames(HeartJobSystem& system, int frameCount, int rootCount, int childCount, uint32_t workPerJob)
+	{
+		std::atomic_uint32_t sink = 0;
+		auto begin = std::chrono::steady_clock::now();
+
+		for (int frame = 0; frame < frameCount; ++frame)
+		{
+			std::atomic_int remaining = rootCount * childCount;
+
+			for (int r = 0; r < rootCount; ++r)
+			{
+				system.EnqueueJob([&, r]() {
+					for (int c = 0; c < childCount; ++c)
+					{
+						system.EnqueueJob([&, r, c]() {
+							sink += SpinWork(uint32_t(r * childCount + c), workPerJob);
+							remaining--;
+							return HeartJobResult::Success;
+						});
+					}
+
+					return HeartJobResult::Success;
+				});
+			}
+
+			while (remaining > 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		auto end = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::micro>(end - begin).count() / frameCount;
+	}
+}
+
+TEST(HeartJobSystemBenchmark, DISABLED_SchedulerScaling)
+{
+	const int FrameCount = 50;
+	const int RootCount = 32;
+	const int ChildCount = 128;
+	const uint32_t WorkPerJob = 200;
+
+	const HeartJobSchedulerMode Modes[] = {HeartJobSchedulerMode::SharedQueue, HeartJobSchedulerMode::WorkStealing};
+	const char* ModeNames[] = {"SharedQueue", "WorkStealing"};
+
+	printf("%-14s %8s %14s %12s\n", "mode", "threads", "us/frame", "jobs/sec");
+
+	for (int m = 0; m < 2; ++m)
+	{
+		for (uint8_t threadCount = 1; threadCount <= 16; threadCount *= 2)
+		{
+			HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+			settings.threadCount = threadCount;
+			settings.schedulerMode = Modes[m];
+
+			HeartJobSystem system;
+			system.Initialize(settings);
+
+			double frameTime = RunFanOutFrames(system, FrameCount, RootCount, ChildCount, WorkPerJob);
+			double jobsPerSecond = double(RootCount * (ChildCount + 1)) / (frameTime / 1000000.0);
+
+			printf("%-14s %8u %14.1f %12.0f\n", ModeNames[m], threadCount, frameTime, jobsPerSecond);
+
+			system.Shutdown();
+		}
+	}
+}
+
+TEST(HeartJobSystemBenchmark, DISABLED_BatchSubmission)
+{
+	const int FrameCount = 200;
+	const size_t JobCount = 512;
+
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 8;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_uint32_t sink = 0;
+	auto makeJob = [&](size_t i) {
+		return [&sink, i]() {
+			sink += SpinWork(uint32_t(i), 50);
+			return HeartJobResult::Success;
+		};
+	};
+
+	double submitTime[2] = {};
+	double frameTime[2] = {};
+
+	for (int batched = 0; batched < 2; ++batched)
+	{
+		for (int frame = 0; frame < FrameCount; ++frame)
+		{
+			auto begin = std::chrono::steady_clock::now();
+
+			HeartJobCounterRef group;
+			if (batched)
+			{
+				group = system.EnqueueJobs(JobCount, makeJob);
+			}
+			else
+			{
+				group = system.CreateCounter();
+				for (size_t i = 0; i < JobCount; ++i)
+				{
+					system.EnqueueJob(makeJob(i), HeartJobPriority::Normal, HeartJobMaskDefault, group.Get());
+				}
+			}
+
+			auto submitted = std::chrono::steady_clock::now();
+			system.Wait(*group);
+			auto end = std::chrono::steady_clock::now();
+
+			submitTime[batched] += std::chrono::duration<double, std::micro>(submitted - begin).count();
+			frameTime[batched] += std::chrono::duration<double, std::micro>(end - begin).count();
+		}
+	}
+
+	printf("%-12s %14s %14s\n", "submission", "submit us", "frame us");
+	printf("%-12s %14.1f %14.1f\n", "EnqueueJob", submitTime[0] / FrameCount, frameTime[0] / FrameCount);
+	printf("%-12s %14.1f %14.1f\n", "EnqueueJobs", submitTime[1] / FrameCount, frameTime[1] / FrameCount);
+
+	system.Shutdown();
+}
+
+TEST(HeartJobSystemBenchmark, DISABLED_MixedMasks)
+{
+	const uint32_t MaskCount = 16;
+	const int QueueDepths[] = {256, 1024, 4096, 16384};
+
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 1;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	// Occupy the only worker so that the queue only drains through masked steals
+	std::atomic_bool release = false;
+	std::atomic_bool started = false;
+	system.EnqueueJob([&]() {
+		started = true;
+		while (!release)
+		{
+			std::this_thread::yield();
+		}
+
+		return HeartJobResult::Success;
+	});
+
+	while (!started)
+	{
+		std::this_thread::yield();
+	}
+
+	printf("%8s %14s\n", "depth", "ns/steal");
+
+	for (int depth : QueueDepths)
+	{
+		// Every thief only takes jobs with its own bit. One in eight jobs accepts every thief.
+		for (int i = 0; i < depth; ++i)
+		{
+			uint32_t mask = (i % 8) == 7 ? HeartJobMaskAll : 1u << (i % MaskCount);
+			system.EnqueueJob([]() { return HeartJobResult::Success; }, HeartJobPriority::Normal, mask);
+		}
+
+		std::atomic_int stolen = 0;
+		std::vector<std::thread> thieves;
+
+		auto begin = std::chrono::steady_clock::now();
+		for (uint32_t t = 0; t < MaskCount; ++t)
+		{
+			thieves.emplace_back([&, t]() {
+				while (system.TryStealJobWork(HeartJobPriority::Normal, 1u << t))
+				{
+					stolen++;
+				}
+			});
+		}
+
+		for (auto& t : thieves)
+		{
+			t.join();
+		}
+
+		auto end = std::chrono::steady_clock::now();
+
+		EXPECT_EQ(stolen.load(), depth);
+		printf("%8d %14.1f\n", depth, std::chrono::duration<double, std::nano>(end - begin).count() / depth);
+	}
+
+	release = true;
+	system.Shutdown();
+}
+
+TEST(HeartJobSystemBenchmark, DISABLED_WakeLatency)
+{
+	const int SampleCount = 200;
+	const int IdleMs[] = {0, 1, 20};
+
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	printf("%8s %14s %14s\n", "idle ms", "avg us", "max us");
+
+	for (int idle : IdleMs)
+	{
+		double total = 0.0;
+		double worst = 0.0;
+
+		for (int i = 0; i < SampleCount; ++i)
+		{
+			// Give the workers time to spin down and park
+			std::this_thread::sleep_for(std::chrono::milliseconds(idle));
+
+			std::atomic<std::chrono::steady_clock::time_point> started;
+			std::atomic_bool ran = false;
+
+			auto enqueued = std::chrono::steady_clock::now();
+			system.EnqueueJob([&]() {
+				started = std::chrono::steady_clock::now();
+				ran = true;
+				return HeartJobResult::Success;
+			});
+
+			while (!ran)
+			{
+				std::this_thread::yield();
+			}
+
+			double latency = std::chrono::duration<double, std::micro>(started.load() - enqueued).count();
+			total += latency;
+			worst = std::max(worst, latency);
+		}
+
+		printf("%8d %14.1f %14.1f\n", idle, total / SampleCount, worst);
+	}
+
+	system.Shutdown();
+}
@@ -0,0 +1,277 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/jobs/task.h>
+
+#include <gtest/gtest.h>
+
+#include "utils/tracking_allocator.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	HeartJobSystem::Settings TaskSettings(int threadCount)
+	{
+		HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+		settings.threadCount = threadCount;
+		return settings;
+	}
+
+	HeartTask<int> Add(int a, int b)
+	{
+		co_return a + b;
+	}
+
+	HeartTask<std::unique_ptr<int>> MakeUnique(int value)
+	{
+		co_return std::make_unique<int>(value);
+	}
+
+	HeartTask<> Increment(std::atomic<int>& value)
+	{
+		++value;
+		co_return;
+	}
+
+	HeartTask<int> AwaitChildren(std::atomic<int>& incremented)
+	{
+		int sum = co_await Add(1, 2);
+		sum += co_await Add(sum, 4);
+
+		std::unique_ptr<int> unique = co_await MakeUnique(sum);
+		co_await Increment(incremented);
+
+		co_return *unique;
+	}
+
+	HeartTask<HeartJobStatus> AwaitJob(HeartJobRef job, std::thread::id& resumedOn)
+	{
+		HeartJobStatus status = co_await job;
+		resumedOn = std::this_thread::get_id();
+		co_return status;
+	}
+
+	HeartTask<> AwaitCounter(HeartJobCounter& counter, bool& sawZero)
+	{
+		co_await counter;
+		sawZero = counter.GetValue() == 0;
+	}
+
+	HeartTask<> AwaitFence(HeartFence& fence, uint32_t revision, std::thread::id& resumedOn)
+	{
+		co_await HeartTaskWaitForFence(fence, revision);
+		resumedOn = std::this_thread::get_id();
+	}
+
+	HeartTask<int> AllocatedAdd(std::allocator_arg_t, HeartBaseAllocator&, int a, int b)
+	{
+		co_return co_await Add(a, b);
+	}
+}
+
+TEST(HeartTask, ReturnsValue)
+{
+	HeartJobSystem system;
+	system.Initialize(TaskSettings(2));
+
+	HeartJobCounter counter;
+	HeartTask<int> task = Add(40, 2);
+	EXPECT_FALSE(task.IsDone());
+
+	task.Start(system, HeartJobPriority::Normal, &counter);
+	system.Wait(counter);
+
+	EXPECT_TRUE(task.IsDone());
+	EXPECT_EQ(task.GetResult(), 42);
+
+	system.Shutdown();
+}
+
+TEST(HeartTask, AwaitTask)
+{
+	HeartJobSystem system;
+	system.Initialize(TaskSettings(2));
+
+	std::atomic<int> incremented = 0;
+
+	HeartJobCounter counter;
+	HeartTask<int> task = AwaitChildren(incremented);
+	task.Start(system, HeartJobPriority::Normal, &counter);
+	system.Wait(counter);
+
+	EXPECT_EQ(task.GetResult(), 10);
+	EXPECT_EQ(incremented.load(), 1);
+
+	system.Shutdown();
+}
+
+TEST(HeartTask, AwaitJob)
+{
+	HeartJobSystem system;
+	system.Initialize(TaskSettings(2));
+
+	std::atomic_bool release = false;
+	HeartJobRef job = system.EnqueueJob([&]() {
+		if (!release)
+			return HeartJobResult::Retry;
+
+		return HeartJobResult::Failure;
+	});
+
+	std::thread::id resumedOn;
+	HeartTask<HeartJobStatus> task = AwaitJob(job, resumedOn);
+	task.Start(system);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	EXPECT_FALSE(task.IsDone());
+
+	// Not Wait(), which would let this thread resume the task itself
+	release = true;
+	while (!task.IsDone())
+	{
+		std::this_thread::yield();
+	}
+
+	EXPECT_EQ(task.GetResult(), HeartJobStatus::Failure);
+	EXPECT_NE(resumedOn, std::this_thread::get_id());
+
+	system.Shutdown();
+}
+
+TEST(HeartTask, AwaitCounter)
+{
+	HeartJobSystem system;
+	system.Initialize(TaskSettings(2));
+
+	HeartJobCounter gate(1);
+	bool sawZero = false;
+
+	HeartJobCounter counter;
+	HeartTask<> task = AwaitCounter(gate, sawZero);
+	task.Start(system, HeartJobPriority::Normal, &counter);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	EXPECT_FALSE(task.IsDone());
+
+	gate.Decrement();
+	system.Wait(counter);
+
+	EXPECT_TRUE(sawZero);
+
+	system.Shutdown();
+}
+
+TEST(HeartTask, AwaitFence)
+{
+	HeartJobSystem system;
+	system.Initialize(TaskSettings(2));
+
+	HeartFence fence;
+	std::thread::id resumedOn;
+
+	HeartTask<> task = AwaitFence(fence, 2, resumedOn);
+	task.Start(system);
+
+	// Like an IO thread finishing a command list
+	std::thread::id signalledOn;
+	std::thread signaller([&]() {
+		signalledOn = std::this_thread::get_id();
+
+		fence.Signal(1);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		EXPECT_FALSE(task.IsDone());
+
+		fence.Signal(2);
+	});
+
+	while (!task.IsDone())
+	{
+		std::this_thread::yield();
+	}
+
+	signaller.join();
+	EXPECT_NE(resumedOn, signalledOn);
+	EXPECT_NE(resumedOn, std::this_thread::get_id());
+
+	system.Shutdown();
+}
+
+TEST(HeartTask, ManySuspended)
+{
+	constexpr uint32_t TaskCount = 2000;
+
+	HeartJobSystem system;
+	system.Initialize(TaskSettings(1));
+
+	HeartFence fence;
+	std::vector<std::thread::id> resumedOn(TaskCount);
+
+	// Far more suspended tasks than we could ever have fibers for
+	HeartJobCounter counter;
+	std::vector<HeartTask<>> tasks;
+	for (uint32_t i = 0; i < TaskCount; ++i)
+	{
+		tasks.push_back(AwaitFence(fence, 1, resumedOn[i]));
+		tasks.back().Start(system, HeartJobPriority::Normal, &counter);
+	}
+
+	fence.Signal(1);
+	system.Wait(counter);
+
+	for (HeartTask<>& task : tasks)
+	{
+		EXPECT_TRUE(task.IsDone());
+	}
+
+	system.Shutdown();
+}
+
+TEST(HeartTask, FrameAllocator)
+{
+	TestTrackingAllocator defaultAllocator;
+	TestTrackingAllocator explicitAllocator;
+	HeartSetDefaultTaskAllocator(&defaultAllocator);
+
+	{
+		HeartJobSystem system;
+		system.Initialize(TaskSettings(1));
+
+		HeartJobCounter counter;
+		HeartTask<int> task = AllocatedAdd(std::allocator_arg, explicitAllocator, 2, 3);
+		EXPECT_EQ(explicitAllocator.m_allocatedCount.load(), 1);
+		EXPECT_EQ(defaultAllocator.m_allocatedCount.load(), 0);
+
+		task.Start(system, HeartJobPriority::Normal, &counter);
+		system.Wait(counter);
+		EXPECT_EQ(task.GetResult(), 5);
+
+		// The frame of the Add it awaited is gone already
+		EXPECT_EQ(defaultAllocator.m_allocatedCount.load(), 0);
+
+		task.Reset();
+		EXPECT_EQ(explicitAllocator.m_allocatedCount.load(), 0);
+
+		// A task that never starts still frees its frame
+		HeartTask<int> unstarted = Add(1, 1);
+		EXPECT_EQ(defaultAllocator.m_allocatedCount.load(), 1);
+		unstarted.Reset();
+		EXPECT_EQ(defaultAllocator.m_allocatedCount.load(), 0);
+
+		system.Shutdown();
+	}
+
+	HeartSetDefaultTaskAllocator(nullptr);
+	EXPECT_EQ(&HeartGetDefaultTaskAllocator(), &GetHeartDefaultAllocator());
+}
@@ -0,0 +1,152 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/memory/timer_wheel.h>
+
+#include <gtest/gtest.h>
+
+struct TimerEntry
+{
+	char label = 0;
+	uint64_t deadline = 0;
+	HeartIntrusiveListLink link;
+};
+
+using TestTimerWheel = HeartTimerWheel<TimerEntry, &TimerEntry::link, &TimerEntry::deadline, 8>;
+
+TEST(HeartTimerWheel, ExpiresInOrder)
+{
+	TimerEntry a {'a', 3};
+	TimerEntry b {'b', 5};
+
+	TestTimerWheel wheel;
+	wheel.Schedule(&b);
+	wheel.Schedule(&a);
+
+	EXPECT_EQ(wheel.Size(), 2);
+	EXPECT_EQ(wheel.GetNextTick(), 3);
+
+	TestTimerWheel::ItemList expired;
+	EXPECT_EQ(wheel.Advance(2, expired), 0);
+	EXPECT_EQ(wheel.Advance(3, expired), 1);
+	EXPECT_EQ(expired.PopFront(), &a);
+
+	EXPECT_EQ(wheel.GetNextTick(), 5);
+	EXPECT_EQ(wheel.Advance(10, expired), 1);
+	EXPECT_EQ(expired.PopFront(), &b);
+
+	EXPECT_TRUE(wheel.IsEmpty());
+	EXPECT_EQ(wheel.GetNextTick(), TestTimerWheel::NoDeadline);
+}
+
+TEST(HeartTimerWheel, LaterTurns)
+{
+	// Both land in slot 2, but c is due a full turn later
+	TimerEntry b {'b', 2};
+	TimerEntry c {'c', 18};
+
+	TestTimerWheel wheel;
+	wheel.Schedule(&c);
+	wheel.Schedule(&b);
+
+	TestTimerWheel::ItemList expired;
+	EXPECT_EQ(wheel.Advance(9, expired), 1);
+	EXPECT_EQ(expired.PopFront(), &b);
+
+	// The real deadline, not just the next non-empty slot
+	EXPECT_EQ(wheel.GetNextTick(), 18);
+
+	EXPECT_EQ(wheel.Advance(17, expired), 0);
+	EXPECT_EQ(wheel.Advance(18, expired), 1);
+	EXPECT_EQ(expired.PopFront(), &c);
+}
+
+TEST(HeartTimerWheel, PastDeadlines)
+{
+	TestTimerWheel wheel(100);
+
+	// Already overdue, so it expires on the next advance
+	TimerEntry a {'a', 4};
+	wheel.Schedule(&a);
+	EXPECT_EQ(wheel.GetNextTick(), 100);
+
+	TestTimerWheel::ItemList expired;
+	EXPECT_EQ(wheel.Advance(100, expired), 1);
+
+	// Jumping far ahead expires everything in between
+	TimerEntry entries[16];
+	for (uint64_t i = 0; i < 16; ++i)
+	{
+		entries[i].deadline = 101 + i * 3;
+		wheel.Schedule(&entries[i]);
+	}
+
+	expired.Clear();
+	EXPECT_EQ(wheel.Advance(1000, expired), 16);
+	EXPECT_TRUE(wheel.IsEmpty());
+}
+
+TEST(HeartTimerWheel, Remove)
+{
+	TestTimerWheel wheel(10);
+
+	TimerEntry a {'a', 12};
+	TimerEntry b {'b', 12};
+	TimerEntry c {'c', 30};
+	wheel.Schedule(&a);
+	wheel.Schedule(&b);
+	wheel.Schedule(&c);
+
+	EXPECT_TRUE(wheel.Remove(&b));
+	EXPECT_EQ(wheel.Size(), 2);
+
+	// Once removed, it reads as expired
+	EXPECT_FALSE(wheel.Remove(&b));
+
+	TestTimerWheel::ItemList expired;
+	EXPECT_EQ(wheel.Advance(12, expired), 1);
+	EXPECT_EQ(expired.PopFront(), &a);
+
+	// Too late to take back
+	EXPECT_FALSE(wheel.Remove(&a));
+
+	EXPECT_TRUE(wheel.Remove(&c));
+	EXPECT_TRUE(wheel.IsEmpty());
+	EXPECT_EQ(wheel.Advance(100, expired), 0);
+}
+
+TEST(HeartTimerWheel, FarDeadlines)
+{
+	TestTimerWheel wheel(5);
+
+	// Many turns of the wheel away, and in the same slot as a nearer one
+	TimerEntry far {'f', 5 + 8 * 1000 + 3};
+	TimerEntry near {'n', 5 + 8 * 10 + 3};
+	TimerEntry later {'l', 5 + 8 * 500 + 6};
+	wheel.Schedule(&far);
+	wheel.Schedule(&near);
+	wheel.Schedule(&later);
+	EXPECT_EQ(wheel.GetNextTick(), near.deadline);
+
+	// Taking the earliest away finds the next one
+	EXPECT_TRUE(wheel.Remove(&near));
+	EXPECT_EQ(wheel.GetNextTick(), later.deadline);
+
+	TestTimerWheel::ItemList expired;
+	EXPECT_EQ(wheel.Advance(later.deadline, expired), 1);
+	EXPECT_EQ(expired.PopFront(), &later);
+	EXPECT_EQ(wheel.GetNextTick(), far.deadline);
+
+	// A nearer one scheduled later takes over
+	TimerEntry soon {'s', later.deadline + 2};
+	wheel.Schedule(&soon);
+	EXPECT_EQ(wheel.GetNextTick(), soon.deadline);
+}
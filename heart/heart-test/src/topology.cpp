@@ -0,0 +1,148 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/jobs/system.h>
+#include <heart/thread/topology.h>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+
+namespace
+{
+	// coreCount cores in one package, each with smtCount consecutive CPUs
+	HeartCpuTopology MakeTopology(uint32_t coreCount, uint32_t smtCount)
+	{
+		HeartCpuTopology topology;
+		for (uint32_t core = 0; core < coreCount; ++core)
+		{
+			HeartCpuSet cpus;
+			for (uint32_t i = 0; i < smtCount; ++i)
+			{
+				cpus.Add(core * smtCount + i);
+			}
+
+			topology.AddCore(0, cpus);
+		}
+
+		return topology;
+	}
+}
+
+TEST(HeartCpuSet, Parse)
+{
+	HeartCpuSet cpus = HeartCpuSet::Parse("0-3,8,10-11\n");
+	EXPECT_EQ(cpus.GetCount(), 7);
+	EXPECT_TRUE(cpus.Contains(3));
+	EXPECT_FALSE(cpus.Contains(4));
+	EXPECT_TRUE(cpus.Contains(11));
+
+	EXPECT_EQ(cpus.GetNext(4), 8);
+	EXPECT_EQ(cpus.GetNth(5), 10);
+	EXPECT_EQ(cpus.GetNext(12), HeartCpuSet::InvalidCpu);
+
+	EXPECT_EQ(HeartCpuSet::Parse("130").GetNext(), 130);
+	EXPECT_EQ(HeartCpuSet::Parse("130").GetWord(2), uint64_t(1) << 2);
+
+	EXPECT_TRUE(HeartCpuSet::Parse("3-1").IsEmpty());
+	EXPECT_TRUE(HeartCpuSet::Parse("a").IsEmpty());
+	EXPECT_TRUE(HeartCpuSet::Parse("0-9999").IsEmpty());
+}
+
+TEST(HeartCpuTopology, Detect)
+{
+	const HeartCpuTopology& topology = HeartCpuTopology::Get();
+	ASSERT_GT(topology.GetCoreCount(), 0);
+	EXPECT_GE(topology.GetLogicalCpuCount(), topology.GetCoreCount());
+	EXPECT_GT(topology.GetPackageCount(), 0);
+
+	// Every CPU belongs to exactly one core
+	uint32_t cpuCount = 0;
+	for (uint32_t i = 0; i < topology.GetCoreCount(); ++i)
+	{
+		const HeartCpuSet& cpus = topology.GetCore(i).cpus;
+		cpuCount += cpus.GetCount();
+		EXPECT_EQ(topology.FindCore(cpus.GetNext()), i);
+	}
+
+	EXPECT_EQ(cpuCount, topology.GetLogicalCpuCount());
+}
+
+TEST(HeartJobSystem, DefaultSettingsFromTopology)
+{
+	// With SMT, only the main thread's core is reserved
+	HeartJobSystem::Settings smt = HeartJobSystem::GetDefaultSettings(MakeTopology(8, 2));
+	EXPECT_EQ(smt.threadCount, 7);
+	EXPECT_EQ(smt.affinity, HeartJobAffinityMode::None);
+	EXPECT_EQ(smt.workerCpus, HeartCpuSet::Parse("2-15"));
+
+	// Without it, a few more cores are left for the rest of the game
+	HeartJobSystem::Settings noSmt = HeartJobSystem::GetDefaultSettings(MakeTopology(8, 1));
+	EXPECT_EQ(noSmt.threadCount, 6);
+	EXPECT_EQ(noSmt.workerCpus, HeartCpuSet::Parse("2-7"));
+
+	HeartJobSystem::Settings single = HeartJobSystem::GetDefaultSettings(MakeTopology(1, 1));
+	EXPECT_EQ(single.threadCount, 1);
+
+	HeartJobSystem::Settings huge = HeartJobSystem::GetDefaultSettings(MakeTopology(64, 2));
+	EXPECT_EQ(huge.threadCount, 16);
+}
+
+TEST(HeartJobSystem, WorkerCpus)
+{
+	HeartCpuTopology topology = MakeTopology(4, 2);
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings(topology);
+	settings.threadCount = 4;
+
+	EXPECT_TRUE(HeartJobSystem::GetWorkerCpus(settings, 0, topology).IsEmpty());
+
+	// One core per worker, skipping the reserved one and wrapping around
+	settings.affinity = HeartJobAffinityMode::PhysicalCores;
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 0, topology), HeartCpuSet::Parse("2-3"));
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 2, topology), HeartCpuSet::Parse("6-7"));
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 3, topology), HeartCpuSet::Parse("2-3"));
+
+	// Only the allowed CPUs of each core are used
+	settings.workerCpus = HeartCpuSet::Parse("1,2,4");
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 0, topology), HeartCpuSet::Parse("1"));
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 1, topology), HeartCpuSet::Parse("2"));
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 2, topology), HeartCpuSet::Parse("4"));
+
+	settings.affinity = HeartJobAffinityMode::CpuSet;
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 1, topology), HeartCpuSet::Parse("2"));
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 3, topology), HeartCpuSet::Parse("1"));
+
+	// A separately pinned urgent worker doesn't take a CPU from the others
+	settings.urgentWorkerCpus = HeartCpuSet::Parse("7");
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 0, topology), HeartCpuSet::Parse("7"));
+	EXPECT_EQ(HeartJobSystem::GetWorkerCpus(settings, 1, topology), HeartCpuSet::Parse("1"));
+}
+
+TEST(HeartJobSystem, PinnedWorkers)
+{
+	HeartJobSystem::Settings settings = HeartJobSystem::GetDefaultSettings();
+	settings.threadCount = 4;
+	settings.affinity = HeartJobAffinityMode::PhysicalCores;
+	settings.workerCpus = {};
+
+	HeartJobSystem system;
+	system.Initialize(settings);
+
+	std::atomic_int doneCount = 0;
+	HeartJobCounterRef counter = system.ParallelFor(0, 256, [&](size_t) {
+		doneCount++;
+	});
+
+	system.Wait(*counter);
+	EXPECT_EQ(doneCount.load(), 256);
+
+	system.Shutdown();
+}
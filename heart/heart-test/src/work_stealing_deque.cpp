@@ -0,0 +1,135 @@
+/* Copyright (C) 2023 James Keats
+*
+* This file is part of Heart, a collection of game engine technologies.
+*
+* You may use, distribute, and modify this code under the terms of its modified
+* BSD-3-Clause license. Use for any commercial purposes is prohibited.
+
+* You should have received a copy of the license with this file. If not, please visit:
+* https://github.com/growlitheharpo/heart-engine-playground
+*
+*/
+#include <heart/memory/work_stealing_deque.h>
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+TEST(WorkStealingDeque, EmptyDeque)
+{
+	HeartWorkStealingDeque<int, 8> deque;
+
+	EXPECT_TRUE(deque.IsEmpty());
+	EXPECT_EQ(deque.Pop(), nullptr);
+	EXPECT_EQ(deque.Steal(), nullptr);
+}
+
+TEST(WorkStealingDeque, PopIsLifo)
+{
+	int a = 0, b = 1, c = 2;
+
+	HeartWorkStealingDeque<int, 8> deque;
+	deque.Push(&a);
+	deque.Push(&b);
+	deque.Push(&c);
+
+	EXPECT_EQ(deque.Size(), 3);
+	EXPECT_EQ(deque.Pop(), &c);
+	EXPECT_EQ(deque.Pop(), &b);
+	EXPECT_EQ(deque.Pop(), &a);
+	EXPECT_TRUE(deque.IsEmpty());
+}
+
+TEST(WorkStealingDeque, StealIsFifo)
+{
+	int a = 0, b = 1, c = 2;
+
+	HeartWorkStealingDeque<int, 8> deque;
+	deque.Push(&a);
+	deque.Push(&b);
+	deque.Push(&c);
+
+	EXPECT_EQ(deque.Steal(), &a);
+	EXPECT_EQ(deque.Steal(), &b);
+	EXPECT_EQ(deque.Pop(), &c);
+	EXPECT_TRUE(deque.IsEmpty());
+}
+
+TEST(WorkStealingDeque, Full)
+{
+	int values[4] = {};
+
+	HeartWorkStealingDeque<int, 4> deque;
+	for (int& v : values)
+	{
+		EXPECT_TRUE(deque.Push(&v));
+	}
+
+	int extra = 0;
+	EXPECT_FALSE(deque.Push(&extra)) << "A full deque should reject new items";
+
+	EXPECT_EQ(deque.Steal(), &values[0]);
+	EXPECT_TRUE(deque.Push(&extra)) << "Stealing should free up a slot";
+}
+
+TEST(WorkStealingDeque, ConcurrentSteal)
+{
+	const int ItemCount = 100000;
+	const int ThiefCount = 3;
+
+	std::vector<int> items(ItemCount);
+	std::vector<std::atomic_int> taken(ItemCount);
+
+	HeartWorkStealingDeque<int, 256> deque;
+	std::atomic_bool done = false;
+
+	auto take = [&](int* item) {
+		++taken[item - items.data()];
+	};
+
+	std::vector<std::thread> thieves;
+	for (int i = 0; i < ThiefCount; ++i)
+	{
+		thieves.emplace_back([&]() {
+			while (!done || !deque.IsEmpty())
+			{
+				if (int* item = deque.Steal())
+					take(item);
+			}
+		});
+	}
+
+	for (int i = 0; i < ItemCount; ++i)
+	{
+		while (!deque.Push(&items[i]))
+		{
+			if (int* item = deque.Pop())
+				take(item);
+		}
+
+		// Occasionally pop our own work too so that the owner and thieves race for the last item
+		if ((i % 7) == 0)
+		{
+			if (int* item = deque.Pop())
+				take(item);
+		}
+	}
+
+	while (int* item = deque.Pop())
+	{
+		take(item);
+	}
+
+	done = true;
+	for (auto& t : thieves)
+	{
+		t.join();
+	}
+
+	for (auto& count : taken)
+	{
+		EXPECT_EQ(count.load(), 1);
+	}
+}